@@ -3,11 +3,25 @@
 
 #include "misc.h"
 
+/*
+ * The data is buf[start .. offset): consuming from the front only
+ * moves start, the data gets moved back to the front (compaction) only
+ * when there is no room at the end anymore. Nothing is zeroed, the
+ * data is kept NUL-terminated instead.
+ */
+/*
+ * Buffers start out at BUF_INITSIZE; those blocks are kept in a pool
+ * as every connection takes a few and gives them back when it is done.
+ * Buffers that had to grow go back to malloc.
+ */
+#define BUF_INITSIZE (4 * 1024)
+
 struct buf {
-	mutex_t		mutex;			/* Mutex */
+	lock_t		lock;			/* Lock (non-recursive) */
 	char		*buf;			/* Buffer */
 	uint64_t	size;			/* Size of the buffer */
-	uint64_t	offset;			/* Length of data in buffer */
+	uint64_t	start;			/* Read cursor: begin of data */
+	uint64_t	offset;			/* Write cursor: end of data */
 };
 
 typedef struct buf buf_t;
@@ -15,11 +29,26 @@ typedef struct buf buf_t;
 CHKRESULT bool buf_init(buf_t *buf);
 void buf_destroy(buf_t *buf);
 
+/* Free the BUF_INITSIZE blocks that are cached */
+void buf_trim(void);
+
+/*
+ * Give the storage of an empty buffer back (idle connections), the
+ * next put takes it again. Until then buf_buffer() is NULL.
+ */
+void buf_release(buf_t *buf);
+
 void buf_empty(buf_t *buf);
 void buf_emptyL(buf_t *buf);
 
 void buf_shift(buf_t *buf, unsigned int length);
 
+/* Move the data to the front, making all room available at the end */
+void buf_compact(buf_t *buf);
+
+/* Exchange the storage (and the data) of two buffers, both locked */
+void buf_swap(buf_t *a, buf_t *b);
+
 void buf_added(buf_t *buf, unsigned int length);
 
 bool buf_putl(buf_t *buf, const char *txt, unsigned int len);
@@ -37,12 +66,13 @@ CHKRESULT bool buf_minsize(buf_t *buf, unsigned int len);
 void buf_lock(buf_t *buf);
 void buf_unlock(buf_t *buf);
 
-#define buf_buffer(buff) ((buff)->buf)
+#define buf_buffer(buff) (&((buff)->buf)[(buff)->start])
 #define buf_bufend(buff) (&((buff)->buf)[(buff)->offset])
-#define buf_max(buff) ((buff)->size)
-#define buf_cur(buff) ((buff)->offset)
+#define buf_max(buff) ((buff)->size - (buff)->start)
+#define buf_cur(buff) ((buff)->offset - (buff)->start)
 #define buf_left(buff) (buf_max(buff) - buf_cur(buff) - 1)
 
+/* offset is relative to buf_buffer() */
 CHKRESULT char *buf_find(buf_t *buf, uint64_t offset, char chr, bool findnul);
 
 #endif /* BUF_H */
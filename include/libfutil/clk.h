@@ -0,0 +1,42 @@
+#ifndef CLK_H
+#define CLK_H 1
+
+/*
+ * Coarse clock: the time as the kernel last ticked it (on Linux the
+ * *_COARSE clocks, a read of the vDSO page, a few msec behind at most),
+ * for what only needs seconds or about a msec: deadlines, last activity.
+ *
+ * Per second, per thread, a cache of what is made of the time over and
+ * over again: the broken-down local and GMT time, a log timestamp and
+ * the HTTP date. It is made the first time a thread asks for a second,
+ * thus localtime_r() and its timezone lock are once per second, not
+ * once per log line or response.
+ */
+
+/* "YYYY-MM-DD HH:MM:SS" (local) */
+#define CLK_STAMP_LEN	20
+
+/* "Sun, 06 Nov 1994 08:49:37 GMT" (RFC 7231 IMF-fixdate) */
+#define CLK_HTTP_LEN	30
+
+typedef struct {
+	time_t		sec;		/* The second it is all for */
+	struct tm	local;		/* localtime_r() */
+	struct tm	gmt;		/* gmtime_r() */
+	char		stamp[CLK_STAMP_LEN];
+	char		http[CLK_HTTP_LEN];
+} clk_sec_t;
+
+/* Monotonic msec, coarse */
+CHKRESULT uint64_t clk_msec(void);
+
+/* Wall clock seconds (and msec of it when msec != NULL), coarse */
+CHKRESULT uint64_t clk_now(uint64_t *msec);
+
+/* All of second sec, valid for this thread until it asks for another */
+CHKRESULT const clk_sec_t *clk_sec(time_t sec);
+
+/* The HTTP date of any t, buf of CLK_HTTP_LEN (now: from clk_sec()) */
+void clk_http(time_t t, char *buf);
+
+#endif /* CLK_H */
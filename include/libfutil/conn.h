@@ -12,18 +12,60 @@
 #include <openssl/engine.h>
 #endif
 
+typedef struct conn conn_t;
+
+/* How a connset waits for events, see connset_init_backend() */
+typedef enum {
+	CONNSET_SELECT = 0,		/* select(), limited to FD_SETSIZE */
+	CONNSET_EPOLL,			/* epoll(), Linux only */
+	CONNSET_EPOLL_EDGE,		/* epoll() edge-triggered, hasevents is
+					 * kept until I/O hits EAGAIN */
+	CONNSET_URING			/* io_uring multishot poll, stays armed
+					 * while handled, caches like
+					 * CONNSET_EPOLL_EDGE; readiness only,
+					 * I/O is not done through the ring */
+} connset_backend_t;
+
+/* Can be overridden at compile time, eg -DCONNSET_DEFAULT=CONNSET_URING */
+#ifndef CONNSET_DEFAULT
+#ifdef _LINUX
+#define CONNSET_DEFAULT CONNSET_EPOLL_EDGE
+#else
+#define CONNSET_DEFAULT CONNSET_SELECT
+#endif
+#endif
+
+struct connset_uring;
+
 typedef struct {
 	mutex_t		mutex;		/* Connset lock (for fd_*) */
 	hlist_t		active;		/* Active connections in this set (polling) */
-	hlist_t		ready;		/* Connections that are ready */
+	hlist_t		ready;		/* Connections that are ready
+					 * (only when readyq is full) */
+	mpmc_t		readyq;		/* Ready connections for the workers */
+	executor_t	*executor;	/* Or hand them to these workers */
 	hlist_t		inactive;	/* Inactive connections (no polling) */
 	hlist_t		handling;	/* Connections being handled */
 
-	fd_set		fd_read;	/* Read FDs */
-	fd_set		fd_write;	/* Write FDs */
+	connset_backend_t backend;	/* Polling backend */
+
+	fd_set		fd_read;	/* Read FDs (select) */
+	fd_set		fd_write;	/* Write FDs (select) */
+	int		hifd;		/* Highest FD (select) */
+
+	int		epfd;		/* epoll instance (epoll) */
+	struct connset_uring *uring;	/* io_uring instance (uring) */
+	conn_t		**fdmap;	/* FD to conn mapping (epoll, uring) */
+	unsigned int	fdmap_len;	/* Slots in fdmap */
+
+	uint64_t	syscalls;	/* Poller syscalls, for benchmarks */
+	uint64_t	iocalls;	/* Conn I/O syscalls, for benchmarks */
+
+	wheel_t		wheel;		/* Deadlines of the conns (msec) */
+	uint64_t	wakeup;		/* The poller wakes up by then (msec) */
+	uint64_t	timeouts;	/* Deadlines that passed */
 
 	uint64_t	id;		/* Set ID */
-	int		hifd;		/* Highest FD */
 
 	uint64_t	triggers;	/* Number of outstanding triggers */
 	int		pipe[2];	/* Control Pipe (force timeout, exit etc) */
@@ -40,21 +82,51 @@ typedef enum {
 	CONN_CONNECTED
 } connstate_t;
 
-typedef struct conn conn_t;
-
 /* Hook called when flushing() which helps for debugging and testing */
 typedef int (*conn_flush_hook)(void *data, unsigned int id, bool isheader,
 				const char *buf, uint64_t length);
 
 typedef void (*conn_posthandle_f)(conn_t *conn, void *user);
 
+/*
+ * Called once borrowed memory (conn_putref()) or a file (conn_putfd(),
+ * data is NULL then) has been written or the connection dropped it.
+ * The connection is locked, do not call into it.
+ */
+typedef void (*conn_release_f)(void *user, const char *data, uint64_t len);
+
+/*
+ * What is sent goes out as a chain of segments: buffers (owned), borrowed
+ * memory and ranges of files. Consecutive memory segments are written
+ * with one writev(), files with sendfile().
+ */
+struct conn_seg;
+struct conn_entry;
+
+typedef struct {
+	struct conn_seg		*head;		/* Next to write */
+	struct conn_seg		*tail;		/* Appended to */
+	uint64_t		len;		/* Bytes not written yet */
+} conn_chain_t;
+
 /* Per-connection context */
 struct conn {
 	hnode_t			node;		/* List node */
-	mutex_t			mutex;		/* Mutex */
+	lock_t			lock;		/* Lock (non-recursive) */
 	socket_t		sock;		/* Socket */
 	uint16_t		wntevents;	/* Wanted Socket events */
 	uint16_t		hasevents;	/* Have   Socket events */
+	uint16_t		pollevents;	/* Events armed in the poller */
+	bool			pollreg;	/* Registered with the poller */
+	bool			pollfailed;	/* Arming it failed */
+	uint32_t		pollgen;	/* Registration generation (uring) */
+	uint16_t		pollarmed;	/* Events the kernel watches (uring) */
+	uint16_t		pollseen;	/* Seen while away (uring) */
+	bool			queued;		/* On connset readyq (connset lock) */
+	struct conn_entry	*entry;		/* What is queued for it (") */
+	unsigned int		worker;		/* Executor worker that had it last */
+	wheel_timer_t		timer;		/* Deadline (connset lock) */
+	uint8_t			timedout;	/* It passed (connset lock) */
 	hlist_t			*connset_l;	/* Which list it is on */
 	connset_t		*connset;	/* Set this conn belongs to */
 	void			*clientdata;	/* Client data */
@@ -73,15 +145,13 @@ struct conn {
 	buf_t			recv;		/* Receive side */
 	buf_t			send;		/* Sending side */
 	buf_t			send_headers;	/* Headers to send */
+	conn_chain_t		body;		/* Body before send (frozen) */
+	conn_chain_t		chain;		/* Sealed responses (conn_seal) */
 	uint64_t		real_contentlen;/* Real content length */
 
 	conn_posthandle_f	posthandle_f;	/* Post Handling function */
 	void			*posthandle_u;	/* User data */
 
-	int			sendfile_fd;	/* FD to send */
-	uint64_t		sendfile_off;	/* Current offset */
-	uint64_t		sendfile_len;	/* How much is the total? */
-
 	/* OpenSSL */
 #ifdef CONN_SSL
 	BIO			*ssl_bio_in;	/* Binary In */
@@ -89,9 +159,9 @@ struct conn {
 	SSL			*ssl;		/* SSL Session */
 	const char		*ssl_psk_key;	/* SSL PSK Key */
 	const char		*ssl_psk_id;	/* SSL PSK Id */
-	char			ssl_in[16*1024]; /* SSL Input */
+	char			*ssl_in;	/* SSL Input (while in use) */
 	uint64_t		ssl_in_len;
-	char			ssl_out[16*1024]; /* SSL Output */
+	char			*ssl_out;	/* SSL Output (while in use) */
 	uint64_t		ssl_out_len;
 #endif
 };
@@ -107,6 +177,9 @@ CHKRESULT bool conn_ssl_start(conn_t *conn, SSL_CTX *ssl_ctx, const char *ssl_ps
 CHKRESULT bool conn_init(conn_t *conn, void *clientdata);
 
 void conn_destroy(conn_t *conn);
+
+/* Give the buffer storage back while there is nothing buffered */
+void conn_release(conn_t *conn);
 void conn_close(conn_t *conn);
 
 CHKRESULT bool conn_create_listen(connset_t *connset, const char *hostname,
@@ -126,15 +199,37 @@ CHKRESULT bool conn_connect(conn_t *conn, const char *host, uint32_t protocol,
 
 void conn_events(conn_t *conn, uint16_t events);
 
+/*
+ * When the conn is not handled again within msec it goes to a worker
+ * anyway, with conn_timedout() set; while it is handled that happens
+ * right after. Replaces the deadline before it, 0 only cancels that.
+ * The worker that got it with conn_timedout() clears it when done.
+ * A conn the poller can't watch (anymore) passes its deadline right
+ * away, and again every DEF_POLL_TIMEOUT msec until arming works.
+ */
+void conn_deadline(conn_t *conn, unsigned int msec);
+#define conn_timedout(conn) ((conn)->timedout != 0)
+
 CHKRESULT bool conn_is_eof(conn_t *conn);
 
 int conn_recv(conn_t *conn);
 int conn_recvline(conn_t *conn, char *buf, unsigned int buflen);
 void conn_recv_empty(conn_t *conn, uint64_t len);
 
+/* Bytes not written yet: sealed and being built */
 uint64_t conn_flushleft(conn_t *conn);
+
+/* Write what the socket takes, the rest goes on at the next POLLOUT */
 bool conn_flush(conn_t *conn);
 
+/*
+ * Put the response that was built in send_headers/body/send behind the
+ * ones before it, the next one can then be built while these are not
+ * written yet. conn_flush() writes all of them with as few writev()s
+ * as it can.
+ */
+CHKRESULT bool conn_seal(conn_t *conn);
+
 void conn_set_flush_hook(conn_t *conn, conn_flush_hook hook, void *data);
 void conn_unset_flush_hook(conn_t *conn);
 
@@ -153,6 +248,36 @@ bool conn_vprintf(conn_t *conn, const char *fmt, va_list ap)
 bool conn_printf(conn_t *conn, const char *fmt, ...)
 	ATTR_FORMAT(printf, 2, 3);
 
+/*
+ * Add len bytes at data to the body without copying them, they have to
+ * stay there until release (can be NULL) is called. That also happens
+ * when this fails.
+ */
+CHKRESULT bool conn_putref(conn_t *conn, const char *data, uint64_t len,
+			   conn_release_f release, void *user);
+
+/*
+ * Add len bytes of fd from off onwards to the body, closefd closes fd
+ * once they are written (or dropped, also when this fails).
+ * Files go out with sendfile(), anything else (pipes, sockets) with
+ * splice() (Linux only) from where it is. Those have to be blocking,
+ * a worker waits for their data (non-blocking ones are refused).
+ */
+CHKRESULT bool conn_putfile(conn_t *conn, int fd, uint64_t off,
+			    uint64_t len, bool closefd);
+
+/*
+ * Like conn_putfile() for a regular file that stays open until release
+ * (can be NULL) is called, also when this fails. Files shared between
+ * connections: nothing is asked from the file system here.
+ */
+CHKRESULT bool conn_putfd(conn_t *conn, int fd, uint64_t off, uint64_t len,
+			  conn_release_f release, void *user);
+
+/* Open a regular file for conn_putfile(), -1 when it can't be sent */
+CHKRESULT int conn_openfile(const char *file, uint64_t *size);
+
+/* Add the whole file to the body */
 CHKRESULT bool conn_sendfile(conn_t *conn, const char *file);
 
 #define CONN_IDn "c%" PRIu64 ""
@@ -210,11 +335,14 @@ CHKRESULT bool conn_poll_in(conn_t *conn);
 CHKRESULT bool conn_poll_out(conn_t *conn);
 
 CHKRESULT bool connset_init(connset_t *cs);
+CHKRESULT bool connset_init_backend(connset_t *cs, connset_backend_t backend);
 void connset_destroy(connset_t *cs);
 CHKRESULT int connset_poll(connset_t *cs);
 
 CHKRESULT conn_t *connset_get_one_ready(connset_t *cs);
 CHKRESULT conn_t *connset_get_ready(connset_t *cs);
+void connset_set_executor(connset_t *cs, executor_t *ex);
+CHKRESULT conn_t *connset_get_ready_worker(connset_t *cs, executor_worker_t *w);
 void connset_handling_setup(conn_t *conn);
 void connset_handling_done(conn_t *conn, bool keephandling);
 void conn_set_posthandle(conn_t *conn, conn_posthandle_f f, void *user);
@@ -223,6 +351,7 @@ void conn_set_posthandle(conn_t *conn, conn_posthandle_f f, void *user);
 
 #define connset_is_empty(cs) (list_isempty(&(cs)->active) && \
 			      list_isempty(&(cs)->ready) && \
+			      mpmc_isempty(&(cs)->readyq) && \
 			      list_isempty(&(cs)->inactive))
 
 #endif /* CONN_H */
@@ -0,0 +1,67 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H 1
+
+#include "misc.h"
+
+/*
+ * Open files by path, for sending them (conn_putfd())
+ *
+ * An entry keeps the file open with what is needed to answer for it:
+ * size, modification time, an ETag and the content type. Everybody
+ * sending the file shares the one fd, entries are refcounted and the
+ * file is closed once the last one let go of an entry that left the
+ * cache.
+ *
+ * Entries are checked against the file system (stat()) at most once per
+ * ttl seconds, a file that changed (or went away) gets a new entry. Upto
+ * max entries are kept, the least recently used one goes first.
+ */
+
+/* Content type of a file, called when it is opened */
+typedef const char *(*filecache_type_f)(const char *path);
+
+typedef struct filecache_entry filecache_entry_t;
+
+struct filecache_entry {
+	filecache_entry_t	*next;		/* Hash chain */
+	filecache_entry_t	*older;		/* LRU list */
+	filecache_entry_t	*newer;
+	uint32_t		hash;		/* Of the path */
+	uint32_t		refs;		/* The cache holds one too */
+	uint64_t		checked;	/* Last stat() */
+	bool			cached;		/* Still in the cache */
+
+	int			fd;		/* Open, read-only */
+	uint64_t		size;		/* Size in bytes */
+	time_t			mtime;		/* Modification time */
+	uint64_t		ino;		/* Inode, for replaced files */
+	const char		*type;		/* Content type */
+	char			etag[48];	/* "ino-size-mtime" (quoted) */
+	char			path[];		/* Key */
+};
+
+typedef struct {
+	lock_t			lock;		/* Protects all below */
+	filecache_entry_t	**hash;		/* Hash table */
+	uint32_t		mask;		/* Slots - 1 */
+	filecache_entry_t	*oldest;	/* LRU list */
+	filecache_entry_t	*newest;
+	unsigned int		n;		/* Entries */
+	unsigned int		max;		/* Most entries */
+	unsigned int		ttl;		/* Seconds between stat()s */
+	filecache_type_f	type;		/* Content type of a file */
+	uint64_t		hits;		/* Answered from the cache */
+	uint64_t		misses;		/* Had to open the file */
+} filecache_t;
+
+CHKRESULT bool filecache_init(filecache_t *fc, unsigned int max,
+			      unsigned int ttl, filecache_type_f type);
+void filecache_destroy(filecache_t *fc);
+
+/* The entry for path, with a reference; NULL when it can't be opened */
+CHKRESULT filecache_entry_t *filecache_get(filecache_t *fc, const char *path);
+
+/* Let go of a reference */
+void filecache_put(filecache_entry_t *fe);
+
+#endif /* FILECACHE_H */
@@ -0,0 +1,73 @@
+#ifndef HTTPPARSE_H
+#define HTTPPARSE_H 1
+
+#include "misc.h"
+
+/*
+ * Incremental HTTP/1.x request head parser
+ *
+ * httpparse_run() is handed the whole buffer (which starts at the
+ * request) every time more came in. It only scans the bytes it did
+ * not see before and records where the request line and the headers
+ * are as offsets into the buffer: nothing is copied or modified, the
+ * offsets are valid for any copy of the head.
+ *
+ * Lines end in LF or CRLF, empty lines before the request line are
+ * skipped, leading and trailing whitespace of header values is not
+ * part of the value. Obsolete line folding is refused.
+ */
+
+/* Most headers a request can have */
+#define HTTPPARSE_MAXHDRS	64
+
+/* httpparse_run() results, errors are the HTTP status to answer with */
+#define HTTPPARSE_MORE		0	/* Not complete yet */
+#define HTTPPARSE_BAD		(-400)	/* Malformed (or a NUL in it) */
+#define HTTPPARSE_URITOOLONG	(-414)	/* Request line over the limit */
+#define HTTPPARSE_TOOLARGE	(-431)	/* Headers over the limit */
+#define HTTPPARSE_BADRANGE	(-416)	/* Range not satisfiable */
+
+typedef struct {
+	uint32_t		off;		/* Offset in the buffer */
+	uint32_t		len;		/* Length */
+} httpparse_span_t;
+
+typedef struct {
+	httpparse_span_t	name;		/* Without the ':' */
+	httpparse_span_t	value;		/* Without whitespace around */
+} httpparse_hdr_t;
+
+typedef struct {
+	uint32_t		off;		/* Scanned up to here */
+	uint32_t		line;		/* Start of the current line */
+	uint32_t		max;		/* Longest head we accept */
+
+	httpparse_span_t	request;	/* The request line */
+	httpparse_span_t	method;		/* Parts of it */
+	httpparse_span_t	uri;
+	httpparse_span_t	version;	/* Empty for HTTP/0.9 */
+
+	unsigned int		nhdrs;		/* Headers found */
+	httpparse_hdr_t		hdrs[HTTPPARSE_MAXHDRS];
+} httpparse_t;
+
+/* Start parsing a new request, the head can be upto max bytes */
+void httpparse_init(httpparse_t *p, uint32_t max);
+
+/* Length of the complete head, HTTPPARSE_MORE or an HTTPPARSE_ error */
+CHKRESULT int httpparse_run(httpparse_t *p, const char *buf, uint32_t len);
+
+/* Index of the (first) header called name, -1 when there is none */
+CHKRESULT int httpparse_find(const httpparse_t *p, const char *buf,
+			     const char *name, unsigned int len);
+
+/*
+ * The part of something of size bytes that a Range header value (NULL
+ * when there was none) asks for, in off/len. Returns the status to
+ * answer with: 206, 200 for all of it (no Range, one that is invalid
+ * or more than one range) or HTTPPARSE_BADRANGE.
+ */
+CHKRESULT int httpparse_range(const char *value, uint64_t size,
+			      uint64_t *off, uint64_t *len);
+
+#endif /* HTTPPARSE_H */
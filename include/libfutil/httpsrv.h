@@ -3,6 +3,8 @@
 
 #include "misc.h"
 #include "conn.h"
+#include "httpparse.h"
+#include "filecache.h"
 
 typedef enum {
 	HTTP_M_NONE = 0,
@@ -28,24 +30,31 @@ typedef struct {
 	const char	**val;
 } httpsrv_argl_t;
 
+/*
+ * The strings of a request (URI, arguments, header values) live in the
+ * request block of the client and are referred to by offset/length;
+ * httpsrv_str() gives the (NUL-terminated) string. Ones that are not
+ * there are "".
+ */
 typedef struct {
-	char		remote_ip[128];
-	char		remote_port_s[8];
+	uint32_t	off;		/* Offset into hcl->strs */
+	uint32_t	len;		/* Length, without the NUL */
+} httpsrv_slice_t;
+
+typedef struct {
+	char		remote_ip[INET6_ADDRSTRLEN];
 	uint32_t	remote_port;
-	char		local_ip[128];
-	char		local_port_s[8];
+	char		local_ip[INET6_ADDRSTRLEN];
 	uint32_t	local_port;
-	char		hostname[256];
-
-	char		rawuri[8192];
-	char		uri[8192];
 
-	char		args[4096];
-	char		argsplit[4096];
+	httpsrv_slice_t	hostname;
+	httpsrv_slice_t	rawuri;
+	httpsrv_slice_t	uri;
+	httpsrv_slice_t	argsplit;
 
-	char		cookie[4096];
-	char		content_type[256];
-	char		content_length_s[32];
+	httpsrv_slice_t	cookie;
+	httpsrv_slice_t	content_type;
+	httpsrv_slice_t	content_length_s;
 	uint64_t	content_length;
 
 } httpsrv_headers_t;
@@ -57,12 +66,39 @@ typedef bool (*httpsrv_done_f)(httpsrv_client_t *hcl, void *user);
 typedef void (*httpsrv_line_f)(httpsrv_client_t *hcl, void *user, char *line);
 typedef void (*httpsrv_bfwd_f)(httpsrv_client_t *hcl, httpsrv_client_t *fhcl, void *user);
 
+typedef struct httpsrv_shard httpsrv_shard_t;
+
+/*
+ * The request block: the parser state and the strings of the request
+ * (strs), which start with a copy of the request head. A client only
+ * holds one (from hs->requests) while it is busy with a request, idle
+ * clients are just the httpsrv_client_t.
+ */
+#define HTTPSRV_LINE_LEN	(16*1024)
+#define HTTPSRV_HEAD_LEN	(32*1024)
+#define HTTPSRV_STRS_LEN	(64*1024)
+#define HTTPSRV_REQ_LEN		(sizeof(httpparse_t) + HTTPSRV_STRS_LEN)
+
+/* Limits of the strings, including the NUL */
+#define HTTPSRV_URI_LEN		8192
+#define HTTPSRV_ARGS_LEN	4096
+
 /* All private */
 typedef struct {
 	uint64_t		id;		/* Identifier for debugging */
 	mutex_t			mutex;		/* Lock */
-	connset_t		connset;	/* Connections */
+	connset_t		connset;	/* Connections (shard 0) */
 	hlist_t			sessions;	/* Sessions */
+	httpsrv_shard_t		*shards;	/* Pollers */
+	unsigned int		numshards;	/* Number of shards */
+	pool_t			clients;	/* httpsrv_client_t's */
+	pool_t			requests;	/* Request blocks */
+	filecache_t		files;		/* httpsrv_sendfile() ones */
+
+	/* Deadlines in msec, 0 = none (httpsrv_set_timeouts()) */
+	unsigned int		timeout_idle;	/* For the next request */
+	unsigned int		timeout_head;	/* For the rest of a head */
+	unsigned int		timeout_write;	/* Without anything going out */
 
 	/* Caller functions (callbacks) */
 	/* User data */
@@ -93,6 +129,18 @@ typedef struct {
 	httpsrv_f		close;
 } httpsrv_t;
 
+/* A poller with its own listen socket, connset and workers */
+struct httpsrv_shard {
+	httpsrv_t		*hs;		/* HTTP Server */
+	unsigned int		num;		/* Shard number */
+	connset_t		*connset;	/* Connections of this shard */
+	executor_t		executor;	/* Workers of this shard */
+#ifdef _LINUX
+	bool			pin;		/* Pin threads to cpus? */
+	cpu_set_t		cpus;		/* CPUs of this shard */
+#endif
+};
+
 /* Per-connection/session from mod_dgw or listeners */
 struct httpsrv_client {
 	hnode_t			node;		/* Session list node */
@@ -103,12 +151,17 @@ struct httpsrv_client {
 	httpsrv_t		*hs;		/* HTTP Server */
 	conn_t			conn;		/* Connection */
 	http_method_t		method;		/* HTTP Method */
-	char			line[16*1024];		/* Request line */
-	char			the_request[16*1024]; /* Full HTTP request */
-	buf_t			the_headers;	/* All headers (raw) */
+	httpparse_t		*parse;		/* Request parser (lazy) */
+	char			*the_request;	/* Request line (in strs) */
+	char			*strs;		/* Strings of the request */
+	uint32_t		strs_len;	/* Used in strs */
+	buf_t			the_headers;	/* httpsrv_rawheaders() */
 	httpsrv_headers_t	headers;	/* Inbound headers */
 	bool			close;		/* Close it? */
 	bool			keephandling;	/* Keep Handling it? */
+	bool			batch;		/* httpsrv_handle_batch() */
+	uint8_t			deadline;	/* What conn_deadline() is for */
+	uint64_t		deadline_mark;	/* reqid resp. flushleft then */
 	void			*user;		/* User data */
 
 	httpsrv_client_t	*bodyfwd;	/* Forward the body? */
@@ -126,6 +179,10 @@ struct httpsrv_client {
 	httpsrv_sf		posthandle;
 };
 
+/* String of a slice in hcl->headers */
+#define httpsrv_str(hcl, sl) \
+	((hcl)->strs != NULL ? (const char *)&(hcl)->strs[(sl).off] : "")
+
 #define HCL_IDn "%" PRIu64
 #define HCL_ID "[hcl" HCL_IDn "]"
 
@@ -145,8 +202,26 @@ httpsrv_start(
 		const char *hostname,
 		unsigned int port,
 		unsigned int numworkers);
+CHKRESULT bool
+httpsrv_start_sharded(
+		httpsrv_t *hs,
+		const char *hostname,
+		unsigned int port,
+		unsigned int numshards,
+		unsigned int numworkers,
+		bool pin);
 void httpsrv_exit(httpsrv_t *hs);
 
+/*
+ * Clients are closed when they take longer than idle to send the next
+ * request, longer than head for the rest of a request head (from its
+ * first byte, or the connect) or do not take any of the answer for
+ * write; a request body may not stall for longer than idle either. In
+ * msec, 0 disables it, it applies from the next time a client is seen.
+ */
+void httpsrv_set_timeouts(httpsrv_t *hs, unsigned int idle,
+			  unsigned int head, unsigned int write);
+
 CHKRESULT httpsrv_client_t *httpsrv_newcl(httpsrv_t *hs);
 void httpsrv_client_destroy(httpsrv_client_t *hcl);
 
@@ -156,6 +231,12 @@ CHKRESULT int
 httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args);
 
 const char *httpsrv_methodname(unsigned int method);
+
+/* Value of a request header, NULL when it was not sent */
+const char *httpsrv_header(httpsrv_client_t *hcl, const char *name);
+
+/* All headers but Content-Length as "name: value\r\n" lines */
+buf_t *httpsrv_rawheaders(httpsrv_client_t *hcl);
 void httpsrv_close(httpsrv_client_t *hcl);
 
 void httpsrv_set_userdata(httpsrv_client_t *hcl, void *user);
@@ -172,6 +253,8 @@ void httpsrv_readbody_free(httpsrv_client_t *hcl);
 void httpsrv_sessions(httpsrv_client_t *hcl);
 
 #define HTTPSRV_HTTP_OK		200, "OK"
+#define HTTPSRV_HTTP_PARTIAL	206, "Partial Content"
+#define HTTPSRV_HTTP_NOTMODIFIED	304, "Not Modified"
 #define HTTPSRV_HTTP_FORBIDDEN	403, "Forbidden"
 #define HTTPSRV_HTTP_NOTFOUND	404, "Not Found"
 
@@ -17,8 +17,8 @@ struct hlist_t
 			*tail,		/* The tail of the list */
 			*tailprev;	/* The previous of the tail
 					   of the list */
-	mutex_t		mutex;		/* Mutex */
-	cond_t		cond;		/* Condition */
+	lock_t		lock;		/* Lock (non-recursive) */
+	lockcond_t	cond;		/* Condition */
 
 #ifdef DEBUG
 	uint64_t	locks;		/* Number of locks */
@@ -0,0 +1,72 @@
+#ifndef LOCK_H
+#define LOCK_H 1
+
+#include "misc.h"
+
+/*
+ * Non-recursive lock for the hot paths (conn_t, buf_t, hlist_t)
+ *
+ * On Linux it spins a little (the holder is typically on another CPU
+ * and done quickly) and then sleeps on a futex; otherwise it is a
+ * plain, non-recursive, pthread mutex.
+ *
+ * With LOCK_DEBUG (default in DEBUG builds, -DLOCK_NODEBUG to disable)
+ * taking a lock that the thread already holds, or releasing one it
+ * does not hold, is caught instead of silently deadlocking.
+ */
+#if defined(DEBUG) && !defined(LOCK_NODEBUG)
+#define LOCK_DEBUG 1
+#endif
+
+typedef struct {
+#ifdef _LINUX
+	uint32_t	state;		/* 0 = free, 1 = locked, 2 = waiters */
+#else
+	pthread_mutex_t	mutex;		/* Non-recursive mutex */
+#endif
+#ifdef LOCK_DEBUG
+	os_thread_t	owner;		/* Thread holding it */
+	bool		owned;		/* owner is valid */
+#endif
+} lock_t;
+
+/* Static initializer (lock_init() is still fine to use) */
+#ifdef _LINUX
+#define LOCK_INITIALIZER	{ 0 }
+#else
+#define LOCK_INITIALIZER	{ PTHREAD_MUTEX_INITIALIZER }
+#endif
+
+/* Condition for use with a lock_t */
+typedef struct {
+#ifdef _LINUX
+	uint32_t	seq;		/* Bumped for every trigger (futex) */
+	uint32_t	waiters;	/* Number of waiters */
+#else
+	pthread_cond_t	cond;		/* Condition */
+#endif
+} lockcond_t;
+
+void lock_init(lock_t *l);
+void lock_destroy(lock_t *l);
+void lock_lock(lock_t *l);
+CHKRESULT bool lock_trylock(lock_t *l);
+void lock_unlock(lock_t *l);
+
+#ifdef LOCK_DEBUG
+#define lock_assert_held(l) fassert((l)->owned && \
+				    pthread_equal((l)->owner, pthread_self()))
+#else
+#define lock_assert_held(l) {}
+#endif
+
+void lockcond_init(lockcond_t *c);
+void lockcond_destroy(lockcond_t *c);
+
+/* Lock held by caller, returns true on timeout (like cond_wait) */
+bool lockcond_wait(lockcond_t *c, lock_t *l, unsigned int msec);
+
+/* Wake all waiters, lock held by caller */
+void lockcond_trigger(lockcond_t *c);
+
+#endif /* LOCK_H */
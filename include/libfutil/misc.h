@@ -28,11 +28,13 @@
 #include <sys/select.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <sys/syscall.h>
 #include <pwd.h>
 #ifdef _LINUX
 #include <sys/sendfile.h>
+#include <sys/epoll.h>
 #endif
 #include <sys/wait.h>
 
@@ -136,6 +138,7 @@ typedef HANDLE			cond_t;
 #ifdef __MACH__
 #include <mach/clock.h>
 #include <mach/mach.h>
+#include <mach/mach_time.h>
 #endif
 
 #ifdef _DARWIN
@@ -237,20 +240,79 @@ void logline(unsigned int level, const char *caller, const char *format, ...)
 
 #define LOG_ARG __func__
 
-/* We completely compile out DEBUG statements */
+/*
+ * Every log_xxx() is a site: a static that says whether it logs, thus a
+ * disabled one costs a load and a (predicted) branch, not a call. The
+ * first time it is hit it gets known and follows the log level
+ * (log_setlevel(), SAFDEF_LOG_LEVEL) and the rules of log_site_rule()
+ * from then on. Levels less important than LOG_LEVEL_COMPILED are not
+ * compiled in at all, arguments included (-DLOG_LEVEL_COMPILED=LOG_INFO,
+ * default: LOG_DEBUG in DEBUG builds, LOG_INFO otherwise).
+ */
+#ifndef LOG_LEVEL_COMPILED
 #ifdef DEBUG
-#define log_dbg(...) logline(LOG_DEBUG,   LOG_ARG, __VA_ARGS__)
+#define LOG_LEVEL_COMPILED LOG_DEBUG
+#else
+#define LOG_LEVEL_COMPILED LOG_INFO
+#endif
+#endif
+
+#define LOG_SITE_OFF	0
+#define LOG_SITE_ON	1
+#define LOG_SITE_NEW	2	/* Not known yet, decided on the first hit */
+
+typedef struct log_site log_site_t;
+
+struct log_site {
+	uint8_t		on;		/* LOG_SITE_*, not 0: call logsite() */
+	uint8_t		level;
+	const char	*file;		/* __FILE__ */
+	const char	*caller;	/* __func__ */
+	log_site_t	*next;		/* Known sites */
+};
+
+void logsite(log_site_t *site, const char *format, ...)
+	     ATTR_FORMAT(printf, 2, 3);
+
+#define log_site(level, ...) do {					\
+	static log_site_t log_site_ = {					\
+		LOG_SITE_NEW, (level), __FILE__, LOG_ARG, NULL };	\
+	if (__builtin_expect(atomic_ldr(log_site_.on) != LOG_SITE_OFF,	\
+			     0))					\
+		logsite(&log_site_, __VA_ARGS__);			\
+} while (0)
+
+#define log_none(...) do {} while (0)
+
+#if LOG_LEVEL_COMPILED >= LOG_DEBUG
+#define log_dbg(...) log_site(LOG_DEBUG,   __VA_ARGS__)
+#else
+#define log_dbg(...) log_none(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL_COMPILED >= LOG_INFO
+#define log_inf(...) log_site(LOG_INFO,    __VA_ARGS__)
+#else
+#define log_inf(...) log_none(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL_COMPILED >= LOG_NOTICE
+#define log_ntc(...) log_site(LOG_NOTICE,  __VA_ARGS__)
+#else
+#define log_ntc(...) log_none(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL_COMPILED >= LOG_WARNING
+#define log_wrn(...) log_site(LOG_WARNING, __VA_ARGS__)
 #else
-#define log_dbg(...) {}
+#define log_wrn(...) log_none(__VA_ARGS__)
 #endif
 
-#define log_emg(...) logline(LOG_EMERG,   LOG_ARG, __VA_ARGS__)
-#define log_alt(...) logline(LOG_ALERT,   LOG_ARG, __VA_ARGS__)
-#define log_crt(...) logline(LOG_CRIT,    LOG_ARG, __VA_ARGS__)
-#define log_err(...) logline(LOG_ERR,     LOG_ARG, __VA_ARGS__)
-#define log_wrn(...) logline(LOG_WARNING, LOG_ARG, __VA_ARGS__)
-#define log_ntc(...) logline(LOG_NOTICE,  LOG_ARG, __VA_ARGS__)
-#define log_inf(...) logline(LOG_INFO,    LOG_ARG, __VA_ARGS__)
+/* Errors and worse are always there */
+#define log_err(...) log_site(LOG_ERR,     __VA_ARGS__)
+#define log_crt(...) log_site(LOG_CRIT,    __VA_ARGS__)
+#define log_alt(...) log_site(LOG_ALERT,   __VA_ARGS__)
+#define log_emg(...) log_site(LOG_EMERG,   __VA_ARGS__)
 
 typedef void (*logfunc_f)(unsigned int level, const char *caller,
 			  const char *format, va_list ap)
@@ -262,8 +324,70 @@ void log_setup(const char *name, FILE *f);
 void log_setlevel(unsigned int level);
 void log_setfunc(logfunc_f func);
 
+/*
+ * Switch sites on (or off) whatever their level: those in file (without
+ * directories, "conn.c") and/or caller (function), NULL matches all.
+ * The last rule that matches a site counts, sites that no rule matches
+ * follow the log level. False when there are too many rules.
+ */
+CHKRESULT bool log_site_rule(const char *file, const char *caller, bool on);
+void log_site_rules_clear(void);
+
+/*
+ * Asynchronous logging: logline() only formats the line into a ring of
+ * its thread (of ringsize bytes, lock-free), a writer thread gathers them
+ * and writes them out in large batches. It also rotates the log file of
+ * log_set() (to <file>.1) once that grows beyond maxsize (0: never).
+ * Lines that do not fit in the ring are dropped and counted, errors and
+ * worse first wait a little for the writer. Needs log_set()/log_setup(),
+ * log_async_stop() writes out what is left; it does nothing from the
+ * writer itself (a log break there), the lines then stay in the rings.
+ */
+CHKRESULT bool log_async_start(unsigned int ringsize, uint64_t maxsize);
+void log_async_stop(void);
+void log_async_stats(uint64_t *lines, uint64_t *drops);
+
+/*
+ * Who formats the lines of asynchronous logging: the threads that log
+ * them (text), or the writer and the threads only copy the arguments
+ * (deferred), or nobody: binary log file, log_decode() (make logdecode)
+ * turns it into text, on a machine of the same kind. Deferred formats
+ * and callers have to stay (literals, __func__), those that use %n, %m
+ * or positional arguments are formatted right away. Only while it is
+ * stopped, false otherwise.
+ */
+typedef enum {
+	LOG_FORMAT_TEXT = 0,
+	LOG_FORMAT_DEFERRED,
+	LOG_FORMAT_BINARY
+} log_format_t;
+
+CHKRESULT bool log_async_format(log_format_t format);
+
+/* Binary log (LOG_FORMAT_BINARY) as text, false when it is broken */
+CHKRESULT bool log_decode(FILE *in, FILE *out);
+
 bool cond_wait_(cond_t *c, mutex_t *m, unsigned int msec);
 
+/* Atomics (gcc/clang builtins), x is the variable, not a pointer */
+#define atomic_ld(x)		__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define atomic_ldr(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define atomic_st(x, v)		__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define atomic_inc(x)		__atomic_add_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#define atomic_dec(x)		__atomic_sub_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#define atomic_cas(x, e, v)	__atomic_compare_exchange_n(&(x), &(e), (v), \
+					false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+#define atomic_fence()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#ifdef _LINUX
+/*
+ * Sleep while *addr == val, msec = 0 is without timeout
+ * Returns true on timeout (like cond_wait)
+ */
+bool futex_wait(uint32_t *addr, uint32_t val, unsigned int msec);
+void futex_wake(uint32_t *addr, unsigned int num);
+#endif
+
 /**
  ** inet infrastructure
  **/
@@ -307,12 +431,19 @@ inet_ntopA(const ipaddress_t *addr, char *dst, socklen_t cnt);
 		teem.tm_year+1900, teem.tm_mon+1, teem.tm_mday,	\
 		teem.tm_hour, teem.tm_min, teem.tm_sec
 
+#include "lock.h"
+#include "pool.h"
 #include "list.h"
+#include "mpmc.h"
+#include "rcu.h"
 #include "thread.h"
 #include "rwl.h"
 #include "stack.h"
+#include "wheel.h"
+#include "clk.h"
 
-#define gettime() gettimes(NULL)
+/* Seconds are fine coarse, gettimes() is the exact time */
+#define gettime() clk_now(NULL)
 CHKRESULT uint64_t gettimes(uint64_t *msec);
 
 #ifndef _WIN32
@@ -328,6 +459,14 @@ typedef struct {
 } misc_map_t;
 
 CHKRESULT int misc_map(const char *str, const misc_map_t *map, char *data);
+
+/* Only find the entry, val/vlen: the value (pointing into str) */
+CHKRESULT int misc_map_find(const char *str, const misc_map_t *map,
+			    const char **val, unsigned int *vlen);
+
+/* Entry of a label (not terminated, case insensitive), -2 when unknown */
+CHKRESULT int misc_map_label(const char *label, unsigned int len,
+			     const misc_map_t *map);
 #define MAPLABEL(x)	x, sizeof(x)-1
 #define MAPEND		NULL,0,0,0
 
@@ -380,7 +519,8 @@ void dumppacket(int level, const uint8_t *packet, uint64_t len);
 #ifdef DEBUG
 #define debugpacket(packet,len) dumppacket(LOG_DEBUG, packet, len)
 #else
-#define debugpacket(packet,len) {}
+/* Still "uses" what only goes into it, -Werror would trip over that */
+#define debugpacket(packet,len) { (void)(packet); (void)(len); }
 #endif
 
 CHKRESULT int parse_iso8601_time(const char *t, uint64_t *when);
@@ -0,0 +1,63 @@
+#ifndef MPMC_H
+#define MPMC_H 1
+
+#include "misc.h"
+
+/*
+ * Bounded lock-free multi-producer/multi-consumer queue of pointers
+ * (Dmitry Vyukov's ring: every cell carries a sequence number, push
+ * and pop are a single CAS on head resp. tail).
+ *
+ * Consumers that find it empty can park in mpmc_pop_wait(), producers
+ * only pay for a wakeup (futex on Linux) when somebody is parked.
+ */
+typedef struct {
+	uint64_t	seq;		/* Sequence number of this cell */
+	void		*data;		/* The item */
+} mpmc_cell_t;
+
+#define MPMC_CACHELINE 64
+
+typedef struct {
+	mpmc_cell_t	*cells;		/* The ring */
+	uint64_t	mask;		/* Number of cells - 1 */
+	char		pad0[MPMC_CACHELINE];
+
+	uint64_t	head;		/* Next cell to push into */
+	char		pad1[MPMC_CACHELINE - sizeof(uint64_t)];
+
+	uint64_t	tail;		/* Next cell to pop from */
+	char		pad2[MPMC_CACHELINE - sizeof(uint64_t)];
+
+	uint32_t	waiters;	/* Consumers parked (or about to) */
+	uint32_t	wakeups;	/* Bumped for every wakeup (futex) */
+#ifndef _LINUX
+	mutex_t		mutex;		/* Parking lock */
+	cond_t		cond;		/* Parking condition */
+#endif
+} mpmc_t;
+
+/* size is rounded up to a power of 2 */
+CHKRESULT bool mpmc_init(mpmc_t *q, unsigned int size);
+void mpmc_destroy(mpmc_t *q);
+
+/* false when the queue is full */
+CHKRESULT bool mpmc_push(mpmc_t *q, void *data);
+
+/* NULL when the queue is empty */
+CHKRESULT void *mpmc_pop(mpmc_t *q);
+
+/*
+ * Pop, parking up to msec when the queue is empty (0 = no parking).
+ * Can return NULL early after a mpmc_wake(), callers loop.
+ */
+CHKRESULT void *mpmc_pop_wait(mpmc_t *q, unsigned int msec);
+
+/* Kick a parked consumer (eg when something became available elsewhere) */
+void mpmc_wake(mpmc_t *q);
+
+/* Approximation when there is concurrent access */
+#define mpmc_count(q) (atomic_ld((q)->head) - atomic_ld((q)->tail))
+#define mpmc_isempty(q) (mpmc_count(q) == 0)
+
+#endif /* MPMC_H */
@@ -0,0 +1,51 @@
+#ifndef POOL_H
+#define POOL_H 1
+
+#include "misc.h"
+
+/*
+ * Object pool: a cache of equally sized objects for things that are
+ * allocated and freed all the time (clients, buffers). Objects that
+ * come back are handed out again instead of going through malloc and
+ * faulting in fresh pages.
+ *
+ * The cache is trimmed every POOL_WINDOW puts to what the high-water
+ * mark of objects in use during that window needs, so memory goes
+ * back once the churn drops.
+ */
+#define POOL_WINDOW 1024
+
+typedef struct pool_obj {
+	struct pool_obj	*next;		/* Free list */
+} pool_obj_t;
+
+typedef struct {
+	lock_t		lock;		/* Protects all below */
+	const char	*name;		/* For the memory debugging */
+	size_t		size;		/* Size of an object */
+	pool_obj_t	*free;		/* Cached objects */
+	unsigned int	nfree;		/* Number of cached objects */
+	unsigned int	inuse;		/* Objects handed out */
+	unsigned int	hiwat;		/* Max inuse in this window */
+	unsigned int	puts;		/* Puts in this window */
+	uint64_t	allocs;		/* Objects allocated */
+	uint64_t	reuses;		/* Objects handed out again */
+	uint64_t	trimmed;	/* Cached objects freed by trimming */
+} pool_t;
+
+#define POOL_INITIALIZER(size, name) \
+	{ LOCK_INITIALIZER, name, size, NULL, 0, 0, 0, 0, 0, 0, 0 }
+
+void pool_init(pool_t *pool, size_t size, const char *name);
+
+/* All objects have to be returned */
+void pool_destroy(pool_t *pool);
+
+/* Not zeroed, NULL when out of memory */
+CHKRESULT void *pool_get(pool_t *pool);
+void pool_put(pool_t *pool, void *obj);
+
+/* Free all cached objects */
+void pool_trim(pool_t *pool);
+
+#endif /* POOL_H */
@@ -0,0 +1,53 @@
+#ifndef RCU_H
+#define RCU_H 1
+
+#include "misc.h"
+
+/*
+ * Epoch based reclamation (read-copy-update)
+ *
+ * Readers wrap their access in rcu_read_lock()/rcu_read_unlock(),
+ * which only touch a per-thread record, and fetch shared pointers with
+ * rcu_dereference(). Writers (serialized among themselves by their own
+ * lock) build a new version, publish it with rcu_assign() and hand the
+ * old one to rcu_defer(): it is freed once every reader that could
+ * still see it has left its read section.
+ *
+ * Read sections nest, must not block for long and must not call
+ * rcu_synchronize() or rcu_barrier().
+ */
+typedef struct rcu_head {
+	struct rcu_head	*next;			/* Pending list */
+	void		(*func)(struct rcu_head *head);	/* Frees it */
+} rcu_head_t;
+
+typedef void (*rcu_func_t)(rcu_head_t *head);
+
+/* Callbacks pending before a writer reclaims them */
+#define RCU_DEFER_BATCH 64
+
+#define rcu_dereference(p)	__atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign(p, v)	__atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+
+/* Wait until all read sections that are running have finished */
+void rcu_synchronize(void);
+
+/* Call func(head) once no reader can see head anymore */
+void rcu_defer(rcu_head_t *head, rcu_func_t func);
+
+/* Reclaim everything that rcu_defer() has pending */
+void rcu_barrier(void);
+
+/* The calling thread will not read anymore (eg it is exiting) */
+void rcu_thread_offline(void);
+
+/* Same for a thread being cancelled, which may be inside a read section */
+void rcu_thread_cancel(void);
+
+/* Reclaims what is pending and frees the per-thread records */
+void rcu_exit(void);
+
+#endif /* RCU_H */
@@ -3,14 +3,55 @@
 
 #include "misc.h"
 
+/*
+ * Readers/writer lock
+ *
+ * All state lives in one atomic word: readers get in with a single
+ * CAS as long as no writer holds or waits for the lock. A waiting
+ * writer holds off new readers (no writer starvation), releasing the
+ * write lock lets the readers that queued up in before the next writer
+ * gets a turn. Waiting is done on a futex (Linux), no spinning.
+ *
+ * Writers thus go first: read locks do not nest. A thread that takes
+ * the read lock again while holding it deadlocks as soon as a writer
+ * waits in between (DEBUG builds assert on it).
+ *
+ * Big reader mode (rwl_init_bigreader()) is for data that is read all
+ * the time and written rarely: every CPU gets its own reader count on
+ * its own cache line, uncontended readers thus do not touch a shared
+ * cache line. Writers pay for it, they have to wait for all CPUs.
+ */
+#define RWL_CACHELINE	64
+
+#define RWL_WRITER	0x80000000	/* state: a writer has it */
+#define RWL_WWAIT	0x40000000	/* state: writers are waiting */
+#define RWL_READERS	0x3fffffff	/* state: number of readers */
+
+typedef struct {
+	int32_t		readers;	/* Readers that went in on this CPU */
+	char		pad[RWL_CACHELINE - sizeof(int32_t)];
+} rwl_slot_t;
+
 typedef struct {
-	mutex_t		mutex;			/* Lock for changing readers/writers */
-	mutex_t		mutexW;			/* Lock held when something is writing */
-	unsigned int	readers;		/* How many readers are in */
-	unsigned int	writers;		/* How many writers are waiting */
+	uint32_t	state;		/* RWL_WRITER | RWL_WWAIT | readers */
+	uint32_t	rseq;		/* Bumped to wake readers (futex) */
+	uint32_t	wseq;		/* Bumped to wake writers (futex) */
+	uint32_t	rwaiters;	/* Readers sleeping (or about to) */
+	uint32_t	wwaiters;	/* Writers sleeping (or about to) */
+
+	/* Big reader mode */
+	rwl_slot_t	*slots;		/* Per-CPU reader counts */
+	unsigned int	nslots;		/* Number of slots */
+	lock_t		writer;		/* Serializes the writers */
+
+#ifndef _LINUX
+	mutex_t		mutex;		/* Parking lock */
+	cond_t		cond;		/* Parking condition */
+#endif
 } rwl_t;
 
 void rwl_init(rwl_t *rwl);
+CHKRESULT bool rwl_init_bigreader(rwl_t *rwl);
 void rwl_destroy(rwl_t *rwl);
 void rwl_lockR(rwl_t *rwl);
 void rwl_unlockR(rwl_t *rwl);
@@ -18,4 +59,3 @@ void rwl_lockW(rwl_t *rwl);
 void rwl_unlockW(rwl_t *rwl);
 
 #endif /* RWL_H */
-
@@ -0,0 +1,46 @@
+#ifndef SCAN_H
+#define SCAN_H 1
+
+#include "misc.h"
+
+/*
+ * Searching for delimiters (line ends, separators)
+ *
+ * There are SSE2 and AVX2 versions next to the plain C one. The first
+ * call picks the best one the CPU has, scan_select() forces one (tests,
+ * benchmarks). None of them read outside of [s, e).
+ */
+
+/* A small set of bytes to look for, can include NUL */
+#define SCAN_SET_MAX 8
+
+typedef struct {
+	unsigned int	n;			/* Bytes in c */
+	char		c[SCAN_SET_MAX];	/* The bytes */
+} scan_set_t;
+
+/* eg: static const scan_set_t set = SCAN_SET("\n\0"); */
+#define SCAN_SET(chars) { sizeof(chars) - 1, chars }
+
+typedef enum {
+	SCAN_AUTO = 0,
+	SCAN_SCALAR,
+	SCAN_SSE2,
+	SCAN_AVX2,
+	SCAN_MAX
+} scan_impl_t;
+
+/* First a or b in [s, e), NULL when neither is there */
+CHKRESULT const char *scan_find2(const char *s, const char *e, char a, char b);
+
+/* First byte of [s, e) that is in the set, NULL when there is none */
+CHKRESULT const char *scan_set(const scan_set_t *set, const char *s,
+			       const char *e);
+
+/* Use impl from now on, false when this CPU does not have it */
+CHKRESULT bool scan_select(scan_impl_t impl);
+
+/* Name of the one in use */
+const char *scan_name(void);
+
+#endif /* SCAN_H */
@@ -30,11 +30,15 @@ typedef struct {
 	os_thread_t	thread;		/* The thread */
 	os_thread_id	thread_id;	/* Thread Identifier */
 	uint64_t	thread_num;	/* Thread number */
-	thread_status_t	state;		/* Sleeping? */
+	thread_status_t	state;		/* Sleeping? (atomic) */
 	uint64_t	starttime;	/* Time thread started */
 	cond_t		cond;		/* Condition variable */
 	bool		cancelable;	/* Cancel this thread at exit? */
-	uint64_t	served;		/* Requests served */
+	bool		stopped;	/* Taken over by stopall (list lock) */
+	uint32_t	exited;		/* Stopped and gone (atomic) */
+	uint64_t	served;		/* Requests served (atomic) */
+	uint64_t	local;		/* Executor: work from own queue */
+	uint64_t	steals;		/* Executor: work stolen from others */
 	char		message[128];	/* Short 'status' message */
 
         /* The routine we are going to call with its argument */
@@ -60,6 +64,10 @@ CHKRESULT mythread_t *thread_getthis(void);
 
 void thread_serve(void);
 
+#ifdef _LINUX
+CHKRESULT bool thread_setaffinity(const cpu_set_t *cpus);
+#endif
+
 typedef void (*thread_list_f)(void		*cbdata,
 			      uint64_t		tnum,
 			      uint64_t		tid,
@@ -73,6 +81,68 @@ typedef void (*thread_list_f)(void		*cbdata,
 
 CHKRESULT unsigned int thread_list(thread_list_f cb, void *cbdata);
 
+/* Per thread counters, local/steals are only kept by executor workers */
+typedef void (*thread_stats_f)(void		*cbdata,
+			       uint64_t		tnum,
+			       const char	*description,
+			       uint64_t		served,
+			       uint64_t		local,
+			       uint64_t		steals);
+
+CHKRESULT unsigned int thread_stats(thread_stats_f cb, void *cbdata);
+
+/*
+ * Work-stealing executor
+ *
+ * Every worker has its own queue, items are submitted with a hint
+ * which worker should get it (eg the one that handled it last, its
+ * data is still hot in that CPU's cache). A worker takes from its
+ * own queue first and steals from the others when that is empty.
+ */
+#define EXECUTOR_ANY (~0U)
+
+typedef struct executor executor_t;
+
+typedef struct {
+	mpmc_t		q;		/* Work for this worker */
+	executor_t	*ex;		/* Executor it belongs to */
+	unsigned int	num;		/* Worker number */
+	mythread_t	*thread;	/* Thread that joined (stats) */
+	uint32_t	parked;		/* Waiting for work */
+	uint32_t	wakeups;	/* Bumped for every wakeup (futex) */
+#ifndef _LINUX
+	mutex_t		mutex;		/* Parking lock */
+	cond_t		cond;		/* Parking condition */
+#endif
+} executor_worker_t;
+
+struct executor {
+	executor_worker_t *workers;	/* The workers */
+	unsigned int	num;		/* Number of workers */
+	unsigned int	joined;		/* Workers that joined */
+	unsigned int	next;		/* Round-robin for EXECUTOR_ANY */
+	uint32_t	idle;		/* Workers parked */
+};
+
+CHKRESULT bool executor_init(executor_t *ex, unsigned int workers,
+			     unsigned int qsize);
+void executor_destroy(executor_t *ex);
+
+/* Calling thread becomes the next worker, NULL when all are there */
+CHKRESULT executor_worker_t *executor_join(executor_t *ex);
+
+/* false when all queues are full */
+CHKRESULT bool executor_submit(executor_t *ex, void *item, unsigned int hint);
+
+/* Next item for worker w, parks up to msec, NULL when there is none */
+CHKRESULT void *executor_next(executor_worker_t *w, unsigned int msec);
+
+/* Any item, for draining on shutdown */
+CHKRESULT void *executor_pop(executor_t *ex);
+
+/* Kick a parked worker (eg when there is work elsewhere) */
+void executor_wake(executor_t *ex);
+
 CHKRESULT int thread_daemonize(const char *pidfile, const char *username);
 
 void thread_stop_running(void);
@@ -0,0 +1,52 @@
+#ifndef WHEEL_H
+#define WHEEL_H 1
+
+/*
+ * Hierarchical timer wheel: WHEEL_LEVELS levels of WHEEL_SLOTS slots,
+ * a slot of level n covers WHEEL_SLOTS^n ticks. Timers are linked into
+ * their slot, arming, re-arming and cancelling are O(1); the ones on a
+ * higher level move down (cascade) once their slot comes up.
+ *
+ * A tick is whatever the owner counts in (connset: milliseconds),
+ * timers further out than the wheel spans cascade until they are due.
+ * Not locked, that is up to the owner.
+ */
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_LEVELS	4
+
+typedef struct wheel_timer wheel_timer_t;
+
+struct wheel_timer {
+	wheel_timer_t	*next;		/* In the slot */
+	wheel_timer_t	**pprev;	/* What points at us, NULL: not armed */
+	uint64_t	expires;	/* Tick it is due at */
+	uint8_t		level;		/* Where it is */
+	uint8_t		slot;
+};
+
+typedef struct {
+	wheel_timer_t	*slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	uint64_t	used[WHEEL_LEVELS];	/* Slots that have timers */
+	uint64_t	now;		/* Ticks done */
+	unsigned int	n;		/* Armed timers */
+} wheel_t;
+
+void wheel_init(wheel_t *w, uint64_t now);
+void wheel_timer_init(wheel_timer_t *t);
+
+/* (Re-)arm t to be due at tick expires, the past is due right away */
+void wheel_arm(wheel_t *w, wheel_timer_t *t, uint64_t expires);
+void wheel_cancel(wheel_t *w, wheel_timer_t *t);
+#define wheel_armed(t) ((t)->pprev != NULL)
+
+/*
+ * Ticks from w->now until something has to be done, UINT64_MAX when
+ * nothing is armed. Can be a cascade that turns out not to be due yet.
+ */
+CHKRESULT uint64_t wheel_next(wheel_t *w);
+
+/* The next timer that is due at now (disarmed), NULL when there is none */
+CHKRESULT wheel_timer_t *wheel_expire(wheel_t *w, uint64_t now);
+
+#endif /* WHEEL_H */
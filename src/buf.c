@@ -1,13 +1,17 @@
 #include <libfutil/buf.h>
+#include <libfutil/scan.h>
+
+/* Initial buffer blocks (BUF_INITSIZE) */
+static pool_t l_buf_pool = POOL_INITIALIZER(BUF_INITSIZE, "buf");
 
 void
 buf_lock(buf_t *buf) {
-	mutex_lock(buf->mutex);
+	lock_lock(&buf->lock);
 }
 
 void
 buf_unlock(buf_t *buf) {
-	mutex_unlock(buf->mutex);
+	lock_unlock(&buf->lock);
 }
 
 bool
@@ -17,12 +21,12 @@ buf_init(buf_t *buf) {
 	/* Empty it out */
 	memzero(buf, sizeof *buf);
 
-	/* Init the per-buf mutex */
-	mutex_init(buf->mutex);
+	/* Init the per-buf lock */
+	lock_init(&buf->lock);
 
 	/* Start with an initial size of 4 KiB */
-	buf->size = (4 * 1024);
-	buf->buf = (void *)calloc(1, buf->size);
+	buf->size = BUF_INITSIZE;
+	buf->buf = pool_get(&l_buf_pool);
 	if (buf->buf == NULL) {
 		log_dbg("(%p)", (void *)buf);
 		return (false);
@@ -35,26 +39,51 @@ buf_init(buf_t *buf) {
 	return (true);
 }
 
-/* Destroy the mutex, final cleanup */
+/* Give the storage back */
+static void
+buf_free(buf_t *buf);
+static void
+buf_free(buf_t *buf) {
+	/* Blocks that never grew go back to the pool */
+	if (buf->buf && buf->size == BUF_INITSIZE)
+		pool_put(&l_buf_pool, buf->buf);
+	else if (buf->buf)
+		free(buf->buf);
+
+	buf->buf = NULL;
+	buf->size = 0;
+	buf->start = 0;
+	buf->offset = 0;
+}
+
+/* Destroy the lock, final cleanup */
 void
 buf_destroy(buf_t *buf) {
 	log_dbg("(%p)", (void *)buf);
 
-	if (buf->buf)
-		free(buf->buf);
+	buf_free(buf);
 
-	buf->buf = NULL;
-	buf->size = 0;
+	lock_destroy(&buf->lock);
+}
+
+void
+buf_release(buf_t *buf) {
+	if (buf_cur(buf) == 0)
+		buf_free(buf);
+}
 
-	mutex_destroy(buf->mutex);
+void
+buf_trim(void) {
+	pool_trim(&l_buf_pool);
 }
 
 /* Empty the buffer, making it ready for re-use */
 void
 buf_empty(buf_t *buf) {
-	if (buf->buf)
-		memzero(buf->buf, buf->offset);
+	buf->start = 0;
 	buf->offset = 0;
+	if (buf->buf)
+		buf->buf[0] = '\0';
 }
 
 void
@@ -68,27 +97,53 @@ void
 buf_shift(buf_t *buf, unsigned int length) {
 
 	/* Should never try to shift out more than what is left */
-	fassert(length <= buf->offset);
+	fassert(length <= buf_cur(buf));
 
-	/* All of it? Then we are quickly done */
-	if (length == buf->offset) {
-		memzero(buf->buf, buf->offset);
-		buf->offset = 0;
-	} else {
-		unsigned int left = buf->offset - length;
+	/* All of it? Then start over at the front */
+	if (length == buf_cur(buf)) {
+		buf_empty(buf);
+		return;
+	}
 
-		memmove(buf->buf, &buf->buf[length], left);
-		memzero(&buf->buf[left], buf->size - left);
+	/* Only the read cursor moves */
+	buf->start += length;
+}
+
+void
+buf_compact(buf_t *buf) {
+	uint64_t len = buf_cur(buf);
 
-		buf->offset = left;
-		buf->buf[left] = '\0';
+	if (buf->start == 0) {
+		return;
 	}
+
+	memmove(buf->buf, buf_buffer(buf), len);
+	buf->start = 0;
+	buf->offset = len;
+	buf->buf[len] = '\0';
+}
+
+void
+buf_swap(buf_t *a, buf_t *b) {
+	char		*p = a->buf;
+	uint64_t	size = a->size, start = a->start, offset = a->offset;
+
+	a->buf = b->buf;
+	a->size = b->size;
+	a->start = b->start;
+	a->offset = b->offset;
+
+	b->buf = p;
+	b->size = size;
+	b->start = start;
+	b->offset = offset;
 }
 
 void
 buf_added(buf_t *buf, unsigned int length) {
 	fassert((buf->offset + length) < buf->size);
 	buf->offset += length;
+	buf->buf[buf->offset] = '\0';
 }
 
 /* Mutex locked by caller */
@@ -105,6 +160,28 @@ buf_willfit(buf_t *buf, unsigned int len) {
 	if (ns < buf->size)
 		return (true);
 
+	/* Released (buf_release()), a fresh block will mostly do */
+	if (buf->buf == NULL && ns < BUF_INITSIZE) {
+		buf->buf = pool_get(&l_buf_pool);
+		if (!buf->buf) {
+			log_err("Out of memory (%u)", BUF_INITSIZE);
+			return (false);
+		}
+
+		buf->size = BUF_INITSIZE;
+		buf->buf[0] = '\0';
+		return (true);
+	}
+
+	/* Reclaim what was consumed from the front first */
+	if (buf->start > 0) {
+		buf_compact(buf);
+
+		ns = len + buf->offset;
+		if (ns < buf->size)
+			return (true);
+	}
+
 	/* Need more, increase per 8 KiB */
 	ns = (((((ns + (8*1024)) / (8*1024))) * (8*1024)) + (8*1024));
 
@@ -116,8 +193,17 @@ buf_willfit(buf_t *buf, unsigned int len) {
 		return (false);
 	}
 
-	/* Get more memory */
-	b = realloc(buf->buf, ns);
+	/* Get more memory, a pool block is given back instead */
+	if (buf->size == BUF_INITSIZE) {
+		b = malloc(ns);
+		if (b) {
+			memcpy(b, buf->buf, buf->offset + 1);
+			pool_put(&l_buf_pool, buf->buf);
+		}
+	} else {
+		b = realloc(buf->buf, ns);
+	}
+
 	if (!b) {
 		log_err("Out of memory (%" PRIu64 ")", ns);
 		fassert(false);
@@ -149,6 +235,7 @@ buf_putl(buf_t *buf, const char *txt, unsigned int len) {
 
 		/* The length that was added */
 		buf->offset += len;
+		buf->buf[buf->offset] = '\0';
 	}
 
 	return (ret);
@@ -184,7 +271,7 @@ buf_vprintf(buf_t *buf, const char *fmt, va_list ap) {
 		}
 
 		/* Resize the buffer a bit if we can to fit it */
-		if (buf_willfit(buf, len + buf->offset)) {
+		if (buf_willfit(buf, len)) {
 			/* Try again */
 			continue;
 		}
@@ -234,16 +321,13 @@ buf_printfL(buf_t *buf, const char *fmt, ...) {
 /* Simple char searcher that optionally breaks at ASCII-NUL '\0' */
 char *
 buf_find(buf_t *buf, uint64_t offset, char chr, bool findnul) {
-	uint64_t i, len = buf_cur(buf);
-
-	for (i = offset; i < len; i++) {
-		if (buf->buf[i] == chr ||
-		    (findnul && buf->buf[i] == '\0')) {
-			return &buf->buf[i];
-		}
+	if (buf->start + offset >= buf->offset) {
+		return (NULL);
 	}
 
-	/* Not found */
-	return NULL;
+	/* Both at once, or chr twice */
+	return ((char *)scan_find2(&buf->buf[buf->start + offset],
+				   &buf->buf[buf->offset],
+				   chr, findnul ? '\0' : chr));
 }
 
@@ -0,0 +1,123 @@
+/* Coarse clock */
+
+#include <libfutil/misc.h>
+
+/* The second this thread asked for last */
+static __thread clk_sec_t l_clk_sec;
+static __thread bool l_clk_valid = false;
+
+#ifdef __MACH__
+/* Ticks of mach_absolute_time() to nsec, asked for once per thread */
+static __thread mach_timebase_info_data_t l_clk_tb;
+#endif
+
+uint64_t
+clk_msec(void) {
+#if defined(__MACH__)
+	/*
+	 * Not gettimes(): that is the calendar clock, it jumps when the
+	 * date is set. This one only counts up (not while asleep), like
+	 * CLOCK_UPTIME_RAW; clock_gettime_nsec_np() needs OS X 10.12
+	 */
+	uint64_t t = mach_absolute_time();
+
+	if (l_clk_tb.denom == 0) {
+		mach_timebase_info(&l_clk_tb);
+	}
+
+	/* Split, ticks * numer overflows sooner */
+	t = (t / l_clk_tb.denom) * l_clk_tb.numer +
+	    (t % l_clk_tb.denom) * l_clk_tb.numer / l_clk_tb.denom;
+
+	return (t / (1000 * 1000));
+#elif defined(_WIN32)
+	uint64_t ms, s = gettimes(&ms);
+
+	return (s * 1000 + ms);
+#else
+	struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / (1000 * 1000));
+#endif
+}
+
+uint64_t
+clk_now(uint64_t *msec) {
+#if defined(_WIN32) || defined(__MACH__)
+	return (gettimes(msec));
+#else
+	struct timespec ts;
+
+#ifdef CLOCK_REALTIME_COARSE
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+
+	if (msec != NULL) {
+		*msec = ts.tv_nsec / (1000 * 1000);
+	}
+
+	return (ts.tv_sec);
+#endif
+}
+
+static void
+clk_http_tm(const struct tm *tm, char *buf);
+static void
+clk_http_tm(const struct tm *tm, char *buf) {
+	static const char days[7][4] =
+			{ "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+	static const char mons[12][4] =
+			{ "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+			  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+	snprintf(buf, CLK_HTTP_LEN, "%s, %02u %s %04u %02u:%02u:%02u GMT",
+		 days[tm->tm_wday], tm->tm_mday, mons[tm->tm_mon],
+		 tm->tm_year + 1900, tm->tm_hour, tm->tm_min, tm->tm_sec);
+}
+
+void
+clk_http(time_t t, char *buf) {
+	struct tm tm;
+
+	/* Most of the time it is about now, that is made once a second */
+	if ((l_clk_valid && t == l_clk_sec.sec) ||
+	    (uint64_t)t == clk_now(NULL)) {
+		memcpy(buf, clk_sec(t)->http, CLK_HTTP_LEN);
+		return;
+	}
+
+	gmtime_r(&t, &tm);
+	clk_http_tm(&tm, buf);
+}
+
+const clk_sec_t *
+clk_sec(time_t sec) {
+	clk_sec_t *c = &l_clk_sec;
+
+	if (l_clk_valid && c->sec == sec) {
+		return (c);
+	}
+
+	c->sec = sec;
+	localtime_r(&sec, &c->local);
+	gmtime_r(&sec, &c->gmt);
+
+	snprintf(c->stamp, sizeof c->stamp, "%04u-%02u-%02u %02u:%02u:%02u",
+		 c->local.tm_year + 1900, c->local.tm_mon + 1,
+		 c->local.tm_mday, c->local.tm_hour, c->local.tm_min,
+		 c->local.tm_sec);
+
+	clk_http_tm(&c->gmt, c->http);
+
+	l_clk_valid = true;
+
+	return (c);
+}
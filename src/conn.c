@@ -8,6 +8,122 @@
 */
 /* #define POLLDEBUG */
 
+/* io_uring is used when the kernel headers know about it */
+#ifdef _LINUX
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+/* Multishot poll, headers before Linux 5.13 lack it */
+#ifdef IORING_POLL_ADD_MULTI
+#define CONN_URING 1
+#endif
+#endif
+#endif
+#endif
+
+/* Backends that keep hasevents until I/O reports EAGAIN */
+#define connset_caches(cs) ((cs)->backend == CONNSET_EPOLL_EDGE || \
+			    (cs)->backend == CONNSET_URING)
+#define connset_is_epoll(cs) ((cs)->backend == CONNSET_EPOLL || \
+			      (cs)->backend == CONNSET_EPOLL_EDGE)
+
+/* Slots in the ready queue, overflow goes to the ready list */
+#define CONNSET_READYQ		4096
+
+/* How long a worker parks before checking thread_keep_running() */
+#define CONNSET_READY_WAIT	5000
+
+/* Compact (or grow) the recv buffer when less than this is left at the end */
+#define CONN_RECV_COMPACT	1024
+
+/* The recv buffer does not grow beyond this */
+#define CONN_RECV_MAX		(2 * 1024 * 1024)
+
+#ifdef CONN_SSL
+/* SSL staging buffers, only held while there is crypted data in them */
+#define CONN_SSL_BUFLEN		(16 * 1024)
+static pool_t l_conn_sslbufs = POOL_INITIALIZER(CONN_SSL_BUFLEN, "conn_ssl");
+#endif
+
+/* A send buffer holding this much becomes a segment instead of growing */
+#define CONN_SEG_MIN		(BUF_INITSIZE / 2)
+
+/* The buffer after it is taken this large at once: the body is large */
+#define CONN_SEG_SIZE		(64 * 1024)
+
+/* Buffers upto this are copied behind the segment before, if it fits */
+#define CONN_SEG_COPY		1024
+
+/* Most segments written with one writev() */
+#define CONN_SEG_IOV		64
+
+/* Room conn_vprintf() expects to need */
+#define CONN_PRINTF_LEN		256
+
+/* Readahead asked for ahead of sendfile() */
+#define CONN_FILE_RA		(512 * 1024)
+
+/* Most moved through the pipe at once (splice()) */
+#define CONN_FILE_PIPE		(64 * 1024)
+
+typedef enum {
+	CONN_SEG_BUF = 0,			/* Owned buffer */
+	CONN_SEG_REF,				/* Borrowed memory */
+	CONN_SEG_FILE				/* Range of a file */
+} conn_segtype_t;
+
+typedef struct conn_seg conn_seg_t;
+
+struct conn_seg {
+	conn_seg_t		*next;		/* Next in the chain */
+	conn_segtype_t		type;		/* What this is */
+	buf_t			buf;		/* CONN_SEG_BUF: the data */
+	const char		*data;		/* CONN_SEG_REF: the data */
+	conn_release_f		release;	/* REF/FILE: done with it */
+	void			*user;		/* REF/FILE: for release */
+	int			fd;		/* CONN_SEG_FILE: the file */
+	bool			closefd;	/* CONN_SEG_FILE: close it after */
+	bool			splice;		/* CONN_SEG_FILE: not a file */
+	int			pipe[2];	/* CONN_SEG_FILE: for splice() */
+	uint64_t		inpipe;		/* CONN_SEG_FILE: in the pipe */
+	uint64_t		ra;		/* CONN_SEG_FILE: readahead upto */
+	uint64_t		off;		/* REF/FILE: next byte to write */
+	uint64_t		end;		/* REF/FILE: end of the data */
+};
+
+static pool_t l_conn_segs = POOL_INITIALIZER(sizeof(conn_seg_t), "conn_seg");
+
+/*
+ * What the ready queue (or the executor) holds for a conn. A conn that
+ * leaves its connset while queued only clears conn, whoever pops the
+ * entry frees it: a popped pointer is never freed memory and nothing
+ * has to be taken out of the queue.
+ */
+typedef struct conn_entry {
+	conn_t			*conn;		/* NULL once it left (connset lock) */
+} conn_entry_t;
+
+static pool_t l_conn_entries = POOL_INITIALIZER(sizeof(conn_entry_t),
+						"conn_entry");
+
+/* Count a syscall made for polling */
+#define connset_syscall(cs) __atomic_add_fetch(&(cs)->syscalls, 1, \
+					       __ATOMIC_RELAXED)
+
+/* Count a recv()/send() of a conn, when it is in a connset */
+#define conn_iocall(conn) do {						\
+		if ((conn)->connset != NULL)				\
+			__atomic_add_fetch(&(conn)->connset->iocalls, 1,	\
+					   __ATOMIC_RELAXED);		\
+	} while (0)
+
+/* conn->timedout: passed, and a worker has seen it */
+#define CONN_DEADLINE_PASSED	1
+#define CONN_DEADLINE_SEEN	2
+
 /*
  * For the keyfile.pem + server.pem use:
  *
@@ -47,7 +163,7 @@ connset_unlock(connset_t *cs) {
 	mutex_unlock(cs->mutex);
 }
 
-#ifdef DEBUG
+#if LOG_LEVEL_COMPILED >= LOG_DEBUG
 static const char *
 connset_list(connset_t *cs, hlist_t *l);
 static const char *
@@ -61,12 +177,26 @@ connset_list(connset_t *cs, hlist_t *l) {
 }
 #endif
 
+/* Locked by caller */
+static void
+connset_trigger_drain(connset_t *cs);
+static void
+connset_trigger_drain(connset_t *cs) {
+	char buf;
+
+	/* Reset the count */
+	cs->triggers = 0;
+
+	/* Receive the triggers */
+	do {
+		connset_syscall(cs);
+	} while (read(cs->pipe[0], &buf, 1) == 1);
+}
+
 void
 connset_trigger_clear(connset_t *cs, fd_set *fd_r);
 void
 connset_trigger_clear(connset_t *cs, fd_set *fd_r) {
-	char buf;
-
 	/* Reset the trigger count */
 	if (cs->triggers == 0) {
 		return;
@@ -77,11 +207,7 @@ connset_trigger_clear(connset_t *cs, fd_set *fd_r) {
 		return;
 	}
 
-	/* Reset the count */
-	cs->triggers = 0;
-
-	/* Receive the triggers */
-	while (read(cs->pipe[0], &buf, 1) == 1);
+	connset_trigger_drain(cs);
 }
 
 /* Locked by caller */
@@ -96,19 +222,586 @@ connset_trigger_set(connset_t *cs) {
 	if (cs->triggers == 0) {
 		/* Trigger it one more time */
 		cs->triggers++;
+		connset_syscall(cs);
 		write(cs->pipe[1], "F", 1);
 	}
 }
 
-/* Locked by caller */
+#ifdef _LINUX
+/* Map a FD back to its conn for epoll events (Locked by caller) */
+static bool
+connset_fdmap_set(connset_t *cs, int fd, conn_t *conn);
+static bool
+connset_fdmap_set(connset_t *cs, int fd, conn_t *conn) {
+	unsigned int	len;
+	conn_t		**m;
+
+	fassert(fd >= 0);
+
+	if ((unsigned int)fd >= cs->fdmap_len) {
+		/* Nothing to clear beyond the end */
+		if (conn == NULL) {
+			return (true);
+		}
+
+		/* Grow by doubling, to at least fit this FD */
+		len = cs->fdmap_len > 0 ? cs->fdmap_len : 1024;
+		while (len <= (unsigned int)fd) {
+			len *= 2;
+		}
+
+		m = realloc(cs->fdmap, len * sizeof *m);
+		if (m == NULL) {
+			log_crt(CONNS_ID " No memory for fdmap (%u)",
+				cs->id, len);
+			return (false);
+		}
+
+		memzero(&m[cs->fdmap_len], (len - cs->fdmap_len) * sizeof *m);
+		cs->fdmap = m;
+		cs->fdmap_len = len;
+	}
+
+	cs->fdmap[fd] = conn;
+	return (true);
+}
+
+/*
+ * Registrations are always EPOLLONESHOT: once an event is reported
+ * the kernel stops watching the FD until we re-arm it, this so that
+ * a connection that is ready or being handled does not wake the poller.
+ *
+ * Re-arming is a single EPOLL_CTL_MOD done by the worker,
+ * the poller does not need a trigger to pick it up.
+ */
+static bool
+connset_arm_epoll(connset_t *cs, conn_t *conn, uint16_t events);
+static bool
+connset_arm_epoll(connset_t *cs, conn_t *conn, uint16_t events) {
+	struct epoll_event	ev;
+	int			op;
+
+	/* Not registered yet and nothing wanted, keep it that way */
+	if (!conn->pollreg && events == CONN_POLLNONE) {
+		return (true);
+	}
+
+	memzero(&ev, sizeof ev);
+	ev.events = EPOLLONESHOT;
+	if (cs->backend == CONNSET_EPOLL_EDGE)
+		ev.events |= EPOLLET;
+	if (events & CONN_POLLIN)
+		ev.events |= EPOLLIN | EPOLLRDHUP;
+	if (events & CONN_POLLOUT)
+		ev.events |= EPOLLOUT;
+	ev.data.fd = conn->sock;
+
+	op = conn->pollreg ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	connset_syscall(cs);
+	if (epoll_ctl(cs->epfd, op, conn->sock, &ev) == -1) {
+		log_err(
+			CONNS_ID " " CONN_ID " epoll_ctl(%s) failed",
+			cs->id, conn_id(conn),
+			op == EPOLL_CTL_ADD ? "add" : "mod");
+		return (false);
+	}
+
+	/* First time we see it, remember where it belongs */
+	if (!conn->pollreg) {
+		if (!connset_fdmap_set(cs, conn->sock, conn)) {
+			epoll_ctl(cs->epfd, EPOLL_CTL_DEL, conn->sock, &ev);
+			return (false);
+		}
+
+		conn->pollreg = true;
+	}
+
+	return (true);
+}
+#endif /* _LINUX */
+
+#ifdef CONN_URING
+/*
+ * io_uring without liburing, we only need a small part of it:
+ * multishot IORING_OP_POLL_ADD and IORING_OP_POLL_REMOVE.
+ *
+ * A conn stays armed while it is away (ready, handled, inactive), what
+ * the kernel reports meanwhile is kept in pollseen and makes it ready
+ * again as soon as it comes back. Coming back for the same events thus
+ * costs nothing. Only other events, closing, or the kernel ending the
+ * poll (no IORING_CQE_F_MORE) need an SQE, the poller submits those with
+ * its wait, or the arming thread itself when the poller is asleep.
+ *
+ * Readiness only: accept(), recv() and writev() stay plain syscalls of
+ * the handler (conn_accept(), conn_recv(), conn_flush()), they are not
+ * submitted through the ring.
+ */
+#define CONNSET_URING_ENTRIES	1024
+#define CONNSET_URING_IGNORE	(~(uint64_t)0)
+
+struct connset_uring {
+	int			fd;		/* The ring */
+	bool			waiting;	/* Poller in io_uring_enter() */
+	uint32_t		gen;		/* Registration generation */
+
+	/* Submission queue */
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_entries;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+
+	/* Completion queue */
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	/* Mappings */
+	void			*ring;
+	size_t			ring_len;
+	size_t			sqes_len;
+};
+
+/* Registration generation and FD, to spot stale completions */
+#define connset_uring_data(conn) \
+	(((uint64_t)(conn)->pollgen << 32) | (uint32_t)(conn)->sock)
+
+static void
+connset_uring_destroy(connset_t *cs);
+static void
+connset_uring_destroy(connset_t *cs) {
+	struct connset_uring *u = cs->uring;
+
+	if (u == NULL) {
+		return;
+	}
+
+	if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+		munmap(u->sqes, u->sqes_len);
+	}
+
+	if (u->ring != NULL && u->ring != MAP_FAILED) {
+		munmap(u->ring, u->ring_len);
+	}
+
+	if (u->fd != -1) {
+		close(u->fd);
+	}
+
+	mfree(u, sizeof *u, "connset_uring");
+	cs->uring = NULL;
+}
+
+static bool
+connset_uring_init(connset_t *cs);
+static bool
+connset_uring_init(connset_t *cs) {
+	struct io_uring_params	p;
+	struct connset_uring	*u;
+	size_t			sq_len, cq_len;
+	uint8_t			*r;
+
+	u = mcalloc(sizeof *u, "connset_uring");
+	if (u == NULL) {
+		log_crt(CONNS_ID " No memory for io_uring", cs->id);
+		return (false);
+	}
+
+	cs->uring = u;
+	u->fd = -1;
+
+	memzero(&p, sizeof p);
+	u->fd = syscall(__NR_io_uring_setup, CONNSET_URING_ENTRIES, &p);
+	if (u->fd == -1) {
+		log_wrn(CONNS_ID " io_uring_setup() failed", cs->id);
+		connset_uring_destroy(cs);
+		return (false);
+	}
+
+	/*
+	 * We need one mapping for both rings, timeouts on the wait and
+	 * multishot poll (5.13, which also brought IORING_FEAT_RSRC_TAGS)
+	 */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG) ||
+	    !(p.features & IORING_FEAT_RSRC_TAGS)) {
+		log_wrn(CONNS_ID " io_uring lacks features (%x)",
+			cs->id, p.features);
+		connset_uring_destroy(cs);
+		return (false);
+	}
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->ring_len = sq_len > cq_len ? sq_len : cq_len;
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	u->ring = mmap(NULL, u->ring_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+		log_err(CONNS_ID " io_uring mmap() failed", cs->id);
+		connset_uring_destroy(cs);
+		return (false);
+	}
+
+	r = u->ring;
+	u->sq_head	= (unsigned int *)(r + p.sq_off.head);
+	u->sq_tail	= (unsigned int *)(r + p.sq_off.tail);
+	u->sq_mask	= (unsigned int *)(r + p.sq_off.ring_mask);
+	u->sq_entries	= (unsigned int *)(r + p.sq_off.ring_entries);
+	u->sq_array	= (unsigned int *)(r + p.sq_off.array);
+	u->cq_head	= (unsigned int *)(r + p.cq_off.head);
+	u->cq_tail	= (unsigned int *)(r + p.cq_off.tail);
+	u->cq_mask	= (unsigned int *)(r + p.cq_off.ring_mask);
+	u->cqes		= (struct io_uring_cqe *)(r + p.cq_off.cqes);
+
+	return (true);
+}
+
+/* Submit what is queued, optionally waiting for completions */
+static int
+connset_uring_enter(connset_t *cs, unsigned int wait,
+		    struct io_uring_getevents_arg *arg);
+static int
+connset_uring_enter(connset_t *cs, unsigned int wait,
+		    struct io_uring_getevents_arg *arg) {
+	struct connset_uring	*u = cs->uring;
+	unsigned int		todo, flags = 0;
+
+	/*
+	 * Everything not consumed by the kernel yet, another thread
+	 * submitting part of it concurrently is harmless
+	 */
+	todo = __atomic_load_n(u->sq_tail, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+	if (wait > 0) {
+		flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+	}
+
+	connset_syscall(cs);
+
+	return (syscall(__NR_io_uring_enter, u->fd, todo, wait, flags,
+			arg, arg ? sizeof *arg : 0));
+}
+
+/* Queue a poll request, flags are IORING_POLL_* (Locked by caller) */
+static bool
+connset_uring_queue(connset_t *cs, uint8_t op, int fd, uint32_t events,
+		    uint32_t flags, uint64_t addr, uint64_t user_data);
+static bool
+connset_uring_queue(connset_t *cs, uint8_t op, int fd, uint32_t events,
+		    uint32_t flags, uint64_t addr, uint64_t user_data) {
+	struct connset_uring	*u = cs->uring;
+	struct io_uring_sqe	*sqe;
+	unsigned int		tail, idx;
+
+	tail = *u->sq_tail;
+
+	/* Full, push it to the kernel to make space */
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+	    *u->sq_entries) {
+		connset_uring_enter(cs, 0, NULL);
+
+		if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+		    *u->sq_entries) {
+			log_err(CONNS_ID " io_uring submission queue full",
+				cs->id);
+			return (false);
+		}
+	}
+
+	idx = tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+
+	memzero(sqe, sizeof *sqe);
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->len = flags;
+	sqe->addr = addr;
+	sqe->user_data = user_data;
+
+	u->sq_array[idx] = idx;
+
+	/* Publish it to the kernel */
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return (true);
+}
+
+/* Stop the kernel watching it, what it still reports is stale */
+static void
+connset_uring_disarm(connset_t *cs, conn_t *conn);
+static void
+connset_uring_disarm(connset_t *cs, conn_t *conn) {
+	struct connset_uring *u = cs->uring;
+
+	if (conn->pollarmed == CONN_POLLNONE) {
+		return;
+	}
+
+	connset_uring_queue(cs, IORING_OP_POLL_REMOVE, -1, 0, 0,
+			    connset_uring_data(conn), CONNSET_URING_IGNORE);
+
+	conn->pollgen = ++u->gen;
+	conn->pollarmed = CONN_POLLNONE;
+	conn->pollseen = CONN_POLLNONE;
+
+	/* The poller submits it with its next wait unless it sleeps */
+	if (u->waiting) {
+		connset_uring_enter(cs, 0, NULL);
+	}
+}
+
+static bool
+connset_arm_uring(connset_t *cs, conn_t *conn, uint16_t events);
+static bool
+connset_arm_uring(connset_t *cs, conn_t *conn, uint16_t events) {
+	struct connset_uring	*u = cs->uring;
+	uint32_t		pev = 0;
+
+	/* Stays armed while away, or still is for these events */
+	if (events == CONN_POLLNONE || events == conn->pollarmed) {
+		return (true);
+	}
+
+	connset_uring_disarm(cs, conn);
+
+	if (!conn->pollreg) {
+		if (!connset_fdmap_set(cs, conn->sock, conn)) {
+			return (false);
+		}
+
+		conn->pollreg = true;
+	}
+
+	if (events & CONN_POLLIN)
+		pev |= POLLIN | POLLRDHUP;
+	if (events & CONN_POLLOUT)
+		pev |= POLLOUT;
+
+	if (!connset_uring_queue(cs, IORING_OP_POLL_ADD, conn->sock, pev,
+				 IORING_POLL_ADD_MULTI, 0,
+				 connset_uring_data(conn))) {
+		return (false);
+	}
+
+	conn->pollarmed = events;
+
+	if (u->waiting) {
+		connset_uring_enter(cs, 0, NULL);
+	}
+
+	return (true);
+}
+#endif /* CONN_URING */
+
+static void
+connset_wakeL(connset_t *cs);
+
+/*
+ * Tell the poller which events to watch for on this conn,
+ * CONN_POLLNONE stops watching it (eg while ready or handling)
+ *
+ * When that fails nothing watches it anymore: its deadline is made to
+ * pass right away, a worker gets it with conn_timedout() and closes it.
+ * Owners that keep it (listeners) have it back once per poll timeout.
+ *
+ * Connset locked by caller
+ */
+static void
+connset_arm(conn_t *conn, uint16_t events);
+static void
+connset_arm(conn_t *conn, uint16_t events) {
+	connset_t	*cs = conn->connset;
+	bool		ok = true;
+
+	/* Nothing changes */
+	if (conn->pollevents == events) {
+		return;
+	}
+
+	switch (cs->backend) {
+#ifdef _LINUX
+	case CONNSET_EPOLL:
+	case CONNSET_EPOLL_EDGE:
+		ok = connset_arm_epoll(cs, conn, events);
+		break;
+#endif
+
+#ifdef CONN_URING
+	case CONNSET_URING:
+		ok = connset_arm_uring(cs, conn, events);
+		break;
+#endif
+
+	case CONNSET_SELECT:
+	default:
+		if (events & CONN_POLLIN)
+			FD_SET(conn->sock, &cs->fd_read);
+		else
+			FD_CLR(conn->sock, &cs->fd_read);
+
+		if (events & CONN_POLLOUT)
+			FD_SET(conn->sock, &cs->fd_write);
+		else
+			FD_CLR(conn->sock, &cs->fd_write);
+
+		if (events != CONN_POLLNONE) {
+/* Windows does not use the highest fd param, it is there for compat only */
+#ifndef _WIN32
+			/* Make sure we have the right Highest FD */
+			if (conn->sock > cs->hifd) {
+				log_dbg(
+					CONNS_ID " New high FD: " SOCK_ID
+					" " CONN_ID,
+					cs->id,
+					conn_sock(conn),
+					conn_id(conn));
+				cs->hifd = conn->sock;
+			}
+#endif
+		}
+
+		/*
+		 * Newly wanted events need select() to restart
+		 * this 'aborts' the select() that it is likely in
+		 */
+		if (events & ~conn->pollevents) {
+			connset_trigger_set(cs);
+		}
+		break;
+	}
+
+	/* Not watching it anymore failed: it is not wanted anyway */
+	if (!ok && events != CONN_POLLNONE) {
+		if (conn->pollfailed) {
+			wheel_arm(&cs->wheel, &conn->timer,
+				  clk_msec() + DEF_POLL_TIMEOUT);
+			return;
+		}
+
+		log_err(CONN_ID " can't be watched, closing it",
+			conn_id(conn));
+
+		conn->pollfailed = true;
+		wheel_arm(&cs->wheel, &conn->timer, 0);
+		cs->wakeup = 0;
+		connset_wakeL(cs);
+		return;
+	}
+
+	conn->pollfailed = false;
+	conn->pollevents = events;
+}
+
+/* Make the poller look at the deadlines again (Locked by caller) */
+static void
+connset_wakeL(connset_t *cs) {
+#ifdef CONN_URING
+	if (cs->backend == CONNSET_URING) {
+		/* Completes right away, that ends the wait */
+		connset_uring_queue(cs, IORING_OP_NOP, -1, 0, 0, 0,
+				    CONNSET_URING_IGNORE);
+		if (cs->uring->waiting) {
+			connset_uring_enter(cs, 0, NULL);
+		}
+		return;
+	}
+#endif
+
+	connset_trigger_set(cs);
+}
+
+/* The conn leaves the connset or closes its socket (Locked by caller) */
+static void
+connset_forget(conn_t *conn);
+static void
+connset_forget(conn_t *conn) {
+	connset_t *cs = conn->connset;
+
+	/* Stop watching it */
+	connset_arm(conn, CONN_POLLNONE);
+	wheel_cancel(&cs->wheel, &conn->timer);
+	conn->timedout = 0;
+	conn->pollfailed = false;
+
+#ifdef CONN_URING
+	if (cs->backend == CONNSET_URING) {
+		connset_uring_disarm(cs, conn);
+	}
+#endif
+
+#ifdef _LINUX
+	if (conn->pollreg) {
+		if (connset_is_epoll(cs)) {
+			struct epoll_event ev;
+
+			/* Pre-2.6.9 kernels require a non-NULL event */
+			memzero(&ev, sizeof ev);
+			connset_syscall(cs);
+			epoll_ctl(cs->epfd, EPOLL_CTL_DEL, conn->sock, &ev);
+		}
+
+		if ((unsigned int)conn->sock < cs->fdmap_len &&
+		    cs->fdmap[conn->sock] == conn) {
+			cs->fdmap[conn->sock] = NULL;
+		}
+	}
+#else
+	(void)cs;
+#endif
+
+	conn->pollreg = false;
+}
+
 bool
 connset_init(connset_t *cs) {
+	return (connset_init_backend(cs, CONNSET_DEFAULT));
+}
+
+/* Locked by caller */
+bool
+connset_init_backend(connset_t *cs, connset_backend_t backend) {
 	/* Unique connection number, for easy debugging */
 	static unsigned int	connset_id = 0;
 
 	/* A new one */
 	memzero(cs, sizeof *cs);
 	cs->id = ++connset_id;
+	cs->epfd = -1;
+
+#ifndef _LINUX
+	if (backend != CONNSET_SELECT) {
+		log_wrn(CONNS_ID " epoll not available, using select",
+			cs->id);
+		backend = CONNSET_SELECT;
+	}
+#else
+#ifndef CONN_URING
+	if (backend == CONNSET_URING) {
+		log_wrn(CONNS_ID " io_uring not available, using epoll",
+			cs->id);
+		backend = CONNSET_EPOLL_EDGE;
+	}
+#endif
+#endif
+	cs->backend = backend;
+
+#ifdef CONN_URING
+	/* Older kernels (< 5.11) do not have everything we need */
+	if (cs->backend == CONNSET_URING && !connset_uring_init(cs)) {
+		log_wrn(CONNS_ID " io_uring not usable, using epoll",
+			cs->id);
+		cs->backend = CONNSET_EPOLL_EDGE;
+	}
+#endif
 
 	/* Try creating the pipe first */
 	cs->pipe[0] = cs->pipe[1] = -1;
@@ -123,10 +816,34 @@ connset_init(connset_t *cs) {
 		return (false);
 	}
 
+#ifdef _LINUX
+	if (connset_is_epoll(cs)) {
+		struct epoll_event ev;
+
+		cs->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (cs->epfd == -1) {
+			log_err(CONNS_ID " epoll_create1() failed", cs->id);
+			return (false);
+		}
+
+		/* The control pipe stays armed (level-triggered) */
+		memzero(&ev, sizeof ev);
+		ev.events = EPOLLIN;
+		ev.data.fd = cs->pipe[0];
+		if (epoll_ctl(cs->epfd, EPOLL_CTL_ADD, cs->pipe[0], &ev) == -1) {
+			log_err(CONNS_ID " epoll_ctl(pipe) failed", cs->id);
+			return (false);
+		}
+	}
+#endif
+
 	/* Initialize the rest */
 	mutex_init(cs->mutex);
 	list_init(&cs->active);
 	list_init(&cs->ready);
+	if (!mpmc_init(&cs->readyq, CONNSET_READYQ)) {
+		return (false);
+	}
 	list_init(&cs->inactive);
 	list_init(&cs->handling);
 
@@ -150,10 +867,12 @@ connset_init(connset_t *cs) {
 	/* Negative is the maximum */
 	cs->hifd = -1;
 
+	wheel_init(&cs->wheel, clk_msec());
+
 	return (true);
 }
 
-#ifdef DEBUG
+#if LOG_LEVEL_COMPILED >= LOG_DEBUG
 static unsigned int
 connset_destroy_list(hlist_t *l, const char *state);
 static unsigned int
@@ -167,25 +886,69 @@ connset_destroy_list(hlist_t *l, const char UNUSED *state) {
 	unsigned int	i = 0;
 	conn_t		*conn;
 
-	while ((conn = (conn_t *)list_pop(l))) {
+	while ((conn = (conn_t *)list_pop(l))) {
+		conn->connset = NULL;
+		conn->connset_l = NULL;
+
+		i++;
+		log_dbg(
+			"closing %s " CONN_ID,
+			state, conn_id(conn));
+		conn_destroy(conn);
+		mfree(conn, sizeof *conn, "conn");
+	}
+
+	return (i);
+}
+
+/* Any queued entry, for draining on destroy */
+static conn_entry_t *
+connset_dequeue(connset_t *cs);
+static conn_entry_t *
+connset_dequeue(connset_t *cs) {
+	conn_entry_t *e;
+
+	e = (conn_entry_t *)mpmc_pop(&cs->readyq);
+	if (e == NULL && cs->executor != NULL) {
+		e = (conn_entry_t *)executor_pop(cs->executor);
+	}
+
+	return (e);
+}
+
+void
+connset_destroy(connset_t *cs) {
+	unsigned int	i;
+	conn_entry_t	*e;
+	conn_t		*conn;
+
+	/*
+	 * Ready conns are only in the queue, others in there
+	 * are stale entries for conns on one of the lists
+	 */
+	while ((e = connset_dequeue(cs)) != NULL) {
+		conn = e->conn;
+		pool_put(&l_conn_entries, e);
+
+		if (conn == NULL) {
+			continue;
+		}
+
+		conn->queued = false;
+		conn->entry = NULL;
+
+		if (conn->connset_l != &cs->ready) {
+			continue;
+		}
+
 		conn->connset = NULL;
 		conn->connset_l = NULL;
 
-		i++;
-		log_dbg(
-			"closing %s " CONN_ID,
-			state, conn_id(conn));
+		log_dbg("closing ready " CONN_ID, conn_id(conn));
 		conn_destroy(conn);
 		mfree(conn, sizeof *conn, "conn");
 	}
 
-	return (i);
-}
-
-void
-connset_destroy(connset_t *cs) {
-	unsigned int	i;
-
 	do {
 		i  = connset_destroy_list(&cs->handling,"handling");
 		i += connset_destroy_list(&cs->active,	"active");
@@ -204,7 +967,23 @@ connset_destroy(connset_t *cs) {
 		}
 	}
 
+	/* Close the poller */
+	if (cs->epfd != -1) {
+		close(cs->epfd);
+		cs->epfd = -1;
+	}
+
+#ifdef CONN_URING
+	connset_uring_destroy(cs);
+#endif
+
+	if (cs->fdmap) {
+		mfree(cs->fdmap, cs->fdmap_len * sizeof *cs->fdmap, "fdmap");
+		cs->fdmap_len = 0;
+	}
+
 	/* Destroy lists */
+	mpmc_destroy(&cs->readyq);
 	list_destroy(&cs->ready);
 	list_destroy(&cs->active);
 	list_destroy(&cs->inactive);
@@ -235,14 +1014,213 @@ connset_poll_list(const char *type, hlist_t *l, fd_set *fd_r, fd_set *fd_w) {
 }
 #endif
 
-int
-connset_poll(connset_t *cs) {
+/*
+ * Hand a conn to the workers
+ *
+ * A conn is at most once in the ready queue, when it comes back
+ * to ready before a worker saw its previous entry that one is used.
+ * Only when the queue is full it goes on the ready list.
+ *
+ * Connset locked by caller
+ */
+static void
+connset_readyL(conn_t *conn);
+static void
+connset_readyL(conn_t *conn) {
+	connset_t *cs = conn->connset;
+
+	conn->connset_l = &cs->ready;
+
+	if (conn->queued) {
+		return;
+	}
+
+	/* Kept for the next time, unless it left the connset */
+	if (conn->entry == NULL) {
+		conn->entry = pool_get(&l_conn_entries);
+		if (conn->entry != NULL) {
+			conn->entry->conn = conn;
+		}
+	}
+
+	/* Preferably back to the worker that had it last */
+	if (conn->entry != NULL &&
+	    (cs->executor != NULL ?
+	     executor_submit(cs->executor, conn->entry, conn->worker) :
+	     mpmc_push(&cs->readyq, conn->entry))) {
+		conn->queued = true;
+		return;
+	}
+
+	log_dbg(CONN_ID " ready queue full", conn_id(conn));
+
+	/* A parked worker has to look at the list */
+	list_addtail_l(&cs->ready, &conn->node);
+	if (cs->executor != NULL) {
+		executor_wake(cs->executor);
+	} else {
+		mpmc_wake(&cs->readyq);
+	}
+}
+
+/*
+ * A conn leaves the connset (destroyed or moved): its queue entry stays
+ * behind for whoever pops it, pointing at nothing
+ *
+ * Connset locked by caller, workers look at entries under it
+ */
+static void
+connset_purgeL(conn_t *conn);
+static void
+connset_purgeL(conn_t *conn) {
+	if (!conn->queued) {
+		return;
+	}
+
+	conn->entry->conn = NULL;
+	conn->entry = NULL;
+	conn->queued = false;
+}
+
+/*
+ * Hand the conns that are waiting when their deadline passes to the
+ * workers (conn_timedout()), those that are ready or handled see it
+ * then resp. go back to them afterwards. Returns how long the poller
+ * can sleep: upto the next deadline, at most DEF_POLL_TIMEOUT as it
+ * also has to notice when to stop.
+ *
+ * Connset locked by caller
+ */
+static int
+connset_expireL(connset_t *cs);
+static int
+connset_expireL(connset_t *cs) {
+	wheel_timer_t	*t;
+	conn_t		*conn;
+	uint64_t	now = clk_msec(), next;
+
+	while ((t = wheel_expire(&cs->wheel, now)) != NULL) {
+		conn = (conn_t *)(void *)((char *)t - offsetof(conn_t, timer));
+		cs->timeouts++;
+
+		log_dbg(CONN_ID " deadline passed", conn_id(conn));
+
+		conn->timedout = CONN_DEADLINE_PASSED;
+		if (conn->connset_l != &cs->active) {
+			continue;
+		}
+
+		connset_arm(conn, CONN_POLLNONE);
+		list_remove_l(&cs->active, &conn->node);
+		connset_readyL(conn);
+	}
+
+	next = wheel_next(&cs->wheel);
+	if (next > DEF_POLL_TIMEOUT) {
+		next = DEF_POLL_TIMEOUT;
+	}
+
+	cs->wakeup = now + next;
+
+	return ((int)next);
+}
+
+/*
+ * Note the events seen for a conn on the active list and
+ * move it to the ready list when it has any it wanted
+ *
+ * Connset and active list locked by caller
+ */
+static bool
+connset_poll_conn(conn_t *conn, bool rd, bool wr);
+static bool
+connset_poll_conn(conn_t *conn, bool rd, bool wr) {
+	log_dbg(
+		CONN_ID " checking " SOCK_ID
+		", (i:%s/%s o:%s/%s)",
+		conn_id(conn),
+		conn_sock(conn),
+		yesno(conn_wnt_in(conn)),
+		yesno(rd),
+		yesno(conn_wnt_out(conn)),
+		yesno(wr));
+
+	/*
+	 * No events found for this one yet,
+	 * in edge mode we only get told about new ones
+	 * thus keep what we knew already
+	 */
+	if (!connset_caches(conn->connset)) {
+		conn->hasevents = 0;
+	}
+
+	if (rd) {
+		if (conn_wnt_in(conn)) {
+			conn->hasevents |= CONN_POLLIN;
+		} else {
+			log_dbg(
+				CONN_ID " have IN signal, "
+				"but did not want",
+				conn_id(conn));
+#ifdef POLLDEBUG
+			fassert(false);
+#endif
+		}
+	}
+
+	if (wr) {
+		if (conn_wnt_out(conn)) {
+			conn->hasevents |= CONN_POLLOUT;
+		} else {
+			log_dbg(
+				CONN_ID " have OUT signal, "
+				"but did not want",
+				conn_id(conn));
+#ifdef POLLDEBUG
+			fassert(false);
+#endif
+		}
+	}
+
+	if ((conn->hasevents & conn->wntevents) == 0) {
+		return (false);
+	}
+
+	log_dbg(
+		CONN_ID " Adding to ready list",
+		conn_id(conn));
+
+	/*
+	 * Move it to the ready list
+	 * (active is locked)
+	 *
+	 * Stop watching it so that the poller
+	 * does not notice it again
+	 */
+	connset_arm(conn, CONN_POLLNONE);
+
+	fassert(conn->connset_l == &conn->connset->active);
+	list_remove(&conn->connset->active,
+		    &conn->node);
+
+	connset_readyL(conn);
+
+	log_dbg(
+		CONN_ID " Added to list: ready",
+		conn_id(conn));
+
+	return (true);
+}
+
+static int
+connset_poll_select(connset_t *cs);
+static int
+connset_poll_select(connset_t *cs) {
 	struct timeval	timeout;
 	conn_t		*conn, *conn_next;
 	fd_set		fd_r, fd_w;
-	int		i, errsv, hifd;
+	int		i, errsv, hifd, ms;
 #ifdef POLLDEBUG
-	int		j;
 	uint64_t	a_s, a_ms, b_s, b_ms, d;
 #endif
 
@@ -250,6 +1228,9 @@ connset_poll(connset_t *cs) {
 		/* log_dbg("..."); */
 		connset_lock(cs);
 
+		/* Upto the next deadline, we get triggered for sooner ones */
+		ms = connset_expireL(cs);
+
 		/* What we want to check */
 		hifd = cs->hifd + 1;
 		memcpy(&fd_r, &cs->fd_read, sizeof fd_r);
@@ -272,12 +1253,8 @@ connset_poll(connset_t *cs) {
 #endif
 		connset_unlock(cs);
 
-		/*
-		 * Timeout every second, we get triggered
-		 * when we need to be quicker
-		 */
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 0;
+		timeout.tv_sec = ms / 1000;
+		timeout.tv_usec = (ms % 1000) * 1000;
 
 		thread_setstate(thread_state_select);
 		errno = 0;
@@ -287,6 +1264,7 @@ connset_poll(connset_t *cs) {
 #endif
 		i = select(hifd, &fd_r, &fd_w, NULL, &timeout);
  		errsv = errno;
+		connset_syscall(cs);
 
 #ifdef POLLDEBUG
 		b_s = gettimes(&b_ms);
@@ -344,102 +1322,283 @@ connset_poll(connset_t *cs) {
 			/* Sanity check */
 			fassert(cs == conn->connset);
 
-			log_dbg(
-				CONN_ID " checking " SOCK_ID
-				", (i:%s/%s o:%s/%s)",
-				conn_id(conn),
-				conn_sock(conn),
-				yesno(conn_wnt_in(conn)),
-				yesno(FD_ISSET(conn->sock, &fd_r)),
-				yesno(conn_wnt_out(conn)),
-				yesno(FD_ISSET(conn->sock, &fd_w)));
-
-			/* No events found for this one yet */
-			conn->hasevents = 0;
-
-			if (FD_ISSET(conn->sock, &fd_r)) {
-				if (conn_wnt_in(conn)) {
-					conn->hasevents |= CONN_POLLIN;
-#ifdef POLLDEBUG
-					j++;
-#endif
-				} else {
-					log_dbg(
-						CONN_ID " have IN signal, "
-						"but did not want",
-						conn_id(conn));
-#ifdef POLLDEBUG
-					fassert(false);
-#endif
-				}
+			connset_poll_conn(conn,
+					  FD_ISSET(conn->sock, &fd_r),
+					  FD_ISSET(conn->sock, &fd_w));
+		}
+
+		list_unlock(&cs->active);
+
+		connset_unlock(cs);
+	}
+
+	return (0);
+}
+
+#ifdef _LINUX
+static int
+connset_poll_epoll(connset_t *cs);
+static int
+connset_poll_epoll(connset_t *cs) {
+	struct epoll_event	evs[DEF_POLLSET_NUM];
+	conn_t			*conn;
+	int			i, n, fd, errsv, ms;
+
+	while (true) {
+		/* Upto the next deadline, we get triggered for sooner ones */
+		connset_lock(cs);
+		ms = connset_expireL(cs);
+		connset_unlock(cs);
+
+		thread_setstate(thread_state_select);
+		errno = 0;
+
+		n = epoll_wait(cs->epfd, evs, lengthof(evs), ms);
+		errsv = errno;
+		connset_syscall(cs);
+
+		thread_setstate(thread_state_running);
+
+		if (n < 0) {
+			/* Ignore signals */
+			if (errsv == EINTR) {
+				log_ntc("epoll_wait() Interrupted");
+			} else {
+				log_err("epoll_wait() Failed");
 			}
 
-			if (FD_ISSET(conn->sock, &fd_w)) {
-				if (conn_wnt_out(conn)) {
-					conn->hasevents |= CONN_POLLOUT;
-#ifdef POLLDEBUG
-					j++;
-#endif
-				} else {
-					log_dbg(
-						CONN_ID " have OUT signal, "
-						"but did not want",
-						conn_id(conn));
-#ifdef POLLDEBUG
-					fassert(false);
-#endif
-				}
+			return (-1);
+		}
+
+		/* Timeout or needing to stop running? */
+		if (n == 0 || !thread_keep_running()) {
+			break;
+		}
+
+		/* Lock the connset first */
+		connset_lock(cs);
+		list_lock(&cs->active);
+
+		for (i = 0; i < n; i++) {
+			fd = evs[i].data.fd;
+
+			/* Clear outstanding events */
+			if (fd == cs->pipe[0]) {
+				connset_trigger_drain(cs);
+				continue;
 			}
 
-			if (conn->hasevents != 0) {
-				log_dbg(
-					CONN_ID " Adding to ready list",
-					conn_id(conn));
+			/* Closed while we were waiting */
+			if ((unsigned int)fd >= cs->fdmap_len ||
+			    cs->fdmap[fd] == NULL) {
+				continue;
+			}
 
-				/*
-				 * Move it to the ready list
-				 * (active is locked)
-				 *
-				 * Clear the bits so that select() does
-				 * not notice them
-				 */
-				FD_CLR(conn->sock, &conn->connset->fd_read);
-				FD_CLR(conn->sock, &conn->connset->fd_write);
+			conn = cs->fdmap[fd];
+
+			/* Sanity check */
+			fassert(cs == conn->connset);
 
-				fassert(conn->connset_l == &conn->connset->active);
-				list_remove(&conn->connset->active,
-					    &conn->node);
+			/* One-shot: the kernel does not watch it anymore */
+			conn->pollevents = CONN_POLLNONE;
+
+			/* Moved while we were waiting, it re-arms later */
+			if (conn->connset_l != &cs->active) {
+				continue;
+			}
+
+			/*
+			 * Errors and hangups are reported as readable
+			 * and writable, the I/O call will report them
+			 */
+			if (!connset_poll_conn(conn,
+				evs[i].events & (EPOLLIN | EPOLLRDHUP |
+						 EPOLLHUP | EPOLLERR),
+				evs[i].events & (EPOLLOUT |
+						 EPOLLHUP | EPOLLERR))) {
+				/* Nothing we wanted, watch it again */
+				connset_arm(conn, conn->wntevents);
+			}
+		}
+
+		list_unlock(&cs->active);
+		connset_unlock(cs);
+	}
+
+	return (0);
+}
+#endif /* _LINUX */
+
+#ifdef CONN_URING
+static int
+connset_poll_uring(connset_t *cs);
+static int
+connset_poll_uring(connset_t *cs) {
+	struct connset_uring		*u = cs->uring;
+	struct io_uring_getevents_arg	arg;
+	struct __kernel_timespec	ts;
+	struct io_uring_cqe		*cqe;
+	conn_t				*conn;
+	unsigned int			head, tail, n;
+	uint64_t			ud;
+	int				r, errsv, fd, ms;
+	bool				rd, wr;
+
+	while (true) {
+		/*
+		 * Upto the next deadline, arming threads submit
+		 * themselves while we wait (sooner deadlines a NOP)
+		 */
+		connset_lock(cs);
+		ms = connset_expireL(cs);
+
+		memzero(&ts, sizeof ts);
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000;
+
+		memzero(&arg, sizeof arg);
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+
+		/* From now on arming threads have to submit themselves */
+		u->waiting = true;
+		connset_unlock(cs);
+
+		thread_setstate(thread_state_select);
+
+		/* Submit all queued (re-)arms along with the wait */
+		r = connset_uring_enter(cs, 1, &arg);
+		errsv = errno;
+
+		thread_setstate(thread_state_running);
+
+		/* Lock the connset first */
+		connset_lock(cs);
+		u->waiting = false;
+
+		if (r < 0 && errsv != ETIME) {
+			connset_unlock(cs);
+
+			/* Ignore signals */
+			if (errsv == EINTR) {
+				log_ntc("io_uring_enter() Interrupted");
+			} else {
+				log_err("io_uring_enter() Failed");
+			}
+
+			return (-1);
+		}
+
+		list_lock(&cs->active);
+
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+		for (n = 0; head != tail; head++, n++) {
+			cqe = &u->cqes[head & *u->cq_mask];
+			ud = cqe->user_data;
+
+			/* Completion of a POLL_REMOVE */
+			if (ud == CONNSET_URING_IGNORE) {
+				continue;
+			}
+
+			fd = (int)(uint32_t)ud;
+
+			/* Closed while we were waiting */
+			if ((unsigned int)fd >= cs->fdmap_len ||
+			    cs->fdmap[fd] == NULL) {
+				continue;
+			}
+
+			conn = cs->fdmap[fd];
+
+			/* Sanity check */
+			fassert(cs == conn->connset);
+
+			/* Cancelled or re-armed since, a newer one follows */
+			if (connset_uring_data(conn) != ud) {
+				continue;
+			}
+
+			/* The kernel stopped watching it, arm it anew */
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				conn->pollarmed = CONN_POLLNONE;
+				conn->pollevents = CONN_POLLNONE;
+			}
 
-				conn->connset_l = &conn->connset->ready;
-				list_addtail_l(&conn->connset->ready,
-					       &conn->node);
+			/*
+			 * Errors and hangups are reported as readable
+			 * and writable, the I/O call will report them
+			 */
+			rd = cqe->res < 0 ||
+			     (cqe->res & (POLLIN | POLLRDHUP |
+					  POLLHUP | POLLERR));
+			wr = cqe->res < 0 ||
+			     (cqe->res & (POLLOUT | POLLHUP | POLLERR));
+
+			/* Away, it is ready as soon as it comes back */
+			if (conn->connset_l != &cs->active) {
+				conn->pollseen |= (rd ? CONN_POLLIN : 0) |
+						  (wr ? CONN_POLLOUT : 0);
+				continue;
+			}
 
-				log_dbg(
-					CONN_ID " Added to list: ready",
-					conn_id(conn));
+			if (!connset_poll_conn(conn, rd, wr)) {
+				/* Nothing we wanted, watch it (again) */
+				connset_arm(conn, conn->wntevents);
 			}
 		}
 
-		list_unlock(&cs->active);
+		/* Hand the slots back to the kernel */
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
 
+		list_unlock(&cs->active);
 		connset_unlock(cs);
+
+		/* Timeout or needing to stop running? */
+		if (n == 0 || !thread_keep_running()) {
+			break;
+		}
 	}
 
 	return (0);
 }
+#endif /* CONN_URING */
+
+int
+connset_poll(connset_t *cs) {
+	switch (cs->backend) {
+#ifdef _LINUX
+	case CONNSET_EPOLL:
+	case CONNSET_EPOLL_EDGE:
+		return (connset_poll_epoll(cs));
+#endif
+
+#ifdef CONN_URING
+	case CONNSET_URING:
+		return (connset_poll_uring(cs));
+#endif
+
+	case CONNSET_SELECT:
+	default:
+		break;
+	}
+
+	return (connset_poll_select(cs));
+}
 
 static void
 conn_lock(conn_t *conn);
 static void
 conn_lock(conn_t *conn) {
-	mutex_lock(conn->mutex);
+	lock_lock(&conn->lock);
 }
 
 static void
 conn_unlock(conn_t *conn);
 static void
 conn_unlock(conn_t *conn) {
-	mutex_unlock(conn->mutex);
+	lock_unlock(&conn->lock);
 }
 
 #define conn_bits(func,x)			\
@@ -461,6 +1620,34 @@ conn_bits(conn_poll_in,	(conn->hasevents & CONN_POLLIN) &&
 conn_bits(conn_poll_out,(conn->hasevents & CONN_POLLOUT) &&
 			(conn->wntevents & CONN_POLLOUT))
 
+/*
+ * The socket would block for these events, in edge mode
+ * the poller has to tell us about them again
+ *
+ * Locked by caller
+ */
+static void
+conn_drainedA(conn_t *conn, uint16_t events);
+static void
+conn_drainedA(conn_t *conn, uint16_t events) {
+	conn->hasevents &= ~events;
+}
+
+/*
+ * In edge mode events that were not drained yet are still there, as are
+ * those io_uring saw while it was away, such a conn can go straight to
+ * the ready list without the poller
+ *
+ * Connset locked by caller
+ */
+static bool
+connset_cachedL(conn_t *conn, uint16_t events);
+static bool
+connset_cachedL(conn_t *conn, uint16_t events) {
+	return (connset_caches(conn->connset) &&
+		((conn->hasevents | conn->pollseen) & events) != 0);
+}
+
 static void
 conn_set_nonblocking(conn_t *conn);
 static void
@@ -1083,6 +2270,9 @@ conn_ssl_init(bool serverside) {
 	}
 
 	SSL_CTX_set_options(ctx, 0);
+
+	/* Idle connections do not keep OpenSSL's read/write buffers */
+	SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
 	SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"sid", 4);
 
 	/* Provide a lot of debugging output */
@@ -1121,7 +2311,7 @@ conn_ssl_init(bool serverside) {
 
 void
 conn_set_state(conn_t *conn, connstate_t state) {
-#ifdef DEBUG
+#if LOG_LEVEL_COMPILED >= LOG_DEBUG
 	static const char *states[] = {
 				"UNUSED", "LISTENING", "ACCEPTING",
 				"CONNECTING", "CONNECTED" };
@@ -1135,6 +2325,221 @@ conn_set_state(conn_t *conn, connstate_t state) {
 	conn->state = state;
 }
 
+static conn_seg_t *
+conn_seg_new(conn_segtype_t type);
+static conn_seg_t *
+conn_seg_new(conn_segtype_t type) {
+	conn_seg_t *seg = pool_get(&l_conn_segs);
+
+	if (seg == NULL) {
+		log_crt("No memory for a send segment");
+		return (NULL);
+	}
+
+	memzero(seg, sizeof *seg);
+	seg->type = type;
+	seg->fd = -1;
+	seg->pipe[0] = seg->pipe[1] = -1;
+
+	/* Released: no storage until a buffer is swapped in */
+	lock_init(&seg->buf.lock);
+
+	return (seg);
+}
+
+static void
+conn_seg_free(conn_seg_t *seg);
+static void
+conn_seg_free(conn_seg_t *seg) {
+	switch (seg->type) {
+	case CONN_SEG_BUF:
+		break;
+
+	case CONN_SEG_REF:
+		if (seg->release != NULL) {
+			seg->release(seg->user, seg->data, seg->end);
+		}
+		break;
+
+	case CONN_SEG_FILE:
+		if (seg->closefd) {
+			close(seg->fd);
+		}
+
+		if (seg->release != NULL) {
+			seg->release(seg->user, NULL, 0);
+		}
+
+		/* What is still in there is dropped */
+		if (seg->pipe[0] != -1) {
+			close(seg->pipe[0]);
+			close(seg->pipe[1]);
+		}
+		break;
+
+	default:
+		fassert(false);
+		break;
+	}
+
+	buf_destroy(&seg->buf);
+	pool_put(&l_conn_segs, seg);
+}
+
+/* Bytes of the segment that are not written yet */
+static uint64_t
+conn_seg_left(conn_seg_t *seg);
+static uint64_t
+conn_seg_left(conn_seg_t *seg) {
+	if (seg->type == CONN_SEG_BUF) {
+		return (buf_cur(&seg->buf));
+	}
+
+	return (seg->end - seg->off);
+}
+
+/* Where the unwritten bytes of a memory segment are */
+static const char *
+conn_seg_data(conn_seg_t *seg);
+static const char *
+conn_seg_data(conn_seg_t *seg) {
+	fassert(seg->type != CONN_SEG_FILE);
+
+	if (seg->type == CONN_SEG_BUF) {
+		return (buf_buffer(&seg->buf));
+	}
+
+	return (&seg->data[seg->off]);
+}
+
+/* Chains are protected by the conn lock */
+static void
+conn_chain_addA(conn_chain_t *ch, conn_seg_t *seg);
+static void
+conn_chain_addA(conn_chain_t *ch, conn_seg_t *seg) {
+	seg->next = NULL;
+
+	if (ch->tail != NULL) {
+		ch->tail->next = seg;
+	} else {
+		ch->head = seg;
+	}
+
+	ch->tail = seg;
+	ch->len += conn_seg_left(seg);
+}
+
+/* Move all of from behind ch */
+static void
+conn_chain_joinA(conn_chain_t *ch, conn_chain_t *from);
+static void
+conn_chain_joinA(conn_chain_t *ch, conn_chain_t *from) {
+	if (from->head == NULL) {
+		return;
+	}
+
+	if (ch->tail != NULL) {
+		ch->tail->next = from->head;
+	} else {
+		ch->head = from->head;
+	}
+
+	ch->tail = from->tail;
+	ch->len += from->len;
+
+	memzero(from, sizeof *from);
+}
+
+/*
+ * Move what is in buf (locked) behind ch. Small amounts are copied into
+ * the buffer segment before it, otherwise the segment takes the storage
+ * over and buf gets a fresh block on the next put.
+ */
+static bool
+conn_chain_bufA(conn_chain_t *ch, buf_t *buf);
+static bool
+conn_chain_bufA(conn_chain_t *ch, buf_t *buf) {
+	conn_seg_t	*seg = ch->tail;
+	uint64_t	len = buf_cur(buf);
+
+	if (len == 0) {
+		return (true);
+	}
+
+	if (len <= CONN_SEG_COPY &&
+	    seg != NULL && seg->type == CONN_SEG_BUF &&
+	    len <= buf_left(&seg->buf)) {
+		if (!buf_putl(&seg->buf, buf_buffer(buf), len)) {
+			return (false);
+		}
+
+		ch->len += len;
+		buf_empty(buf);
+		return (true);
+	}
+
+	seg = conn_seg_new(CONN_SEG_BUF);
+	if (seg == NULL) {
+		return (false);
+	}
+
+	buf_swap(&seg->buf, buf);
+	conn_chain_addA(ch, seg);
+
+	return (true);
+}
+
+/* The first len bytes of ch were written */
+static void
+conn_chain_consumeA(conn_chain_t *ch, uint64_t len);
+static void
+conn_chain_consumeA(conn_chain_t *ch, uint64_t len) {
+	conn_seg_t	*seg;
+	uint64_t	left;
+
+	fassert(len <= ch->len);
+	ch->len -= len;
+
+	while (len > 0) {
+		seg = ch->head;
+		left = conn_seg_left(seg);
+
+		if (len < left) {
+			if (seg->type == CONN_SEG_BUF) {
+				buf_shift(&seg->buf, len);
+			} else {
+				seg->off += len;
+			}
+
+			break;
+		}
+
+		len -= left;
+
+		ch->head = seg->next;
+		if (ch->head == NULL) {
+			ch->tail = NULL;
+		}
+
+		conn_seg_free(seg);
+	}
+}
+
+/* Drop all of it, unwritten */
+static void
+conn_chain_freeA(conn_chain_t *ch);
+static void
+conn_chain_freeA(conn_chain_t *ch) {
+	conn_seg_t *seg, *next;
+
+	for (seg = ch->head; seg != NULL; seg = next) {
+		next = seg->next;
+		conn_seg_free(seg);
+	}
+
+	memzero(ch, sizeof *ch);
+}
+
 bool
 conn_init(conn_t *conn, void *clientdata)
 {
@@ -1169,18 +2574,15 @@ conn_init(conn_t *conn, void *clientdata)
 	log_dbg(CONN_ID, conn_id(conn));
 
 	node_init(&conn->node);
-	mutex_init(conn->mutex);
+	lock_init(&conn->lock);
 
 	/* Initial assignment */
 	conn->sock = INVALID_SOCKET;
 	conn->connset = NULL;
 	conn->clientdata = clientdata;
+	conn->worker = EXECUTOR_ANY;
 	conn_set_state(conn, CONN_UNUSED);
 
-	conn->sendfile_fd = -1;
-	conn->sendfile_off = 0;
-	conn->sendfile_len = 0;
-
 	/* Init the buffers */
 	if (	!buf_init(&conn->recv) ||
 		!buf_init(&conn->send) ||
@@ -1188,21 +2590,36 @@ conn_init(conn_t *conn, void *clientdata)
 		return (false);
 	}
 
-	/* 2 MiB incoming */
-	if (!buf_minsize(&conn->recv, 2 * 1024 * 1024)) {
-		return (false);
-	}
+	/* Storage is only taken once there is something to buffer */
+	conn_release(conn);
 
 	return (true);
 }
 
+void
+conn_release(conn_t *conn) {
+	conn_lock(conn);
+
+	buf_lock(&conn->recv);
+	buf_release(&conn->recv);
+	buf_unlock(&conn->recv);
+
+	buf_lock(&conn->send);
+	buf_lock(&conn->send_headers);
+	buf_release(&conn->send);
+	buf_release(&conn->send_headers);
+	buf_unlock(&conn->send_headers);
+	buf_unlock(&conn->send);
+
+	conn_unlock(conn);
+}
+
 /* What do we want to hear? (Mutex locked by caller) */
 static void
 conn_eventsA(conn_t *conn, uint16_t events);
 static void
 conn_eventsA(conn_t *conn, uint16_t events) {
 	hlist_t *new_l;
-	bool	changed;
 
 	fassert(conn_is_valid(conn));
 
@@ -1237,46 +2654,18 @@ conn_eventsA(conn_t *conn, uint16_t events) {
 			CONN_ID " want=%u, events=%u",
 			conn_id(conn), conn->wntevents, events);
 
-		/* Currently monitoring for something? */
-		if ((conn->wntevents & CONN_POLLIN) !=
-		          (events & CONN_POLLIN)) {
-
-			if (events & CONN_POLLIN)
-				FD_SET(conn->sock, &conn->connset->fd_read);
-			else
-				FD_CLR(conn->sock, &conn->connset->fd_read);
-
-			changed = true;
-		}
-
-		if ((conn->wntevents & CONN_POLLOUT) !=
-		          (events & CONN_POLLOUT)) {
-
-			if (events & CONN_POLLOUT)
-				FD_SET(conn->sock, &conn->connset->fd_write);
-			else
-				FD_CLR(conn->sock, &conn->connset->fd_write);
-
-			changed = true;
-		}
-
-		if (changed) {
-			/*
-			 * Trigger the change
-			 * this 'aborts' the select()
-			 * that it is likely in directly
-			 */
-			connset_trigger_set(conn->connset);
-		}
-
 		log_dbg(
 			CONN_ID " currently on list: %s",
 			conn_id(conn),
 			connset_list(conn->connset, conn->connset_l));
 
-		/* Stay on ready when already there, go active, or go inactive otherwise */
+		/*
+		 * Stay on ready when already there or when the events
+		 * are still cached, go active, or go inactive otherwise
+		 */
 		new_l = events != CONN_POLLNONE ?
-				(conn->connset_l == &conn->connset->ready ?
+				(conn->connset_l == &conn->connset->ready ||
+				 connset_cachedL(conn, events) ?
 				  &conn->connset->ready : &conn->connset->active) :
 				&conn->connset->inactive;
 
@@ -1293,13 +2682,19 @@ conn_eventsA(conn_t *conn, uint16_t events) {
 				list_remove_l(conn->connset_l, &conn->node);
 			}
 
-			/* The current list */
-			conn->connset_l = new_l;
-
-			/* Add it to active or inactive */
-			list_addtail_l(new_l, &conn->node);
+			/* Add it to active, inactive or hand it to a worker */
+			if (new_l == &conn->connset->ready) {
+				connset_readyL(conn);
+			} else {
+				conn->connset_l = new_l;
+				list_addtail_l(new_l, &conn->node);
+			}
 		}
 
+		/* Only the active list is watched by the poller */
+		connset_arm(conn, new_l == &conn->connset->active ?
+				  events : CONN_POLLNONE);
+
 		log_dbg(
 			CONN_ID " (non-handling portion done)",
 			conn_id(conn));
@@ -1314,30 +2709,6 @@ conn_eventsA(conn_t *conn, uint16_t events) {
 		conn_wnt_out(conn)	? "OUT" : ".",
 		connset_list(conn->connset, conn->connset_l));
 
-	/* Ensure that we track the hi_fd properly */
-	if (events != 0) {
-/* Windows does not use the highest fd param, it is there for compat only */
-#ifndef _WIN32
-		/* Make sure we have the right Highest FD */
-		if (conn->sock > conn->connset->hifd) {
-			log_dbg(
-				CONNS_ID " New high FD: " SOCK_ID " " CONN_ID,
-				conn->connset->id,
-				conn_sock(conn),
-				conn_id(conn));
-			conn->connset->hifd = conn->sock;
-		} else {
-			log_dbg(
-				CONNS_ID " Old high FD: " SOCK_ID
-				", " CONN_ID " = " SOCK_ID,
-				conn->connset->id,
-				conn->connset->hifd,
-				conn_id(conn),
-				conn_sock(conn));
-		}
-#endif
-	}
-
 	/* Release her */
 	connset_unlock(conn->connset);
 }
@@ -1349,6 +2720,41 @@ conn_events(conn_t *conn, uint16_t events) {
 	conn_unlock(conn);
 }
 
+void
+conn_deadline(conn_t *conn, unsigned int msec) {
+	connset_t	*cs;
+	uint64_t	at;
+
+	conn_lock(conn);
+
+	/* Without a connset (or socket) nobody waits for it */
+	cs = conn->connset;
+	if (cs == NULL || !conn_is_valid(conn)) {
+		conn_unlock(conn);
+		return;
+	}
+
+	connset_lock(cs);
+
+	conn->timedout = 0;
+
+	if (msec == 0) {
+		wheel_cancel(&cs->wheel, &conn->timer);
+	} else {
+		at = clk_msec() + msec;
+		wheel_arm(&cs->wheel, &conn->timer, at);
+
+		/* Sooner than the poller looks again */
+		if (at < cs->wakeup) {
+			cs->wakeup = at;
+			connset_wakeL(cs);
+		}
+	}
+
+	connset_unlock(cs);
+	conn_unlock(conn);
+}
+
 /* Locked by caller */
 static void
 conn_set_connset(conn_t *conn, connset_t *cs);
@@ -1382,16 +2788,22 @@ conn_set_connset(conn_t *conn, connset_t *cs) {
 		log_dbg(CONN_ID " old connset " CONNS_ID,
 			conn_id(conn), conn->connset->id);
 		conn_eventsA(conn, 0);
+
+		connset_lock(conn->connset);
+		connset_forget(conn);
+		connset_purgeL(conn);
+		connset_unlock(conn->connset);
 	}
 
-	/* Add to new connset */
+	/* Add to new connset, it has to be known before arming there */
+	conn->connset = cs;
+	conn->wntevents = CONN_POLLNONE;
+
 	if (cs != NULL) {
 		log_dbg(CONN_ID " new connset " CONNS_ID,
 			conn_id(conn), cs->id);
 		conn_eventsA(conn, events);
 	}
-
-	conn->connset = cs;
 }
 
 /* Destroy the connection, final cleanup */
@@ -1408,17 +2820,35 @@ conn_destroy(conn_t *conn) {
 	buf_destroy(&conn->send);
 	buf_destroy(&conn->send_headers);
 
+	/* Anything put after it was closed */
+	conn_chain_freeA(&conn->body);
+	conn_chain_freeA(&conn->chain);
+
 	/* Unlink the node from any list it was put on */
 	if (conn->connset != NULL) {
-		/* XXX: should be 'inactive' as that is what conn_close() causes */
+		connset_lock(conn->connset);
+		connset_purgeL(conn);
+		wheel_cancel(&conn->connset->wheel, &conn->timer);
+
+		/*
+		 * XXX: should be 'inactive' as that is what conn_close() causes
+		 * Under the connset lock, workers pop the ready list under it
+		 */
 		list_remove_l(conn->connset_l, &conn->node);
+		connset_unlock(conn->connset);
 
 		/* No more connset here */
 		conn->connset = NULL;
 		conn->connset_l = NULL;
 	}
 
-	mutex_destroy(conn->mutex);
+	/* Not queued (anymore), thus only ours */
+	if (conn->entry != NULL) {
+		pool_put(&l_conn_entries, conn->entry);
+		conn->entry = NULL;
+	}
+
+	lock_destroy(&conn->lock);
 	node_destroy(&conn->node);
 
 	log_dbg(CONN_ID " gone", conn_id(conn));
@@ -1455,41 +2885,107 @@ static void
 connset_handling_setupL(conn_t *conn) {
 	log_dbg(CONN_ID, conn_id(conn));
 
-	/* Clear the bits so that select() ignores them */
-	if (conn->wntevents & CONN_POLLIN) {
-		FD_CLR(conn->sock, &conn->connset->fd_read);
+	/* Stop watching it so that the poller ignores it */
+	connset_arm(conn, CONN_POLLNONE);
+
+	/* This worker gets to see it */
+	if (conn->timedout != 0) {
+		conn->timedout = CONN_DEADLINE_SEEN;
 	}
 
-	if (conn->wntevents & CONN_POLLOUT) {
-		FD_CLR(conn->sock, &conn->connset->fd_write);
-	}
+	/* And what the poller saw while it was away */
+	conn->hasevents |= conn->pollseen;
+	conn->pollseen = CONN_POLLNONE;
+
+	/*
+	 * We took conn from a list add it to handling list
+	 */
+	fassert(conn->connset_l == &conn->connset->ready);
+	conn->connset_l = &conn->connset->handling;
+	list_addtail_l(&conn->connset->handling, &conn->node);
+
+	log_dbg(
+		CONN_ID " done, list: handling",
+		conn_id(conn));
+}
+
+/*
+ * Take the next ready conn from the queue, the executor for worker w
+ * (or the overflow list) and set it up for handling, parking up to
+ * msec when there is none
+ *
+ * Returns NULL when there was nothing (yet)
+ */
+static conn_t *
+connset_take_ready(connset_t *cs, executor_worker_t *w, unsigned int msec);
+static conn_t *
+connset_take_ready(connset_t *cs, executor_worker_t *w, unsigned int msec) {
+	conn_entry_t	*e;
+	conn_t		*conn;
+
+	/* With an executor all workers have to use it */
+	fassert((w != NULL) == (cs->executor != NULL));
+
+	while (true) {
+		e = (conn_entry_t *)(w != NULL ? executor_next(w, 0) :
+						 mpmc_pop(&cs->readyq));
+
+		if (e == NULL && list_isempty(&cs->ready)) {
+			if (msec == 0) {
+				return (NULL);
+			}
+
+			e = (conn_entry_t *)(w != NULL ?
+				executor_next(w, msec) :
+				mpmc_pop_wait(&cs->readyq, msec));
+
+			/* Only wait once, the caller loops */
+			msec = 0;
+
+			if (e == NULL) {
+				return (NULL);
+			}
+		}
+
+		/*
+		 * Only the connset lock: a conn can't leave the connset
+		 * while it is held, and nobody else has a ready one
+		 */
+		connset_lock(cs);
+
+		if (e != NULL) {
+			/* This entry is used up, a new one can be queued */
+			conn = e->conn;
+			if (conn != NULL) {
+				conn->queued = false;
+			}
+		} else {
+			conn = (conn_t *)list_pop(&cs->ready);
+		}
+
+		/* Still ready? It might have moved on since it got queued */
+		if (conn != NULL && conn->connset_l == &cs->ready) {
+			fassert(conn->connset == cs);
 
-	/*
-	 * We took conn from a list add it to handling list
-	 */
-	fassert(conn->connset_l == &conn->connset->ready);
-	conn->connset_l = &conn->connset->handling;
-	list_addtail_l(&conn->connset->handling, &conn->node);
+			/* Locked, make magic happen */
+			connset_handling_setupL(conn);
 
-	log_dbg(
-		CONN_ID " done, list: handling",
-		conn_id(conn));
-}
+			/* Remember who has its data in cache */
+			if (w != NULL) {
+				conn->worker = w->num;
+			}
 
-static void
-connset_handling_setupA(conn_t *conn);
-static void
-connset_handling_setupA(conn_t *conn) {
-	/* Lock her up */
-	conn_lock(conn);
-	connset_lock(conn->connset);
+			connset_unlock(cs);
+			return (conn);
+		}
 
-	/* Locked, make magic happen */
-	connset_handling_setupL(conn);
+		connset_unlock(cs);
 
-	/* Release her */
-	connset_unlock(conn->connset);
-	conn_unlock(conn);
+		/* It left while queued, the entry is ours to free */
+		if (e != NULL && conn == NULL) {
+			pool_put(&l_conn_entries, e);
+		}
+	}
 }
 
 void
@@ -1522,25 +3018,40 @@ connset_handling_setup(conn_t *conn) {
 
 conn_t *
 connset_get_ready(connset_t *cs) {
-	conn_t *conn;
+	return (connset_get_ready_worker(cs, NULL));
+}
 
-	conn = (conn_t *)list_getnext(&cs->ready);
-	if (conn != NULL) {
-		connset_handling_setupA(conn);
-	}
+conn_t *
+connset_get_one_ready(connset_t *cs) {
+	return (connset_take_ready(cs, NULL, 0));
+}
 
-	return (conn);
+/*
+ * Let an executor hand out the ready conns (instead of the ready queue)
+ * Before anything is added to the connset, workers then use
+ * connset_get_ready_worker() with the worker from executor_join()
+ */
+void
+connset_set_executor(connset_t *cs, executor_t *ex) {
+	fassert(mpmc_isempty(&cs->readyq));
+
+	connset_lock(cs);
+	cs->executor = ex;
+	connset_unlock(cs);
 }
 
 conn_t *
-connset_get_one_ready(connset_t *cs) {
-	conn_t *conn;
+connset_get_ready_worker(connset_t *cs, executor_worker_t *w) {
+	conn_t *conn = NULL;
+
+	thread_setstate(thread_state_list_next);
 
-	conn = (conn_t *)list_pop(&cs->ready);
-	if (conn != NULL) {
-		connset_handling_setupA(conn);
+	while (conn == NULL && thread_keep_running()) {
+		conn = connset_take_ready(cs, w, CONNSET_READY_WAIT);
 	}
 
+	thread_setstate(thread_state_running);
+
 	return (conn);
 }
 
@@ -1548,13 +3059,22 @@ connset_get_one_ready(connset_t *cs) {
 void
 connset_handling_done(conn_t *conn, bool keeplocked) {
 	hlist_t	*l;
-	bool	changed = false;
 
 	/* Has to be one some list */
 	fassert(conn->connset_l != NULL);
 
 	log_dbg(CONN_ID " (kh=%s)", conn_id(conn), yesno(keeplocked));
 
+	/*
+	 * Still ours (on handling), but not locked yet: the hook
+	 * can use the conn functions (the locks are not recursive)
+	 */
+	if (conn->posthandle_f) {
+		conn->posthandle_f(conn, conn->posthandle_u);
+		conn->posthandle_f = NULL;
+		conn->posthandle_u = NULL;
+	}
+
 	/* Lock it */
 	conn_lock(conn);
 	connset_lock(conn->connset);
@@ -1567,29 +3087,39 @@ connset_handling_done(conn_t *conn, bool keeplocked) {
 	/* Should still be on the handling list */
 	fassert(conn->connset_l == &conn->connset->handling);
 
-	if (!keeplocked) {
-		/* Set the bits correctly so that select() answers again */
-		if (conn->wntevents & CONN_POLLIN) {
-			FD_SET(conn->sock, &conn->connset->fd_read);
-			changed = true;
-		}
-
-		if (conn->wntevents & CONN_POLLOUT) {
-			FD_SET(conn->sock, &conn->connset->fd_write);
-			changed = true;
-		}
+	/* The worker saw it, or it passed meanwhile: then it goes back */
+	if (conn->timedout == CONN_DEADLINE_SEEN) {
+		conn->timedout = 0;
+	}
 
-		/* Place it back on the active/inactive list */
-		if (conn->wntevents == CONN_POLLNONE) {
+	if (!keeplocked) {
+		/*
+		 * Place it back on the active/inactive list
+		 * or straight on ready when not drained yet
+		 */
+		if (conn->timedout != 0) {
+			l = &conn->connset->ready;
+		} else if (conn->wntevents == CONN_POLLNONE) {
 			l = &conn->connset->inactive;
+		} else if (connset_cachedL(conn, conn->wntevents)) {
+			l = &conn->connset->ready;
 		} else {
 			l = &conn->connset->active;
 		}
 
 		/* Put it on the right list */
 		list_remove_l(conn->connset_l, &conn->node);
-		conn->connset_l = l;
-		list_addtail_l(l, &conn->node);
+		if (l == &conn->connset->ready) {
+			connset_readyL(conn);
+		} else {
+			conn->connset_l = l;
+			list_addtail_l(l, &conn->node);
+		}
+
+		/* Watch it again so that the poller answers again */
+		if (l == &conn->connset->active) {
+			connset_arm(conn, conn->wntevents);
+		}
 
 		log_dbg(
 				CONN_ID " new list: %s",
@@ -1602,17 +3132,6 @@ connset_handling_done(conn_t *conn, bool keeplocked) {
 				connset_list(conn->connset, conn->connset_l));
 	}
 
-	if (conn->posthandle_f) {
-		conn->posthandle_f(conn, conn->posthandle_u);
-		conn->posthandle_f = NULL;
-		conn->posthandle_u = NULL;
-	}
-
-	/* Trigger as select() needs to know about our changes */
-	if (changed) {
-		connset_trigger_set(conn->connset);
-	}
-
 	/* Release it */
 	connset_unlock(conn->connset);
 	conn_unlock(conn);
@@ -1637,6 +3156,13 @@ conn_close(conn_t *conn) {
 	/* Don't want to hear from this socket any further */
 	conn_eventsA(conn, CONN_POLLNONE);
 
+	/* The poller has to forget the FD before it can be reused */
+	if (conn->connset != NULL) {
+		connset_lock(conn->connset);
+		connset_forget(conn);
+		connset_unlock(conn->connset);
+	}
+
 	/*
 	 * Make the socket temporarily blocking
 	 * This so we are sure that the shutdown()
@@ -1662,6 +3188,8 @@ conn_close(conn_t *conn) {
 	buf_emptyL(&conn->recv);
 	buf_emptyL(&conn->send);
 	buf_emptyL(&conn->send_headers);
+	conn_chain_freeA(&conn->body);
+	conn_chain_freeA(&conn->chain);
 
 #ifdef CONN_SSL
 	if (conn->ssl) {
@@ -1672,10 +3200,12 @@ conn_close(conn_t *conn) {
 		conn->ssl_bio_out = NULL;
 	}
 
-	memzero(conn->ssl_in, sizeof conn->ssl_in);
+	pool_put(&l_conn_sslbufs, conn->ssl_in);
+	conn->ssl_in = NULL;
 	conn->ssl_in_len = 0;
 
-	memzero(conn->ssl_out, sizeof conn->ssl_out);
+	pool_put(&l_conn_sslbufs, conn->ssl_out);
+	conn->ssl_out = NULL;
 	conn->ssl_out_len = 0;
 #endif /* CONN_SSL */
 
@@ -1767,7 +3297,7 @@ conn_ssl_flush(conn_t *conn) {
 			CONN_ID " sent %" PRIu64 ", but %" PRIu64 " left",
 			conn_id(conn), r, left);
 
-		memmove(&conn->ssl_out, &conn->ssl_out[r], left);
+		memmove(conn->ssl_out, &conn->ssl_out[r], left);
 
 		conn->ssl_out_len = left;
 
@@ -1777,6 +3307,8 @@ conn_ssl_flush(conn_t *conn) {
 
 	/* Done writing all our SSL data */
 	conn->ssl_out_len = 0;
+	pool_put(&l_conn_sslbufs, conn->ssl_out);
+	conn->ssl_out = NULL;
 	log_dbg(CONN_ID " done %" PRIu64, conn_id(conn), r);
 
 	return (true);
@@ -1796,7 +3328,9 @@ conn_ssl_bio_write(conn_t *conn) {
 	 * We read from the socket crypted data into ssl_in,
 	 * thus write towards OpenSSL which can then decrypt it
 	 */
-	rc = BIO_write(conn->ssl_bio_in, &conn->ssl_in, conn->ssl_in_len);
+	rc = BIO_write(conn->ssl_bio_in,
+		       conn->ssl_in != NULL ? conn->ssl_in : "",
+		       conn->ssl_in_len);
 	log_dbg(CONN_ID " BIO_write = %d", conn_id(conn), rc);
 
 	/*
@@ -1819,6 +3353,8 @@ conn_ssl_bio_write(conn_t *conn) {
 	 * (at least there is no way the API supports them...)
 	 */
 	conn->ssl_in_len = 0;
+	pool_put(&l_conn_sslbufs, conn->ssl_in);
+	conn->ssl_in = NULL;
 
 	if (!SSL_is_init_finished(conn->ssl)) {
 		/*
@@ -1832,6 +3368,12 @@ conn_ssl_bio_write(conn_t *conn) {
 	} else {
 		log_dbg("Attempting SSL Read");
 		buf_lock(&conn->recv);
+		if (!buf_minsize(&conn->recv, CONN_SSL_BUFLEN)) {
+			buf_unlock(&conn->recv);
+			conn_ssl_err(conn, "SSL_read no memory");
+			return;
+		}
+
 		rc = SSL_read(conn->ssl, buf_bufend(&conn->recv),
 			      conn_buffer_left(conn));
 
@@ -1867,10 +3409,25 @@ conn_ssl_bio_read(conn_t *conn) {
 	 * thus read it and then send it out over the socket by doing
 	 * a conn_ssl_flush();
 	 */
+	if (conn->ssl_out == NULL) {
+		conn->ssl_out = pool_get(&l_conn_sslbufs);
+		if (conn->ssl_out == NULL) {
+			conn_ssl_err(conn, "BIO_read no memory");
+			return;
+		}
+	}
+
 	rc = BIO_read(conn->ssl_bio_out,
 		       &conn->ssl_out[conn->ssl_out_len],
-		       sizeof conn->ssl_out - conn->ssl_out_len);
+		       CONN_SSL_BUFLEN - conn->ssl_out_len);
 	log_dbg(CONN_ID " BIO_read = %d", conn_id(conn), rc);
+
+	/* Nothing came out, no need to hold on to the buffer */
+	if (rc <= 0 && conn->ssl_out_len == 0) {
+		pool_put(&l_conn_sslbufs, conn->ssl_out);
+		conn->ssl_out = NULL;
+	}
+
 	if (rc > 0) {
 		/* We got data that needs flushing */
 		conn->ssl_out_len += rc;
@@ -1893,14 +3450,11 @@ conn_ssl_bio(conn_t *conn) {
 	conn_ssl_bio_write(conn);
 	conn_ssl_bio_read(conn);
 
-	buf_lock(&conn->recv);
-	buf_lock(&conn->send);
+	/* Only peeking for the log, callers can hold the send buffer */
 	log_dbg(CONN_ID " in: %u/%u, out: %u/%u",
 		conn_id(conn),
 		conn->ssl_in_len, (unsigned int)buf_cur(&conn->recv),
 		conn->ssl_out_len, (unsigned int)buf_cur(&conn->send));
-	buf_unlock(&conn->send);
-	buf_unlock(&conn->recv);
 }
 
 static long
@@ -1976,12 +3530,34 @@ conn_recvA(conn_t *conn) {
 
 	buf_lock(&conn->recv);
 
+	/*
+	 * What was consumed (buf_shift()) is room again, grow when that
+	 * is not enough. Idle connections have no storage (conn_release()).
+	 */
+	if (conn->recv.buf == NULL || conn_buffer_left(conn) < CONN_RECV_COMPACT) {
+		if (conn->recv.size >= CONN_RECV_MAX) {
+			buf_compact(&conn->recv);
+		} else if (!buf_minsize(&conn->recv, CONN_RECV_COMPACT)) {
+			buf_unlock(&conn->recv);
+			return (-ENOMEM);
+		}
+	}
+
 #ifdef CONN_SSL
+	if (conn->ssl && conn->ssl_in == NULL) {
+		conn->ssl_in = pool_get(&l_conn_sslbufs);
+		if (conn->ssl_in == NULL) {
+			buf_unlock(&conn->recv);
+			return (-ENOMEM);
+		}
+	}
+
 	if (conn->ssl) {
-		len = sizeof conn->ssl_in - conn->ssl_in_len;
+		len = CONN_SSL_BUFLEN - conn->ssl_in_len;
 		log_dbg(
 			CONN_ID " ssl, cur = %" PRIu64 ", left = %" PRIu64,
 			conn_id(conn), conn_buffer_cur(conn), len);
+		conn_iocall(conn);
 		thread_setstate(thread_state_io_read);
 		r = recv(conn->sock, &conn->ssl_in[conn->ssl_in_len],
 			 len, MSG_NOSIGNAL);
@@ -1992,12 +3568,19 @@ conn_recvA(conn_t *conn) {
 		log_dbg(
 			CONN_ID " cur = %" PRIu64 ", left = %" PRIu64,
 			conn_id(conn), conn_buffer_cur(conn), len);
+		conn_iocall(conn);
 		thread_setstate(thread_state_io_read);
 		r = recv(conn->sock, buf_bufend(&conn->recv),
 			len, MSG_NOSIGNAL);
 		thread_setstate(thread_state_running);
 #ifdef CONN_SSL
 	}
+
+	/* Nothing came in, do not hold on to the staging buffer */
+	if (r <= 0 && conn->ssl_in != NULL && conn->ssl_in_len == 0) {
+		pool_put(&l_conn_sslbufs, conn->ssl_in);
+		conn->ssl_in = NULL;
+	}
 #endif
 
 	/* Orderly shutdown? */
@@ -2017,6 +3600,7 @@ conn_recvA(conn_t *conn) {
 			log_dbg(
 				CONN_ID " EAGAIN (len=%" PRIsizet ")",
 				conn_id(conn), r);
+			conn_drainedA(conn, CONN_POLLIN);
 			return (0);
 		}
 
@@ -2028,12 +3612,20 @@ conn_recvA(conn_t *conn) {
 
 	conn->last_recv = gettime();
 
+	/* A short read emptied the socket, avoid a recv() for the EAGAIN */
+	if ((uint64_t)r < len) {
+		conn_drainedA(conn, CONN_POLLIN);
+	}
+
 #ifdef CONN_SSL
 	if (conn->ssl) {
 		log_dbg(CONN_ID " ssl received %" PRIu64, conn_id(conn), r);
 		conn->ssl_in_len += r;
 
+		/* SSL_read() locks the recv buffer itself */
+		buf_unlock(&conn->recv);
 		conn_ssl_bio(conn);
+		buf_lock(&conn->recv);
 	} else {
 #endif
 		uint64_t cur;
@@ -2108,6 +3700,7 @@ conn_recvline(conn_t *conn, char *buf, unsigned int buflen) {
 						   buf_buffer(&conn->recv),
 						   buf_cur(&conn->recv));
 					buf_unlock(&conn->recv);
+					conn_unlock(conn);
 					/* Not acceptable in lines */
 					return (-EINVAL);
 				}
@@ -2165,8 +3758,10 @@ conn_recvline(conn_t *conn, char *buf, unsigned int buflen) {
 			CONN_ID " trying to get more",
 			conn_id(conn));
 
-		/* Receive more */
+		/* Receive more (that locks the recv buffer itself) */
+		buf_unlock(&conn->recv);
 		i = conn_recvA(conn);
+		buf_lock(&conn->recv);
 		if (i == 0) {
 			/* Blocking socket, thus cannot happen */
 			log_dbg(
@@ -2290,8 +3885,10 @@ conn_flushleft(conn_t *conn) {
 	buf_lock(&conn->send);
 	buf_lock(&conn->send_headers);
 
-	l = buf_cur(&conn->send) +
-	    buf_cur(&conn->send_headers);
+	l = conn->chain.len +
+	    buf_cur(&conn->send_headers) +
+	    conn->body.len +
+	    buf_cur(&conn->send);
 
 	buf_unlock(&conn->send_headers);
 	buf_unlock(&conn->send);
@@ -2299,41 +3896,167 @@ conn_flushleft(conn_t *conn) {
 	return (l);
 }
 
-static void
-conn_sendfile_done(conn_t *conn);
-static void
-conn_sendfile_done(conn_t *conn) {
-	conn->sendfile_len = 0;
-	conn->sendfile_off = 0;
+/*
+ * Put a segment behind what is in the body already
+ * (everything in send goes before it)
+ */
+static bool
+conn_putseg(conn_t *conn, conn_seg_t *seg);
+static bool
+conn_putseg(conn_t *conn, conn_seg_t *seg) {
+	bool ret;
+
+	conn_lock(conn);
+	buf_lock(&conn->send);
+	buf_lock(&conn->send_headers);
+
+	ret = conn_chain_bufA(&conn->body, &conn->send);
+	if (ret) {
+		conn_chain_addA(&conn->body, seg);
+	}
+
+	buf_unlock(&conn->send_headers);
+	buf_unlock(&conn->send);
+	conn_unlock(conn);
+
+	if (!ret) {
+		conn_seg_free(seg);
+	}
 
-	assert(conn->sendfile_fd != -1);
+	return (ret);
+}
+
+bool
+conn_putref(conn_t *conn, const char *data, uint64_t len,
+	    conn_release_f release, void *user) {
+	conn_seg_t *seg;
+
+	seg = len > 0 ? conn_seg_new(CONN_SEG_REF) : NULL;
+	if (seg == NULL) {
+		if (release != NULL) {
+			release(user, data, len);
+		}
 
-	if (conn->sendfile_fd != -1) {
-		close(conn->sendfile_fd);
-		conn->sendfile_fd = -1;
+		return (len == 0);
 	}
+
+	seg->data = data;
+	seg->end = len;
+	seg->release = release;
+	seg->user = user;
+
+	log_dbg(CONN_ID " %" PRIu64, conn_id(conn), len);
+
+	return (conn_putseg(conn, seg));
 }
 
 /*
- * Caller has to call conn_flush() separately
- * This so that headers can be added
+ * Short ranges are read by sendfile() right away, asking for readahead
+ * would only cost a syscall
  */
+static void
+conn_seg_readahead(conn_seg_t *seg);
+static void
+conn_seg_readahead(conn_seg_t *seg) {
+	seg->ra = seg->end - seg->off > CONN_FILE_RA / 2 ? seg->off : seg->end;
+}
+
 bool
-conn_sendfile(conn_t *conn, const char *file) {
-	int		fd;
+conn_putfile(conn_t *conn, int fd, uint64_t off, uint64_t len,
+	     bool closefd) {
+	conn_seg_t	*seg;
 	struct stat	st;
 
-	/* Make sure there was nothing yet */
-	assert(conn->sendfile_fd == -1);
-	assert(conn->sendfile_off == 0);
-	assert(conn->sendfile_len == 0);
+	seg = len > 0 ? conn_seg_new(CONN_SEG_FILE) : NULL;
+	if (seg == NULL || fstat(fd, &st) == -1) {
+		if (seg != NULL) {
+			log_err(CONN_ID " Could not fstat fd%d",
+				conn_id(conn), fd);
+			conn_seg_free(seg);
+		}
+
+		if (closefd) {
+			close(fd);
+		}
+
+		return (len == 0);
+	}
+
+	seg->fd = fd;
+	seg->closefd = closefd;
+	seg->off = off;
+	seg->end = off + len;
+
+	/* Pipes, sockets, devices: sendfile() can't read them */
+	seg->splice = !S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode);
+
+#ifndef _LINUX
+	if (seg->splice) {
+		log_err(CONN_ID " fd%d is not a file", conn_id(conn), fd);
+		conn_seg_free(seg);
+		return (false);
+	}
+#else
+	/* Nothing polls it, it would only ever say EAGAIN to the worker */
+	if (seg->splice && (fcntl(fd, F_GETFL) & O_NONBLOCK)) {
+		log_err(CONN_ID " fd%d is non-blocking", conn_id(conn), fd);
+		conn_seg_free(seg);
+		return (false);
+	}
+#endif
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	/* Read from start to end, a larger readahead helps */
+	if (!seg->splice) {
+		posix_fadvise(fd, off, len, POSIX_FADV_SEQUENTIAL);
+	}
+#endif
+	conn_seg_readahead(seg);
+
+	log_dbg(CONN_ID " fd%d %" PRIu64 "+%" PRIu64 "%s",
+		conn_id(conn), fd, off, len, seg->splice ? " (splice)" : "");
+
+	return (conn_putseg(conn, seg));
+}
+
+bool
+conn_putfd(conn_t *conn, int fd, uint64_t off, uint64_t len,
+	   conn_release_f release, void *user) {
+	conn_seg_t *seg;
+
+	seg = len > 0 ? conn_seg_new(CONN_SEG_FILE) : NULL;
+	if (seg == NULL) {
+		if (release != NULL) {
+			release(user, NULL, 0);
+		}
+
+		return (len == 0);
+	}
+
+	seg->fd = fd;
+	seg->off = off;
+	seg->end = off + len;
+	seg->release = release;
+	seg->user = user;
+	conn_seg_readahead(seg);
+
+	log_dbg(CONN_ID " fd%d %" PRIu64 "+%" PRIu64,
+		conn_id(conn), fd, off, len);
+
+	return (conn_putseg(conn, seg));
+}
+
+int
+conn_openfile(const char *file, uint64_t *size) {
+	int		fd;
+	struct stat	st;
 
 	/* Check the path for strange ../ kind of constructs */
 	if (strstr(file, "../") != NULL) {
 		log_err(
 			"Refusing '%s' which contains a relative path",
 			file);
-		return (false);
+		return (-1);
 	}
 
 	fd = open(file, O_RDONLY | O_NONBLOCK | O_CLOEXEC | O_LARGEFILE);
@@ -2341,7 +4064,7 @@ conn_sendfile(conn_t *conn, const char *file) {
 		log_err(
 			"Could not open %s for sendfile()",
 			file);
-		return (false);
+		return (-1);
 	}
 
 #ifdef _DARWIN
@@ -2367,289 +4090,300 @@ conn_sendfile(conn_t *conn, const char *file) {
 			"Could not fstat %s for sendfile()",
 			file);
 		close(fd);
-		return (false);
+		return (-1);
 	}
 
-	/* Fill in our sendfile details */
-	conn->sendfile_fd = fd;
-	conn->sendfile_off = 0;
-	conn->sendfile_len = st.st_size;
+	/* Fifos and devices would block a worker (or never end) */
+	if (!S_ISREG(st.st_mode)) {
+		log_err(
+			"Refusing %s which is not a regular file",
+			file);
+		close(fd);
+		return (-1);
+	}
 
-	/* For HTTP requests */
-	conn_set_real_contentlen(conn, conn->sendfile_len);
+	*size = st.st_size;
+	return (fd);
+}
 
-	return (true);
+/*
+ * Caller has to call conn_flush() separately
+ * This so that headers can be added
+ */
+bool
+conn_sendfile(conn_t *conn, const char *file) {
+	uint64_t	size;
+	int		fd;
+
+	fd = conn_openfile(file, &size);
+	if (fd == -1) {
+		return (false);
+	}
+
+	/* The Content-Length comes from the body it is in */
+	return (conn_putfile(conn, fd, 0, size, true));
 }
 
+#ifdef CONN_SSL
+/* Files have to go through SSL_write(), a block at a time */
 static bool
-conn_flush_sendfile(conn_t *conn);
+conn_ssl_sendfileA(conn_t *conn, conn_seg_t *seg, uint64_t *len,
+		   uint64_t *wlen);
 static bool
-conn_flush_sendfile(conn_t *conn) {
-	off_t	off;
-#ifdef _LINUX
-	size_t	cnt;
-#else
-	off_t	cnt;
-#endif
-	int	r;
+conn_ssl_sendfileA(conn_t *conn, conn_seg_t *seg, uint64_t *len,
+		   uint64_t *wlen) {
+	char	*b = pool_get(&l_conn_sslbufs);
+	ssize_t	rd = -1;
+	bool	ret;
 
-	log_dbg(
-		CONN_ID " sendfile(%" PRIu64 "/%" PRIu64 ") (pre-flush)",
-		conn_id(conn), conn->sendfile_off, conn->sendfile_len);
+	if (*len > CONN_SSL_BUFLEN) {
+		*len = CONN_SSL_BUFLEN;
+	}
 
-	off = conn->sendfile_off;
-	cnt = conn->sendfile_len;
-	cnt -= off;
+	if (b != NULL && seg->splice) {
+		rd = read(seg->fd, b, *len);
+	} else if (b != NULL) {
+		rd = pread(seg->fd, b, *len, seg->off);
+	}
+
+	/* All of what was read goes into the SSL buffer */
+	ret = rd > 0;
+	if (ret) {
+		*len = *wlen = rd;
+		ret = conn_ssl_send(conn, b, wlen);
+	} else {
+		log_err(CONN_ID " Could not read the file to send",
+			conn_id(conn));
+	}
+
+	pool_put(&l_conn_sslbufs, b);
+	return (ret);
+}
+#endif /* CONN_SSL */
 
-	/*
-	 * Note that this blocks on input,
-	 * but we assume disk IO to be faster than network IO
-	 * Also, we have multiple worker threads thus it ain't that bad
-	 */
 #ifdef _LINUX
-	/* Linux */
-	r = sendfile(conn->sock, conn->sendfile_fd, &off, cnt);
-#else
-	/* Darwin/BSD variants */
-	r = sendfile(conn->sendfile_fd, conn->sock, off, &cnt, NULL, 0);
-#endif
-	if (r == -1) {
-		/* On Linux an error is a hard error, no progress is made */
-#ifndef _LINUX
-		switch (errno) {
-		case EAGAIN:
-			/* We are non-blocking, thus expected */
-			break;
-		default:
-#endif
-			/* Something broken */
-			log_err(
-				CONN_ID " sendfile() failed",
-				conn->id);
-			conn_sendfile_done(conn);
-			return (false);
-#ifndef _LINUX
-		}
+/*
+ * Not a file: splice() it into a pipe and from there into the socket,
+ * what the socket did not take stays in the pipe for the next time.
+ * The source is blocking (conn_putfile() refuses others): there is
+ * nothing that polls it, an EAGAIN from it would have the conn wait
+ * for POLLOUT on a socket that is writable and spin.
+ */
+static bool
+conn_splice_fileA(conn_t *conn, conn_seg_t *seg, uint64_t *len,
+		  uint64_t *wlen);
+static bool
+conn_splice_fileA(conn_t *conn, conn_seg_t *seg, uint64_t *len,
+		  uint64_t *wlen) {
+	ssize_t r;
 
-		/* Should always go forward */
-		assert((uint64_t)off >= conn->sendfile_off);
+	*wlen = 0;
 
-		/* Store our new offset */
-		conn->sendfile_off += cnt;
+	if (seg->pipe[0] == -1 && pipe2(seg->pipe, O_NONBLOCK | O_CLOEXEC)) {
+		log_err(CONN_ID " No pipe for splice()", conn_id(conn));
+		return (false);
+	}
 
-		log_dbg(
-			CONN_ID " sendfile(%" PRIu64 "/"
-			"%" PRIu64 ") = %0.2f%%",
-			conn_id(conn),
-			conn->sendfile_off,
-			conn->sendfile_len,
-			(float)conn->sendfile_off * 100 / (float)conn->sendfile_len);
-#endif
-	} else {
-		assert(r >= 0);
-#ifdef _LINUX
-		/* Linux stores the new offset in off */
-		conn->sendfile_off = off;
+	/* Refill the pipe once the socket took all that was in it */
+	if (seg->inpipe == 0) {
+		r = splice(seg->fd, NULL, seg->pipe[1], NULL,
+			   *len < CONN_FILE_PIPE ? *len : CONN_FILE_PIPE,
+			   SPLICE_F_MOVE);
+		if (r <= 0) {
+			log_err(CONN_ID " splice() from fd%d failed",
+				conn_id(conn), seg->fd);
+			return (false);
+		}
 
-		log_dbg(
-			CONN_ID " sendfile(%" PRIu64 "/"
-			"%" PRIu64 ") = %0.2f%%",
-			conn_id(conn),
-			conn->sendfile_off,
-			conn->sendfile_len,
-			(float)conn->sendfile_off * 100 / (float)conn->sendfile_len);
+		seg->inpipe = r;
+	}
 
-		/* Done? */
-		if (conn->sendfile_off >= conn->sendfile_len)
-		{
-#endif
-		conn_sendfile_done(conn);
+	*len = seg->inpipe;
 
-		log_dbg(CONN_ID " flush complete", conn_id(conn));
+	conn_iocall(conn);
+	thread_setstate(thread_state_io_write);
+	r = splice(seg->pipe[0], NULL, conn->sock, NULL, seg->inpipe,
+		   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	thread_setstate(thread_state_running);
 
-		/* Nothing to flush thus continue polling for incoming */
-		conn_eventsA(conn, CONN_POLLIN);
-#ifdef _LINUX
-		}
-#endif
+	if (r == -1 && errno == EAGAIN) {
+		/* The socket is full */
+		return (true);
+	}
+
+	if (r <= 0) {
+		log_dbg(CONN_ID " splice() failed", conn_id(conn));
+		return (false);
 	}
 
+	seg->inpipe -= r;
+	*wlen = r;
+
 	return (true);
 }
+#endif /* _LINUX */
 
 /*
- * Flush a bit more of the buffer towards the client
- * Might be async and not flush everything
+ * Send a bit of the file segment at the head of the chain,
+ * wlen is 0 when the socket is full
  */
-bool
-conn_flush(conn_t *conn) {
-	ssize_t		r;
-	uint64_t	len, len_b, len_h, wlen;
-	bool		ret = true;
-
-	log_dbg(
-		CONN_ID " list: %s",
-		conn_id(conn),
-		connset_list(conn->connset, conn->connset_l));
+static bool
+conn_write_fileA(conn_t *conn, conn_seg_t *seg, uint64_t *len,
+		 uint64_t *wlen);
+static bool
+conn_write_fileA(conn_t *conn, conn_seg_t *seg, uint64_t *len,
+		 uint64_t *wlen) {
+	off_t	off = seg->off;
+#ifdef _LINUX
+	ssize_t	r;
+#else
+	off_t	cnt;
+	int	r;
+#endif
 
-	conn_lock(conn);
-	buf_lock(&conn->send);
-	buf_lock(&conn->send_headers);
+	*len = seg->end - seg->off;
 
 #ifdef CONN_SSL
-	if (!conn_ssl_flush(conn)) {
-		/* Still need to flush the SSL buffer */
-		/* Thus don't do anything else here yet */
-		log_dbg(CONN_ID " SSL flush needed", conn_id(conn));
-		buf_unlock(&conn->send_headers);
-		buf_unlock(&conn->send);
-		conn_unlock(conn);
-		return (true);
+	if (conn->ssl) {
+		return (conn_ssl_sendfileA(conn, seg, len, wlen));
 	}
 #endif /* CONN_SSL */
 
-	if (!conn_is_connected(conn) || conn_is_eofA(conn)) {
-		log_dbg(CONN_ID " not connected", conn_id(conn));
-		buf_unlock(&conn->send_headers);
-		buf_unlock(&conn->send);
-		conn_unlock(conn);
-		return (false);
+#ifdef _LINUX
+	if (seg->splice) {
+		return (conn_splice_fileA(conn, seg, len, wlen));
 	}
+#endif
 
-	len_b = buf_cur(&conn->send);
-	len_h = buf_cur(&conn->send_headers);
-	len = len_b + len_h;
-
-	/* Nothing to flush */
-	if (len == 0) {
-		buf_unlock(&conn->send_headers);
-		buf_unlock(&conn->send);
-
-		/* Need to send more of a file? */
-		if (conn->sendfile_len != 0) {
-			ret = conn_flush_sendfile(conn);
-		} else {
-			log_dbg(CONN_ID " nothing to flush", conn_id(conn));
+#ifdef POSIX_FADV_WILLNEED
+	/*
+	 * Start reading the next part before sendfile() gets there, then
+	 * it does not have to wait for the disk (and block the worker)
+	 */
+	if (seg->ra < seg->end && seg->off + CONN_FILE_RA / 2 >= seg->ra) {
+		uint64_t ra = seg->end - seg->ra;
 
-			/* Nothing to flush thus continue polling for incoming */
-			conn_eventsA(conn, CONN_POLLIN);
+		if (ra > CONN_FILE_RA) {
+			ra = CONN_FILE_RA;
 		}
 
-		conn_unlock(conn);
-		return (ret);
+		posix_fadvise(seg->fd, seg->ra, ra, POSIX_FADV_WILLNEED);
+		seg->ra += ra;
 	}
+#endif
 
-	conn->last_sent = gettime();
-
-	/* Call the flush hook */
-	if (conn->flush_hook) {
-		if (len_h > 0) {
-			conn->flush_hook(conn->flush_data,
-					 conn_id(conn), true,
-					 buf_buffer(&conn->send_headers),
-					 len_h);
-		}
+	/*
+	 * Note that this blocks on input,
+	 * but we assume disk IO to be faster than network IO
+	 * Also, we have multiple worker threads thus it ain't that bad
+	 */
+	conn_iocall(conn);
+	thread_setstate(thread_state_io_write);
+#ifdef _LINUX
+	/* Linux */
+	r = sendfile(conn->sock, seg->fd, &off, *len);
+	*wlen = r > 0 ? (uint64_t)r : 0;
+#else
+	/* Darwin/BSD variants, what went out is in cnt (also on EAGAIN) */
+	cnt = *len;
+	r = sendfile(seg->fd, conn->sock, off, &cnt, NULL, 0);
+	*wlen = cnt > 0 ? (uint64_t)cnt : 0;
+#endif
+	thread_setstate(thread_state_running);
 
-		if (len_b > 0) {
-			conn->flush_hook(conn->flush_data,
-					 conn_id(conn), false,
-					 buf_buffer(&conn->send),
-					 len_b);
-		}
+	if (r == -1 && errno == EAGAIN) {
+		/* The socket is full */
+		return (true);
 	}
 
-	if (len_h > 0) {
-		struct iovec	iovec[2];
-		unsigned int	iolen;
-
-		/* Add separating when we didn't yet \n */
-		fassert((len_b + len_h) != 0);
-
-		if (conn->real_contentlen > 0 || len_b > 0) {
-			if (len_b > 0) {
-				log_dbg(
-					CONN_ID " Have Content-Length: %" PRIu64,
-					conn_id(conn), len_b);
-			}
-
-			if (conn->real_contentlen != 0) {
-				log_dbg(CONN_ID
-					" Real Content-Length: %" PRIu64,
-					conn_id(conn), conn->real_contentlen);
-			}
-
-			conn_addheaderf(conn,
-				"Content-Length: %" PRIu64,
-				conn->real_contentlen > 0 ?
-					conn->real_contentlen :
-					len_b);
+	/* Nothing at all: the file got shorter */
+	if (r == -1 || *wlen == 0) {
+		log_err(
+			CONN_ID " sendfile() failed",
+			conn->id);
+		return (false);
+	}
 
-			/* Reset it to avoid re-use */
-			conn->real_contentlen = 0;
-		}
+	log_dbg(
+		CONN_ID " sendfile(%" PRIu64 "/%" PRIu64 ")",
+		conn_id(conn), *wlen, *len);
 
-		/* Separate header from body */
-		conn_addheader(conn, "");
+	return (true);
+}
 
-		/* We added some headers, thus this became larger */
-		len_h = buf_cur(&conn->send_headers);
-		len = len_b + len_h;
+/*
+ * Write the start of the chain: the memory segments upto the first file
+ * segment with one writev(), or that file segment, wlen is 0 when the
+ * socket is full
+ */
+static bool
+conn_writeA(conn_t *conn, uint64_t *len, uint64_t *wlen);
+static bool
+conn_writeA(conn_t *conn, uint64_t *len, uint64_t *wlen) {
+	struct iovec	iovec[CONN_SEG_IOV];
+	unsigned int	iolen = 0;
+	conn_seg_t	*seg = conn->chain.head;
+	const char	*data;
+	ssize_t		r;
 
-		log_dbg(
-			CONN_ID " "
-			"Full HEADERs (%" PRIu64 " vs %" PRIsizet ")",
-			conn_id(conn),
-			len_h,
-			strlen(buf_buffer(&conn->send_headers)));
-		log_dbg("8<-----------");
-		log_dbg("%s", buf_buffer(&conn->send_headers));
-		log_dbg("----------->8");
+	if (seg->type == CONN_SEG_FILE) {
+		return (conn_write_fileA(conn, seg, len, wlen));
+	}
 
-		/* The chunks to send */
-		iovec[0].iov_base = buf_buffer(&conn->send_headers);
-		iovec[0].iov_len = len_h;
-		iovec[1].iov_base = buf_buffer(&conn->send);
-		iovec[1].iov_len = len_b;
+	*len = 0;
 
-		/* Sometimes we do not have content thus we skip that one */
-		iolen = iovec[1].iov_len > 0 ? 2 : 1;
+	for (; seg != NULL && seg->type != CONN_SEG_FILE &&
+	       iolen < lengthof(iovec); seg = seg->next) {
+		/* iov_base is not const, it is only read from */
+		data = conn_seg_data(seg);
+		iovec[iolen].iov_base = (char *)data;
+		iovec[iolen].iov_len = conn_seg_left(seg);
+		*len += iovec[iolen++].iov_len;
+	}
 
-		log_dbg(CONN_ID " Flushing %" PRIu64 " (h)",
-			conn_id(conn), len);
+	log_dbg(CONN_ID " Flushing %" PRIu64 " in %u",
+		conn_id(conn), *len, iolen);
 
+	if (iolen > 1) {
 #ifdef CONN_SSL
 		if (conn->ssl) {
-			r = conn_ssl_sendv(conn, iovec, iolen, &wlen);
+			r = conn_ssl_sendv(conn, iovec, iolen, wlen);
 		} else {
 #endif
+			conn_iocall(conn);
 			thread_setstate(thread_state_io_write);
 			r = writev(conn->sock, iovec, iolen);
 			thread_setstate(thread_state_running);
-			wlen = r;
+			*wlen = r;
 #ifdef CONN_SSL
 		}
 #endif
 	} else {
-		wlen = len_b;
-		log_dbg(CONN_ID " Flushing %" PRIu64, conn_id(conn), len);
+		*wlen = iovec[0].iov_len;
 
 #ifdef CONN_SSL
 		if (conn->ssl) {
-			r = conn_ssl_send(conn, buf_buffer(&conn->send), &wlen);
+			r = conn_ssl_send(conn, iovec[0].iov_base, wlen);
 		} else {
 #endif
 			fassert(conn_is_valid(conn));
+			conn_iocall(conn);
 			thread_setstate(thread_state_io_write);
-			r = send(conn->sock, buf_buffer(&conn->send), wlen,
+			r = send(conn->sock, iovec[0].iov_base, *wlen,
 				 MSG_NOSIGNAL);
 			thread_setstate(thread_state_running);
-			wlen = r;
+			*wlen = r;
 #ifdef CONN_SSL
 		}
 #endif
 	}
 
-	if (r <= -1) {
+	if (r <= -1 && errno == EAGAIN) {
+		log_dbg(CONN_ID " Flush EAGAIN", conn_id(conn));
+
+		/* Nothing went out */
+		*wlen = 0;
+	} else if (r <= -1) {
 		/*
 		 * While this is an 'error', they just mean
 		 * the connection was closed while sending
@@ -2663,66 +4397,232 @@ conn_flush(conn_t *conn) {
 		log_dbg(CONN_ID " Flush error = %" PRIsizet,
 			conn_id(conn), r);
 #endif
-
-		buf_unlock(&conn->send_headers);
-		buf_unlock(&conn->send);
-		conn_unlock(conn);
 		return (false);
 	}
 
-	if (wlen == len) {
-		log_dbg(CONN_ID " Written all", conn_id(conn));
-
-		/* Nothing further to send */
-		buf_empty(&conn->send);
-		buf_empty(&conn->send_headers);
+	return (true);
+}
 
-		/* Need to send more of a file? */
-		if (conn->sendfile_len != 0) {
-			ret = conn_flush_sendfile(conn);
-		} else {
-			log_dbg(CONN_ID " nothing to flush", conn_id(conn));
+/*
+ * Finish the response in send_headers/body/send: the Content-Length and
+ * the empty line that ends the headers. Every response gets here once,
+ * thus this also is where the flush hook sees it (files excluded).
+ *
+ * Locked by caller
+ */
+static void
+conn_finishA(conn_t *conn);
+static void
+conn_finishA(conn_t *conn) {
+	conn_seg_t	*seg;
+	uint64_t	len_b = conn->body.len + buf_cur(&conn->send),
+			len_h = buf_cur(&conn->send_headers);
 
-			/* Nothing to flush thus continue polling for incoming */
-			conn_eventsA(conn, CONN_POLLIN);
+	/* Call the flush hook */
+	if (conn->flush_hook) {
+		if (len_h > 0) {
+			conn->flush_hook(conn->flush_data,
+					 conn_id(conn), true,
+					 buf_buffer(&conn->send_headers),
+					 len_h);
 		}
-	} else {
-		log_dbg(
-			CONN_ID " Written %" PRIu64 " of %" PRIu64 ", left: %" PRIu64,
-			conn_id(conn), wlen, len, len - wlen);
 
-		/* Headers will go first */
-		if (len_h > 0) {
-			if (wlen >= len_h) {
-				/* Done with the headers */
-				wlen -= len_h;
-				buf_empty(&conn->send_headers);
-			} else {
-				/* Move rest to the front of the buffer */
-				buf_shift(&conn->send_headers, wlen);
-				len_h -= wlen;
-				wlen = 0;
+		for (seg = conn->body.head; seg != NULL; seg = seg->next) {
+			if (seg->type != CONN_SEG_FILE) {
+				conn->flush_hook(conn->flush_data,
+						 conn_id(conn), false,
+						 conn_seg_data(seg),
+						 conn_seg_left(seg));
 			}
 		}
 
-		/* Bytes left from the normal buffer? */
-		if (wlen > 0) {
-			fassert(wlen < len_b);
-			/* Move the rest to the front of the buffer */
-			buf_shift(&conn->send, wlen);
-			len_b -= wlen;
-			wlen = 0;
+		if (buf_cur(&conn->send) > 0) {
+			conn->flush_hook(conn->flush_data,
+					 conn_id(conn), false,
+					 buf_buffer(&conn->send),
+					 buf_cur(&conn->send));
+		}
+	}
+
+	/* Only a body, nothing to finish */
+	if (len_h == 0) {
+		return;
+	}
+
+	if (conn->real_contentlen > 0 || len_b > 0) {
+		if (len_b > 0) {
+			log_dbg(
+				CONN_ID " Have Content-Length: %" PRIu64,
+				conn_id(conn), len_b);
+		}
+
+		if (conn->real_contentlen != 0) {
+			log_dbg(CONN_ID
+				" Real Content-Length: %" PRIu64,
+				conn_id(conn), conn->real_contentlen);
 		}
 
-		/* Try to get it out there */
-		conn_eventsA(conn, CONN_POLLIN | CONN_POLLOUT);
+		/* send_headers is locked already */
+		buf_printf(&conn->send_headers,
+			"Content-Length: %" PRIu64 "\r\n",
+			conn->real_contentlen > 0 ?
+				conn->real_contentlen :
+				len_b);
+
+		/* Reset it to avoid re-use */
+		conn->real_contentlen = 0;
+	}
+
+	/* Separate header from body */
+	buf_put(&conn->send_headers, "\r\n");
+
+	log_dbg(
+		CONN_ID " "
+		"Full HEADERs (%" PRIu64 " vs %" PRIsizet ")",
+		conn_id(conn),
+		buf_cur(&conn->send_headers),
+		strlen(buf_buffer(&conn->send_headers)));
+	log_dbg("8<-----------");
+	log_dbg("%s", buf_buffer(&conn->send_headers));
+	log_dbg("----------->8");
+}
+
+/*
+ * Finish the response being built and move it behind the sealed ones:
+ * the headers, the body segments and what is left in send
+ *
+ * Locked by caller
+ */
+static bool
+conn_sealA(conn_t *conn);
+static bool
+conn_sealA(conn_t *conn) {
+	bool ret;
+
+	if (buf_cur(&conn->send_headers) == 0 &&
+	    conn->body.head == NULL &&
+	    buf_cur(&conn->send) == 0) {
+		return (true);
+	}
+
+	conn_finishA(conn);
+
+	ret = conn_chain_bufA(&conn->chain, &conn->send_headers);
+	conn_chain_joinA(&conn->chain, &conn->body);
+	ret = ret && conn_chain_bufA(&conn->chain, &conn->send);
+
+	if (!ret) {
+		log_crt(CONN_ID " No memory to queue the response",
+			conn_id(conn));
+
+		/* It was finished, it can't be sealed again */
+		buf_empty(&conn->send_headers);
+		buf_empty(&conn->send);
 	}
 
+	return (ret);
+}
+
+bool
+conn_seal(conn_t *conn) {
+	bool ret;
+
+	conn_lock(conn);
+	buf_lock(&conn->send);
+	buf_lock(&conn->send_headers);
+
+	ret = conn_sealA(conn);
+
+	buf_unlock(&conn->send_headers);
+	buf_unlock(&conn->send);
+	conn_unlock(conn);
+
+	return (ret);
+}
+
+/*
+ * Flush a bit more of the buffer towards the client
+ * Might be async and not flush everything
+ *
+ * The response being built is sealed first, then the chain is written
+ * until it is empty or the socket is full; what is left goes on at the
+ * next POLLOUT.
+ */
+bool
+conn_flush(conn_t *conn) {
+	uint64_t	len, wlen;
+	bool		ret = true;
+
 	log_dbg(
-		CONN_ID " left: h: %" PRIu64 ", b: %"  PRIu64 ", sf: %" PRIu64,
+		CONN_ID " list: %s",
 		conn_id(conn),
-		len_h, len_b,	
-		conn->sendfile_len);
+		connset_list(conn->connset, conn->connset_l));
+
+	conn_lock(conn);
+	buf_lock(&conn->send);
+	buf_lock(&conn->send_headers);
+
+#ifdef CONN_SSL
+	if (!conn_ssl_flush(conn)) {
+		/* Still need to flush the SSL buffer */
+		/* Thus don't do anything else here yet */
+		log_dbg(CONN_ID " SSL flush needed", conn_id(conn));
+		buf_unlock(&conn->send_headers);
+		buf_unlock(&conn->send);
+		conn_unlock(conn);
+		return (true);
+	}
+#endif /* CONN_SSL */
+
+	if (!conn_is_connected(conn) || conn_is_eofA(conn)) {
+		log_dbg(CONN_ID " not connected", conn_id(conn));
+		buf_unlock(&conn->send_headers);
+		buf_unlock(&conn->send);
+		conn_unlock(conn);
+		return (false);
+	}
+
+	ret = conn_sealA(conn);
+
+	if (ret && conn->chain.head != NULL) {
+		conn->last_sent = gettime();
+	}
+
+	while (ret && conn->chain.head != NULL) {
+		ret = conn_writeA(conn, &len, &wlen);
+		if (!ret) {
+			break;
+		}
+
+		conn_chain_consumeA(&conn->chain, wlen);
+
+		if (wlen < len) {
+			log_dbg(
+				CONN_ID " Written %" PRIu64 " of %" PRIu64
+				", left: %" PRIu64,
+				conn_id(conn), wlen, len, conn->chain.len);
+
+			/* A short write filled the socket */
+			conn_drainedA(conn, CONN_POLLOUT);
+
+			/* Try to get it out there */
+			conn_eventsA(conn, CONN_POLLIN | CONN_POLLOUT);
+			break;
+		}
+	}
+
+	if (ret && conn->chain.head == NULL) {
+		log_dbg(CONN_ID " Written all", conn_id(conn));
+
+		/* Nothing coming in either: idle, drop the storage */
+		if (conn_buffer_cur(conn) == 0) {
+			buf_release(&conn->send);
+			buf_release(&conn->send_headers);
+		}
+
+		/* Nothing to flush thus continue polling for incoming */
+		conn_eventsA(conn, CONN_POLLIN);
+	}
 
 	buf_unlock(&conn->send_headers);
 	buf_unlock(&conn->send);
@@ -2761,7 +4661,7 @@ bool
 conn_addheaderf(conn_t *conn, const char *fmt, ...) {
         va_list		ap;
 	bool		ret;
-#ifdef DEBUG
+#if LOG_LEVEL_COMPILED >= LOG_DEBUG
 	uint64_t	cur;
 #endif
 
@@ -2769,7 +4669,7 @@ conn_addheaderf(conn_t *conn, const char *fmt, ...) {
 
         va_start(ap, fmt);
 
-#ifdef DEBUG
+#if LOG_LEVEL_COMPILED >= LOG_DEBUG
 	cur = buf_cur(&conn->send_headers);
 #endif
 	ret = buf_vprintf(&conn->send_headers, fmt, ap);
@@ -2787,6 +4687,26 @@ conn_addheaderf(conn_t *conn, const char *fmt, ...) {
 	return (ret);
 }
 
+/*
+ * A send buffer that is full and holds enough becomes a segment of the
+ * body instead of growing (realloc() and copying all that is in there),
+ * new data goes into a fresh CONN_SEG_SIZE one.
+ *
+ * Locked by caller
+ */
+static bool
+conn_freezeA(conn_t *conn, uint64_t len);
+static bool
+conn_freezeA(conn_t *conn, uint64_t len) {
+	if (buf_cur(&conn->send) < CONN_SEG_MIN ||
+	    len <= buf_left(&conn->send)) {
+		return (true);
+	}
+
+	return (conn_chain_bufA(&conn->body, &conn->send) &&
+		buf_minsize(&conn->send, CONN_SEG_SIZE - 1));
+}
+
 bool
 conn_putl(conn_t *conn, const char *txt, unsigned int len) {
 	bool		ret;
@@ -2799,8 +4719,10 @@ conn_putl(conn_t *conn, const char *txt, unsigned int len) {
 	buf_lock(&conn->send);
 	buf_lock(&conn->send_headers);
 
+	ret = conn_freezeA(conn, len);
+
 	cur = buf_cur(&conn->send);
-	ret = buf_putl(&conn->send, txt, len);
+	ret = ret && buf_putl(&conn->send, txt, len);
 
 	if (ret) {
 		log_dbg(CONN_ID ": %u", conn_id(conn), len);
@@ -2877,8 +4799,10 @@ conn_vprintf(conn_t *conn, const char *fmt, va_list ap) {
 	buf_lock(&conn->send);
 	buf_lock(&conn->send_headers);
 
+	ret = conn_freezeA(conn, CONN_PRINTF_LEN);
+
 	cur = buf_cur(&conn->send);
-	ret = buf_vprintf(&conn->send, fmt, ap);
+	ret = ret && buf_vprintf(&conn->send, fmt, ap);
 
 	if (ret) {
 		log_dbg(CONN_ID "", conn_id(conn));
@@ -3243,6 +5167,16 @@ conn_accept(conn_t *conn, conn_t *lconn, void *clientdata) {
 	conn->sock = accept(lconn->sock, NULL, 0);
 #endif
 
+	if (conn->sock == INVALID_SOCKET && errno == EAGAIN) {
+		/* Drained the backlog, another thread got it first */
+		conn_drainedA(lconn, CONN_POLLIN);
+		conn_unlock(lconn);
+
+		log_dbg(CONN_ID " nothing to accept", conn_id(conn));
+		conn_unlock(conn);
+		return (false);
+	}
+
 	conn_unlock(lconn);
 
 	if (conn->sock == INVALID_SOCKET) {
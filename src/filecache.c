@@ -0,0 +1,309 @@
+/* Open file cache */
+
+#include <libfutil/misc.h>
+#include <libfutil/conn.h>
+#include <libfutil/filecache.h>
+
+/* FNV-1a */
+static uint32_t
+filecache_hash(const char *path);
+static uint32_t
+filecache_hash(const char *path) {
+	uint32_t h = 2166136261U;
+
+	for (; *path != '\0'; path++) {
+		h = (h ^ (uint8_t)*path) * 16777619U;
+	}
+
+	return (h);
+}
+
+bool
+filecache_init(filecache_t *fc, unsigned int max, unsigned int ttl,
+	       filecache_type_f type) {
+	uint32_t slots = 16;
+
+	memzero(fc, sizeof *fc);
+
+	/* Short chains: twice as many slots as entries */
+	while (slots < max * 2) {
+		slots *= 2;
+	}
+
+	fc->hash = mcalloc(slots * sizeof *fc->hash, "filecache");
+	if (fc->hash == NULL) {
+		log_crt("No memory for a file cache of %u", max);
+		return (false);
+	}
+
+	lock_init(&fc->lock);
+	fc->mask = slots - 1;
+	fc->max = max;
+	fc->ttl = ttl;
+	fc->type = type;
+
+	return (true);
+}
+
+void
+filecache_put(filecache_entry_t *fe) {
+	if (atomic_dec(fe->refs) != 0) {
+		return;
+	}
+
+	fassert(!fe->cached);
+
+	close(fe->fd);
+	mfree(fe, sizeof *fe + strlen(fe->path) + 1, "filecache_entry");
+}
+
+/* Take it out of the cache, the reference the cache had is the caller's */
+static void
+filecache_removeL(filecache_t *fc, filecache_entry_t *fe);
+static void
+filecache_removeL(filecache_t *fc, filecache_entry_t *fe) {
+	filecache_entry_t **p;
+
+	for (p = &fc->hash[fe->hash & fc->mask]; *p != fe; p = &(*p)->next) {
+		fassert(*p != NULL);
+	}
+
+	*p = fe->next;
+
+	if (fe->older != NULL) {
+		fe->older->newer = fe->newer;
+	} else {
+		fc->oldest = fe->newer;
+	}
+
+	if (fe->newer != NULL) {
+		fe->newer->older = fe->older;
+	} else {
+		fc->newest = fe->older;
+	}
+
+	fe->cached = false;
+	fc->n--;
+}
+
+/* Make it the most recently used one */
+static void
+filecache_touchL(filecache_t *fc, filecache_entry_t *fe);
+static void
+filecache_touchL(filecache_t *fc, filecache_entry_t *fe) {
+	if (fc->newest == fe) {
+		return;
+	}
+
+	/* Unlink, it is not the newest thus has a newer one */
+	if (fe->older != NULL) {
+		fe->older->newer = fe->newer;
+	} else {
+		fc->oldest = fe->newer;
+	}
+
+	fe->newer->older = fe->older;
+
+	/* And in front */
+	fe->older = fc->newest;
+	fe->newer = NULL;
+	fc->newest->newer = fe;
+	fc->newest = fe;
+}
+
+static void
+filecache_insertL(filecache_t *fc, filecache_entry_t *fe);
+static void
+filecache_insertL(filecache_t *fc, filecache_entry_t *fe) {
+	filecache_entry_t **slot = &fc->hash[fe->hash & fc->mask];
+
+	fe->next = *slot;
+	*slot = fe;
+
+	fe->older = fc->newest;
+	fe->newer = NULL;
+	if (fc->newest != NULL) {
+		fc->newest->newer = fe;
+	} else {
+		fc->oldest = fe;
+	}
+	fc->newest = fe;
+
+	fe->cached = true;
+	fc->n++;
+}
+
+static filecache_entry_t *
+filecache_lookupL(filecache_t *fc, const char *path, uint32_t hash);
+static filecache_entry_t *
+filecache_lookupL(filecache_t *fc, const char *path, uint32_t hash) {
+	filecache_entry_t *fe;
+
+	for (fe = fc->hash[hash & fc->mask]; fe != NULL; fe = fe->next) {
+		if (fe->hash == hash && strcmp(fe->path, path) == 0) {
+			break;
+		}
+	}
+
+	return (fe);
+}
+
+/* Is the file still the one the entry has open? */
+static bool
+filecache_same(filecache_entry_t *fe, const struct stat *st);
+static bool
+filecache_same(filecache_entry_t *fe, const struct stat *st) {
+	return ((uint64_t)st->st_ino == fe->ino &&
+		(uint64_t)st->st_size == fe->size &&
+		st->st_mtime == fe->mtime);
+}
+
+/* A new entry, not in the cache yet */
+static filecache_entry_t *
+filecache_open(filecache_t *fc, const char *path, uint32_t hash,
+	       uint64_t now);
+static filecache_entry_t *
+filecache_open(filecache_t *fc, const char *path, uint32_t hash,
+	       uint64_t now) {
+	filecache_entry_t	*fe;
+	struct stat		st;
+	uint64_t		size;
+	size_t			len = strlen(path);
+	int			fd;
+
+	/* The same checks as for any file that gets sent */
+	fd = conn_openfile(path, &size);
+	if (fd == -1) {
+		return (NULL);
+	}
+
+	fe = mcalloc(sizeof *fe + len + 1, "filecache_entry");
+	if (fe == NULL || fstat(fd, &st) == -1) {
+		log_err("Could not cache %s", path);
+		if (fe != NULL) {
+			mfree(fe, sizeof *fe + len + 1, "filecache_entry");
+		}
+		close(fd);
+		return (NULL);
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	/* It will be read from start to end, again and again */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	memcpy(fe->path, path, len + 1);
+	fe->hash = hash;
+	fe->checked = now;
+	fe->fd = fd;
+	fe->size = st.st_size;
+	fe->mtime = st.st_mtime;
+	fe->ino = st.st_ino;
+	fe->type = fc->type != NULL ? fc->type(path) : NULL;
+
+	snprintf(fe->etag, sizeof fe->etag,
+		 "\"%" PRIx64 "-%" PRIx64 "-%" PRIx64 "\"",
+		 fe->ino, fe->size, (uint64_t)fe->mtime);
+
+	return (fe);
+}
+
+filecache_entry_t *
+filecache_get(filecache_t *fc, const char *path) {
+	filecache_entry_t	*fe, *old = NULL;
+	uint32_t		hash = filecache_hash(path);
+	uint64_t		now = gettime();
+	struct stat		st;
+
+	lock_lock(&fc->lock);
+
+	fe = filecache_lookupL(fc, path, hash);
+	if (fe != NULL) {
+		filecache_touchL(fc, fe);
+		atomic_inc(fe->refs);
+		fc->hits++;
+	}
+
+	lock_unlock(&fc->lock);
+
+	if (fe != NULL) {
+		/* Recently looked at, or still the same */
+		if (now < atomic_ldr(fe->checked) + fc->ttl ||
+		    (stat(path, &st) == 0 && filecache_same(fe, &st))) {
+			atomic_st(fe->checked, now);
+			return (fe);
+		}
+
+		log_dbg("%s changed", path);
+
+		/* Out with it, unless somebody else did that already */
+		lock_lock(&fc->lock);
+		if (fe->cached) {
+			filecache_removeL(fc, fe);
+			old = fe;
+		}
+		lock_unlock(&fc->lock);
+
+		if (old != NULL) {
+			filecache_put(old);
+		}
+
+		filecache_put(fe);
+		old = NULL;
+	}
+
+	/* Not there (anymore) */
+	fe = filecache_open(fc, path, hash, now);
+	if (fe == NULL) {
+		return (NULL);
+	}
+
+	/* One for the cache, one for the caller */
+	fe->refs = 2;
+
+	lock_lock(&fc->lock);
+
+	/* Another one opened it at the same time */
+	old = filecache_lookupL(fc, path, hash);
+	if (old != NULL) {
+		atomic_inc(old->refs);
+
+		fc->hits++;
+		lock_unlock(&fc->lock);
+
+		fe->refs = 1;
+		filecache_put(fe);
+		return (old);
+	}
+
+	filecache_insertL(fc, fe);
+	fc->misses++;
+
+	/* Too many: the one not used for the longest time goes */
+	if (fc->n > fc->max) {
+		old = fc->oldest;
+		filecache_removeL(fc, old);
+	}
+
+	lock_unlock(&fc->lock);
+
+	if (old != NULL) {
+		filecache_put(old);
+	}
+
+	return (fe);
+}
+
+void
+filecache_destroy(filecache_t *fc) {
+	filecache_entry_t *fe;
+
+	/* Entries still in use go once they are let go of */
+	while ((fe = fc->oldest) != NULL) {
+		filecache_removeL(fc, fe);
+		filecache_put(fe);
+	}
+
+	mfree(fc->hash, (fc->mask + 1) * sizeof *fc->hash, "filecache");
+	lock_destroy(&fc->lock);
+}
@@ -0,0 +1,242 @@
+/* HTTP request head parser */
+
+#include <libfutil/misc.h>
+#include <libfutil/httpparse.h>
+#include <libfutil/scan.h>
+
+/* The end of a header name, anything but the ':' is wrong */
+static const scan_set_t httpparse_name_end = SCAN_SET(": \t");
+
+void
+httpparse_init(httpparse_t *p, uint32_t max) {
+	/* The header spans are only valid upto nhdrs */
+	memzero(p, offsetof(httpparse_t, hdrs));
+	p->max = max;
+}
+
+/* Split the request line in method, URI and version */
+static int
+httpparse_request(httpparse_t *p, const char *buf, uint32_t ls, uint32_t le);
+static int
+httpparse_request(httpparse_t *p, const char *buf, uint32_t ls, uint32_t le) {
+	const char *s, *e = &buf[le];
+
+	p->request.off = ls;
+	p->request.len = le - ls;
+
+	s = memchr(&buf[ls], ' ', le - ls);
+	if (s == NULL || s == &buf[ls]) {
+		return (HTTPPARSE_BAD);
+	}
+
+	p->method.off = ls;
+	p->method.len = (s - buf) - ls;
+
+	p->uri.off = ++s - buf;
+	s = memchr(s, ' ', e - s);
+	if (s == NULL) {
+		s = e;
+	}
+
+	p->uri.len = (s - buf) - p->uri.off;
+	if (p->uri.len == 0) {
+		return (HTTPPARSE_BAD);
+	}
+
+	if (s < e) {
+		s++;
+	}
+
+	p->version.off = s - buf;
+	p->version.len = e - s;
+
+	return (HTTPPARSE_MORE);
+}
+
+/* Record a 'name: value' line */
+static int
+httpparse_header(httpparse_t *p, const char *buf, uint32_t ls, uint32_t le);
+static int
+httpparse_header(httpparse_t *p, const char *buf, uint32_t ls, uint32_t le) {
+	httpparse_hdr_t	*h;
+	const char	*s, *c, *e = &buf[le];
+
+	/* Folded continuation of the previous header */
+	if (buf[ls] == ' ' || buf[ls] == '\t') {
+		return (HTTPPARSE_BAD);
+	}
+
+	/* No whitespace in (or behind) the name */
+	c = scan_set(&httpparse_name_end, &buf[ls], e);
+	if (c == NULL || *c != ':' || c == &buf[ls]) {
+		return (HTTPPARSE_BAD);
+	}
+
+	if (p->nhdrs == lengthof(p->hdrs)) {
+		return (HTTPPARSE_TOOLARGE);
+	}
+
+	for (s = c + 1; s < e && (*s == ' ' || *s == '\t'); s++);
+	for (; e > s && (e[-1] == ' ' || e[-1] == '\t'); e--);
+
+	h = &p->hdrs[p->nhdrs++];
+	h->name.off = ls;
+	h->name.len = (c - buf) - ls;
+	h->value.off = s - buf;
+	h->value.len = e - s;
+
+	return (HTTPPARSE_MORE);
+}
+
+int
+httpparse_run(httpparse_t *p, const char *buf, uint32_t len) {
+	const char	*s;
+	uint32_t	ls, le;
+	int		i;
+
+	while (true) {
+		s = scan_find2(&buf[p->off], &buf[len], '\n', '\0');
+		if (s == NULL) {
+			/* Nothing new in there, continue behind it next time */
+			p->off = len;
+			break;
+		}
+
+		if (*s == '\0') {
+			return (HTTPPARSE_BAD);
+		}
+
+		/* The line without the LF and the CR(s) before it */
+		ls = p->line;
+		le = s - buf;
+		p->off = p->line = le + 1;
+
+		if (p->off > p->max) {
+			break;
+		}
+
+		while (le > ls && buf[le - 1] == '\r') {
+			le--;
+		}
+
+		if (p->request.len == 0) {
+			/* Stray empty lines before the request */
+			if (le == ls) {
+				continue;
+			}
+
+			i = httpparse_request(p, buf, ls, le);
+		} else if (le == ls) {
+			/* Empty line: the end of the head */
+			return (p->off);
+		} else {
+			i = httpparse_header(p, buf, ls, le);
+		}
+
+		if (i != HTTPPARSE_MORE) {
+			return (i);
+		}
+	}
+
+	if (p->off <= p->max) {
+		return (HTTPPARSE_MORE);
+	}
+
+	return (p->request.len == 0 ? HTTPPARSE_URITOOLONG :
+		HTTPPARSE_TOOLARGE);
+}
+
+/* Digits at s, false when there are none or too many */
+static bool
+httpparse_num(const char **s, uint64_t *v);
+static bool
+httpparse_num(const char **s, uint64_t *v) {
+	const char *c = *s;
+
+	for (*v = 0; *c >= '0' && *c <= '9'; c++) {
+		if (*v > (UINT64_MAX - 9) / 10) {
+			return (false);
+		}
+
+		*v = *v * 10 + (*c - '0');
+	}
+
+	if (c == *s) {
+		return (false);
+	}
+
+	*s = c;
+	return (true);
+}
+
+int
+httpparse_range(const char *value, uint64_t size, uint64_t *off,
+		uint64_t *len) {
+	const char	*s = value;
+	uint64_t	first, last = UINT64_MAX;
+
+	*off = 0;
+	*len = size;
+
+	/* One range of bytes, the rest we do not do */
+	if (s == NULL || strncasecmp(s, "bytes=", 6) != 0 ||
+	    strchr(s, ',') != NULL) {
+		return (200);
+	}
+
+	for (s += 6; *s == ' ' || *s == '\t'; s++);
+
+	if (*s == '-') {
+		/* The last bytes */
+		s++;
+		if (!httpparse_num(&s, &last)) {
+			return (200);
+		}
+
+		first = last < size ? size - last : 0;
+		last = size - 1;
+	} else {
+		if (!httpparse_num(&s, &first) || *s++ != '-') {
+			return (200);
+		}
+
+		/* Without the last one it is upto the end */
+		if (*s >= '0' && *s <= '9' &&
+		    (!httpparse_num(&s, &last) || last < first)) {
+			return (200);
+		}
+	}
+
+	for (; *s == ' ' || *s == '\t'; s++);
+	if (*s != '\0') {
+		return (200);
+	}
+
+	if (first >= size) {
+		return (HTTPPARSE_BADRANGE);
+	}
+
+	if (last >= size) {
+		last = size - 1;
+	}
+
+	*off = first;
+	*len = last - first + 1;
+
+	return (206);
+}
+
+int
+httpparse_find(const httpparse_t *p, const char *buf,
+	       const char *name, unsigned int len) {
+	unsigned int i;
+
+	for (i = 0; i < p->nhdrs; i++) {
+		if (p->hdrs[i].name.len == len &&
+		    strncasecmp(&buf[p->hdrs[i].name.off], name, len) == 0) {
+			return (i);
+		}
+	}
+
+	return (-1);
+}
@@ -4,13 +4,34 @@
 #include <libfutil/conn.h>
 #include <libfutil/httpsrv.h>
 
-/*
- * XXX: Disconnect idle connections if they are idle too long
- */
-
 /* Internal. */
 
-#define HTTPH(h) offsetof(httpsrv_headers_t, h), sizeof (((httpsrv_headers_t *)NULL)->h)
+/* Queue slots per worker (executor) */
+#define HTTPSRV_WORKQ 1024
+
+/* Answers a batch of pipelined requests queues up before writing them */
+#define HTTPSRV_BATCH_MAX (64*1024)
+
+/* Default deadlines (msec), see httpsrv_set_timeouts() */
+#define HTTPSRV_TIMEOUT_IDLE	(60 * 1000)
+#define HTTPSRV_TIMEOUT_HEAD	(20 * 1000)
+#define HTTPSRV_TIMEOUT_WRITE	(60 * 1000)
+
+/* What the deadline of a client is for */
+typedef enum {
+	HTTPSRV_DEADLINE_NONE = 0,	/* The application has it */
+	HTTPSRV_DEADLINE_IDLE,		/* The next request */
+	HTTPSRV_DEADLINE_HEAD,		/* The rest of the request head */
+	HTTPSRV_DEADLINE_BODY,		/* More of the body */
+	HTTPSRV_DEADLINE_WRITE		/* The socket taking the answer */
+} httpsrv_deadline_t;
+
+/* Files httpsrv_sendfile() keeps open, seconds before looking again */
+#define HTTPSRV_FILES_MAX 1024
+#define HTTPSRV_FILES_TTL 1
+
+/* Slice in the headers, pointing at the value in the copy of the head */
+#define HTTPH(h) offsetof(httpsrv_headers_t, h), 0
 
 /* We ignore the Content-Length header, this avoids multiple matches */
 #define HTTPH_CONTENT_LENGTH 0
@@ -50,6 +71,73 @@ httpsrv_methodname(unsigned int method) {
 	return (http_methods[method].name);
 }
 
+/* Method of a request line, HTTP_M_NONE when we do not know it */
+static http_method_t
+httpsrv_method(const char *name, unsigned int len);
+static http_method_t
+httpsrv_method(const char *name, unsigned int len) {
+	unsigned int m;
+
+	for (m = 1; m < lengthof(http_methods); m++) {
+		/* Only the ones of the same length need a compare */
+		if (http_methods[m].len == len &&
+		    strncasecmp(name, http_methods[m].name, len) == 0) {
+			return (m);
+		}
+	}
+
+	return (HTTP_M_NONE);
+}
+
+const char *
+httpsrv_header(httpsrv_client_t *hcl, const char *name) {
+	int i;
+
+	if (hcl->parse == NULL) {
+		return (NULL);
+	}
+
+	i = httpparse_find(hcl->parse, &hcl->strs[1], name, strlen(name));
+	if (i < 0) {
+		return (NULL);
+	}
+
+	return (&hcl->strs[1 + hcl->parse->hdrs[i].value.off]);
+}
+
+buf_t *
+httpsrv_rawheaders(httpsrv_client_t *hcl) {
+	httpparse_t	*p = hcl->parse;
+	httpparse_hdr_t	*h;
+	const char	*head;
+	unsigned int	n;
+
+	buf_lock(&hcl->the_headers);
+
+	/* Only built when somebody asks for them */
+	if (buf_cur(&hcl->the_headers) == 0 && p != NULL) {
+		head = &hcl->strs[1];
+
+		for (n = 0; n < p->nhdrs; n++) {
+			h = &p->hdrs[n];
+
+			if (misc_map_label(&head[h->name.off], h->name.len,
+					   httpsrv_headers) ==
+			    HTTPH_CONTENT_LENGTH) {
+				continue;
+			}
+
+			buf_putl(&hcl->the_headers, &head[h->name.off],
+				 h->value.off + h->value.len - h->name.off);
+			buf_putl(&hcl->the_headers, "\r\n", 2);
+		}
+	}
+
+	buf_unlock(&hcl->the_headers);
+
+	return (&hcl->the_headers);
+}
+
 void
 httpsrv_set_userdata(httpsrv_client_t *hcl, void *user) {
 	log_dbg(
@@ -86,6 +174,158 @@ httpsrv_close(httpsrv_client_t *hcl) {
 	hcl->close = true;
 }
 
+void
+httpsrv_set_timeouts(httpsrv_t *hs, unsigned int idle,
+		     unsigned int head, unsigned int write) {
+	hs->timeout_idle = idle;
+	hs->timeout_head = head;
+	hs->timeout_write = write;
+}
+
+/*
+ * Set the deadline for what the client is up to now. Those that only
+ * start (idle, head) are only armed once per request, the others are
+ * pushed out as long as something happens.
+ */
+static void
+httpsrv_deadline(httpsrv_client_t *hcl);
+static void
+httpsrv_deadline(httpsrv_client_t *hcl) {
+	httpsrv_t	*hs = hcl->hs;
+	uint64_t	mark = hcl->reqid, left = conn_flushleft(&hcl->conn);
+	unsigned int	msec;
+	uint8_t		what;
+
+	if (left > 0) {
+		/* The answer has to go out, again only once some went */
+		what = HTTPSRV_DEADLINE_WRITE;
+		msec = hs->timeout_write;
+		mark = left;
+
+		if (hcl->deadline == what && left >= hcl->deadline_mark) {
+			return;
+		}
+	} else if (hcl->skipbody_len || hcl->bodyfwd || hcl->readbody) {
+		/* The body has to keep coming */
+		what = HTTPSRV_DEADLINE_BODY;
+		msec = hs->timeout_idle;
+	} else if (hcl->method != HTTP_M_NONE) {
+		/* The application is answering, it takes as long as it takes */
+		what = HTTPSRV_DEADLINE_NONE;
+		msec = 0;
+
+		if (hcl->deadline == what) {
+			return;
+		}
+	} else {
+		/* Waiting for (the rest of) a request */
+		if (hcl->reqid == 0 || !conn_buffer_isempty(&hcl->conn)) {
+			what = HTTPSRV_DEADLINE_HEAD;
+			msec = hs->timeout_head;
+		} else {
+			what = HTTPSRV_DEADLINE_IDLE;
+			msec = hs->timeout_idle;
+		}
+
+		if (hcl->deadline == what && hcl->deadline_mark == mark) {
+			return;
+		}
+	}
+
+	hcl->deadline = what;
+	hcl->deadline_mark = mark;
+
+	conn_deadline(&hcl->conn, msec);
+}
+
+/* Empty the request block for the next request */
+static void
+httpsrv_req_reset(httpsrv_client_t *hcl);
+static void
+httpsrv_req_reset(httpsrv_client_t *hcl) {
+	httpparse_init(hcl->parse, HTTPSRV_HEAD_LEN);
+
+	/* Offset 0 is the empty string of slices that are not set */
+	hcl->strs[0] = '\0';
+	hcl->strs_len = 1;
+	hcl->the_request = hcl->strs;
+}
+
+/* Get a request block for reading a request */
+static bool
+httpsrv_req_get(httpsrv_client_t *hcl);
+static bool
+httpsrv_req_get(httpsrv_client_t *hcl) {
+	if (hcl->parse != NULL) {
+		return (true);
+	}
+
+	hcl->parse = pool_get(&hcl->hs->requests);
+	if (hcl->parse == NULL) {
+		return (false);
+	}
+
+	hcl->strs = (char *)&hcl->parse[1];
+	httpsrv_req_reset(hcl);
+	return (true);
+}
+
+/* Give the request block back */
+static void
+httpsrv_req_put(httpsrv_client_t *hcl);
+static void
+httpsrv_req_put(httpsrv_client_t *hcl) {
+	pool_put(&hcl->hs->requests, hcl->parse);
+	hcl->parse = NULL;
+	hcl->the_request = NULL;
+	hcl->strs = NULL;
+	hcl->strs_len = 0;
+}
+
+/* Room for a string of up to len (with the NUL), NULL when full */
+static char *
+httpsrv_strs_reserve(httpsrv_client_t *hcl, httpsrv_slice_t *sl,
+		     unsigned int len);
+static char *
+httpsrv_strs_reserve(httpsrv_client_t *hcl, httpsrv_slice_t *sl,
+		     unsigned int len) {
+	char *s;
+
+	if (hcl->strs == NULL || len > HTTPSRV_STRS_LEN - hcl->strs_len) {
+		return (NULL);
+	}
+
+	s = &hcl->strs[hcl->strs_len];
+	s[0] = '\0';
+
+	sl->off = hcl->strs_len;
+	sl->len = 0;
+	hcl->strs_len += len;
+
+	return (s);
+}
+
+/* Copy a string in, NULL when full */
+static char *
+httpsrv_strs_add(httpsrv_client_t *hcl, httpsrv_slice_t *sl,
+		 const char *str, unsigned int len);
+static char *
+httpsrv_strs_add(httpsrv_client_t *hcl, httpsrv_slice_t *sl,
+		 const char *str, unsigned int len) {
+	char *s;
+
+	s = httpsrv_strs_reserve(hcl, sl, len + 1);
+	if (s == NULL) {
+		return (NULL);
+	}
+
+	memcpy(s, str, len);
+	s[len] = '\0';
+	sl->len = len;
+
+	return (s);
+}
+
 void
 httpsrv_client_destroy(httpsrv_client_t *hcl) {
 	/* Destroy the connection */
@@ -94,7 +334,9 @@ httpsrv_client_destroy(httpsrv_client_t *hcl) {
 	/* Cleanup the headers */
 	buf_destroy(&hcl->the_headers);
 
-	mfree(hcl, sizeof *hcl, "httpsrv_client_t");
+	httpsrv_req_put(hcl);
+
+	pool_put(&hcl->hs->clients, hcl);
 }
 
 bool
@@ -131,32 +373,17 @@ static void
 httpsrv_http_headertime(httpsrv_client_t *hcl, const char *header, time_t t);
 static void
 httpsrv_http_headertime(httpsrv_client_t *hcl, const char *header, time_t t) {
-	static const char days[7][4] =
-			{ "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
-	static const char mons[12][4] =
-			{ "Jan", "Feb", "Mar", "Apr", "May", "Jun",
-			  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
-	struct tm	tm;
+	char date[CLK_HTTP_LEN];
 
-	gmtime_r(&t, &tm);
-
-	conn_addheaderf(&hcl->conn,
-			"%s: %s, %u %s %u %u:%u:%u GMT",
-			header,
-			days[tm.tm_wday],
-			tm.tm_mday,
-			mons[tm.tm_mon],
-			tm.tm_year + 1900,
-			tm.tm_hour,
-			tm.tm_min,
-			tm.tm_sec);
+	clk_http(t, date);
+	conn_addheaderf(&hcl->conn, "%s: %s", header, date);
 }
 
 void
 httpsrv_expire(httpsrv_client_t *hcl, unsigned int maxage) {
 	time_t		t;
 
-	t = time(NULL);
+	t = gettime();
 
 	if (maxage == 0)
 	{
@@ -198,7 +425,7 @@ void
 httpsrv_answer(httpsrv_client_t *hcl, unsigned int code, const char *msg, const char *ctype) {
 	conn_addheaderf(&hcl->conn, "HTTP/1.1 %u %s", code, msg);
 
-	if (code != 200) {
+	if (code >= 400) {
 		log_err(
 			HCL_ID " " CONN_ID " HTTP Error %u %s",
 			hcl->id, conn_id(&hcl->conn), code, msg);
@@ -245,7 +472,7 @@ httpsrv_handle_http_skipbody(httpsrv_client_t *hcl) {
 	if (len == 0) {
 		/* Try to get more */
 		i = conn_recv(&hcl->conn);
-		if (i == 0) {
+		if (i <= 0) {
 			/* Try at another time */
 			connset_handling_done(&hcl->conn, false);
 			return (true);
@@ -317,7 +544,7 @@ httpsrv_handle_http_bodyfwd(httpsrv_client_t *hcl) {
 			i);
 
 		if (i < 0) {
-			return (-1);
+			return (true);
 		}
 
 		if (i == 0) {
@@ -326,7 +553,7 @@ httpsrv_handle_http_bodyfwd(httpsrv_client_t *hcl) {
 			/* Get more details */
 			connset_handling_done(&hcl->conn, false);
 
-			return (0);
+			return (true);
 		}
 	}
 
@@ -352,7 +579,9 @@ httpsrv_handle_http_bodyfwd(httpsrv_client_t *hcl) {
 			hcl->bodyfwd->id,
 			conn_id(&hcl->bodyfwd->conn),
 			hcl->bodyfwd_len);
-		return (1);
+
+		/* Forward some more */
+		return (false);
 	}
 
 	/* Done */
@@ -386,7 +615,7 @@ httpsrv_handle_http_bodyfwd(httpsrv_client_t *hcl) {
 
 	/* Done with this for now */
 	httpsrv_done(hcl);
-	return (1);
+	return (true);
 }
 
 static bool
@@ -395,14 +624,14 @@ static bool
 httpsrv_handle_http_readbody(httpsrv_client_t *hcl) {
 	uint64_t	len;
 	int		i;
-	bool		done;
+	bool		UNUSED done;	/* Only logged */
 
 	len = conn_buffer_cur(&hcl->conn);
 
 	if (len == 0) {
 		/* Try to get more */
 		i = conn_recv(&hcl->conn);
-		if (i == 0) {
+		if (i <= 0) {
 			/* Try at another time */
 			return (true);
 		}
@@ -459,229 +688,292 @@ httpsrv_handle_http_readbody(httpsrv_client_t *hcl) {
 			HCL_ID " handling body complete (done:%s)",
 			hcl->id, yesno(done));
 
-		if (done) {
-			return (true);
-		}
+		/* Either way the handler has it now */
+		return (true);
 	}
 
 	return (false);
 }
 
-static void
-httpsrv_handle_http(httpsrv_client_t *hcl);
-static void
-httpsrv_handle_http(httpsrv_client_t *hcl) {
+/* Parse what came in of the request head, > 0 once it is complete */
+static int
+httpsrv_handle_http_head(httpsrv_client_t *hcl);
+static int
+httpsrv_handle_http_head(httpsrv_client_t *hcl) {
+	buf_t	*recv = &hcl->conn.recv;
+	int	i = HTTPPARSE_MORE;
+
+	buf_lock(recv);
+
+	/* Only scans what came in since the last time */
+	if (buf_cur(recv) > 0) {
+		i = httpparse_run(hcl->parse, buf_buffer(recv), buf_cur(recv));
+	}
+
+	if (i > 0) {
+		/*
+		 * The body is read from the front of the receive buffer,
+		 * thus the head moves out in one go; the offsets the parser
+		 * found stay the same in the copy.
+		 */
+		fassert((unsigned int)i < HTTPSRV_STRS_LEN);
+		memcpy(&hcl->strs[1], buf_buffer(recv), i);
+		buf_shift(recv, i);
+		hcl->strs_len = 1 + i;
+	}
+
+	buf_unlock(recv);
+
+	return (i);
+}
+
+/* Take the parsed head in use, false when it got refused */
+static bool
+httpsrv_handle_http_request(httpsrv_client_t *hcl);
+static bool
+httpsrv_handle_http_request(httpsrv_client_t *hcl) {
+	httpparse_t	*p = hcl->parse;
+	httpparse_hdr_t	*h;
+	httpsrv_slice_t	*sl;
+	char		*head = &hcl->strs[1];
+	unsigned int	n;
 	int		i;
-	unsigned int	l, m;
-	uint32_t	t32;
-	uint64_t	t64, len;
-	bool		done;
+
+	hcl->the_request = &head[p->request.off];
+	hcl->the_request[p->request.len] = '\0';
 
 	log_dbg(
-		HCL_ID " " CONN_ID ", "
-		"skip: %" PRIu64 ", "
-		"fwdb:%" PRIu64 ", "
-		"read:%" PRIu64,
-		hcl->id, conn_id(&hcl->conn),
-		hcl->skipbody_len,
-		hcl->bodyfwd_len,
-		hcl->readbody_len);
+		HCL_ID " got request (len=%u, headers=%u) : %s",
+		hcl->id, p->request.len, p->nhdrs, hcl->the_request);
 
-	/* As long as we got lines parse them */
-	while (true) {
-		if (hcl->skipbody_len) {
-			/* Skip over the body? */
-			i = httpsrv_handle_http_skipbody(hcl);
-		} else if (hcl->bodyfwd) {
-			/* Forwarding the body? */
-			i = httpsrv_handle_http_bodyfwd(hcl);
-		} else if (hcl->readbody) {
-			/* Read in the buffer? */
-			i = httpsrv_handle_http_readbody(hcl);
-		} else {
-			/* There should be something in this buffer */
-			i = conn_recvline(&hcl->conn, hcl->line, sizeof hcl->line);
-			if (i == -EINVAL) {
-				httpsrv_error(hcl, 400,
-					      "ASCII NUL character found in stream");
+	hcl->method = httpsrv_method(&head[p->method.off], p->method.len);
+	if (hcl->method == HTTP_M_NONE) {
+		log_ntc(
+			HCL_ID " Unknown HTTP: %s",
+			hcl->id, hcl->the_request);
 
-				log_err(
-					HCL_ID " ASCII NULL found, closing",
-					hcl->id);
+		httpsrv_error(hcl, 501, "Not Implemented");
+		return (false);
+	}
 
-				/* Close it up */
-				httpsrv_close(hcl);
-				return;
-			}
-		}
+	if (p->request.len >= HTTPSRV_LINE_LEN) {
+		log_ntc(
+			HCL_ID " Request Too Big: %s",
+			hcl->id, hcl->the_request);
 
-		if (i < 0) {
-			log_err(
-				HCL_ID " Receive line problem (%d), closing",
-				hcl->id, i);
+		httpsrv_error(hcl, 414, "Request-URI Too Long");
+		return (false);
+	}
 
-			/* Close it up */
-			httpsrv_close(hcl);
-			return;
+	for (n = 0; n < p->nhdrs; n++) {
+		h = &p->hdrs[n];
 
-		} else if (i == 0) {
-			log_dbg(
-				HCL_ID " " CONN_ID " No new line yet",
-				hcl->id,
-				conn_id(&hcl->conn));
-
-			/* Dump what we got */
-			len = conn_buffer_cur(&hcl->conn);
-			if (len > 0) {
-				debugpacket((uint8_t *)conn_buffer(&hcl->conn),
-					    len);
-			}
+		/* Terminates both the value and the line */
+		head[h->value.off + h->value.len] = '\0';
 
-			/* Nothing left */
-			return;
+		/* Map the header to values that we look for */
+		i = misc_map_label(&head[h->name.off], h->name.len,
+				   httpsrv_headers);
+		if (i >= 0) {
+			sl = (httpsrv_slice_t *)((char *)&hcl->headers +
+						 httpsrv_headers[i].offset);
+			sl->off = 1 + h->value.off;
+			sl->len = h->value.len;
 		}
 
-		l = i;
+		/* Does the caller want headers? */
+		if (hcl->hs->header) {
+			hcl->hs->header(hcl, hcl->user, &head[h->name.off]);
+		}
+	}
 
-		/* Empty line == end of command */
-		if (l == 1 && hcl->line[0] == '\n') {
-			log_dbg(
-				HCL_ID " Got an empty line",
-				hcl->id);
+	return (true);
+}
 
-			/* Stray \n, ignore it */
-			if (strlen(hcl->the_request) == 0) {
-				continue;
-			}
+/* Read and handle the next request, false when the caller should go on */
+static bool
+httpsrv_handle_http_next(httpsrv_client_t *hcl);
+static bool
+httpsrv_handle_http_next(httpsrv_client_t *hcl) {
+	int		i;
+	uint64_t	t64, len;
+	bool		UNUSED done;	/* Only logged */
 
-			/*
-			 * Note: for POST we read in the body when the caller wants it
-			 * If it is not read we read it in at 'done' time
-			 */
+	if (!httpsrv_req_get(hcl)) {
+		log_crt(
+			HCL_ID " No memory for the request",
+			hcl->id);
 
-			/* Convert the port number strings into numbers */
-			if (sscanf(hcl->headers.local_port_s, "%u", &t32) == 1 &&
-				t32 != 0) {
-				hcl->headers.local_port = t32;
-			} else {
-				log_dbg(
-					HCL_ID " No Local Port found",
-					hcl->id);
-			}
+		/* Close it up */
+		httpsrv_close(hcl);
+		return (true);
+	}
 
-			if (sscanf(hcl->headers.remote_port_s, "%u", &t32) == 1 &&
-				t32 != 0) {
-				hcl->headers.remote_port = t32;
-			} else {
-				log_dbg(
-					HCL_ID " No Remote Port found",
-					hcl->id);
-			}
+	i = httpsrv_handle_http_head(hcl);
+	if (i != HTTPPARSE_MORE && !conn_seal(&hcl->conn)) {
+		/* The answer before this one can't be kept */
+		httpsrv_close(hcl);
+		return (true);
+	}
 
-			/* Post? Requires a content-length */
-			if (hcl->method == HTTP_M_POST) {
-				if (sscanf(hcl->headers.content_length_s,
-					   "%" PRIu64, &t64) == 1) {
-					hcl->headers.content_length = t64;
-				} else {
-					log_wrn(
-						HCL_ID
-						" POST without Content-Length",
-						hcl->id);
-
-					httpsrv_error(hcl, 400,
-						"POST without Content-Length");
-					httpsrv_close(hcl);
-				}
-			}
+	if (i == HTTPPARSE_MORE) {
+		log_dbg(
+			HCL_ID " " CONN_ID " Request not complete yet",
+			hcl->id,
+			conn_id(&hcl->conn));
 
-			/* Another request fed in */
-			hcl->reqid++;
+		/* Dump what we got */
+		len = conn_buffer_cur(&hcl->conn);
+		if (len > 0) {
+			debugpacket((uint8_t *)conn_buffer(&hcl->conn),
+				    len);
+		}
 
-			/* Process it */
-			fassert(hcl->hs->handle != NULL);
+		/* Nothing left */
+		return (true);
 
-			log_dbg(
-				HCL_ID " handling",
-				hcl->id);
+	} else if (i < 0) {
+		log_ntc(
+			HCL_ID " Broken request (%d), closing",
+			hcl->id, -i);
 
-			done = hcl->hs->handle(hcl, hcl->user);
+		httpsrv_error(hcl, -i,
+			      i == HTTPPARSE_URITOOLONG ?
+			      "Request-URI Too Long" :
+			      i == HTTPPARSE_TOOLARGE ?
+			      "Request Header Fields Too Large" :
+			      "Bad Request");
 
-			log_dbg(
-				HCL_ID " handling complete (done: %s)",
-				hcl->id, yesno(done));
+		/* Close it up */
+		httpsrv_close(hcl);
+		return (true);
+	}
 
-			/* Next */
-			if (done)
-				return;
-			else
-				continue;
-		}
+	if (!httpsrv_handle_http_request(hcl)) {
+		httpsrv_close(hcl);
+		return (true);
+	}
 
-		/* Remove trailing \n */
-		hcl->line[--l] = '\0';
+	/*
+	 * Note: for POST we read in the body when the caller wants it
+	 * If it is not read we read it in at 'done' time
+	 */
 
-		log_dbg(
-			HCL_ID" got line (len=%u) : %s",
-			hcl->id, l, hcl->line);
-
-		/* No method yet? */
-		if (hcl->method == HTTP_M_NONE) {
-			for (m = 1; m < lengthof(http_methods); m++) {
-				if (strncasecmp(hcl->line, http_methods[m].name,
-						http_methods[m].len) != 0 ||
-				    hcl->line[http_methods[m].len] != ' ') {
-					continue;
-				}
+	/* Post? Requires a content-length */
+	if (hcl->method == HTTP_M_POST) {
+		if (sscanf(httpsrv_str(hcl, hcl->headers.content_length_s),
+			   "%" PRIu64, &t64) == 1) {
+			hcl->headers.content_length = t64;
+		} else {
+			log_wrn(
+				HCL_ID " POST without Content-Length",
+				hcl->id);
 
-				hcl->method = m;
-				break;
-			}
+			httpsrv_error(hcl, 400, "POST without Content-Length");
+			httpsrv_close(hcl);
+		}
+	}
 
-			if (hcl->method == HTTP_M_NONE) {
-				log_ntc(
-					HCL_ID " Unknown HTTP: %s",
-					hcl->id, hcl->line);
+	/* Another request fed in */
+	hcl->reqid++;
 
-				httpsrv_error(hcl, 501, "Not Implemented");
-				httpsrv_close(hcl);
-				return;
-			}
+	/* Process it */
+	fassert(hcl->hs->handle != NULL);
 
-			if (l >= sizeof hcl->the_request) {
-				log_ntc(
-					HCL_ID " Request Too Big: %s",
-					hcl->id, hcl->line);
+	log_dbg(
+		HCL_ID " handling",
+		hcl->id);
 
-				httpsrv_error(hcl, 414, "Request-URI Too Long");
-				httpsrv_close(hcl);
-				return;
-			}
+	done = hcl->hs->handle(hcl, hcl->user);
 
-			/* Store the request for later parsing */
-			memcpy(hcl->the_request, hcl->line, l);
-			hcl->the_request[l] = '\0';
-			continue;
-		}
+	log_dbg(
+		HCL_ID " handling complete (done: %s)",
+		hcl->id, yesno(done));
 
-		/* Map the header to values that we look for */
-		i = misc_map(hcl->line, httpsrv_headers, (char *)&hcl->headers);
+	/* Answered already? Then go on with the next one */
+	return (hcl->method != HTTP_M_NONE);
+}
 
-		/* Everything but Content-Length goes in to the raw headers */
-		if (i != HTTPH_CONTENT_LENGTH) {
-			buf_lock(&hcl->the_headers);
-			buf_putl(&hcl->the_headers, hcl->line, l);
-			buf_putl(&hcl->the_headers, "\r\n", 2);
-			buf_unlock(&hcl->the_headers);
+static void
+httpsrv_handle_http(httpsrv_client_t *hcl);
+static void
+httpsrv_handle_http(httpsrv_client_t *hcl) {
+	bool done;
+
+	log_dbg(
+		HCL_ID " " CONN_ID ", "
+		"skip: %" PRIu64 ", "
+		"fwdb:%" PRIu64 ", "
+		"read:%" PRIu64,
+		hcl->id, conn_id(&hcl->conn),
+		hcl->skipbody_len,
+		hcl->bodyfwd_len,
+		hcl->readbody_len);
+
+	/* As long as there is something to do for this request */
+	while (true) {
+		if (hcl->close) {
+			/* Going away, nothing of it is handled anymore */
+			done = true;
+		} else if (hcl->skipbody_len) {
+			/* Skip over the body? */
+			done = httpsrv_handle_http_skipbody(hcl);
+		} else if (hcl->bodyfwd) {
+			/* Forwarding the body? */
+			done = httpsrv_handle_http_bodyfwd(hcl);
+		} else if (hcl->readbody) {
+			/* Read in the buffer? */
+			done = httpsrv_handle_http_readbody(hcl);
+		} else if (hcl->method != HTTP_M_NONE) {
+			/* Still busy, httpsrv_done() gets the next request */
+			done = true;
+		} else if (conn_buffer_isempty(&hcl->conn)) {
+			/* Nothing (more) came in */
+			done = true;
+		} else if (conn_flushleft(&hcl->conn) > HTTPSRV_BATCH_MAX) {
+			/* The answers have to go out first */
+			done = true;
+		} else {
+			done = httpsrv_handle_http_next(hcl);
 		}
 
-		/* Does the caller want headers? */
-		if (hcl->hs->header) {
-			hcl->hs->header(hcl, hcl->user, hcl->line);
+		/* Until the next time */
+		if (done) {
+			return;
 		}
 	}
 }
 
+/*
+ * Handle the requests that came in as one batch: the answers are queued
+ * up behind each other (files included) and written with one flush.
+ * Stops when the queue gets too large, httpsrv_worker_thread() goes on
+ * once that has been written.
+ */
+static void
+httpsrv_handle_batch(httpsrv_client_t *hcl);
+static void
+httpsrv_handle_batch(httpsrv_client_t *hcl) {
+	hcl->batch = true;
+
+	do {
+		httpsrv_handle_http(hcl);
+
+		/* Nothing got answered */
+		if (conn_flushleft(&hcl->conn) == 0) {
+			break;
+		}
+
+		conn_flush(&hcl->conn);
+
+	/* All of it went out and there is more? */
+	} while (!hcl->close && hcl->method == HTTP_M_NONE &&
+		 !conn_buffer_isempty(&hcl->conn) &&
+		 conn_flushleft(&hcl->conn) == 0);
+
+	hcl->batch = false;
+}
+
 void
 httpsrv_done(httpsrv_client_t *hcl) {
 	fassert(hcl->keephandling == false);
@@ -704,28 +996,35 @@ httpsrv_done(httpsrv_client_t *hcl) {
 	if (hcl->hs->done)
 		hcl->hs->done(hcl, hcl->user);
 
-	/*
-	 * Flush the output buffer
-	 * We do not care if the flush is complete,
-	 * that will happen in the livetime of it
-	 */
-	conn_flush(&hcl->conn);
-
 	/* No method yet */
 	hcl->method = HTTP_M_NONE;
 
 	/* Last activity */
 	hcl->lastact = gettime();
 
-	/* Empty Request */
-	memzero(&hcl->the_request, sizeof hcl->the_request);
-
 	/* Clear incoming parsed header state */
 	memzero(&hcl->headers, sizeof hcl->headers);
 
 	/* Empty raw headers */
 	buf_emptyL(&hcl->the_headers);
 
+	/*
+	 * Empty Request, the request block is only kept while there is
+	 * more (pipelined) input: idle connections drop everything but
+	 * the httpsrv_client_t itself.
+	 */
+	if (conn_buffer_cur(&hcl->conn) > 0 && hcl->parse != NULL) {
+		httpsrv_req_reset(hcl);
+	} else {
+		httpsrv_req_put(hcl);
+
+		buf_lock(&hcl->the_headers);
+		buf_release(&hcl->the_headers);
+		buf_unlock(&hcl->the_headers);
+
+		conn_release(&hcl->conn);
+	}
+
 	/* Reset */
 	hcl->close = false;
 	hcl->keephandling = false;
@@ -734,28 +1033,28 @@ httpsrv_done(httpsrv_client_t *hcl) {
 	fassert(hcl->bodyfwd == NULL && hcl->bodyfwd_len == 0);
 
 	/*
-	 * This cl connection is now ready for the next request
-	 * which could be in the buffer already due to HTTP pipelining
-	 *
-	 * Thus try to parse more lines if there are more already
+	 * Done while handling a batch: that goes on with the next
+	 * (pipelined) request and flushes the answers in one go
 	 */
-	if (!(conn_buffer_isempty(&hcl->conn))) {
-		log_dbg(
-			HCL_ID " " CONN_ID " has data in receive buffer",
-			hcl->id, conn_id(&hcl->conn));
-
-		httpsrv_handle_http(hcl);
-	} else {
+	if (hcl->batch) {
 		log_dbg(
-			HCL_ID " " CONN_ID " has nothing queued",
+			HCL_ID " " CONN_ID " answer queued",
 			hcl->id, conn_id(&hcl->conn));
+		return;
 	}
 
+	/*
+	 * Done on its own (asynchronously): flush the answer, together
+	 * with those of the requests that were pipelined behind it
+	 */
+	httpsrv_handle_batch(hcl);
+
 	log_dbg(
 		HCL_ID " " CONN_ID " re-enabling events",
 		hcl->id, conn_id(&hcl->conn));
 
 	/* Tell it to try to output (flush) */
+	httpsrv_deadline(hcl);
 	conn_events(&hcl->conn, CONN_POLLIN | CONN_POLLOUT);
 
 	log_dbg(
@@ -788,12 +1087,12 @@ httpsrv_arg_find(httpsrv_argl_t *args, const char *name) {
 
 /* Need to do this in the middle and at the end */
 static void
-httpsrv_parse_requestA(	httpsrv_client_t *hcl, unsigned int *ao_,
+httpsrv_parse_requestA(	char *argsplit, unsigned int *ao_,
 			httpsrv_argl_t *args, httpsrv_argl_t **arg_,
 			const char **var_, const char **val_,
 			unsigned int *argc_mine_);
 static void
-httpsrv_parse_requestA(	httpsrv_client_t *hcl, unsigned int *ao_,
+httpsrv_parse_requestA(	char *argsplit, unsigned int *ao_,
 			httpsrv_argl_t *args, httpsrv_argl_t **arg_,
 			const char **var_, const char **val_,
 			unsigned int *argc_mine_)
@@ -823,7 +1122,7 @@ httpsrv_parse_requestA(	httpsrv_client_t *hcl, unsigned int *ao_,
 		}
 
 		/* Next variable starts here */
-		var = &hcl->headers.argsplit[ao];
+		var = &argsplit[ao];
 
 	/* Did we want it */
 	} else if (arg != NULL) {
@@ -834,7 +1133,7 @@ httpsrv_parse_requestA(	httpsrv_client_t *hcl, unsigned int *ao_,
 		arg = NULL;
 
 		/* Next variable starts here */
-		var = &hcl->headers.argsplit[ao];
+		var = &argsplit[ao];
 
 		/* No value yet */
 		val = NULL;
@@ -845,7 +1144,7 @@ httpsrv_parse_requestA(	httpsrv_client_t *hcl, unsigned int *ao_,
 		 * var stays at same place
 		 * reset argsplit to beginning
 		 */
-		ao = var - hcl->headers.argsplit;
+		ao = var - argsplit;
 		val = NULL;
 	}
 
@@ -860,13 +1159,27 @@ httpsrv_parse_requestA(	httpsrv_client_t *hcl, unsigned int *ao_,
 int
 httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 	unsigned int	j, ro = 0, ao = 0, uo = 0, argc = 0, argc_mine = 0;
-	char		c, *h, *s;
+	unsigned int	rlen, ulen, alen;
+	char		c, *h, *s, *rawuri, *uri, *argsplit;
 	const char	*line, *var = NULL, *val = NULL;
 	uint32_t	proto;
 	httpsrv_argl_t	*arg = NULL;
 
 	line = hcl->the_request;
 
+	/* None of them can get longer than the request (+ escapes) */
+	rlen = strlen(line) + 3;
+	ulen = rlen < HTTPSRV_URI_LEN ? rlen : HTTPSRV_URI_LEN;
+	alen = rlen < HTTPSRV_ARGS_LEN ? rlen : HTTPSRV_ARGS_LEN;
+
+	rawuri = httpsrv_strs_reserve(hcl, &hcl->headers.rawuri, ulen);
+	uri = httpsrv_strs_reserve(hcl, &hcl->headers.uri, ulen);
+	argsplit = httpsrv_strs_reserve(hcl, &hcl->headers.argsplit, alen);
+	if (rawuri == NULL || uri == NULL || argsplit == NULL) {
+		httpsrv_error(hcl, 431, "Request Header Fields Too Large");
+		return (-1);
+	}
+
 	log_dbg(
 		HCL_ID " " CONN_ID " scanning: %s",
 		hcl->id, conn_id(&hcl->conn), line);
@@ -879,15 +1192,15 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 
 	/* Parse the URI */
 	for (	;
-		ro < (sizeof hcl->headers.rawuri   - 2) &&
-		uo < (sizeof hcl->headers.uri      - 2) &&
-		ao < (sizeof hcl->headers.argsplit - 2);
+		ro < (ulen - 2) &&
+		uo < (ulen - 2) &&
+		ao < (alen - 2);
 		j++) {
 
 		c = line[j];
 
 		/* Keep a Raw URI */
-		hcl->headers.rawuri[ro++] = c;
+		rawuri[ro++] = c;
 
 		if (c == ' ' || c == '\0') {
 			/* Done parsing the URI */
@@ -914,8 +1227,8 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 				j++;
 
 				/* Copy over the unmangled variant */
-				hcl->headers.rawuri[ro++] = line[j++];
-				hcl->headers.rawuri[ro++] = line[j];
+				rawuri[ro++] = line[j++];
+				rawuri[ro++] = line[j];
 
 				/* The for() while do the j++ for this char */
 			}
@@ -923,7 +1236,7 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 		} else if (c == '?') {
 			if (argc == 0) {
 				/* Variable name starts here */
-				var = &hcl->headers.argsplit[ao];
+				var = &argsplit[ao];
 				fassert(val == NULL);
 
 				/* Next char in the URI */
@@ -939,7 +1252,7 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 
 		if (var == NULL) {
 			/* Not an argument yet, thus part of the URI */
-			hcl->headers.uri[uo++] = c;
+			uri[uo++] = c;
 		} else {
 			/* Do we even care to look at the arguments? */
 			if (args == NULL) {
@@ -950,22 +1263,22 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 				argc++;
 
 				/* Terminate the var or value */
-				hcl->headers.argsplit[ao++] = '\0';
+				argsplit[ao++] = '\0';
 
 				/* Handle the change of variable */
-				httpsrv_parse_requestA(hcl, &ao, args,
+				httpsrv_parse_requestA(argsplit, &ao, args,
 						       &arg, &var, &val,
 						       &argc_mine);
 			/* Value? */
 			} else if (c == '=') {
 				/* Terminate the variable name */
-				hcl->headers.argsplit[ao++] = '\0';
+				argsplit[ao++] = '\0';
 
 				/* Do we want it ? */
 				arg = httpsrv_arg_find(args, var);
 				if (arg != NULL) {
 					/* Yes, val starts here */
-					val = &hcl->headers.argsplit[ao];
+					val = &argsplit[ao];
 				} else {
 					/* No, ignore it */
 					val = NULL;
@@ -975,7 +1288,7 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 				/* Add it to the string if we want it */
 				if ((val != NULL) ||
 				    (val == NULL && arg == NULL)) {
-					hcl->headers.argsplit[ao++] = c;
+					argsplit[ao++] = c;
 				}
 			}
 		}
@@ -986,16 +1299,16 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 		argc++;
 
 		/* We check -2 above thus should be okay */
-		if (ao < (sizeof hcl->headers.args - 1)) {
+		if (ao < (alen - 1)) {
 			/* Terminate it */
-			hcl->headers.argsplit[ao] = '\0';
+			argsplit[ao] = '\0';
 		} else {
 			log_dbg("On the edge of argsplit");
-			hcl->headers.argsplit[ao-1] = '\0';
+			argsplit[ao-1] = '\0';
 		}
 
 		/* Handle the change of variable */
-		httpsrv_parse_requestA(hcl, &ao, args,
+		httpsrv_parse_requestA(argsplit, &ao, args,
 				       &arg, &var, &val,
 				       &argc_mine);
 	}
@@ -1003,9 +1316,15 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 	/* XXX: should finish in HTTP/1.1, but are indifferent */
 
 	/* Just in case (check with -2 above)*/
-	assert(ro < (sizeof hcl->headers.rawuri - 1));
-	assert(uo < (sizeof hcl->headers.uri    - 1));
-	assert(ao < (sizeof hcl->headers.args   - 1));
+	assert(ro < (ulen - 1));
+	assert(uo < (ulen - 1));
+	assert(ao < (alen - 1));
+
+	rawuri[ro] = '\0';
+	uri[uo] = '\0';
+	hcl->headers.rawuri.len = ro;
+	hcl->headers.uri.len = uo;
+	hcl->headers.argsplit.len = ao;
 
 	/* Get the local + remote IP/port */
 	conn_getinfo(
@@ -1021,18 +1340,18 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 		&proto, &hcl->headers.remote_port);
 
 	/* Not starting with a slash, possibly a proxied request */
-	if (hcl->headers.uri[0] != '/') {
+	if (uri[0] != '/') {
 		/* Strip http/https proxied URLs */
-		if (strncasecmp(hcl->headers.uri, "http://", 7) == 0 ||
-		    strncasecmp(hcl->headers.uri, "https://", 8) == 0) {
+		if (strncasecmp(uri, "http://", 7) == 0 ||
+		    strncasecmp(uri, "https://", 8) == 0) {
 			log_dbg(
 				HCL_ID " " CONN_ID " Proxied Request: %s",
 				hcl->id, conn_id(&hcl->conn),
-				hcl->headers.uri);
+				uri);
 
 			/* Find the end of the hostname */
 			h = NULL;
-			s = hcl->headers.uri;
+			s = uri;
 			/* Find first / */
 			s = strchr(s, '/');
 			if (s != NULL) {
@@ -1046,13 +1365,13 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 					log_dbg(
 						HCL_ID " " CONN_ID " Proxied Request: %s (second not found)",
 						hcl->id, conn_id(&hcl->conn),
-						hcl->headers.uri);
+						uri);
 				}
 			} else {
 				log_dbg(
 					HCL_ID " " CONN_ID " Proxied Request: %s (first not found)",
 					hcl->id, conn_id(&hcl->conn),
-					hcl->headers.uri);
+					uri);
 			}
 
 			/* Hostname not found? */
@@ -1061,7 +1380,7 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 					HCL_ID " " CONN_ID
 					" Broken Proxy URL: %s",
 					hcl->id, conn_id(&hcl->conn),
-					hcl->headers.uri);
+					uri);
 				httpsrv_error(hcl, 400, "Broken Proxy URL");
 				return (-1);
 			}
@@ -1070,20 +1389,25 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 			 * Replace the Host: header as
 			 * they really wanted this site
 			 */
-			strncpy(hcl->headers.hostname, h, (s - h) - 1);
+			if (httpsrv_strs_add(hcl, &hcl->headers.hostname,
+					     h, s - h) == NULL) {
+				httpsrv_error(hcl, 431,
+					"Request Header Fields Too Large");
+				return (-1);
+			}
 
 			/* Move the real URI to the start */
-			memmove(hcl->headers.uri, s,
-				sizeof(hcl->headers.uri) -
-					(s - hcl->headers.uri));
-			memcpy(hcl->headers.rawuri, hcl->headers.uri,
-				sizeof(hcl->headers.rawuri));
+			uo -= s - uri;
+			memmove(uri, s, uo + 1);
+			memcpy(rawuri, uri, uo + 1);
+			hcl->headers.uri.len = uo;
+			hcl->headers.rawuri.len = uo;
 		} else {
 			log_ntc(
 				HCL_ID " " CONN_ID
 				" Broken URL: %s",
 				hcl->id, conn_id(&hcl->conn),
-				hcl->headers.uri);
+				uri);
 			httpsrv_error(hcl, 400, "URL without root");
 			return (-1);
 		}
@@ -1100,8 +1424,8 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 		hcl->id,
 		conn_id(&hcl->conn),
 		hcl->the_request, (unsigned int)strlen(hcl->the_request),
-		hcl->headers.hostname,
-		hcl->headers.uri,
+		httpsrv_str(hcl, hcl->headers.hostname),
+		uri,
 		hcl->headers.local_ip, hcl->headers.local_port,
 		hcl->headers.remote_ip, hcl->headers.remote_port);
 
@@ -1109,7 +1433,7 @@ httpsrv_parse_request(httpsrv_client_t *hcl, httpsrv_argl_t *args) {
 		HCL_ID " " CONN_ID " Found %u arguments, %u useful for me",
 		hcl->id, conn_id(&hcl->conn), argc, argc_mine);
 
-	if (strlen(hcl->headers.hostname) == 0) {
+	if (hcl->headers.hostname.len == 0) {
 		httpsrv_error(hcl, 400, "Bad Request - missing or empty Host header");
 		return (-1);
 	}
@@ -1130,13 +1454,16 @@ httpsrv_newcl(httpsrv_t *hs) {
 	log_dbg("[hs%" PRIu64 "]", hs->id);
 
 	/* Create a cl session */
-	hcl = mcalloc(sizeof *hcl, "httpsrv_client_t");
+	hcl = pool_get(&hs->clients);
 	if (hcl == NULL) {
 		log_crt("[hs%" PRIu64 "] alloc failed", hs->id);
 		mutex_unlock(hs->mutex);
 		return (NULL);
 	}
 
+	/* Pooled objects come back dirty */
+	memzero(hcl, sizeof *hcl);
+
 	/* Identity */
 	hcl->id = ++cl_id;
 
@@ -1196,7 +1523,8 @@ httpsrv_accept(conn_t *lconn, httpsrv_t *hs) {
 
 	/* Accept the socket */
 	if (!conn_accept(&hcl->conn, lconn, hcl)) {
-		log_ntc(
+		/* Failures are logged by conn_accept(), EAGAIN is normal */
+		log_dbg(
 			HCL_ID " l:" CONN_ID " conn_accept()",
 			hcl->id, conn_id(lconn));
 
@@ -1221,7 +1549,8 @@ httpsrv_accept(conn_t *lconn, httpsrv_t *hs) {
 	if (hcl->hs->accept)
 		hcl->hs->accept(hcl, hcl->hs->user);
 
-	/* We expect to receive something from it */
+	/* We expect to receive something from it, in time */
+	httpsrv_deadline(hcl);
 	conn_events(&hcl->conn, CONN_POLLIN);
 
 	return;
@@ -1260,7 +1589,7 @@ httpsrv_receive(httpsrv_client_t *hcl, conn_t *conn) {
 		log_dbg(
 			HCL_ID " " CONN_ID " Try to parse some lines",
 			hcl->id, conn_id(&hcl->conn));
-		httpsrv_handle_http(hcl);
+		httpsrv_handle_batch(hcl);
 	}
 
 	log_dbg(
@@ -1268,18 +1597,36 @@ httpsrv_receive(httpsrv_client_t *hcl, conn_t *conn) {
 		hcl->id, conn_id(&hcl->conn));
 }
 
+/* Keep the threads of a shard on its CPUs */
+static void
+httpsrv_shard_pin(httpsrv_shard_t *sh);
+static void
+httpsrv_shard_pin(httpsrv_shard_t *sh) {
+#ifdef _LINUX
+	if (sh->pin && !thread_setaffinity(&sh->cpus)) {
+		log_wrn("[hs%" PRIu64 "] shard %u could not be pinned",
+			sh->hs->id, sh->num);
+	}
+#else
+	sh = sh;
+#endif
+}
+
 /* This just polls sockets and puts them in the right active queue */
 static void *
 httpsrv_poller_thread(void *context) {
-	httpsrv_t	*hs = (httpsrv_t *)context;
+	httpsrv_shard_t	*sh = (httpsrv_shard_t *)context;
+	httpsrv_t	*hs = sh->hs;
 	int		r;
 
-	log_dbg("[hs%" PRIu64 "] - start", hs->id);
+	log_dbg("[hs%" PRIu64 "] shard %u - start", hs->id, sh->num);
 
-	/* Handle the sockets in the global connset by polling them */
+	httpsrv_shard_pin(sh);
+
+	/* Handle the sockets in the shard's connset by polling them */
 	while (thread_keep_running()) {
 		/* log_dbg("[hs%" PRIu64 "]", hs->id); */
-		r = connset_poll(&hs->connset);
+		r = connset_poll(sh->connset);
 		if (r < 0) {
 			log_ntc(
 				"[hs%" PRIu64 "] connset_poll() failed %d",
@@ -1334,20 +1681,99 @@ httpsrv_mimetype(const char *file) {
 	return (mime);
 }
 
+/* The cache entry goes once the file is sent */
+static void
+httpsrv_sendfile_done(void *user, const char *data, uint64_t len);
+static void
+httpsrv_sendfile_done(void *user, const char UNUSED *data,
+		      uint64_t UNUSED len) {
+	filecache_put((filecache_entry_t *)user);
+}
+
+/* Does the client have this version already? */
+static bool
+httpsrv_sendfile_fresh(httpsrv_client_t *hcl, filecache_entry_t *fe);
+static bool
+httpsrv_sendfile_fresh(httpsrv_client_t *hcl, filecache_entry_t *fe) {
+	const char	*v;
+	struct tm	tm;
+
+	/* If-None-Match wins, If-Modified-Since is then ignored */
+	v = httpsrv_header(hcl, "If-None-Match");
+	if (v != NULL) {
+		return (strcmp(v, "*") == 0 || strstr(v, fe->etag) != NULL);
+	}
+
+	v = httpsrv_header(hcl, "If-Modified-Since");
+	if (v == NULL) {
+		return (false);
+	}
+
+	memzero(&tm, sizeof tm);
+	v = strptime(v, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (v == NULL || *v != '\0') {
+		return (false);
+	}
+
+	return (fe->mtime <= timegm(&tm));
+}
+
 void
 httpsrv_sendfile(httpsrv_client_t *hcl, const char *file) {
-	const char *mime;
+	filecache_entry_t	*fe;
+	uint64_t		off, len;
+	int			r;
 
-	if (!conn_sendfile(&hcl->conn, file)) {
+	/* Open already, with all we need to know about it */
+	fe = filecache_get(&hcl->hs->files, file);
+	if (fe == NULL) {
 		httpsrv_error(hcl, 404, "Not Found");
 		return;
 	}
 
-	/* Get the mime type */
-	mime = httpsrv_mimetype(file);
+	/* Conditional: just the headers */
+	if ((hcl->method == HTTP_M_GET || hcl->method == HTTP_M_HEAD) &&
+	    httpsrv_sendfile_fresh(hcl, fe)) {
+		httpsrv_answer(hcl, HTTPSRV_HTTP_NOTMODIFIED, NULL);
+		conn_addheaderf(&hcl->conn, "ETag: %s", fe->etag);
+		httpsrv_http_headertime(hcl, "Last-Modified", fe->mtime);
+		filecache_put(fe);
+		return;
+	}
+
+	/* Only a part of it? (Range is only for GET) */
+	r = httpparse_range(hcl->method == HTTP_M_GET ?
+				httpsrv_header(hcl, "Range") : NULL,
+			    fe->size, &off, &len);
+	if (r == HTTPPARSE_BADRANGE) {
+		httpsrv_error(hcl, 416, "Range Not Satisfiable");
+		conn_addheaderf(&hcl->conn,
+				"Content-Range: bytes */%" PRIu64, fe->size);
+		filecache_put(fe);
+		return;
+	}
+
+	/* The segment holds our reference from here */
+	if (!conn_putfd(&hcl->conn, fe->fd, off, len,
+			httpsrv_sendfile_done, fe)) {
+		httpsrv_error(hcl, 500, "Internal Server Error");
+		return;
+	}
 
 	/* Answer it */
-	httpsrv_answer(hcl, HTTPSRV_HTTP_OK, mime);
+	if (r == 206) {
+		httpsrv_answer(hcl, HTTPSRV_HTTP_PARTIAL, fe->type);
+		conn_addheaderf(&hcl->conn,
+				"Content-Range: bytes %" PRIu64 "-%" PRIu64
+				"/%" PRIu64,
+				off, off + len - 1, fe->size);
+	} else {
+		httpsrv_answer(hcl, HTTPSRV_HTTP_OK, fe->type);
+	}
+
+	conn_addheader(&hcl->conn, "Accept-Ranges: bytes");
+	conn_addheaderf(&hcl->conn, "ETag: %s", fe->etag);
+	httpsrv_http_headertime(hcl, "Last-Modified", fe->mtime);
 }
 
 void
@@ -1374,17 +1800,26 @@ httpsrv_forward(httpsrv_client_t *hin, httpsrv_client_t *hout) {
 /* These pull items off the active queue */
 static void *
 httpsrv_worker_thread(void *context) {
-	httpsrv_t		*hs = (httpsrv_t *)context;
+	httpsrv_shard_t		*sh = (httpsrv_shard_t *)context;
+	httpsrv_t		*hs = sh->hs;
+	executor_worker_t	*w;
 	conn_t			*conn;
 	httpsrv_client_t	*hcl;
 	bool			k;
 
-	log_dbg("[hs%" PRIu64 "] context", hs->id);
+	log_dbg("[hs%" PRIu64 "] shard %u context", hs->id, sh->num);
+
+	httpsrv_shard_pin(sh);
+
+	w = executor_join(&sh->executor);
+	if (w == NULL) {
+		return (NULL);
+	}
 
 	while (thread_keep_running()) {
 
-		/* Get some work to do */
-		conn = connset_get_ready(&hs->connset);
+		/* Get some work to do, preferably clients we had before */
+		conn = connset_get_ready_worker(sh->connset, w);
 		if (conn == NULL) {
 			/*
 			 * Error somewhere thus abort,
@@ -1413,6 +1848,16 @@ httpsrv_worker_thread(void *context) {
 				HCL_ID " " CONN_ID " handle client",
 				hcl->id, conn_id(&hcl->conn));
 
+			/* Took too long, whatever it was doing */
+			if (conn_timedout(conn)) {
+				log_ntc(
+					HCL_ID " " CONN_ID " timed out",
+					hcl->id, conn_id(conn));
+
+				conn_close(conn);
+				httpsrv_close(hcl);
+			}
+
 			/* Activity! */
 			hcl->lastact = gettime();
 
@@ -1430,6 +1875,14 @@ httpsrv_worker_thread(void *context) {
 					HCL_ID " " CONN_ID " flushing",
 					hcl->id, conn_id(&hcl->conn));
 				conn_flush(&hcl->conn);
+
+				/* Pipelined requests waited for this */
+				if (!hcl->close &&
+				    hcl->method == HTTP_M_NONE &&
+				    !conn_buffer_isempty(&hcl->conn) &&
+				    conn_flushleft(&hcl->conn) == 0) {
+					httpsrv_handle_batch(hcl);
+				}
 			}
 
 			/* Need to close it? */
@@ -1473,6 +1926,8 @@ httpsrv_worker_thread(void *context) {
 
 		if (conn != NULL) {
 			if (hcl) {
+				httpsrv_deadline(hcl);
+
 				k = hcl->keephandling;
 				hcl->keephandling = false;
 			} else {
@@ -1579,8 +2034,7 @@ httpsrv_sessions(httpsrv_client_t *hcl) {
 				"<th>Local_Port</th>\n"
 				"<th>Remote_IP</th>\n"
 				"<th>Remote_Port</th>\n"
-				"<th>Hostname</th>\n"
-				"<th>Request</th>\n"
+				"<th>Busy</th>\n"
 				"</tr>\n");
 		}
 
@@ -1593,7 +2047,6 @@ httpsrv_sessions(httpsrv_client_t *hcl) {
 			    "<td>%s</td>"
 			    "<td>%u</td>"
 			    "<td>%s</td>"
-			    "<td>%s</td>"
 			    "<tr>\n",
 			    h->id,
 			    h->reqid,
@@ -1601,8 +2054,7 @@ httpsrv_sessions(httpsrv_client_t *hcl) {
 			    h->headers.local_port,
 			    h->headers.remote_ip,
 			    h->headers.remote_port,
-			    h->headers.hostname,
-			    h->the_request);
+			    yesno(h->parse != NULL));
 		cnt++;
 	}
 	list_unlock(&hcl->hs->sessions);
@@ -1618,7 +2070,8 @@ httpsrv_sessions(httpsrv_client_t *hcl) {
 
 void
 httpsrv_exit(httpsrv_t *hs) {
-	httpsrv_client_t *hcl;
+	httpsrv_client_t	*hcl;
+	unsigned int		i;
 
 	fassert(hs);
 	fassert(hs->id != 0);
@@ -1635,6 +2088,36 @@ httpsrv_exit(httpsrv_t *hs) {
 	/* Cleanup all remaining connections */
 	connset_destroy(&hs->connset);
 
+	/* Shard 0 uses hs->connset, the others have their own */
+	for (i = 1; i < hs->numshards; i++) {
+		if (hs->shards[i].connset == NULL) {
+			continue;
+		}
+
+		connset_destroy(hs->shards[i].connset);
+		mfree(hs->shards[i].connset, sizeof *hs->shards[i].connset,
+		      "connset");
+	}
+
+	/* The connsets are gone thus nothing is queued anymore */
+	for (i = 0; i < hs->numshards; i++) {
+		if (hs->shards[i].executor.workers != NULL) {
+			executor_destroy(&hs->shards[i].executor);
+		}
+	}
+
+	if (hs->shards != NULL) {
+		mfree(hs->shards, hs->numshards * sizeof *hs->shards,
+		      "httpsrv_shards");
+	}
+
+	/* All clients are gone */
+	pool_destroy(&hs->requests);
+	pool_destroy(&hs->clients);
+
+	/* And with them what they were sending */
+	filecache_destroy(&hs->files);
+
 	/* Destroy it */
 	mutex_destroy(hs->mutex);
 
@@ -1669,6 +2152,16 @@ httpsrv_init(	httpsrv_t *hs,
 	/* The lock */
 	mutex_init(hs->mutex);
 
+	/* Clients and their request blocks */
+	pool_init(&hs->clients, sizeof(httpsrv_client_t), "httpsrv_client_t");
+	pool_init(&hs->requests, HTTPSRV_REQ_LEN, "httpsrv_request");
+
+	/* Files that are sent */
+	if (!filecache_init(&hs->files, HTTPSRV_FILES_MAX, HTTPSRV_FILES_TTL,
+			    httpsrv_mimetype)) {
+		return (false);
+	}
+
 	/* Initialize the connections list */
 	if (!connset_init(&hs->connset)) {
 		return (false);
@@ -1689,31 +2182,148 @@ httpsrv_init(	httpsrv_t *hs,
 	hs->done		= f_done;
 	hs->close		= f_close;
 
+	httpsrv_set_timeouts(hs, HTTPSRV_TIMEOUT_IDLE, HTTPSRV_TIMEOUT_HEAD,
+			     HTTPSRV_TIMEOUT_WRITE);
+
 	return (true);
 }
 
 bool
 httpsrv_start(httpsrv_t *hs, const char *hostname, unsigned int port, unsigned int numworkers) {
-	unsigned int	i;
+	return (httpsrv_start_sharded(hs, hostname, port, 1, numworkers, false));
+}
 
-	/* Listen on the HTTP port (forwarded to from mod_hs) */
-	if (!conn_create_listen(&hs->connset,
-				hostname, IPPROTO_TCP, port)) {
-		log_err("conn_create_listen()");
+/*
+ * Every shard has its own listen socket (SO_REUSEPORT thus the kernel
+ * spreads the connections), connset, poller and numworkers workers.
+ * numshards = 0 means one per CPU the process may run on (its affinity,
+ * eg from taskset or a cpuset); with pin the threads of a shard stay on
+ * its share of those CPUs.
+ */
+bool
+httpsrv_start_sharded(httpsrv_t *hs, const char *hostname, unsigned int port,
+		      unsigned int numshards, unsigned int numworkers,
+		      bool pin) {
+	httpsrv_shard_t	*sh;
+	unsigned int	i, j;
+	long		ncpu;
+#ifdef _LINUX
+	cpu_set_t	avail;
+	unsigned int	k;
+#endif
+
+	/* Only once */
+	fassert(hs->shards == NULL);
+
+#ifdef _LINUX
+	/* Not necessarily 0..n-1, nor all of the online ones */
+	if (sched_getaffinity(0, sizeof avail, &avail) != 0) {
+		log_wrn("sched_getaffinity() failed, using all CPUs");
+
+		CPU_ZERO(&avail);
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		for (j = 0; (long)j < ncpu && j < CPU_SETSIZE; j++) {
+			CPU_SET(j, &avail);
+		}
+	}
+
+	ncpu = CPU_COUNT(&avail);
+#else
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (ncpu < 1) {
+		ncpu = 1;
+	}
+
+	if (numshards == 0) {
+		numshards = ncpu;
+	}
+
+	hs->shards = mcalloc(numshards * sizeof *hs->shards, "httpsrv_shards");
+	if (hs->shards == NULL) {
+		log_crt("No memory for %u shards", numshards);
 		return (false);
 	}
+	hs->numshards = numshards;
 
-	/* Launch a few HTTP worker threads */
-	for (i = 0; i < numworkers; i++) {
-		if (!thread_add("HTTPWorker", &httpsrv_worker_thread, hs)) {
-			log_err("could not create thread");
+	for (i = 0; i < numshards; i++) {
+		sh = &hs->shards[i];
+		sh->hs = hs;
+		sh->num = i;
+
+		/* The first one keeps using the connset from httpsrv_init() */
+		if (i == 0) {
+			sh->connset = &hs->connset;
+		} else {
+			sh->connset = mcalloc(sizeof *sh->connset, "connset");
+			if (sh->connset == NULL) {
+				log_crt("No memory for shard %u", i);
+				return (false);
+			}
+
+			if (!connset_init(sh->connset)) {
+				log_err("connset_init() shard %u", i);
+				mfree(sh->connset, sizeof *sh->connset,
+				      "connset");
+				sh->connset = NULL;
+				return (false);
+			}
+		}
+
+#ifdef _LINUX
+		/*
+		 * Deal out the CPUs, the k-th one we may use goes to shard
+		 * k % numshards; more shards than CPUs share them
+		 */
+		sh->pin = pin;
+		CPU_ZERO(&sh->cpus);
+		for (j = 0, k = 0; j < CPU_SETSIZE; j++) {
+			if (!CPU_ISSET(j, &avail)) {
+				continue;
+			}
+
+			if (k % numshards == i || k == i % ncpu) {
+				CPU_SET(j, &sh->cpus);
+			}
+			k++;
+		}
+#else
+		if (pin && i == 0) {
+			log_wrn("CPU pinning not supported on this platform");
+		}
+#endif
+
+		/* Workers of this shard steal from each other */
+		if (numworkers > 0) {
+			if (!executor_init(&sh->executor, numworkers,
+					   HTTPSRV_WORKQ)) {
+				log_err("executor_init() shard %u", i);
+				return (false);
+			}
+
+			connset_set_executor(sh->connset, &sh->executor);
+		}
+
+		/* Listen on the HTTP port (forwarded to from mod_hs) */
+		if (!conn_create_listen(sh->connset,
+					hostname, IPPROTO_TCP, port)) {
+			log_err("conn_create_listen() shard %u", i);
 			return (false);
 		}
-	}
 
-	if (!thread_add("HTTPPoller", &httpsrv_poller_thread, hs)) {
-		log_err("could not create thread");
-		return (false);
+		/* Launch a few HTTP worker threads */
+		for (j = 0; j < numworkers; j++) {
+			if (!thread_add("HTTPWorker",
+					&httpsrv_worker_thread, sh)) {
+				log_err("could not create thread");
+				return (false);
+			}
+		}
+
+		if (!thread_add("HTTPPoller", &httpsrv_poller_thread, sh)) {
+			log_err("could not create thread");
+			return (false);
+		}
 	}
 
 	return (true);
@@ -71,6 +71,7 @@ list_init(hlist_t *l) {
 	LC(static uint64_t l_id = 0);
 
 	LC(l->id = ++l_id);
+	LC(l->locks = 0);
 
 	LC(LD2("%p - " LIST_ID, (void *)l, list_id(l)));
 
@@ -78,8 +79,8 @@ list_init(hlist_t *l) {
 	l->tail		= NULL;
 	l->head		= (hnode_t *)&l->tail;
 
-	mutex_init(l->mutex);
-	cond_init(l->cond);
+	lock_init(&l->lock);
+	lockcond_init(&l->cond);
 }
 
 /* Destroy a list, does not empty it (it does not know how) */
@@ -91,8 +92,8 @@ list_destroy(hlist_t *l) {
 	l->tail		= NULL;
 	l->tailprev	= NULL;
 
-	mutex_destroy(l->mutex);
-	cond_destroy(l->cond);
+	lock_destroy(&l->lock);
+	lockcond_destroy(&l->cond);
 }
 
 void
@@ -128,7 +129,7 @@ list_remove(hlist_t *l, hnode_t *n) {
 	LC(l->items--);
 
 	/* Signal at least one wanting to know that something got removed */
-	cond_trigger(l->cond);
+	lockcond_trigger(&l->cond);
 
 	LC(fassert(l->locks == 1));
 }
@@ -198,7 +199,7 @@ list_getnext(hlist_t *l) {
 		 */
 		LC(l->locks--);
 
-		if (!cond_wait(l->cond, l->mutex, 5000)) {
+		if (!lockcond_wait(&l->cond, &l->lock, 5000)) {
 			/* We got the lock again */
 			LC(l->locks++);
 
@@ -243,7 +244,7 @@ list_addtail(hlist_t *l, hnode_t *n) {
 	LC(l->items++);
 
 	/* Signal at least one wanting to know that something got added */
-	cond_trigger(l->cond);
+	lockcond_trigger(&l->cond);
 }
 
 void
@@ -255,7 +256,7 @@ list_addtail_l(hlist_t *l, hnode_t *n) {
 
 void
 list_lock(hlist_t *l) {
-	mutex_lock(l->mutex);
+	lock_lock(&l->lock);
 	LDV(LIST_ID, list_id(l));
 	LC(fassert(l->locks == 0));
 	LC(l->locks++);
@@ -266,6 +267,6 @@ list_unlock(hlist_t *l) {
 	LDV(LIST_ID, list_id(l));
 	LC(fassert(l->locks == 1));
 	LC(l->locks--);
-	mutex_unlock(l->mutex);
+	lock_unlock(&l->lock);
 }
 
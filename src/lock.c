@@ -0,0 +1,209 @@
+#include <limits.h>
+
+#include <libfutil/misc.h>
+
+/* Rounds to spin before sleeping on the futex */
+#define LOCK_SPIN 100
+
+#if defined(__x86_64__) || defined(__i386__)
+#define lock_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define lock_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define lock_relax() {}
+#endif
+
+#ifdef LOCK_DEBUG
+/* Catch recursion, non-recursive locks would deadlock on it */
+static void
+lock_debug_enter(lock_t *l);
+static void
+lock_debug_enter(lock_t *l) {
+	if (l->owned && pthread_equal(l->owner, pthread_self())) {
+		log_crt("Lock %p is already held by this thread", (void *)l);
+		fassert(false);
+	}
+}
+
+static void
+lock_debug_acquired(lock_t *l);
+static void
+lock_debug_acquired(lock_t *l) {
+	l->owner = pthread_self();
+	l->owned = true;
+}
+
+static void
+lock_debug_release(lock_t *l);
+static void
+lock_debug_release(lock_t *l) {
+	if (!l->owned || !pthread_equal(l->owner, pthread_self())) {
+		log_crt("Lock %p is not held by this thread", (void *)l);
+		fassert(false);
+	}
+
+	l->owned = false;
+}
+#else
+#define lock_debug_enter(l) {}
+#define lock_debug_acquired(l) {}
+#define lock_debug_release(l) {}
+#endif /* LOCK_DEBUG */
+
+void
+lock_init(lock_t *l) {
+	memzero(l, sizeof *l);
+
+#ifndef _LINUX
+	pthread_mutex_init(&l->mutex, NULL);
+#endif
+}
+
+void
+lock_destroy(lock_t UNUSED *l) {
+#ifdef LOCK_DEBUG
+	fassert(!l->owned);
+#endif
+
+#ifndef _LINUX
+	pthread_mutex_destroy(&l->mutex);
+#endif
+}
+
+bool
+lock_trylock(lock_t *l) {
+#ifdef _LINUX
+	uint32_t	c = 0;
+#endif
+
+	lock_debug_enter(l);
+
+#ifdef _LINUX
+	if (!atomic_cas(l->state, c, 1)) {
+		return (false);
+	}
+#else
+	if (pthread_mutex_trylock(&l->mutex) != 0) {
+		return (false);
+	}
+#endif
+
+	lock_debug_acquired(l);
+
+	return (true);
+}
+
+void
+lock_lock(lock_t *l) {
+#ifdef _LINUX
+	unsigned int	i;
+	uint32_t	c;
+#endif
+
+	lock_debug_enter(l);
+
+#ifdef _LINUX
+	/* Uncontended: one CAS */
+	c = 0;
+	if (!atomic_cas(l->state, c, 1)) {
+		/* Spin a bit, the holder is likely about to release it */
+		for (i = 0; i < LOCK_SPIN; i++) {
+			lock_relax();
+
+			c = 0;
+			if (atomic_ldr(l->state) == 0 &&
+			    atomic_cas(l->state, c, 1)) {
+				break;
+			}
+		}
+
+		/* Sleep, marking that there are waiters (2) */
+		if (i == LOCK_SPIN) {
+			while (__atomic_exchange_n(&l->state, 2,
+						   __ATOMIC_ACQUIRE) != 0) {
+				futex_wait(&l->state, 2, 0);
+			}
+		}
+	}
+#else
+	pthread_mutex_lock(&l->mutex);
+#endif
+
+	lock_debug_acquired(l);
+}
+
+void
+lock_unlock(lock_t *l) {
+	lock_debug_release(l);
+
+#ifdef _LINUX
+	/* Only a syscall when somebody is sleeping on it */
+	if (__atomic_exchange_n(&l->state, 0, __ATOMIC_RELEASE) == 2) {
+		futex_wake(&l->state, 1);
+	}
+#else
+	pthread_mutex_unlock(&l->mutex);
+#endif
+}
+
+void
+lockcond_init(lockcond_t *c) {
+	memzero(c, sizeof *c);
+
+#ifndef _LINUX
+	pthread_cond_init(&c->cond, NULL);
+#endif
+}
+
+void
+lockcond_destroy(lockcond_t UNUSED *c) {
+#ifdef _LINUX
+	fassert(c->waiters == 0);
+#else
+	pthread_cond_destroy(&c->cond);
+#endif
+}
+
+bool
+lockcond_wait(lockcond_t *c, lock_t *l, unsigned int msec) {
+	bool		timedout;
+#ifdef _LINUX
+	uint32_t	seq;
+
+	/* Under the lock, thus a trigger after this changes seq */
+	c->waiters++;
+	seq = atomic_ldr(c->seq);
+
+	lock_unlock(l);
+	timedout = futex_wait(&c->seq, seq, msec);
+	lock_lock(l);
+
+	c->waiters--;
+#else
+	struct timespec	timeout;
+
+	set_timeout(&timeout, msec);
+
+	lock_debug_release(l);
+	timedout = (pthread_cond_timedwait(&c->cond, &l->mutex,
+					   &timeout) == ETIMEDOUT);
+	lock_debug_acquired(l);
+#endif
+
+	return (timedout);
+}
+
+void
+lockcond_trigger(lockcond_t *c) {
+#ifdef _LINUX
+	/* Cheap when nobody waits, which is the common case for lists */
+	if (c->waiters == 0) {
+		return;
+	}
+
+	atomic_inc(c->seq);
+	futex_wake(&c->seq, INT_MAX);
+#else
+	pthread_cond_broadcast(&c->cond);
+#endif
+}
@@ -2,14 +2,19 @@
 #define SYSLOG_NAMES
 
 #include <libfutil/misc.h>
+#include <libfutil/lock.h>
+
+#ifdef _LINUX
+#include <linux/futex.h>
+#endif
 
 #if 1
 #define SAFDEF_LOG_LONG 1
 #endif
 
-static const char project_ver[] = "Project Version: " STR(PROJECT_VERSION);
-static const char project_git[] = "Project GIThash: " STR(PROJECT_GIT);
-static const char project_bld[]	= "Project Build: " STR(PROJECT_BUILDTIME);
+static const char UNUSED project_ver[] = "Project Version: " STR(PROJECT_VERSION);
+static const char UNUSED project_git[] = "Project GIThash: " STR(PROJECT_GIT);
+static const char UNUSED project_bld[]	= "Project Build: " STR(PROJECT_BUILDTIME);
 
 /* Where logs go to */
 static const char	*l_log_filename = NULL;
@@ -19,12 +24,143 @@ static const char	*l_log_name = NULL;
 static logfunc_f	l_log_func = NULL;
 static mutex_t		l_mutex;
 
+/* Log sites (log_site()) that were hit, and what log_site_rule() said */
+#define LOG_RULES_MAX		32
+
+typedef struct {
+	char		file[64];	/* "": all */
+	char		caller[64];	/* "": all */
+	bool		on;
+} log_rule_t;
+
+static lock_t		l_site_lock = LOCK_INITIALIZER;	/* For these */
+static log_site_t	*l_log_sites = NULL;
+static log_rule_t	l_log_rules[LOG_RULES_MAX];
+static unsigned int	l_log_nrules = 0;
+
+static void
+log_sites_update(void);
+
+/* Asynchronous logging (log_async_start()) */
+
+/* Longest line, longer ones are cut off */
+#define LOG_LINE_MAX		1024
+
+/* What the writer gathers for one write() */
+#define LOG_BATCH		(64 * 1024)
+
+/* The writer looks at the rings at least every this many msec */
+#define LOG_TICK		50
+
+/* A full ring first yields upto this many times to let the writer run */
+#define LOG_YIELD_ROUNDS	64
+
+/* Errors and worse then wait upto this many rounds of 100us for room */
+#define LOG_WAIT_ROUNDS		100
+
+/* Largest record, a line with its arguments that is larger is text */
+#define LOG_REC_MAX		2048
+
+/*
+ * Records, in the rings and binary log files: a uint32_t length and
+ * then the record, that starts with its kind
+ */
+#define LOG_REC_TEXT		0	/* Formatted line, with the '\n' */
+#define LOG_REC_ARGS		1	/* log_rec_t, then the arguments */
+#define LOG_REC_STR		2	/* File: log_str_t, then the string */
+#define LOG_REC_START		3	/* File: log_start_t, a writer started */
+
+#define LOG_MAGIC		"FUTILLOG"
+#define LOG_VERSION		1
+
+/*
+ * A line that still has to be formatted. Per conversion of the format
+ * the arguments follow: integers as 64 bits (also '*' widths), doubles,
+ * pointers as 64 bits and strings as a uint32_t length and the bytes
+ * (UINT32_MAX: NULL). Format and caller are addresses, binary files
+ * have a LOG_REC_STR for them before the first line that uses them.
+ */
+typedef struct {
+	uint8_t		kind;		/* LOG_REC_ARGS */
+	uint8_t		level;
+	uint8_t		pad[2];
+	int32_t		errnum;		/* errno at the time */
+	uint64_t	tid;		/* Thread ID */
+	uint64_t	msec;		/* Time, since the epoch */
+	uint64_t	format;		/* Address of the format */
+	uint64_t	caller;		/* Address of the caller */
+} log_rec_t;
+
+typedef struct {
+	uint8_t		kind;		/* LOG_REC_STR */
+	uint8_t		pad[7];
+	uint64_t	addr;		/* The string at this address is */
+} log_str_t;
+
+typedef struct {
+	uint8_t		kind;		/* LOG_REC_START */
+	uint8_t		version;	/* LOG_VERSION */
+	uint8_t		pad[6];
+	char		magic[8];	/* LOG_MAGIC (without '\0') */
+} log_start_t;
+
+/* Strings (addresses) a binary file has, for LOG_REC_STR */
+#define LOG_SEEN_BITS		12
+#define LOG_SEEN		(1 << LOG_SEEN_BITS)
+#define log_seen_hash(addr)	((unsigned int)(((addr) >> 3) * \
+				 0x9e3779b97f4a7c15ULL >> (64 - LOG_SEEN_BITS)))
+
+/*
+ * Per-thread ring of records, see above.
+ * Only its thread writes (head), only the writer reads (tail).
+ */
+typedef struct log_ring {
+	struct log_ring	*next;		/* All rings */
+	char		*buf;		/* The ring */
+	uint32_t	mask;		/* Size - 1 */
+	bool		used;		/* Claimed by a thread */
+	uint64_t	drops;		/* Lines that did not fit */
+	char		pad0[64];
+	uint64_t	head;		/* Written upto (thread) */
+	char		pad1[64 - sizeof(uint64_t)];
+	uint64_t	tail;		/* Read upto (writer) */
+	char		pad2[64 - sizeof(uint64_t)];
+} log_ring_t;
+
+static bool		l_alog_running = false;	/* logline() goes there */
+static bool		l_alog_stop = false;	/* The writer has to stop */
+static pthread_t	l_alog_writer;
+static uint32_t		l_alog_ringsize = 0;
+static uint64_t		l_alog_maxsize = 0;	/* Rotate beyond, 0 = never */
+static uint64_t		l_alog_size = 0;	/* Of the current file */
+static log_ring_t	*l_alog_rings = NULL;	/* Only added to */
+static uint32_t		l_alog_waiting = 0;	/* The writer sleeps */
+static uint32_t		l_alog_wakeups = 0;	/* Bumped for every wakeup */
+static uint64_t		l_alog_lines = 0;	/* Written out */
+static uint64_t		l_alog_drops = 0;	/* Reported as dropped */
+static pthread_key_t	l_alog_key;		/* Frees the ring of a thread */
+static pthread_once_t	l_alog_once = PTHREAD_ONCE_INIT;
+static char		l_alog_batch[LOG_BATCH];
+static unsigned int	l_alog_fill = 0;
+static log_format_t	l_alog_format = LOG_FORMAT_TEXT;
+static bool		l_alog_fresh = false;	/* Binary: new file */
+static uint64_t		l_alog_seen[LOG_SEEN];	/* Binary: strings it has */
+static unsigned int	l_alog_nseen = 0;
+
+/* Ring and id (a syscall) of this thread */
+static __thread log_ring_t *l_alog_me = NULL;
+static __thread uint64_t l_alog_tid = 0;
+
+
 void
 log_setup(const char *name, FILE *f) {
 	mutex_init(l_mutex);
 
 	l_log_name = name;
 	l_log_output = f;
+
+	/* Not the one of log_set() anymore */
+	l_log_filename = NULL;
 }
 
 void
@@ -78,6 +214,8 @@ log_setlevel(unsigned int level) {
 	mutex_lock(l_mutex);
 	l_log_level = level;
 	mutex_unlock(l_mutex);
+
+	log_sites_update();
 }
 
 void
@@ -87,6 +225,30 @@ log_setfunc(logfunc_f func) {
 	mutex_unlock(l_mutex);
 }
 
+static const char *
+log_strerror(int errnum, char *buf, size_t len);
+static const char *
+log_strerror(int errnum, char *buf, size_t len) {
+	const char *e;
+
+	memzero(buf, len);
+/*
+ * There are two variants of strerror_r(), the silly GNU one and the XSI one 
+ * The first returns a buffer (and might not use our buffer) the latter
+ * always uses our buffer. Hence, this trick to solve the difference.
+ */
+#if (!defined(_LINUX) || ((_POSIX_C_SOURCE >= 200112L || _XOPEN_SOURCE >= 600) && ! _GNU_SOURCE))
+	/* XSI version */
+	e = buf;
+#else
+	/* GNU version */
+	e =
+#endif
+	strerror_r(errnum, buf, len);
+
+	return (e);
+}
+
 static void
 logitVA(unsigned int level, const char *caller,
 	const char *format, va_list ap) ATTR_FORMAT(printf, 3, 0);
@@ -100,123 +262,1463 @@ logitVA(unsigned int level, const char *caller,
 	uint64_t		id, msec;
 	struct stat		st;
 	time_t			tm;
-	struct tm		teem;
 	int			errnum;
 
-	/* Retain the errno (before we change it here) */
-	errnum = errno;
+	/* Retain the errno (before we change it here) */
+	errnum = errno;
+
+	/* The current Thread ID */
+	id = getthisthreadid();
+
+	/* Lock her up */
+	mutex_lock(l_mutex);
+
+	/* If we maintain our own log file */
+	/* Check the filesize to not exceed our threshold */
+	if (	l_log_filename &&
+		l_log_output &&
+		(fstat(fileno(l_log_output), &st) != 0 ||
+		 st.st_size > maxlogsize)) {
+
+		/* Error or over our limit */
+		rewind(l_log_output);
+		if (ftruncate(fileno(l_log_output), 0)) {}
+	}
+
+	/* Not open yet? */
+	if (!l_log_output && l_log_filename) {
+		l_log_output = fopen(l_log_filename, "a");
+	}
+
+	/* No log output */
+	if (!l_log_output) {
+#ifndef _WIN32
+		/* Use syslog as we have nothing better */
+		vsyslog(level, format, ap);
+		/* Note: does not log errno */
+#else
+		vfprintf(stderr, format, ap);
+#endif
+	} else {
+		char t[32], ln[9];
+		unsigned int i;
+
+		/* Skip repeated levels */
+		if (level == level_p) {
+			i = sizeof ln;
+			memset(ln, ' ', i);
+			ln[i - 1] = '\0';
+		} else {
+			level_p = level;
+			snprintf(ln, sizeof ln, "%s",
+				 getprioname(level));
+		}
+
+		/* Skip repeated thread id's */
+		snprintf(t, sizeof t, THREAD_ID, id);
+
+		if (id == id_p) {
+			i = strlen(t);
+			memset(t, ' ', i);
+			t[i] = '\0';
+		} else {
+			id_p = id;
+		}
+
+		/* Include the time in the log */
+		tm = clk_now(&msec);
+
+		fprintf(l_log_output,
+#ifdef SAFDEF_LOG_LONG
+			"%s.%03" PRIu64 " "
+#else
+			"%" PRIu64 " "
+#endif
+			"%-8s %s %s() ",
+#ifdef SAFDEF_LOG_LONG
+			clk_sec(tm)->stamp, msec,
+#else
+			tm,
+#endif
+			ln, t, caller);
+		vfprintf(l_log_output, format, ap);
+
+		/* Add the errno + textual version */
+		if (level <= LOG_ERR) {
+			char buf[256];
+			const char *e;
+
+			e = log_strerror(errnum, buf, sizeof buf);
+
+			fprintf(l_log_output,
+				", errno: %s (%d)",
+				e,
+				errnum
+				);
+		}
+
+		fprintf(l_log_output, "\n");
+		fflush(l_log_output);
+	}
+
+	/* Release her */
+	mutex_unlock(l_mutex);
+}
+
+/* What goes before the message, returns its length */
+static unsigned int
+log_async_head(char *line, unsigned int level, uint64_t tid,
+	       const char *caller, uint64_t ms);
+static unsigned int
+log_async_head(char *line, unsigned int level, uint64_t tid,
+	       const char *caller, uint64_t ms) {
+	uint64_t	msec = ms % 1000;
+	time_t		tm = ms / 1000;
+	int		n;
+
+	n = snprintf(line, LOG_LINE_MAX,
+#ifdef SAFDEF_LOG_LONG
+		     "%s.%03" PRIu64 " "
+#else
+		     "%" PRIu64 " "
+#endif
+		     "%-8s " THREAD_ID " %s() ",
+#ifdef SAFDEF_LOG_LONG
+		     clk_sec(tm)->stamp, msec,
+#else
+		     tm,
+#endif
+		     getprioname(level), tid, caller);
+
+	return (n < 0 ? 0 : n >= LOG_LINE_MAX ? LOG_LINE_MAX : (unsigned int)n);
+}
+
+/* The errno part and the newline, upto LOG_LINE_MAX */
+static unsigned int
+log_async_tail(char *line, unsigned int len, unsigned int level, int errnum);
+static unsigned int
+log_async_tail(char *line, unsigned int len, unsigned int level, int errnum) {
+	char	buf[256];
+	int	n;
+
+	if (level <= LOG_ERR && len < LOG_LINE_MAX) {
+		n = snprintf(&line[len], LOG_LINE_MAX - len,
+			     ", errno: %s (%d)",
+			     log_strerror(errnum, buf, sizeof buf), errnum);
+		len += n < 0 ? 0 : (unsigned int)n;
+	}
+
+	/* Cut off, the newline always goes at the end */
+	if (len > LOG_LINE_MAX - 1) {
+		len = LOG_LINE_MAX - 1;
+	}
+
+	line[len++] = '\n';
+
+	return (len);
+}
+
+/* A line as logitVA() writes it, upto LOG_LINE_MAX with the '\n' */
+static unsigned int
+log_async_formatVA(char *line, unsigned int level, const char *caller,
+		   int errnum, const char *format, va_list ap)
+		   ATTR_FORMAT(printf, 5, 0);
+static unsigned int
+log_async_formatVA(char *line, unsigned int level, const char *caller,
+		   int errnum, const char *format, va_list ap)
+{
+	uint64_t	msec, s = clk_now(&msec);
+	unsigned int	len;
+	int		n;
+
+	len = log_async_head(line, level, l_alog_tid, caller, s * 1000 + msec);
+
+	if (len < LOG_LINE_MAX) {
+		n = vsnprintf(&line[len], LOG_LINE_MAX - len, format, ap);
+		len += n < 0 ? 0 : (unsigned int)n;
+	}
+
+	return (log_async_tail(line, len, level, errnum));
+}
+
+/* What a conversion of a format takes as argument */
+typedef enum {
+	LOG_ARG_END = 0,	/* No more conversions */
+	LOG_ARG_PCT,		/* %%, nothing */
+	LOG_ARG_INT,		/* Signed integers, kept as int64_t */
+	LOG_ARG_UINT,		/* Unsigned integers, kept as uint64_t */
+	LOG_ARG_CHAR,		/* %c, kept as int64_t */
+	LOG_ARG_DOUBLE,		/* Kept as double */
+	LOG_ARG_STR,		/* Copied */
+	LOG_ARG_PTR,		/* %p, kept as uint64_t */
+	LOG_ARG_BAD		/* Can't be deferred (%n, %m, %1$d, %Lf, %ls) */
+} log_arg_t;
+
+typedef struct {
+	const char	*text;		/* Literal text before it */
+	unsigned int	textlen;
+	log_arg_t	type;
+	char		length;		/* Modifier: H(h), h, l, q(ll), j, z, t */
+	bool		wstar;		/* Width is an argument */
+	bool		pstar;		/* Precision is an argument */
+	int		prec;		/* Literal precision, -1: none */
+	char		spec[32];	/* To format it with, integers as ll */
+} log_conv_t;
+
+/* The next conversion of the format at *fmt */
+static void
+log_conv_next(const char **fmt, log_conv_t *c);
+static void
+log_conv_next(const char **fmt, log_conv_t *c) {
+	const char	*f = *fmt, *s;
+	unsigned int	n;
+	char		conv;
+
+	c->text = f;
+	while (*f != '\0' && *f != '%') {
+		f++;
+	}
+	c->textlen = f - c->text;
+
+	c->length = 0;
+	c->wstar = false;
+	c->pstar = false;
+	c->prec = -1;
+
+	if (*f == '\0') {
+		c->type = LOG_ARG_END;
+		*fmt = f;
+		return;
+	}
+
+	s = f++;
+	if (*f == '%') {
+		c->type = LOG_ARG_PCT;
+		*fmt = f + 1;
+		return;
+	}
+
+	c->type = LOG_ARG_BAD;
+
+	/* Flags, width and precision */
+	f += strspn(f, "-+ #0'");
+	if (*f == '*') {
+		c->wstar = true;
+		f++;
+	} else {
+		f += strspn(f, "0123456789");
+	}
+
+	if (*f == '.') {
+		f++;
+		if (*f == '*') {
+			c->pstar = true;
+			f++;
+		} else {
+			for (c->prec = 0; *f >= '0' && *f <= '9'; f++) {
+				c->prec = c->prec * 10 + (*f - '0');
+			}
+		}
+	}
+
+	n = f - s;
+
+	switch (*f) {
+	case 'h':
+	case 'l':
+		c->length = *f++;
+		if (*f == c->length) {
+			c->length = c->length == 'h' ? 'H' : 'q';
+			f++;
+		}
+		break;
+
+	case 'q':
+	case 'j':
+	case 'z':
+	case 't':
+	case 'L':
+		c->length = *f++;
+		break;
+
+	default:
+		break;
+	}
+
+	conv = *f;
+	if (conv == '\0' || n + 4 > sizeof c->spec) {
+		return;
+	}
+
+	*fmt = f + 1;
+
+	switch (conv) {
+	case 'd':
+	case 'i':
+		c->type = LOG_ARG_INT;
+		break;
+
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+		c->type = LOG_ARG_UINT;
+		break;
+
+	case 'c':
+		c->type = LOG_ARG_CHAR;
+		break;
+
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		c->type = LOG_ARG_DOUBLE;
+		break;
+
+	case 's':
+		c->type = LOG_ARG_STR;
+		break;
+
+	case 'p':
+		c->type = LOG_ARG_PTR;
+		break;
+
+	default:
+		/* %n, %m, positional ones ('$' ends up here) */
+		return;
+	}
+
+	/* Only integers have a length, doubles only 'l' (ignored) */
+	if ((c->length == 'L') ||
+	    (c->length != 0 && c->length != 'l' && c->type == LOG_ARG_DOUBLE) ||
+	    (c->length != 0 && c->type != LOG_ARG_INT &&
+	     c->type != LOG_ARG_UINT && c->type != LOG_ARG_DOUBLE)) {
+		c->type = LOG_ARG_BAD;
+		return;
+	}
+
+	memcpy(c->spec, s, n);
+	if (c->type == LOG_ARG_INT || c->type == LOG_ARG_UINT) {
+		c->spec[n++] = 'l';
+		c->spec[n++] = 'l';
+	}
+	c->spec[n++] = conv;
+	c->spec[n] = '\0';
+}
+
+/* Add to a record, false when it does not fit */
+static bool
+log_rec_put(uint8_t *rec, uint32_t *len, const void *p, uint32_t n);
+static bool
+log_rec_put(uint8_t *rec, uint32_t *len, const void *p, uint32_t n) {
+	if (*len + n > LOG_REC_MAX) {
+		return (false);
+	}
+
+	memcpy(&rec[*len], p, n);
+	*len += n;
+
+	return (true);
+}
+
+/* Take the next value out of a record, false when it is not there */
+static bool
+log_rec_get(const uint8_t *rec, uint32_t len, uint32_t *off,
+	    void *p, uint32_t n);
+static bool
+log_rec_get(const uint8_t *rec, uint32_t len, uint32_t *off,
+	    void *p, uint32_t n) {
+	if (*off + n > len) {
+		return (false);
+	}
+
+	memcpy(p, &rec[*off], n);
+	*off += n;
+
+	return (true);
+}
+
+/*
+ * Capture a line with its arguments in rec (LOG_REC_ARGS), returns its
+ * length; 0 when it can't be deferred, it is formatted right away then
+ */
+static uint32_t
+log_async_captureVA(uint8_t *rec, unsigned int level, const char *caller,
+		    int errnum, const char *format, va_list ap)
+		    ATTR_FORMAT(printf, 5, 0);
+static uint32_t
+log_async_captureVA(uint8_t *rec, unsigned int level, const char *caller,
+		    int errnum, const char *format, va_list ap)
+{
+	log_rec_t	h;
+	log_conv_t	c;
+	const char	*f = format, *s;
+	uint64_t	msec, u;
+	int64_t		i;
+	double		d;
+	uint32_t	len = sizeof h, n;
+	int		prec;
+
+	memzero(&h, sizeof h);
+	h.kind = LOG_REC_ARGS;
+	h.level = level;
+	h.errnum = errnum;
+	h.tid = l_alog_tid;
+	h.msec = clk_now(&msec) * 1000 + msec;
+	h.format = (uintptr_t)format;
+	h.caller = (uintptr_t)caller;
+	memcpy(rec, &h, sizeof h);
+
+	while (true) {
+		log_conv_next(&f, &c);
+
+		if (c.type == LOG_ARG_END) {
+			break;
+		}
+
+		if (c.type == LOG_ARG_PCT) {
+			continue;
+		}
+
+		if (c.type == LOG_ARG_BAD) {
+			return (0);
+		}
+
+		prec = c.prec;
+
+		if (c.wstar) {
+			i = va_arg(ap, int);
+			if (!log_rec_put(rec, &len, &i, sizeof i)) {
+				return (0);
+			}
+		}
+
+		if (c.pstar) {
+			prec = va_arg(ap, int);
+			i = prec;
+			if (!log_rec_put(rec, &len, &i, sizeof i)) {
+				return (0);
+			}
+		}
+
+		switch (c.type) {
+		case LOG_ARG_INT:
+			switch (c.length) {
+			case 'H':
+				i = (signed char)va_arg(ap, int);
+				break;
+			case 'h':
+				i = (short)va_arg(ap, int);
+				break;
+			case 'l':
+				i = va_arg(ap, long);
+				break;
+			case 'q':
+				i = va_arg(ap, long long);
+				break;
+			case 'j':
+				i = va_arg(ap, intmax_t);
+				break;
+			case 'z':
+				i = va_arg(ap, ssize_t);
+				break;
+			case 't':
+				i = va_arg(ap, ptrdiff_t);
+				break;
+			default:
+				i = va_arg(ap, int);
+				break;
+			}
+
+			if (!log_rec_put(rec, &len, &i, sizeof i)) {
+				return (0);
+			}
+			break;
+
+		case LOG_ARG_UINT:
+			switch (c.length) {
+			case 'H':
+				u = (unsigned char)va_arg(ap, unsigned int);
+				break;
+			case 'h':
+				u = (unsigned short)va_arg(ap, unsigned int);
+				break;
+			case 'l':
+				u = va_arg(ap, unsigned long);
+				break;
+			case 'q':
+				u = va_arg(ap, unsigned long long);
+				break;
+			case 'j':
+				u = va_arg(ap, uintmax_t);
+				break;
+			case 'z':
+				u = va_arg(ap, size_t);
+				break;
+			case 't':
+				u = va_arg(ap, ptrdiff_t);
+				break;
+			default:
+				u = va_arg(ap, unsigned int);
+				break;
+			}
+
+			if (!log_rec_put(rec, &len, &u, sizeof u)) {
+				return (0);
+			}
+			break;
+
+		case LOG_ARG_CHAR:
+			i = va_arg(ap, int);
+			if (!log_rec_put(rec, &len, &i, sizeof i)) {
+				return (0);
+			}
+			break;
+
+		case LOG_ARG_DOUBLE:
+			d = va_arg(ap, double);
+			if (!log_rec_put(rec, &len, &d, sizeof d)) {
+				return (0);
+			}
+			break;
+
+		case LOG_ARG_PTR:
+			u = (uintptr_t)va_arg(ap, void *);
+			if (!log_rec_put(rec, &len, &u, sizeof u)) {
+				return (0);
+			}
+			break;
+
+		case LOG_ARG_STR:
+			s = va_arg(ap, const char *);
+			if (s == NULL) {
+				n = UINT32_MAX;
+			} else {
+				/* Only upto the precision, it need not end */
+				n = prec >= 0 ? strnlen(s, prec) : strlen(s);
+				if (n > LOG_LINE_MAX) {
+					n = LOG_LINE_MAX;
+				}
+			}
+
+			if (!log_rec_put(rec, &len, &n, sizeof n) ||
+			    (s != NULL && !log_rec_put(rec, &len, s, n))) {
+				return (0);
+			}
+			break;
+
+		case LOG_ARG_END:
+		case LOG_ARG_PCT:
+		case LOG_ARG_BAD:
+		default:
+			return (0);
+		}
+	}
+
+	return (len);
+}
+
+/* A plain %d or %u, cut off like snprintf() would */
+static unsigned int
+log_replay_num(char *buf, unsigned int size, uint64_t u, bool neg);
+static unsigned int
+log_replay_num(char *buf, unsigned int size, uint64_t u, bool neg) {
+	char		tmp[24];
+	unsigned int	n = 0, len = 0;
+
+	do {
+		tmp[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u != 0);
+
+	if (neg) {
+		tmp[n++] = '-';
+	}
+
+	while (n > 0 && len < size - 1) {
+		buf[len++] = tmp[--n];
+	}
+
+	return (len);
+}
+
+/*
+ * Format one argument with the spec of its conversion, stars replaced
+ * by the width and precision that were passed. The spec and the type of
+ * the argument both come from the format, thus always fit.
+ *
+ * Plain %d, %u and %s are most of them, those go without snprintf().
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+static unsigned int
+log_replay_one(char *buf, unsigned int size, const log_conv_t *c,
+	       int64_t w, int64_t p, int64_t i, uint64_t u, double d,
+	       const char *s);
+static unsigned int
+log_replay_one(char *buf, unsigned int size, const log_conv_t *c,
+	       int64_t w, int64_t p, int64_t i, uint64_t u, double d,
+	       const char *s) {
+	char		spec[sizeof c->spec + 32];
+	const char	*x;
+	unsigned int	n = 0;
+	int		r = 0;
+
+	if (c->type == LOG_ARG_UINT && strcmp(c->spec, "%llu") == 0) {
+		return (log_replay_num(buf, size, u, false));
+	}
+
+	if (c->type == LOG_ARG_INT && (strcmp(c->spec, "%lld") == 0 ||
+				       strcmp(c->spec, "%lli") == 0)) {
+		return (log_replay_num(buf, size,
+				       i < 0 ? (uint64_t)-(i + 1) + 1 :
+					       (uint64_t)i, i < 0));
+	}
+
+	if (c->type == LOG_ARG_STR && strcmp(c->spec, "%s") == 0) {
+		n = strnlen(s, size - 1);
+		memcpy(buf, s, n);
+		return (n);
+	}
+
+	for (x = c->spec; *x != '\0' && n < sizeof spec - 24; x++) {
+		if (*x != '*') {
+			spec[n++] = *x;
+		} else if (c->wstar && x == strchr(c->spec, '*')) {
+			n += snprintf(&spec[n], sizeof spec - n, "%d", (int)w);
+		} else if (p >= 0) {
+			n += snprintf(&spec[n], sizeof spec - n, "%d", (int)p);
+		} else {
+			/* Negative: as if there was none, '.' goes too */
+			n--;
+		}
+	}
+	spec[n] = '\0';
+
+	switch (c->type) {
+	case LOG_ARG_INT:
+		r = snprintf(buf, size, spec, (long long)i);
+		break;
+
+	case LOG_ARG_UINT:
+		r = snprintf(buf, size, spec, (unsigned long long)u);
+		break;
+
+	case LOG_ARG_CHAR:
+		r = snprintf(buf, size, spec, (int)i);
+		break;
+
+	case LOG_ARG_DOUBLE:
+		r = snprintf(buf, size, spec, d);
+		break;
+
+	case LOG_ARG_PTR:
+		r = snprintf(buf, size, spec, (void *)(uintptr_t)u);
+		break;
+
+	case LOG_ARG_STR:
+		r = snprintf(buf, size, spec, s);
+		break;
+
+	case LOG_ARG_END:
+	case LOG_ARG_PCT:
+	case LOG_ARG_BAD:
+	default:
+		break;
+	}
+
+	return (r < 0 ? 0 : (unsigned int)r >= size ? size - 1 : (unsigned int)r);
+}
+#pragma GCC diagnostic pop
+
+/*
+ * Format a captured line (LOG_REC_ARGS) like log_async_formatVA() would
+ * have, with the format and caller it was for. The record is checked,
+ * what is missing is left out.
+ */
+static unsigned int
+log_replay(char *line, const uint8_t *rec, uint32_t len,
+	   const char *format, const char *caller);
+static unsigned int
+log_replay(char *line, const uint8_t *rec, uint32_t len,
+	   const char *format, const char *caller) {
+	char		s[LOG_LINE_MAX + 1];
+	log_rec_t	h;
+	log_conv_t	c;
+	const char	*f = format;
+	int64_t		w = 0, p = -1, i = 0;
+	uint64_t	u = 0;
+	double		d = 0;
+	uint32_t	off = 0, n, k;
+
+	if (!log_rec_get(rec, len, &off, &h, sizeof h)) {
+		return (0);
+	}
+
+	n = log_async_head(line, h.level, h.tid, caller, h.msec);
+
+	while (n < LOG_LINE_MAX - 1) {
+		log_conv_next(&f, &c);
+
+		k = c.textlen < LOG_LINE_MAX - 1 - n ?
+		    c.textlen : LOG_LINE_MAX - 1 - n;
+		memcpy(&line[n], c.text, k);
+		n += k;
+
+		if (c.type == LOG_ARG_END || c.type == LOG_ARG_BAD ||
+		    n >= LOG_LINE_MAX - 1) {
+			break;
+		}
+
+		if (c.type == LOG_ARG_PCT) {
+			line[n++] = '%';
+			continue;
+		}
+
+		if ((c.wstar && !log_rec_get(rec, len, &off, &w, sizeof w)) ||
+		    (c.pstar && !log_rec_get(rec, len, &off, &p, sizeof p))) {
+			break;
+		}
+
+		switch (c.type) {
+		case LOG_ARG_INT:
+		case LOG_ARG_CHAR:
+			if (!log_rec_get(rec, len, &off, &i, sizeof i)) {
+				c.type = LOG_ARG_BAD;
+			}
+			break;
+
+		case LOG_ARG_UINT:
+		case LOG_ARG_PTR:
+			if (!log_rec_get(rec, len, &off, &u, sizeof u)) {
+				c.type = LOG_ARG_BAD;
+			}
+			break;
+
+		case LOG_ARG_DOUBLE:
+			if (!log_rec_get(rec, len, &off, &d, sizeof d)) {
+				c.type = LOG_ARG_BAD;
+			}
+			break;
+
+		case LOG_ARG_STR:
+			if (!log_rec_get(rec, len, &off, &k, sizeof k)) {
+				c.type = LOG_ARG_BAD;
+			} else if (k == UINT32_MAX) {
+				strcpy(s, "(null)");
+			} else if (k > LOG_LINE_MAX ||
+				   !log_rec_get(rec, len, &off, s, k)) {
+				c.type = LOG_ARG_BAD;
+			} else {
+				s[k] = '\0';
+			}
+			break;
+
+		case LOG_ARG_END:
+		case LOG_ARG_PCT:
+		case LOG_ARG_BAD:
+		default:
+			break;
+		}
+
+		if (c.type == LOG_ARG_BAD) {
+			break;
+		}
+
+		n += log_replay_one(&line[n], LOG_LINE_MAX - n, &c,
+				    w, p, i, u, d, s);
+	}
+
+	return (log_async_tail(line, n, h.level, h.errnum));
+}
+
+static void
+log_async_release(void *ring);
+static void
+log_async_release(void *ring) {
+	/* What is still in it gets written, the next thread goes on there */
+	atomic_st(((log_ring_t *)ring)->used, false);
+}
+
+static void
+log_async_init_once(void);
+static void
+log_async_init_once(void) {
+	if (pthread_key_create(&l_alog_key, log_async_release) != 0) {
+		fassert(false);
+	}
+}
+
+/* Claim a free ring or add a new one, NULL when there is no memory */
+static log_ring_t *
+log_async_ring(void);
+static log_ring_t *
+log_async_ring(void) {
+	log_ring_t	*r, *head;
+	bool		f;
+
+	if (l_alog_me != NULL) {
+		return (l_alog_me);
+	}
+
+	for (r = atomic_ld(l_alog_rings); r != NULL; r = r->next) {
+		f = false;
+		if (atomic_ldr(r->used) == false && atomic_cas(r->used, f, true)) {
+			break;
+		}
+	}
+
+	if (r == NULL) {
+		r = mcalloc(sizeof *r, "log_ring");
+		if (r != NULL) {
+			r->buf = mcalloc(l_alog_ringsize, "log_ring_buf");
+			if (r->buf == NULL) {
+				mfree(r, sizeof *r, "log_ring");
+			}
+		}
+
+		if (r == NULL) {
+			return (NULL);
+		}
+
+		r->mask = l_alog_ringsize - 1;
+		r->used = true;
+
+		head = atomic_ld(l_alog_rings);
+		do {
+			r->next = head;
+		} while (!atomic_cas(l_alog_rings, head, r));
+	}
+
+	pthread_setspecific(l_alog_key, r);
+	l_alog_me = r;
+	l_alog_tid = (uint64_t)getthisthreadid();
+
+	return (r);
+}
+
+/* Copy in resp. out of the ring at position pos, wrapping around */
+static void
+log_async_copyin(log_ring_t *r, uint64_t pos, const void *src, uint32_t len);
+static void
+log_async_copyin(log_ring_t *r, uint64_t pos, const void *src, uint32_t len) {
+	uint32_t o = pos & r->mask, n = r->mask + 1 - o;
+
+	if (n > len) {
+		n = len;
+	}
+
+	memcpy(&r->buf[o], src, n);
+	memcpy(r->buf, (const char *)src + n, len - n);
+}
+
+static void
+log_async_copyout(log_ring_t *r, uint64_t pos, void *dst, uint32_t len);
+static void
+log_async_copyout(log_ring_t *r, uint64_t pos, void *dst, uint32_t len) {
+	uint32_t o = pos & r->mask, n = r->mask + 1 - o;
+
+	if (n > len) {
+		n = len;
+	}
+
+	memcpy(dst, &r->buf[o], n);
+	memcpy((char *)dst + n, r->buf, len - n);
+}
+
+static void
+log_async_wake(void);
+static void
+log_async_wake(void) {
+	/* Pairs with the one in log_async_sleep() */
+	atomic_fence();
+
+	if (atomic_ldr(l_alog_waiting) == 0) {
+		return;
+	}
+
+	atomic_inc(l_alog_wakeups);
+#ifdef _LINUX
+	futex_wake(&l_alog_wakeups, 1);
+#endif
+}
+
+/*
+ * Queue a line for the writer. The writer is woken once a quarter of
+ * the ring is used, a full ring yields so that the writer gets to run
+ * (it might share the CPU) and only drops the line when that did not
+ * make room, errors and worse first wait a little longer.
+ */
+static void
+log_async_push(log_ring_t *r, unsigned int level, const uint8_t *rec,
+	       uint32_t len);
+static void
+log_async_push(log_ring_t *r, unsigned int level, const uint8_t *rec,
+	       uint32_t len) {
+	uint64_t	head = r->head, used;
+	unsigned int	round;
+
+	for (round = 0; ; round++) {
+		used = head - atomic_ld(r->tail);
+		if (used + sizeof len + len <= (uint64_t)r->mask + 1) {
+			break;
+		}
+
+		log_async_wake();
+
+		if (round < LOG_YIELD_ROUNDS) {
+			sched_yield();
+			continue;
+		}
+
+		if (level > LOG_ERR ||
+		    round == LOG_YIELD_ROUNDS + LOG_WAIT_ROUNDS) {
+			atomic_inc(r->drops);
+			return;
+		}
+
+		usleep(100);
+	}
+
+	log_async_copyin(r, head, &len, sizeof len);
+	log_async_copyin(r, head + sizeof len, rec, len);
+	atomic_st(r->head, head + sizeof len + len);
+
+	/* Important ones, or filling up: no waiting for the next tick */
+	if (level <= LOG_ERR || (used + len) * 4 > r->mask) {
+		log_async_wake();
+	}
+}
+
+/* Returns false when there is no ring, it has to be logged directly */
+static bool
+log_asyncVA(unsigned int level, const char *caller,
+	    const char *format, va_list ap) ATTR_FORMAT(printf, 3, 0);
+static bool
+log_asyncVA(unsigned int level, const char *caller,
+	    const char *format, va_list ap)
+{
+	uint8_t		rec[LOG_REC_MAX];
+	int		errnum = errno;
+	log_ring_t	*r = log_async_ring();
+	uint32_t	len = 0;
+	va_list		aq;
+
+	if (r == NULL) {
+		return (false);
+	}
+
+	if (atomic_ldr(l_alog_format) != LOG_FORMAT_TEXT) {
+		va_copy(aq, ap);
+		len = log_async_captureVA(rec, level, caller, errnum,
+					  format, aq);
+		va_end(aq);
+	}
+
+	/* Text, or it can't be done later */
+	if (len == 0) {
+		rec[0] = LOG_REC_TEXT;
+		len = 1 + log_async_formatVA((char *)&rec[1], level, caller,
+					     errnum, format, ap);
+	}
+
+	log_async_push(r, level, rec, len);
+
+	return (true);
+}
+
+/*
+ * Write the batch out, rotating the file when it got too large: after
+ * the batch, thus a binary file gets the strings of its lines again.
+ */
+static void
+log_async_flush(void);
+static void
+log_async_flush(void) {
+	char		old[1024];
+	unsigned int	off;
+	ssize_t		n;
+	FILE		*f;
+
+	if (l_alog_fill == 0) {
+		return;
+	}
+
+	mutex_lock(l_mutex);
+
+	/* Not open yet? */
+	if (l_log_output == NULL && l_log_filename != NULL) {
+		l_log_output = fopen(l_log_filename, "a");
+	}
+
+	if (l_log_output != NULL) {
+		/* Anything written directly (dumppacket()) goes first */
+		fflush(l_log_output);
+
+		for (off = 0; off < l_alog_fill; off += n) {
+			n = write(fileno(l_log_output), &l_alog_batch[off],
+				  l_alog_fill - off);
+			if (n <= 0 && errno != EINTR) {
+				break;
+			}
+
+			if (n < 0) {
+				n = 0;
+			}
+		}
+
+		l_alog_size += l_alog_fill;
+	}
+
+	if (l_log_filename != NULL && l_log_output != NULL &&
+	    l_alog_maxsize != 0 && l_alog_size > l_alog_maxsize &&
+	    snprintf(old, sizeof old, "%s.1", l_log_filename) < (int)sizeof old &&
+	    rename(l_log_filename, old) == 0) {
+		/* The old one stays open (and written to) if this fails */
+		f = fopen(l_log_filename, "a");
+		if (f != NULL) {
+			fclose(l_log_output);
+			l_log_output = f;
+			l_alog_size = 0;
+			l_alog_fresh = true;
+		}
+	}
+
+	mutex_unlock(l_mutex);
+
+	l_alog_fill = 0;
+}
+
+/* Add to the batch, the caller made room (log_async_room()) */
+static void
+log_async_put(const void *p, uint32_t len);
+static void
+log_async_put(const void *p, uint32_t len) {
+	memcpy(&l_alog_batch[l_alog_fill], p, len);
+	l_alog_fill += len;
+}
+
+static void
+log_async_room(uint32_t len);
+static void
+log_async_room(uint32_t len) {
+	if (l_alog_fill + len > sizeof l_alog_batch) {
+		log_async_flush();
+	}
+}
+
+/* Binary: the string at addr, unless the file has it already */
+static void
+log_async_define(uint64_t addr);
+static void
+log_async_define(uint64_t addr) {
+	log_str_t	s;
+	uint32_t	len;
+	unsigned int	i;
+
+	for (i = log_seen_hash(addr); l_alog_seen[i] != 0;
+	     i = (i + 1) % LOG_SEEN) {
+		if (l_alog_seen[i] == addr) {
+			return;
+		}
+	}
+
+	/* Full enough: start over, they come again when used */
+	if (l_alog_nseen > LOG_SEEN / 2) {
+		memzero(l_alog_seen, sizeof l_alog_seen);
+		l_alog_nseen = 0;
+		i = log_seen_hash(addr);
+	}
+
+	l_alog_seen[i] = addr;
+	l_alog_nseen++;
+
+	memzero(&s, sizeof s);
+	s.kind = LOG_REC_STR;
+	s.addr = addr;
+
+	len = strnlen((const char *)(uintptr_t)addr, LOG_LINE_MAX);
+	len += sizeof s;
+	log_async_put(&len, sizeof len);
+	log_async_put(&s, sizeof s);
+	log_async_put((const char *)(uintptr_t)addr, len - sizeof s);
+}
+
+/* A record out of a ring into the batch, as text or as it is (binary) */
+static void
+log_async_emit(const uint8_t *rec, uint32_t len);
+static void
+log_async_emit(const uint8_t *rec, uint32_t len) {
+	char		line[LOG_LINE_MAX];
+	log_start_t	st;
+	log_rec_t	h;
+	uint32_t	n;
+
+	if (atomic_ldr(l_alog_format) != LOG_FORMAT_BINARY) {
+		if (rec[0] == LOG_REC_TEXT) {
+			log_async_room(len - 1);
+			log_async_put(&rec[1], len - 1);
+		} else {
+			memcpy(&h, rec, sizeof h);
+			n = log_replay(line, rec, len,
+				       (const char *)(uintptr_t)h.format,
+				       (const char *)(uintptr_t)h.caller);
+			log_async_room(n);
+			log_async_put(line, n);
+		}
+		return;
+	}
+
+	/* This record, its strings and a start all fit */
+	log_async_room(3 * (sizeof len + sizeof(log_str_t) + LOG_LINE_MAX) +
+		       sizeof len + len);
+
+	if (l_alog_fresh) {
+		memzero(&st, sizeof st);
+		st.kind = LOG_REC_START;
+		st.version = LOG_VERSION;
+		memcpy(st.magic, LOG_MAGIC, sizeof st.magic);
+
+		n = sizeof st;
+		log_async_put(&n, sizeof n);
+		log_async_put(&st, sizeof st);
+
+		memzero(l_alog_seen, sizeof l_alog_seen);
+		l_alog_nseen = 0;
+		l_alog_fresh = false;
+	}
+
+	if (rec[0] == LOG_REC_ARGS) {
+		memcpy(&h, rec, sizeof h);
+		log_async_define(h.format);
+		log_async_define(h.caller);
+	}
+
+	log_async_put(&len, sizeof len);
+	log_async_put(rec, len);
+}
+
+/* Move what the rings have into batches, returns the number of lines */
+static uint64_t
+log_async_drain(void);
+static uint64_t
+log_async_drain(void) {
+	uint8_t		rec[LOG_REC_MAX];
+	log_ring_t	*r;
+	uint64_t	head, tail, lines = 0, drops = 0;
+	uint32_t	len;
+
+	for (r = atomic_ld(l_alog_rings); r != NULL; r = r->next) {
+		head = atomic_ld(r->head);
+		tail = r->tail;
+
+		while (tail != head) {
+			log_async_copyout(r, tail, &len, sizeof len);
+			log_async_copyout(r, tail + sizeof len, rec, len);
+			tail += sizeof len + len;
+
+			/* Room for the next one right away */
+			atomic_st(r->tail, tail);
+
+			log_async_emit(rec, len);
+			lines++;
+		}
+
+		atomic_st(r->tail, tail);
+
+		drops += atomic_ldr(r->drops);
+	}
+
+	log_async_flush();
+
+	atomic_st(l_alog_lines, l_alog_lines + lines);
+
+	/* Shows up in the next round */
+	if (drops > l_alog_drops) {
+		log_wrn("Dropped %" PRIu64 " log lines",
+			drops - l_alog_drops);
+		l_alog_drops = drops;
+	}
+
+	return (lines);
+}
+
+/* Wait for lines, or the next tick */
+static void
+log_async_sleep(void);
+static void
+log_async_sleep(void) {
+	uint32_t	wakeups = atomic_ld(l_alog_wakeups);
+	log_ring_t	*r;
+
+	atomic_st(l_alog_waiting, 1);
+	atomic_fence();
+
+	/* Something came in meanwhile? */
+	for (r = atomic_ld(l_alog_rings); r != NULL; r = r->next) {
+		if (atomic_ld(r->head) != r->tail) {
+			break;
+		}
+	}
+
+	if (r == NULL && !atomic_ld(l_alog_stop)) {
+#ifdef _LINUX
+		futex_wait(&l_alog_wakeups, wakeups, LOG_TICK);
+#else
+		(void)wakeups;
+		usleep(LOG_TICK * 1000);
+#endif
+	}
+
+	atomic_st(l_alog_waiting, 0);
+}
+
+static void *
+log_async_writer(void *arg);
+static void *
+log_async_writer(void UNUSED *arg) {
+	while (!atomic_ld(l_alog_stop)) {
+		if (log_async_drain() == 0) {
+			log_async_sleep();
+		}
+	}
+
+	/* The rest, also what it logged itself */
+	while (log_async_drain() != 0);
+
+	return (NULL);
+}
+
+bool
+log_async_start(unsigned int ringsize, uint64_t maxsize) {
+	struct stat st;
+
+	if (l_alog_running) {
+		return (true);
+	}
+
+	if (l_log_output == NULL) {
+		log_err("Asynchronous logging needs a log file");
+		return (false);
+	}
+
+	pthread_once(&l_alog_once, log_async_init_once);
+
+	/* Rings stay (and are reused), they keep their size */
+	if (l_alog_ringsize == 0) {
+		l_alog_ringsize = LOG_REC_MAX * 4;
+		while (l_alog_ringsize < ringsize) {
+			l_alog_ringsize *= 2;
+		}
+	}
+
+	l_alog_maxsize = maxsize;
+	l_alog_size = fstat(fileno(l_log_output), &st) == 0 ? st.st_size : 0;
+	l_alog_stop = false;
+	l_alog_fresh = true;
+
+	if (pthread_create(&l_alog_writer, NULL, log_async_writer, NULL) != 0) {
+		log_err("Could not start the log writer");
+		return (false);
+	}
+
+	atomic_st(l_alog_running, true);
+
+	return (true);
+}
+
+void
+log_async_stop(void) {
+	bool running = true;
+
+	/*
+	 * Not from the writer (a log break there): nobody would join it and
+	 * the next log_async_start() would race it with a second writer
+	 */
+	if (!atomic_ld(l_alog_running) ||
+	    pthread_equal(pthread_self(), l_alog_writer)) {
+		return;
+	}
+
+	/* Only one of several callers stops it */
+	if (!atomic_cas(l_alog_running, running, false)) {
+		return;
+	}
+
+	atomic_st(l_alog_stop, true);
+	atomic_inc(l_alog_wakeups);
+#ifdef _LINUX
+	futex_wake(&l_alog_wakeups, 1);
+#endif
+
+	pthread_join(l_alog_writer, NULL);
+}
+
+void
+log_async_stats(uint64_t *lines, uint64_t *drops) {
+	log_ring_t *r;
+
+	*lines = atomic_ldr(l_alog_lines);
+	*drops = 0;
+
+	for (r = atomic_ld(l_alog_rings); r != NULL; r = r->next) {
+		*drops += atomic_ldr(r->drops);
+	}
+}
+
+bool
+log_async_format(log_format_t format) {
+	/* The threads and the writer go by it without a lock */
+	if (atomic_ld(l_alog_running)) {
+		return (false);
+	}
+
+	atomic_st(l_alog_format, format);
+
+	return (true);
+}
+
+/* A string of a binary log, by the address it had */
+typedef struct log_dstr {
+	struct log_dstr	*next;		/* Hash chain */
+	uint64_t	addr;
+	char		str[];
+} log_dstr_t;
 
-	/* The current Thread ID */
-	id = getthisthreadid();
+static void
+log_decode_clear(log_dstr_t **strs);
+static void
+log_decode_clear(log_dstr_t **strs) {
+	log_dstr_t	*s;
+	unsigned int	i;
 
-	/* Lock her up */
-	mutex_lock(l_mutex);
+	for (i = 0; i < LOG_SEEN; i++) {
+		while ((s = strs[i]) != NULL) {
+			strs[i] = s->next;
+			mfree(s, sizeof *s + strlen(s->str) + 1, "log_dstr");
+		}
+	}
+}
 
-	/* If we maintain our own log file */
-	/* Check the filesize to not exceed our threshold */
-	if (	l_log_filename &&
-		l_log_output &&
-		(fstat(fileno(l_log_output), &st) != 0 ||
-		 st.st_size > maxlogsize)) {
+static const char *
+log_decode_str(log_dstr_t **strs, uint64_t addr);
+static const char *
+log_decode_str(log_dstr_t **strs, uint64_t addr) {
+	log_dstr_t *s;
 
-		/* Error or over our limit */
-		rewind(l_log_output);
-		if (ftruncate(fileno(l_log_output), 0)) {}
+	for (s = strs[log_seen_hash(addr)]; s != NULL; s = s->next) {
+		if (s->addr == addr) {
+			return (s->str);
+		}
 	}
 
-	/* Not open yet? */
-	if (!l_log_output && l_log_filename) {
-		l_log_output = fopen(l_log_filename, "a");
+	return (NULL);
+}
+
+bool
+log_decode(FILE *in, FILE *out) {
+	uint8_t		rec[LOG_REC_MAX];
+	char		line[LOG_LINE_MAX];
+	log_dstr_t	**strs, *s;
+	log_start_t	st;
+	log_str_t	ls;
+	log_rec_t	h;
+	const char	*format, *caller;
+	uint32_t	len, n;
+	bool		started = false, ok = true;
+
+	strs = mcalloc(LOG_SEEN * sizeof *strs, "log_dstrs");
+	if (strs == NULL) {
+		return (false);
 	}
 
-	/* No log output */
-	if (!l_log_output) {
-#ifndef _WIN32
-		/* Use syslog as we have nothing better */
-		vsyslog(level, format, ap);
-		/* Note: does not log errno */
-#else
-		vfprintf(stderr, format, ap);
-#endif
-	} else {
-		char t[32], ln[9];
-		unsigned int i;
+	while (ok && fread(&len, sizeof len, 1, in) == 1) {
+		if (len == 0 || len > sizeof rec ||
+		    fread(rec, len, 1, in) != 1) {
+			ok = false;
+			break;
+		}
 
-		/* Skip repeated levels */
-		if (level == level_p) {
-			i = sizeof ln;
-			memset(ln, ' ', i);
-			ln[i - 1] = '\0';
-		} else {
-			level_p = level;
-			snprintf(ln, sizeof ln, "%s",
-				 getprioname(level));
+		/* It has to start with a start */
+		if (!started && rec[0] != LOG_REC_START) {
+			ok = false;
+			break;
 		}
 
-		/* Skip repeated thread id's */
-		snprintf(t, sizeof t, THREAD_ID, id);
+		switch (rec[0]) {
+		case LOG_REC_START:
+			memcpy(&st, rec, len < sizeof st ? len : sizeof st);
+			if (len != sizeof st || st.version != LOG_VERSION ||
+			    memcmp(st.magic, LOG_MAGIC, sizeof st.magic) != 0) {
+				ok = false;
+				break;
+			}
 
-		if (id == id_p) {
-			i = strlen(t);
-			memset(t, ' ', i);
-			t[i] = '\0';
-		} else {
-			id_p = id;
-		}
+			/* Another writer, other addresses */
+			log_decode_clear(strs);
+			started = true;
+			break;
 
-		/* Include the time in the log */
-		tm = gettimes(&msec);
-		localtime_r(&tm, &teem);
+		case LOG_REC_STR:
+			if (len < sizeof ls) {
+				ok = false;
+				break;
+			}
 
-		fprintf(l_log_output,
-#ifdef SAFDEF_LOG_LONG
-			"%4u-%02u-%02u %02u:%02u:%02u.%03" PRIu64 " "
-#else
-			"%" PRIu64 " "
-#endif
-			"%-8s %s %s() ",
-#ifdef SAFDEF_LOG_LONG
-			teem.tm_year+1900, teem.tm_mon+1, teem.tm_mday,
-			teem.tm_hour, teem.tm_min, teem.tm_sec, msec,
-#else
-			tm,
-#endif
-			ln, t, caller);
-		vfprintf(l_log_output, format, ap);
+			memcpy(&ls, rec, sizeof ls);
+			n = len - sizeof ls;
 
-		/* Add the errno + textual version */
-		if (level <= LOG_ERR) {
-			char buf[256];
-			const char *e;
+			s = mcalloc(sizeof *s + n + 1, "log_dstr");
+			if (s == NULL) {
+				ok = false;
+				break;
+			}
 
-			memzero(buf, sizeof buf);
-/*
- * There are two variants of strerror_r(), the silly GNU one and the XSI one 
- * The first returns a buffer (and might not use our buffer) the latter
- * always uses our buffer. Hence, this trick to solve the difference.
- */
-#if (!defined(_LINUX) || ((_POSIX_C_SOURCE >= 200112L || _XOPEN_SOURCE >= 600) && ! _GNU_SOURCE))
-			/* XSI version */
-			e = buf;
-#else
-			/* GNU version */
-			e =
-#endif
-			strerror_r(errnum, buf, sizeof buf);
+			s->addr = ls.addr;
+			memcpy(s->str, &rec[sizeof ls], n);
+			s->str[n] = '\0';
 
-			fprintf(l_log_output,
-				", errno: %s (%d)",
-				e,
-				errnum
-				);
-		}
+			s->next = strs[log_seen_hash(s->addr)];
+			strs[log_seen_hash(s->addr)] = s;
+			break;
 
-		fprintf(l_log_output, "\n");
-		fflush(l_log_output);
+		case LOG_REC_TEXT:
+			fwrite(&rec[1], len - 1, 1, out);
+			break;
+
+		case LOG_REC_ARGS:
+			if (len < sizeof h) {
+				ok = false;
+				break;
+			}
+
+			memcpy(&h, rec, sizeof h);
+			format = log_decode_str(strs, h.format);
+			caller = log_decode_str(strs, h.caller);
+			if (format == NULL || caller == NULL) {
+				ok = false;
+				break;
+			}
+
+			n = log_replay(line, rec, len, format, caller);
+			fwrite(line, n, 1, out);
+			break;
+
+		default:
+			ok = false;
+			break;
+		}
 	}
 
-	/* Release her */
-	mutex_unlock(l_mutex);
+	log_decode_clear(strs);
+	mfree(strs, LOG_SEEN * sizeof *strs, "log_dstrs");
+
+	return (ok && started);
 }
 
 static bool
@@ -242,31 +1744,114 @@ log_levelcheck(unsigned int level) {
 	return (level > l_log_level ? false : true);
 }
 
-/** Log line with details
- *  format SHOULD NOT include "\n"
- */
+/* Does the rule cover the site? Its file without the directories */
+static bool
+log_rule_match(const log_rule_t *r, const log_site_t *s);
+static bool
+log_rule_match(const log_rule_t *r, const log_site_t *s) {
+	const char *file = strrchr(s->file, '/');
+
+	file = file != NULL ? file + 1 : s->file;
+
+	return ((r->file[0] == '\0' || strcmp(r->file, file) == 0) &&
+		(r->caller[0] == '\0' || strcmp(r->caller, s->caller) == 0));
+}
+
+/* Whether the site logs: the last rule that covers it, or the level */
+static uint8_t
+log_site_stateL(const log_site_t *s);
+static uint8_t
+log_site_stateL(const log_site_t *s) {
+	unsigned int i = l_log_nrules;
+
+	while (i-- > 0) {
+		if (log_rule_match(&l_log_rules[i], s)) {
+			return (l_log_rules[i].on ? LOG_SITE_ON : LOG_SITE_OFF);
+		}
+	}
+
+	return (log_levelcheck(s->level) ? LOG_SITE_ON : LOG_SITE_OFF);
+}
+
+/* The level or the rules changed, all the known sites follow */
+static void
+log_sites_update(void) {
+	log_site_t *s;
+
+	lock_lock(&l_site_lock);
+
+	for (s = l_log_sites; s != NULL; s = s->next) {
+		atomic_st(s->on, log_site_stateL(s));
+	}
+
+	lock_unlock(&l_site_lock);
+}
+
+bool
+log_site_rule(const char *file, const char *caller, bool on) {
+	log_rule_t	*r;
+	bool		ret = false;
+
+	if (file == NULL) {
+		file = "";
+	}
+
+	if (caller == NULL) {
+		caller = "";
+	}
+
+	lock_lock(&l_site_lock);
+
+	if (l_log_nrules < lengthof(l_log_rules) &&
+	    strlen(file) < sizeof r->file &&
+	    strlen(caller) < sizeof r->caller) {
+		r = &l_log_rules[l_log_nrules++];
+		strcpy(r->file, file);
+		strcpy(r->caller, caller);
+		r->on = on;
+		ret = true;
+	}
+
+	lock_unlock(&l_site_lock);
+
+	if (ret) {
+		log_sites_update();
+	}
+
+	return (ret);
+}
+
 void
-logline(unsigned int level, const char *caller,
-	const char *format, ...)
-{
+log_site_rules_clear(void) {
+	lock_lock(&l_site_lock);
+	l_log_nrules = 0;
+	lock_unlock(&l_site_lock);
+
+	log_sites_update();
+}
+
+/* Log it, whatever the level, and stop at the log break level */
+static void
+loglineVA(unsigned int level, const char *caller,
+	  const char *format, va_list ap)
+	  ATTR_FORMAT(printf, 3, 0);
+static void
+loglineVA(unsigned int level, const char *caller,
+	  const char *format, va_list ap) {
 	static bool		log_break_checked = false;
 	static unsigned int	log_break_level = LOG_CRIT;
-	va_list			ap;
-
-	/* Check if we want this logged or not */
-	if (!log_levelcheck(level)) {
-		return;
-	}
+	va_list			aq;
 
 	/* Actually log it */
-	va_start(ap, format);
+	va_copy(aq, ap);
 
 	if (l_log_func)
-		l_log_func(level, caller, format, ap);
-	else
-		logitVA(level, caller, format, ap);
+		l_log_func(level, caller, format, aq);
+	else if (!atomic_ldr(l_alog_running) ||
+		 !log_asyncVA(level, caller, format, aq))
+		logitVA(level, caller, format, aq);
 
-	va_end(ap);
+	va_end(aq);
 
 	/*
 	 * During debugging we like this to bail out
@@ -283,15 +1868,62 @@ logline(unsigned int level, const char *caller,
 	}
 
 	if (level <= log_break_level) {
-		va_start(ap, format);
+		/* What came before goes out first */
+		log_async_stop();
+
 		logitVA(level, caller, "Hit Log Break", ap);
-		va_end(ap);
 
 		/* Crash and Burn */
 		fassert(false);
 	}
 }
 
+/** Log line with details
+ *  format SHOULD NOT include "\n"
+ */
+void
+logline(unsigned int level, const char *caller,
+	const char *format, ...)
+{
+	va_list ap;
+
+	/* Check if we want this logged or not */
+	if (!log_levelcheck(level)) {
+		return;
+	}
+
+	va_start(ap, format);
+	loglineVA(level, caller, format, ap);
+	va_end(ap);
+}
+
+void
+logsite(log_site_t *site, const char *format, ...) {
+	va_list ap;
+
+	/* The first hit: it gets known, the level and rules decide */
+	if (atomic_ldr(site->on) == LOG_SITE_NEW) {
+		lock_lock(&l_site_lock);
+
+		if (site->on == LOG_SITE_NEW) {
+			site->next = l_log_sites;
+			l_log_sites = site;
+			atomic_st(site->on, log_site_stateL(site));
+		}
+
+		lock_unlock(&l_site_lock);
+	}
+
+	/* Switched off in the meantime (or just now) */
+	if (atomic_ldr(site->on) != LOG_SITE_ON) {
+		return;
+	}
+
+	va_start(ap, format);
+	loglineVA(site->level, site->caller, format, ap);
+	va_end(ap);
+}
+
 const uint8_t ipv4_mapped_ipv6_prefix[12] = {	0, 0, 0, 0,
 						0, 0, 0, 0,
 						0, 0, 0xff, 0xff
@@ -552,10 +2184,57 @@ cond_wait_(cond_t *c, mutex_t *m, unsigned int msec) {
 #endif /* _WIN32 */
 }
 
+#ifdef _LINUX
+bool
+futex_wait(uint32_t *addr, uint32_t val, unsigned int msec) {
+	struct timespec	timeout;
+	long		rc;
+
+	/* Relative timeout, unlike cond_wait_() */
+	timeout.tv_sec = msec / 1000;
+	timeout.tv_nsec = (msec % 1000) * (1000 * 1000);
+
+	rc = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val,
+		     msec == 0 ? NULL : &timeout, NULL, 0);
+
+	/* EAGAIN: value already changed, EINTR: just retry at the caller */
+	return (rc == -1 && errno == ETIMEDOUT ? true : false);
+}
+
+void
+futex_wake(uint32_t *addr, unsigned int num) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, num, NULL, NULL, 0);
+}
+#endif /* _LINUX */
+
 int
-misc_map(const char *str, const misc_map_t *map, char *data) {
-	unsigned int	i = 0, l, len;
+misc_map_label(const char *label, unsigned int len, const misc_map_t *map) {
+	unsigned int i;
+
+	for (i = 0; map[i].label; i++) {
+		/*
+		 * If the length of the label does not
+		 * match we do not need to compare them
+		 */
+		if (len != map[i].label_len) {
+			continue;
+		}
+
+		if (strncasecmp(map[i].label, label, len) == 0) {
+			return (i);
+		}
+	}
+
+	/* -2 indicates not found / not mapped */
+	return (-2);
+}
+
+int
+misc_map_find(const char *str, const misc_map_t *map,
+	      const char **val, unsigned int *vlen) {
+	unsigned int	l, len;
 	const char	*s;
+	int		i;
 
 	/* How long is the string? */
 	len = strlen(str);
@@ -576,51 +2255,45 @@ misc_map(const char *str, const misc_map_t *map, char *data) {
 		return (-1);
 	}
 
-	/* Length of the value */
-	len -= (l+2);
-
-	for (i = 0; map[i].label; i++) {
-		/*
-		 * If the length of the label does not
-		 * match we do not need to compare them
-		 */
-		if (l != map[i].label_len) {
-			continue;
-		}
+	i = misc_map_label(str, l, map);
+	if (i < 0) {
+		return (i);
+	}
 
-		/* Not it then next */
-		if (strncasecmp(map[i].label, str, l) != 0) {
-			continue;
-		}
+	/* Found it, the value is behind the ": " */
+	*val = &str[l+2];
+	*vlen = len - (l+2);
 
-		/* Be sure that was the full header name */
-		if (str[l] != ':' && str[l+1] != ' ') {
-			continue;
-		}
+	return (i);
+}
 
-		/* Will it fit? */
-		if (len > map[i].len) {
-			/* During debugging we want to catch this */
-			log_dbg("Won't fit! %u vs %u\n",
-				len, map[i].len);
-			fassert(false);
-			l = map[i].len;
-		}
+int
+misc_map(const char *str, const misc_map_t *map, char *data) {
+	const char	*val;
+	unsigned int	len;
+	int		i;
 
-		/* Skip the ": " */
-		l += 2;
+	i = misc_map_find(str, map, &val, &len);
+	if (i < 0) {
+		return (i);
+	}
 
-		/* Found it, fill it in */
-		memcpy(&data[map[i].offset], &str[l], len);
+	/* Will it fit? */
+	if (len >= map[i].len) {
+		/* During debugging we want to catch this */
+		log_dbg("Won't fit! %u vs %u\n",
+			len, map[i].len);
+		fassert(false);
+		len = map[i].len - 1;
+	}
 
-		/* Make sure the string is terminated */
-		data[map[i].offset + len] = '\0';
+	/* Found it, fill it in */
+	memcpy(&data[map[i].offset], val, len);
 
-		return (i);
-	}
+	/* Make sure the string is terminated */
+	data[map[i].offset + len] = '\0';
 
-	/* -2 indicates not found / not mapped */
-	return (-2);
+	return (i);
 }
 
 static const struct {
@@ -1534,8 +3207,8 @@ parse_iso8601_interval(const char *interval, uint64_t *start, uint64_t *end) {
 }
 
 void
-steg_free(const char *steg, unsigned int steg_len, 
-	  const char *mime, unsigned int mime_len)
+steg_free(const char *steg, unsigned int UNUSED steg_len,
+	  const char *mime, unsigned int UNUSED mime_len)
 {
 	if (steg != NULL) {
 		fassert(steg_len != 0);
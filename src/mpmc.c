@@ -0,0 +1,190 @@
+#include <libfutil/misc.h>
+
+bool
+mpmc_init(mpmc_t *q, unsigned int size) {
+	uint64_t i, n;
+
+	fassert(q);
+	memzero(q, sizeof *q);
+
+	/* Power of 2, thus a cell is pos & mask */
+	for (n = 2; n < size; n <<= 1);
+
+	q->cells = mcalloc(sizeof *q->cells * n, "mpmc_cells");
+	if (q->cells == NULL) {
+		log_err("Could not allocate %" PRIu64 " queue cells", n);
+		return (false);
+	}
+
+	for (i = 0; i < n; i++) {
+		q->cells[i].seq = i;
+	}
+
+	q->mask = n - 1;
+	q->head = 0;
+	q->tail = 0;
+	q->waiters = 0;
+	q->wakeups = 0;
+
+#ifndef _LINUX
+	mutex_init(q->mutex);
+	cond_init(q->cond);
+#endif
+
+	return (true);
+}
+
+void
+mpmc_destroy(mpmc_t *q) {
+	fassert(q);
+	fassert(q->waiters == 0);
+
+	if (q->cells == NULL) {
+		return;
+	}
+
+	mfree(q->cells, sizeof *q->cells * (q->mask + 1), "mpmc_cells");
+	q->cells = NULL;
+
+#ifndef _LINUX
+	cond_destroy(q->cond);
+	mutex_destroy(q->mutex);
+#endif
+}
+
+void
+mpmc_wake(mpmc_t *q) {
+	/*
+	 * Pairs with the increment of waiters in mpmc_pop_wait():
+	 * either we see the waiter or it sees what we pushed.
+	 */
+	atomic_fence();
+
+	if (atomic_ldr(q->waiters) == 0) {
+		return;
+	}
+
+#ifdef _LINUX
+	atomic_inc(q->wakeups);
+	futex_wake(&q->wakeups, 1);
+#else
+	mutex_lock(q->mutex);
+	cond_trigger(q->cond);
+	mutex_unlock(q->mutex);
+#endif
+}
+
+bool
+mpmc_push(mpmc_t *q, void *data) {
+	mpmc_cell_t	*cell;
+	uint64_t	pos, seq;
+	int64_t		dif;
+
+	fassert(data != NULL);
+
+	pos = atomic_ldr(q->head);
+	while (true) {
+		cell = &q->cells[pos & q->mask];
+		seq = atomic_ld(cell->seq);
+		dif = (int64_t)seq - (int64_t)pos;
+
+		if (dif == 0) {
+			/* Free cell, claim it */
+			if (atomic_cas(q->head, pos, pos + 1)) {
+				break;
+			}
+
+			/* pos got updated by the failed CAS */
+		} else if (dif < 0) {
+			/* Cell still holds the previous round: full */
+			return (false);
+		} else {
+			/* Another producer was faster */
+			pos = atomic_ldr(q->head);
+		}
+	}
+
+	cell->data = data;
+	atomic_st(cell->seq, pos + 1);
+
+	mpmc_wake(q);
+
+	return (true);
+}
+
+void *
+mpmc_pop(mpmc_t *q) {
+	mpmc_cell_t	*cell;
+	uint64_t	pos, seq;
+	int64_t		dif;
+	void		*data;
+
+	pos = atomic_ldr(q->tail);
+	while (true) {
+		cell = &q->cells[pos & q->mask];
+		seq = atomic_ld(cell->seq);
+		dif = (int64_t)seq - (int64_t)(pos + 1);
+
+		if (dif == 0) {
+			/* Filled cell, claim it */
+			if (atomic_cas(q->tail, pos, pos + 1)) {
+				break;
+			}
+		} else if (dif < 0) {
+			/* Not filled (yet): empty */
+			return (NULL);
+		} else {
+			/* Another consumer was faster */
+			pos = atomic_ldr(q->tail);
+		}
+	}
+
+	data = cell->data;
+
+	/* Hand the cell to the producers of the next round */
+	atomic_st(cell->seq, pos + q->mask + 1);
+
+	return (data);
+}
+
+void *
+mpmc_pop_wait(mpmc_t *q, unsigned int msec) {
+	void		*data;
+#ifdef _LINUX
+	uint32_t	wakeups;
+#endif
+
+	data = mpmc_pop(q);
+	if (data != NULL || msec == 0) {
+		return (data);
+	}
+
+#ifdef _LINUX
+	/* A wakeup after this makes futex_wait() return immediately */
+	wakeups = atomic_ld(q->wakeups);
+	atomic_inc(q->waiters);
+
+	/* Re-check now that producers can see us */
+	data = mpmc_pop(q);
+	if (data == NULL) {
+		futex_wait(&q->wakeups, wakeups, msec);
+		data = mpmc_pop(q);
+	}
+
+	atomic_dec(q->waiters);
+#else
+	mutex_lock(q->mutex);
+	atomic_inc(q->waiters);
+
+	data = mpmc_pop(q);
+	if (data == NULL) {
+		cond_wait(q->cond, q->mutex, msec);
+		data = mpmc_pop(q);
+	}
+
+	atomic_dec(q->waiters);
+	mutex_unlock(q->mutex);
+#endif
+
+	return (data);
+}
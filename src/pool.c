@@ -0,0 +1,134 @@
+#include <libfutil/misc.h>
+
+void
+pool_init(pool_t *pool, size_t size, const char *name) {
+	fassert(size >= sizeof(pool_obj_t));
+
+	memzero(pool, sizeof *pool);
+	lock_init(&pool->lock);
+	pool->size = size;
+	pool->name = name;
+}
+
+/* Free a list of objects taken off the pool, they count as trimmed */
+static void
+pool_free(pool_t *pool, pool_obj_t *obj);
+static void
+pool_free(pool_t *pool, pool_obj_t *obj) {
+	pool_obj_t	*next;
+	uint64_t	n = 0;
+
+	for (; obj != NULL; obj = next) {
+		next = obj->next;
+		mfree(obj, pool->size, pool->name);
+		n++;
+	}
+
+	if (n == 0) {
+		return;
+	}
+
+	lock_lock(&pool->lock);
+	pool->trimmed += n;
+	lock_unlock(&pool->lock);
+}
+
+void
+pool_destroy(pool_t *pool) {
+	fassert(pool->inuse == 0);
+
+	pool_trim(pool);
+	lock_destroy(&pool->lock);
+}
+
+void *
+pool_get(pool_t *pool) {
+	pool_obj_t *obj;
+
+	lock_lock(&pool->lock);
+
+	obj = pool->free;
+	if (obj != NULL) {
+		pool->free = obj->next;
+		pool->nfree--;
+		pool->reuses++;
+	} else {
+		pool->allocs++;
+	}
+
+	pool->inuse++;
+	if (pool->inuse > pool->hiwat) {
+		pool->hiwat = pool->inuse;
+	}
+
+	lock_unlock(&pool->lock);
+
+	if (obj == NULL) {
+		obj = mcalloc(pool->size, pool->name);
+		if (obj == NULL) {
+			log_err("Could not allocate %s", pool->name);
+
+			lock_lock(&pool->lock);
+			pool->inuse--;
+			lock_unlock(&pool->lock);
+		}
+	}
+
+	return (obj);
+}
+
+void
+pool_put(pool_t *pool, void *o) {
+	pool_obj_t	*obj = (pool_obj_t *)o, *trim = NULL;
+	unsigned int	keep;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	lock_lock(&pool->lock);
+
+	fassert(pool->inuse > 0);
+	pool->inuse--;
+
+	obj->next = pool->free;
+	pool->free = obj;
+	pool->nfree++;
+
+	/*
+	 * End of a window: keep what it took to get back to its peak,
+	 * the next window starts counting from what is in use now
+	 */
+	if (++pool->puts >= POOL_WINDOW) {
+		keep = pool->hiwat - pool->inuse;
+
+		while (pool->nfree > keep) {
+			obj = pool->free;
+			pool->free = obj->next;
+			pool->nfree--;
+
+			obj->next = trim;
+			trim = obj;
+		}
+
+		pool->hiwat = pool->inuse;
+		pool->puts = 0;
+	}
+
+	lock_unlock(&pool->lock);
+
+	pool_free(pool, trim);
+}
+
+void
+pool_trim(pool_t *pool) {
+	pool_obj_t *trim;
+
+	lock_lock(&pool->lock);
+	trim = pool->free;
+	pool->free = NULL;
+	pool->nfree = 0;
+	lock_unlock(&pool->lock);
+
+	pool_free(pool, trim);
+}
@@ -0,0 +1,322 @@
+#include <limits.h>
+
+#include <libfutil/misc.h>
+
+#ifdef _LINUX
+#include <linux/membarrier.h>
+#endif
+
+/* Per-thread reader record, on its own cache line */
+typedef struct rcu_reader {
+	struct rcu_reader *next;	/* All records */
+	uint64_t	ctr;		/* Epoch entered, 0 = not reading */
+	unsigned int	nest;		/* Nesting of read sections */
+	bool		used;		/* Claimed by a thread */
+	char		pad[64 - sizeof(void *) - sizeof(uint64_t) -
+			    sizeof(unsigned int) - sizeof(bool)];
+} rcu_reader_t;
+
+/* Current epoch, starts at 1 as 0 means 'not reading' */
+static uint64_t l_rcu_epoch = 1;
+
+/* All reader records, only ever added to (until rcu_exit()) */
+static rcu_reader_t *l_rcu_readers = NULL;
+
+/* Record of this thread */
+static __thread rcu_reader_t *l_rcu_me = NULL;
+
+/* Writers waiting for readers to leave, and the futex they sleep on */
+static uint32_t l_rcu_waiting = 0;
+static uint32_t l_rcu_wakeups = 0;
+
+#ifndef _WIN32
+/* Serializes grace periods */
+static mutex_t l_rcu_gpmutex = PTHREAD_MUTEX_INITIALIZER;
+/* Protects the pending callbacks */
+static mutex_t l_rcu_mutex = PTHREAD_MUTEX_INITIALIZER;
+#else
+static mutex_t l_rcu_gpmutex;
+static mutex_t l_rcu_mutex;
+#endif
+
+static rcu_head_t *l_rcu_pending = NULL;
+static unsigned int l_rcu_npending = 0;
+
+/*
+ * With membarrier() the writers force the memory barrier onto the
+ * readers when they need it, readers then only need a compiler
+ * barrier. Decided once, before the first reader record exists.
+ */
+static pthread_once_t l_rcu_once = PTHREAD_ONCE_INIT;
+static bool l_rcu_memb = false;
+
+static void
+rcu_init_once(void);
+static void
+rcu_init_once(void) {
+#ifdef _LINUX
+	if (syscall(SYS_membarrier,
+		    MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0) {
+		l_rcu_memb = true;
+	}
+#endif
+}
+
+/* Barrier on the read side */
+#define rcu_rmb() {							\
+	if (l_rcu_memb) {						\
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);		\
+	} else {							\
+		atomic_fence();						\
+	}								\
+}
+
+/* Barrier on the write side, also orders all the readers */
+static void
+rcu_wmb(void);
+static void
+rcu_wmb(void) {
+#ifdef _LINUX
+	if (l_rcu_memb) {
+		if (syscall(SYS_membarrier,
+			    MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0) {
+			return;
+		}
+
+		log_crt("membarrier() failed: %s", strerror(errno));
+		fassert(false);
+	}
+#endif
+
+	atomic_fence();
+}
+
+/* Claim a free record or add a new one */
+static rcu_reader_t *
+rcu_reader(void);
+static rcu_reader_t *
+rcu_reader(void) {
+	rcu_reader_t	*r, *head;
+	bool		f;
+
+	if (l_rcu_me != NULL) {
+		return (l_rcu_me);
+	}
+
+	pthread_once(&l_rcu_once, rcu_init_once);
+
+	for (r = atomic_ld(l_rcu_readers); r != NULL; r = r->next) {
+		f = false;
+		if (atomic_ldr(r->used) == false && atomic_cas(r->used, f, true)) {
+			l_rcu_me = r;
+			return (r);
+		}
+	}
+
+	r = mcalloc(sizeof *r, "rcu_reader");
+	if (r == NULL) {
+		log_crt("Could not allocate RCU reader record");
+		fassert(false);
+		return (NULL);
+	}
+
+	r->used = true;
+
+	head = atomic_ld(l_rcu_readers);
+	do {
+		r->next = head;
+	} while (!atomic_cas(l_rcu_readers, head, r));
+
+	l_rcu_me = r;
+	return (r);
+}
+
+void
+rcu_read_lock(void) {
+	rcu_reader_t *r = rcu_reader();
+
+	if (r->nest++ > 0) {
+		return;
+	}
+
+	/* Visible before anything the section reads */
+	atomic_st(r->ctr, atomic_ldr(l_rcu_epoch));
+	rcu_rmb();
+}
+
+void
+rcu_read_unlock(void) {
+	rcu_reader_t *r = l_rcu_me;
+
+	fassert(r != NULL && r->nest > 0);
+
+	if (--r->nest > 0) {
+		return;
+	}
+
+	/* Release: the section's reads are done before */
+	atomic_st(r->ctr, 0);
+	rcu_rmb();
+
+	/* A writer is waiting for readers to leave */
+	if (atomic_ldr(l_rcu_waiting) > 0) {
+		atomic_inc(l_rcu_wakeups);
+#ifdef _LINUX
+		futex_wake(&l_rcu_wakeups, INT_MAX);
+#endif
+	}
+}
+
+void
+rcu_synchronize(void) {
+	rcu_reader_t	*r;
+	uint64_t	epoch, c;
+	uint32_t	seq;
+
+	/* Would wait for ourselves */
+	fassert(l_rcu_me == NULL || l_rcu_me->nest == 0);
+
+	pthread_once(&l_rcu_once, rcu_init_once);
+
+	mutex_lock(l_rcu_gpmutex);
+
+	/* Whatever was published before is visible to the next readers */
+	rcu_wmb();
+	epoch = atomic_inc(l_rcu_epoch);
+	rcu_wmb();
+
+	/* Wait for the readers that entered before */
+	for (r = atomic_ld(l_rcu_readers); r != NULL; r = r->next) {
+		while (true) {
+			c = atomic_ld(r->ctr);
+			if (c == 0 || c >= epoch) {
+				break;
+			}
+
+			/* Readers leaving after this wake us */
+			atomic_inc(l_rcu_waiting);
+			seq = atomic_ld(l_rcu_wakeups);
+			rcu_wmb();
+
+			c = atomic_ld(r->ctr);
+			if (c != 0 && c < epoch) {
+#ifdef _LINUX
+				/* Timeout only as a safety net */
+				futex_wait(&l_rcu_wakeups, seq, 100);
+#else
+				(void)seq;
+				usleep(100);
+#endif
+			}
+
+			atomic_dec(l_rcu_waiting);
+		}
+	}
+
+	/* Frees after this are ordered after the readers */
+	rcu_wmb();
+
+	mutex_unlock(l_rcu_gpmutex);
+}
+
+/* Run callbacks of a list taken off pending (after a grace period) */
+static void
+rcu_run(rcu_head_t *head);
+static void
+rcu_run(rcu_head_t *head) {
+	rcu_head_t *next;
+
+	for (; head != NULL; head = next) {
+		next = head->next;
+		head->func(head);
+	}
+}
+
+void
+rcu_defer(rcu_head_t *head, rcu_func_t func) {
+	rcu_head_t *list = NULL;
+
+	head->func = func;
+
+	mutex_lock(l_rcu_mutex);
+	head->next = l_rcu_pending;
+	l_rcu_pending = head;
+	l_rcu_npending++;
+
+	/* Reclaim in batches, amortizing the grace period */
+	if (l_rcu_npending >= RCU_DEFER_BATCH &&
+	    (l_rcu_me == NULL || l_rcu_me->nest == 0)) {
+		list = l_rcu_pending;
+		l_rcu_pending = NULL;
+		l_rcu_npending = 0;
+	}
+	mutex_unlock(l_rcu_mutex);
+
+	if (list != NULL) {
+		rcu_synchronize();
+		rcu_run(list);
+	}
+}
+
+void
+rcu_barrier(void) {
+	rcu_head_t *list;
+
+	mutex_lock(l_rcu_mutex);
+	list = l_rcu_pending;
+	l_rcu_pending = NULL;
+	l_rcu_npending = 0;
+	mutex_unlock(l_rcu_mutex);
+
+	rcu_synchronize();
+	rcu_run(list);
+}
+
+void
+rcu_thread_offline(void) {
+	rcu_reader_t *r = l_rcu_me;
+
+	if (r == NULL) {
+		return;
+	}
+
+	fassert(r->nest == 0);
+
+	l_rcu_me = NULL;
+	atomic_st(r->used, false);
+}
+
+void
+rcu_thread_cancel(void) {
+	rcu_reader_t *r = l_rcu_me;
+
+	if (r == NULL) {
+		return;
+	}
+
+	/* Cancelled inside a section, it never gets to leave it itself */
+	if (r->nest > 0) {
+		r->nest = 1;
+		rcu_read_unlock();
+	}
+
+	rcu_thread_offline();
+}
+
+void
+rcu_exit(void) {
+	rcu_reader_t *r, *next;
+
+	rcu_barrier();
+
+	for (r = atomic_ld(l_rcu_readers); r != NULL; r = next) {
+		next = r->next;
+
+		/* Threads that did not go offline have to be gone */
+		fassert(r->ctr == 0);
+		mfree(r, sizeof *r, "rcu_reader");
+	}
+
+	l_rcu_readers = NULL;
+	l_rcu_me = NULL;
+}
@@ -1,119 +1,342 @@
+#include <limits.h>
+
 #include <libfutil/misc.h>
 
+#ifdef DEBUG
+/* Read locks this thread holds, they do not nest (rwl.h) */
+#define RWL_HELD 8
+
+static __thread rwl_t *l_rwl_held[RWL_HELD];
+static __thread unsigned int l_rwl_nheld = 0;
+
+static void
+rwl_hold(rwl_t *l);
+static void
+rwl_hold(rwl_t *l) {
+	unsigned int i;
+
+	for (i = 0; i < l_rwl_nheld; i++) {
+		fassert(l_rwl_held[i] != l);
+	}
+
+	if (l_rwl_nheld < RWL_HELD) {
+		l_rwl_held[l_rwl_nheld++] = l;
+	}
+}
+
+static void
+rwl_release(rwl_t *l);
+static void
+rwl_release(rwl_t *l) {
+	unsigned int i;
+
+	for (i = 0; i < l_rwl_nheld; i++) {
+		if (l_rwl_held[i] == l) {
+			l_rwl_held[i] = l_rwl_held[--l_rwl_nheld];
+			return;
+		}
+	}
+}
+#endif /* DEBUG */
+
+/* Sleep while *addr == val */
+static void
+rwl_wait(rwl_t *l, uint32_t *addr, uint32_t val);
+static void
+rwl_wait(rwl_t UNUSED *l, uint32_t *addr, uint32_t val) {
+#ifdef _LINUX
+	futex_wait(addr, val, 0);
+#else
+	mutex_lock(l->mutex);
+	while (atomic_ld(*addr) == val) {
+		cond_wait(l->cond, l->mutex, 1000);
+	}
+	mutex_unlock(l->mutex);
+#endif
+}
+
+/* Bump *addr and wake num sleepers on it */
+static void
+rwl_wake(rwl_t *l, uint32_t *addr, unsigned int num);
+static void
+rwl_wake(rwl_t UNUSED *l, uint32_t *addr, unsigned int UNUSED num) {
+	atomic_inc(*addr);
+
+#ifdef _LINUX
+	futex_wake(addr, num);
+#else
+	mutex_lock(l->mutex);
+	cond_trigger(l->cond);
+	mutex_unlock(l->mutex);
+#endif
+}
+
+/* Reader slot of the CPU we are on (big reader mode) */
+static rwl_slot_t *
+rwl_slot(rwl_t *l);
+static rwl_slot_t *
+rwl_slot(rwl_t *l) {
+	unsigned int	cpu = 0;
+#ifdef _LINUX
+	int		c;
+
+	c = sched_getcpu();
+	if (c > 0) {
+		cpu = c;
+	}
+#endif
+
+	return (&l->slots[cpu % l->nslots]);
+}
+
 void
 rwl_init(rwl_t *l) {
 	fassert(l);
 	memzero(l, sizeof *l);
+
+	lock_init(&l->writer);
+
+#ifndef _LINUX
 	mutex_init(l->mutex);
-	mutex_init(l->mutexW);
-	l->readers = 0;
-	l->writers = 0;
+	cond_init(l->cond);
+#endif
+}
+
+bool
+rwl_init_bigreader(rwl_t *l) {
+	long	n;
+
+	rwl_init(l);
+
+	n = sysconf(_SC_NPROCESSORS_CONF);
+	l->nslots = n > 0 ? n : 1;
+
+	l->slots = mcalloc(sizeof *l->slots * l->nslots, "rwl_slots");
+	if (l->slots == NULL) {
+		log_err("Could not allocate %u reader slots", l->nslots);
+		rwl_destroy(l);
+		return (false);
+	}
+
+	return (true);
 }
 
 void
 rwl_destroy(rwl_t *l) {
+	unsigned int	i;
+
 	fassert(l);
-	fassert(l->readers == 0);
-	fassert(l->writers == 0);
+	fassert(l->state == 0);
+	fassert(l->rwaiters == 0);
+	fassert(l->wwaiters == 0);
 
+	if (l->slots != NULL) {
+		for (i = 0; i < l->nslots; i++) {
+			fassert(l->slots[i].readers == 0);
+		}
+
+		mfree(l->slots, sizeof *l->slots * l->nslots, "rwl_slots");
+		l->slots = NULL;
+	}
+
+	lock_destroy(&l->writer);
+
+#ifndef _LINUX
+	cond_destroy(l->cond);
 	mutex_destroy(l->mutex);
-	mutex_destroy(l->mutexW);
+#endif
+}
+
+/* Sleep until (state & mask) is clear, or might be */
+static void
+rwl_waitR(rwl_t *l, uint32_t mask);
+static void
+rwl_waitR(rwl_t *l, uint32_t mask) {
+	uint32_t seq;
+
+	/* Pairs with the check for rwaiters in rwl_unlockW() */
+	atomic_inc(l->rwaiters);
+	seq = atomic_ld(l->rseq);
+	atomic_fence();
+
+	if (atomic_ld(l->state) & mask) {
+		rwl_wait(l, &l->rseq, seq);
+	}
+
+	atomic_dec(l->rwaiters);
 }
 
 void
 rwl_lockR(rwl_t *l) {
+	rwl_slot_t	*slot;
+	uint32_t	s;
+
 	fassert(l);
 
-	mutex_lock(l->mutex);
+#ifdef DEBUG
+	rwl_hold(l);
+#endif
 
-	/* Let me read! */
-	l->readers++;
+	if (l->slots != NULL) {
+		while (true) {
+			/* Announce ourselves, then check for a writer */
+			slot = rwl_slot(l);
+			__atomic_add_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST);
 
-	/* Release the readers/writers lock */
-	mutex_unlock(l->mutex);
+			if ((__atomic_load_n(&l->state, __ATOMIC_SEQ_CST) &
+			     RWL_WRITER) == 0) {
+				return;
+			}
 
-	/* Any waiting writers? Then wait for them to finish */
-	if (l->writers > 0) {
-		/* Try to get the Write Lock */
-		mutex_lock(l->mutexW);
+			/* Back off, the writer might be waiting for us */
+			__atomic_sub_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST);
+			rwl_wake(l, &l->wseq, 1);
 
-		/* Release it, because readers > 0 it won't be grabbed fully by a writer */
-		mutex_unlock(l->mutexW);
+			rwl_waitR(l, RWL_WRITER);
+		}
+	}
+
+	while (true) {
+		s = atomic_ld(l->state);
+
+		/* Writers that are waiting go first */
+		if ((s & (RWL_WRITER | RWL_WWAIT)) == 0) {
+			if (atomic_cas(l->state, s, s + 1)) {
+				return;
+			}
+
+			continue;
+		}
+
+		rwl_waitR(l, RWL_WRITER | RWL_WWAIT);
 	}
 }
 
 void
 rwl_unlockR(rwl_t *l) {
+	rwl_slot_t	*slot;
+	uint32_t	s;
+
 	fassert(l);
-	fassert(l->readers > 0);
 
-	/* One less reader */
-	mutex_lock(l->mutex);
+#ifdef DEBUG
+	rwl_release(l);
+#endif
 
-	l->readers--;
+	if (l->slots != NULL) {
+		/*
+		 * Can be another slot than the one of rwl_lockR() when
+		 * the thread moved, only the sum over all slots counts.
+		 */
+		slot = rwl_slot(l);
+		__atomic_sub_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST);
 
-	mutex_unlock(l->mutex);
+		if (__atomic_load_n(&l->state, __ATOMIC_SEQ_CST) & RWL_WRITER) {
+			rwl_wake(l, &l->wseq, 1);
+		}
+
+		return;
+	}
+
+	s = __atomic_sub_fetch(&l->state, 1, __ATOMIC_SEQ_CST);
+	fassert((s & RWL_READERS) != RWL_READERS);
+
+	/* Last reader out lets a waiting writer in */
+	if ((s & RWL_READERS) == 0 && (s & RWL_WWAIT)) {
+		rwl_wake(l, &l->wseq, 1);
+	}
+}
+
+/* Number of readers in big reader mode */
+static int64_t
+rwl_readers(rwl_t *l);
+static int64_t
+rwl_readers(rwl_t *l) {
+	unsigned int	i;
+	int64_t		n = 0;
+
+	for (i = 0; i < l->nslots; i++) {
+		n += __atomic_load_n(&l->slots[i].readers, __ATOMIC_SEQ_CST);
+	}
+
+	return (n);
 }
 
 void
 rwl_lockW(rwl_t *l) {
-	bool		w = false;
+	uint32_t	s, seq;
 
 	fassert(l);
 
-	mutex_lock(l->mutex);
-
-	/* Let me write! */
-	l->writers++;
+	if (l->slots != NULL) {
+		lock_lock(&l->writer);
 
-	/* Try to get the write lock */
-	if (mutex_trylock(l->mutexW))
-		w = true;
+		/* Stop new readers, then wait for the ones inside */
+		__atomic_store_n(&l->state, RWL_WRITER, __ATOMIC_SEQ_CST);
+		atomic_fence();
 
-	/* Is something reading? */
-	while (l->readers > 0 || !w) {
-		/* Give it back */
-		mutex_unlock(l->mutex);
+		while (true) {
+			seq = atomic_ld(l->wseq);
+			if (rwl_readers(l) == 0) {
+				break;
+			}
 
-		/* Release it for a bit */
-		if (w) {
-			mutex_unlock(l->mutexW);
-			w = false;
+			rwl_wait(l, &l->wseq, seq);
 		}
 
-		/* Force a context switch */
-#ifndef _WIN32
-		sched_yield();
-#else
-		Sleep(0);
-#endif
+		return;
+	}
+
+	/* Pairs with the check for wwaiters in rwl_unlockW() */
+	atomic_inc(l->wwaiters);
 
-		/* Grab it again */
-		mutex_lock(l->mutex);
+	while (true) {
+		seq = atomic_ld(l->wseq);
+		atomic_fence();
+		s = atomic_ld(l->state);
 
-		/* Try to get the write lock */
-		if (mutex_trylock(l->mutexW))
-			w = true;
+		if ((s & (RWL_WRITER | RWL_READERS)) == 0) {
+			if (atomic_cas(l->state, s, RWL_WRITER)) {
+				break;
+			}
+
+			continue;
+		}
+
+		/* Hold off new readers */
+		if ((s & RWL_WWAIT) == 0 &&
+		    !atomic_cas(l->state, s, s | RWL_WWAIT)) {
+			continue;
+		}
+
+		rwl_wait(l, &l->wseq, seq);
 	}
 
-	mutex_unlock(l->mutex);
+	atomic_dec(l->wwaiters);
 }
 
 void
 rwl_unlockW(rwl_t *l) {
 	fassert(l);
-	fassert(l->writers > 0);
+	fassert(l->state & RWL_WRITER);
 
-	/* Acquire the readers/writers lock */
-	mutex_lock(l->mutex);
+	/*
+	 * Also clears RWL_WWAIT: the readers that queued up get in
+	 * before the next writer sets it again.
+	 */
+	__atomic_store_n(&l->state, 0, __ATOMIC_SEQ_CST);
+	atomic_fence();
 
-	/* One less writer */
-	l->writers--;
+	if (atomic_ld(l->rwaiters) > 0) {
+		rwl_wake(l, &l->rseq, INT_MAX);
+	}
 
-	/* Unlock the write lock*/
-	mutex_unlock(l->mutexW);
+	if (l->slots != NULL) {
+		lock_unlock(&l->writer);
+		return;
+	}
 
-	/* Release */
-	mutex_unlock(l->mutex);
+	if (atomic_ld(l->wwaiters) > 0) {
+		rwl_wake(l, &l->wseq, 1);
+	}
 }
-
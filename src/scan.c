@@ -0,0 +1,289 @@
+/* Delimiter search */
+
+#include <libfutil/misc.h>
+#include <libfutil/scan.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+typedef struct {
+	const char	*name;
+	const char	*(*find2)(const char *s, const char *e, char a, char b);
+	const char	*(*set)(const scan_set_t *set, const char *s,
+				const char *e);
+} scan_ops_t;
+
+/* Word at a time: bytes that are zero get their top bit set */
+#define SCAN_ONES	0x0101010101010101ULL
+#define SCAN_HIGHS	0x8080808080808080ULL
+#define SCAN_ZERO(w)	(((w) - SCAN_ONES) & ~(w) & SCAN_HIGHS)
+
+static const char *
+scan_scalar_find2(const char *s, const char *e, char a, char b);
+static const char *
+scan_scalar_find2(const char *s, const char *e, char a, char b) {
+	uint64_t	w, wa = SCAN_ONES * (uint8_t)a, wb = SCAN_ONES * (uint8_t)b;
+
+	/* Eight bytes at a time, only looking at single bytes for the hit */
+	while (e - s >= 8) {
+		memcpy(&w, s, sizeof w);
+		if (SCAN_ZERO(w ^ wa) | SCAN_ZERO(w ^ wb)) {
+			break;
+		}
+
+		s += 8;
+	}
+
+	for (; s < e; s++) {
+		if (*s == a || *s == b) {
+			return (s);
+		}
+	}
+
+	return (NULL);
+}
+
+static const char *
+scan_scalar_set(const scan_set_t *set, const char *s, const char *e);
+static const char *
+scan_scalar_set(const scan_set_t *set, const char *s, const char *e) {
+	unsigned int i;
+
+	for (; s < e; s++) {
+		for (i = 0; i < set->n; i++) {
+			if (*s == set->c[i]) {
+				return (s);
+			}
+		}
+	}
+
+	return (NULL);
+}
+
+#ifdef SCAN_X86
+/*
+ * The SIMD ones start with whole blocks, the last block is the one that
+ * ends at e: it overlaps with what was looked at already, that part is
+ * shifted off the mask. Less than a block goes to the smaller version.
+ */
+
+/* SSE2 is always there on x86_64 */
+static const char *
+scan_sse2_find2(const char *s, const char *e, char a, char b);
+static const char *
+scan_sse2_find2(const char *s, const char *e, char a, char b) {
+	__m128i		va, vb, v;
+	unsigned int	m;
+
+	if (e - s < 16) {
+		return (scan_scalar_find2(s, e, a, b));
+	}
+
+	va = _mm_set1_epi8(a);
+	vb = _mm_set1_epi8(b);
+
+	for (; e - s > 16; s += 16) {
+		v = _mm_loadu_si128((const __m128i *)(const void *)s);
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+						   _mm_cmpeq_epi8(v, vb)));
+		if (m != 0) {
+			return (s + __builtin_ctz(m));
+		}
+	}
+
+	v = _mm_loadu_si128((const __m128i *)(const void *)(e - 16));
+	m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+					   _mm_cmpeq_epi8(v, vb)));
+	m >>= 16 - (e - s);
+
+	return (m != 0 ? s + __builtin_ctz(m) : NULL);
+}
+
+/* Mask of the bytes of the block at s that are in the set */
+#define SCAN_SSE2_SET(vc, n, s, m) {					\
+	__m128i		_v, _hit;					\
+	unsigned int	_i;						\
+									\
+	_v = _mm_loadu_si128((const __m128i *)(const void *)(s));	\
+	_hit = _mm_cmpeq_epi8(_v, vc[0]);				\
+	for (_i = 1; _i < (n); _i++) {					\
+		_hit = _mm_or_si128(_hit, _mm_cmpeq_epi8(_v, vc[_i]));	\
+	}								\
+									\
+	m = _mm_movemask_epi8(_hit);					\
+}
+
+static const char *
+scan_sse2_set(const scan_set_t *set, const char *s, const char *e);
+static const char *
+scan_sse2_set(const scan_set_t *set, const char *s, const char *e) {
+	__m128i		vc[SCAN_SET_MAX];
+	unsigned int	i, m;
+
+	if (e - s < 16) {
+		return (scan_scalar_set(set, s, e));
+	}
+
+	/* Unused ones too, they are never compared against */
+	for (i = 0; i < SCAN_SET_MAX; i++) {
+		vc[i] = _mm_set1_epi8(set->c[i < set->n ? i : 0]);
+	}
+
+	for (; e - s > 16; s += 16) {
+		SCAN_SSE2_SET(vc, set->n, s, m);
+		if (m != 0) {
+			return (s + __builtin_ctz(m));
+		}
+	}
+
+	SCAN_SSE2_SET(vc, set->n, e - 16, m);
+	m >>= 16 - (e - s);
+
+	return (m != 0 ? s + __builtin_ctz(m) : NULL);
+}
+
+/* Only called when the CPU has AVX2 */
+static const char *
+scan_avx2_find2(const char *s, const char *e, char a, char b);
+__attribute__((target("avx2"))) static const char *
+scan_avx2_find2(const char *s, const char *e, char a, char b) {
+	__m256i		va, vb, v;
+	unsigned int	m;
+
+	if (e - s < 32) {
+		return (scan_sse2_find2(s, e, a, b));
+	}
+
+	va = _mm256_set1_epi8(a);
+	vb = _mm256_set1_epi8(b);
+
+	for (; e - s > 32; s += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(const void *)s);
+		m = _mm256_movemask_epi8(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+					_mm256_cmpeq_epi8(v, vb)));
+		if (m != 0) {
+			return (s + __builtin_ctz(m));
+		}
+	}
+
+	v = _mm256_loadu_si256((const __m256i *)(const void *)(e - 32));
+	m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+						 _mm256_cmpeq_epi8(v, vb)));
+	m >>= 32 - (e - s);
+
+	return (m != 0 ? s + __builtin_ctz(m) : NULL);
+}
+
+#define SCAN_AVX2_SET(vc, n, s, m) {					\
+	__m256i		_v, _hit;					\
+	unsigned int	_i;						\
+									\
+	_v = _mm256_loadu_si256((const __m256i *)(const void *)(s));	\
+	_hit = _mm256_cmpeq_epi8(_v, vc[0]);				\
+	for (_i = 1; _i < (n); _i++) {					\
+		_hit = _mm256_or_si256(_hit,				\
+				       _mm256_cmpeq_epi8(_v, vc[_i]));	\
+	}								\
+									\
+	m = _mm256_movemask_epi8(_hit);					\
+}
+
+static const char *
+scan_avx2_set(const scan_set_t *set, const char *s, const char *e);
+__attribute__((target("avx2"))) static const char *
+scan_avx2_set(const scan_set_t *set, const char *s, const char *e) {
+	__m256i		vc[SCAN_SET_MAX];
+	unsigned int	i, m;
+
+	if (e - s < 32) {
+		return (scan_sse2_set(set, s, e));
+	}
+
+	for (i = 0; i < SCAN_SET_MAX; i++) {
+		vc[i] = _mm256_set1_epi8(set->c[i < set->n ? i : 0]);
+	}
+
+	for (; e - s > 32; s += 32) {
+		SCAN_AVX2_SET(vc, set->n, s, m);
+		if (m != 0) {
+			return (s + __builtin_ctz(m));
+		}
+	}
+
+	SCAN_AVX2_SET(vc, set->n, e - 32, m);
+	m >>= 32 - (e - s);
+
+	return (m != 0 ? s + __builtin_ctz(m) : NULL);
+}
+#endif /* SCAN_X86 */
+
+static const scan_ops_t l_scan_ops[SCAN_MAX] = {
+	[SCAN_SCALAR]	= { "scalar", scan_scalar_find2, scan_scalar_set },
+#ifdef SCAN_X86
+	[SCAN_SSE2]	= { "sse2", scan_sse2_find2, scan_sse2_set },
+	[SCAN_AVX2]	= { "avx2", scan_avx2_find2, scan_avx2_set },
+#endif
+};
+
+/* The one in use, picked on the first call */
+static const scan_ops_t *l_scan = NULL;
+
+bool
+scan_select(scan_impl_t impl) {
+	if (impl == SCAN_AUTO) {
+		return (scan_select(SCAN_AVX2) ||
+			scan_select(SCAN_SSE2) ||
+			scan_select(SCAN_SCALAR));
+	}
+
+	if (impl >= SCAN_MAX || l_scan_ops[impl].name == NULL) {
+		return (false);
+	}
+
+#ifdef SCAN_X86
+	if (impl == SCAN_AVX2 && !__builtin_cpu_supports("avx2")) {
+		return (false);
+	}
+#endif
+
+	atomic_st(l_scan, &l_scan_ops[impl]);
+	return (true);
+}
+
+static const scan_ops_t *
+scan_ops(void);
+static const scan_ops_t *
+scan_ops(void) {
+	const scan_ops_t *ops = atomic_ldr(l_scan);
+
+	if (ops == NULL) {
+		/* Can't fail, scalar is always there */
+		if (!scan_select(SCAN_AUTO)) {
+			fassert(false);
+		}
+
+		ops = atomic_ldr(l_scan);
+	}
+
+	return (ops);
+}
+
+const char *
+scan_find2(const char *s, const char *e, char a, char b) {
+	return (scan_ops()->find2(s, e, a, b));
+}
+
+const char *
+scan_set(const scan_set_t *set, const char *s, const char *e) {
+	fassert(set->n > 0 && set->n <= SCAN_SET_MAX);
+
+	return (scan_ops()->set(set, s, e));
+}
+
+const char *
+scan_name(void) {
+	return (scan_ops()->name);
+}
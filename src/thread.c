@@ -16,6 +16,22 @@ static mutex_t l_tmutex;
 static bool l_keep_running = true;
 static char *l_pidfile = NULL;
 
+/*
+ * Lookup table of the threads, read without locks (RCU), a new
+ * version is published under l_tmutex for every thread that starts
+ * or stops. Entries can be NULL.
+ */
+typedef struct {
+	rcu_head_t	rcu;			/* Deferred free */
+	unsigned int	num;			/* Number of entries */
+	mythread_t	*threads[];		/* The threads */
+} thread_table_t;
+
+static thread_table_t *l_ttable = NULL;
+
+/* The thread we are, set by thread_start() */
+static __thread mythread_t *l_tself = NULL;
+
 static const char *ts_names[20] = {
 	"dying",
 	"running",
@@ -93,7 +109,7 @@ void
 process_destroy(myprocess_t *p, bool force) {
 	int r;
 
-	fassert(p != NULL)
+	fassert(p != NULL);
 
 	log_dbg("Signalling %u to %s at PID %" PRIu64")",
 		force ? SIGKILL : SIGTERM,
@@ -468,63 +484,101 @@ thread_init(void) {
 	return (true);
 }
 
-/* Get & Lock current thread handle */
-static mythread_t *
-thread_getbyid(os_thread_id thread_id);
-static mythread_t *
-thread_getbyid(os_thread_id thread_id) {
-	mythread_t *t, *tn, *tf = NULL;
+static void
+thread_table_free(rcu_head_t *head);
+static void
+thread_table_free(rcu_head_t *head) {
+	thread_table_t *tt = (thread_table_t *)head;
 
-#ifdef _WIN32
-	/* XXX */
-	if (l_threads != NULL) {
-		return (NULL);
+	mfree(tt, sizeof *tt + sizeof *tt->threads * tt->num, "thread_table");
+}
+
+/* Publish a table with add added and/or del removed, l_tmutex held */
+static void
+thread_table_set(mythread_t *add, mythread_t *del);
+static void
+thread_table_set(mythread_t *add, mythread_t *del) {
+	thread_table_t	*ott = l_ttable, *tt;
+	unsigned int	i, num = 0;
+
+	if (ott != NULL) {
+		num = ott->num;
 	}
-#else
-	mutex_lock(l_tmutex);
-#endif
 
-	list_lock(l_threads);
+	tt = mcalloc(sizeof *tt + sizeof *tt->threads * (num + 1),
+		     "thread_table");
+	if (tt == NULL) {
+		log_err("No memory for thread table");
 
-	list_for(l_threads, t, tn, mythread_t *) {
-		if (t->thread_id != thread_id)
-			continue;
+		/* Readers skip NULL entries, no copy needed for that */
+		for (i = 0; del != NULL && ott != NULL && i < ott->num; i++) {
+			if (ott->threads[i] == del) {
+				rcu_assign(ott->threads[i], NULL);
+			}
+		}
 
-		tf = t;
-		thread_lock(tf);
-		break;
+		return;
 	}
 
-	list_unlock(l_threads);
+	for (i = 0; ott != NULL && i < ott->num; i++) {
+		if (ott->threads[i] != NULL && ott->threads[i] != del) {
+			tt->threads[tt->num++] = ott->threads[i];
+		}
+	}
 
-#ifdef _WIN32
-#else
-	mutex_unlock(l_tmutex);
-#endif
+	if (add != NULL) {
+		tt->threads[tt->num++] = add;
+	}
 
-	return (tf);
+	rcu_assign(l_ttable, tt);
+
+	if (ott != NULL) {
+		rcu_defer(&ott->rcu, thread_table_free);
+	}
 }
 
+/* Get & Lock current thread handle */
 mythread_t *
 thread_getthis(void) {
-	return (thread_getbyid(getthisthreadid()));
+	mythread_t *t = l_tself;
+
+	if (t != NULL) {
+		thread_lock(t);
+	}
+
+	return (t);
 }
 
 /*
  * Remove a thread from the thread list
  * This is automatically called by the threading
- * code when it returns from the calling function
+ * code when it returns from the calling function.
+ * Returns false when thread_stopall() took it over, it frees it.
 */
-static void
+static bool
 thread_remove(mythread_t *t);
-static void
+static bool
 thread_remove(mythread_t *t) {
+	bool stopped;
 
 	fassert(t);
 
 	log_dbg("Thread %s stopped", t->description);
 
-	list_remove_l(l_threads, &t->node);
+	list_lock(l_threads);
+	stopped = t->stopped;
+	list_remove(l_threads, &t->node);
+	list_unlock(l_threads);
+
+	if (stopped) {
+		return (false);
+	}
+
+	mutex_lock(l_tmutex);
+	thread_table_set(NULL, t);
+	mutex_unlock(l_tmutex);
+
+	return (true);
 }
 
 static void
@@ -546,17 +600,18 @@ thread_destroy(mythread_t *t) {
 	mfree(t, "thread", sizeof *t);
 }
 
+/*
+ * state and served are only written by the thread itself and read
+ * (atomically) by thread_list(), no locking needed
+ */
 bool
 thread_setstate(thread_status_t state) {
-	mythread_t *t;
+	mythread_t *t = l_tself;
 
-	t = thread_getthis();
 	if (!t)
 		return (false);
 
-	t->state = state;
-
-	thread_unlock(t);
+	atomic_st(t->state, state);
 
 	return (true);
 }
@@ -581,16 +636,30 @@ thread_setmessage(const char *fmt, ...) {
 
 void
 thread_serve(void) {
-	mythread_t *t;
+	mythread_t *t = l_tself;
 
-	t = thread_getthis();
 	if (!t)
 		return;
 
-	t->served++;
+	/* Single writer: no need for an atomic increment */
+	atomic_st(t->served, atomic_ldr(t->served) + 1);
+}
 
-	thread_unlock(t);
+#ifdef _LINUX
+/* Pin the calling thread to a set of CPUs */
+bool
+thread_setaffinity(const cpu_set_t *cpus) {
+	int r;
+
+	r = pthread_setaffinity_np(pthread_self(), sizeof *cpus, cpus);
+	if (r != 0) {
+		log_wrn("pthread_setaffinity_np() failed (%d)", r);
+		return (false);
+	}
+
+	return (true);
 }
+#endif
 
 /* Let the thread sleep for X msecs, but allow it to be interrupted for exit */
 /* Returns true when fully slept out, false when it was interrupted */
@@ -610,9 +679,9 @@ thread_sleep(unsigned int msec) {
 		return (false);
 	}
 
-	t->state = thread_state_sleeping;
+	atomic_st(t->state, thread_state_sleeping);
 	ret = cond_wait(t->cond, t->mutex, msec);
-	t->state = thread_state_running;
+	atomic_st(t->state, thread_state_running);
 
 	/* Unlock the thread */
 	thread_unlock(t);
@@ -634,11 +703,50 @@ thread_start(mythread_t *t) {
 		"Thread %s started%s", t->description,
 		t->start_routine ? "" : " (" STR(PROJECT_BUILDTIME) ")");
 
+	l_tself = t;
+
 	/* Add self to the list of threads */
 	list_addtail_l(l_threads, &t->node);
+
+	mutex_lock(l_tmutex);
+	thread_table_set(t, NULL);
+	mutex_unlock(l_tmutex);
+}
+
+/* The thread is done with itself, cancelled or returned */
+static void
+thread_finish(mythread_t *t, bool cancelled);
+static void
+thread_finish(mythread_t *t, bool cancelled) {
+	bool owned = thread_remove(t);
+
+	if (cancelled) {
+		rcu_thread_cancel();
+	} else {
+		rcu_thread_offline();
+	}
+
+	l_tself = NULL;
+
+	/* thread_stopall() frees it once it sees this, hands off */
+	if (!owned) {
+		atomic_st(t->exited, true);
+		return;
+	}
+
+	/* Nobody can find it anymore, wait for those that just did */
+	rcu_synchronize();
+	thread_destroy(t);
 }
 
 #ifndef _WIN32
+static void
+thread_cancelled(void *arg);
+static void
+thread_cancelled(void *arg) {
+	thread_finish((mythread_t *)arg, true);
+}
+
 static void *
 thread_autoremove(void *arg);
 static void *
@@ -666,11 +774,18 @@ thread_autoremove(LPVOID arg) {
 	thread_start(t);
 
 	/* The actual fun stuff */
+#ifndef _WIN32
+	pthread_cleanup_push(thread_cancelled, t);
+#endif
 	t->start_routine(t->arg);
+#ifndef _WIN32
+	/* A cancel from here on would skip the cleanup */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_pop(0);
+#endif
 
 	/* And the cleanup */
-	thread_remove(t);
-	thread_destroy(t);
+	thread_finish(t, false);
 
 #ifndef _WIN32
 	return (NULL);
@@ -738,12 +853,16 @@ thread_add(const char *description, void *(*start_routine)(void *), void *arg)
 	return (true);
 }
 
+/* How long (msec) a forced exit waits for a cancelled thread to be gone */
+#define THREAD_CANCEL_WAIT 1000
+
 void
 thread_stopall(bool force) {
 	unsigned	int i = 0, max = 5;
-	bool		done = false;
+	bool		done = false, leaked = false;
 	mythread_t	*t, *tn;
 	os_thread_id	tid = getthisthreadid();
+	hlist_t		gone;
 
 	log_dbg("Signaling threads that they should exit");
 
@@ -808,7 +927,21 @@ thread_stopall(bool force) {
 	if (force && !list_isempty(l_threads)) {
 		log_dbg("Forcing Thread Exit");
 
-		while ((t = (mythread_t *)list_pop(l_threads))) {
+		list_init(&gone);
+
+		while (true) {
+			/* Ours from here on, it does not free itself */
+			list_lock(l_threads);
+			t = (mythread_t *)list_pop_l(l_threads);
+			if (t != NULL) {
+				t->stopped = true;
+			}
+			list_unlock(l_threads);
+
+			if (t == NULL) {
+				break;
+			}
+
 			if (t->thread_id != tid) {
 				thread_lock(t);
 				log_dbg(
@@ -824,11 +957,48 @@ thread_stopall(bool force) {
 #ifndef _WIN32
 				pthread_cancel(t->thread);
 #endif
+
+				/* Its cleanup still uses it (l_tself too) */
+				for (i = 0; i < THREAD_CANCEL_WAIT &&
+				     !atomic_ldr(t->exited); i++) {
+					usleep(1000);
+				}
+
+				if (!atomic_ldr(t->exited)) {
+					log_err("Thread " THREAD_ID " \"%s\" "
+						"did not exit, leaking it",
+						t->thread_id, t->description);
+					leaked = true;
+					continue;
+				}
+			} else {
+				l_tself = NULL;
 			}
 
-			/* Destroy it */
-			thread_destroy(t);
+			/* Unpublish, freed after the readers that found it */
+			mutex_lock(l_tmutex);
+			thread_table_set(NULL, t);
+			mutex_unlock(l_tmutex);
+
+			list_addtail(&gone, &t->node);
+		}
+
+		/*
+		 * Only once all are gone: one still running (cancelled or
+		 * not) could be in a read section that we would wait on.
+		 * With one left running that wait might not end, leak them.
+		 */
+		if (!leaked) {
+			rcu_synchronize();
+		}
+
+		while ((t = (mythread_t *)list_pop(&gone))) {
+			if (!leaked) {
+				thread_destroy(t);
+			}
 		}
+
+		list_destroy(&gone);
 	}
 
 	log_dbg("done");
@@ -862,6 +1032,14 @@ thread_exit(void) {
 	mfree(l_threads, sizeof *l_threads, "l_threads");
 	l_threads = NULL;
 
+	/* Old thread tables that are still pending */
+	rcu_exit();
+
+	if (l_ttable != NULL) {
+		thread_table_free(&l_ttable->rcu);
+		l_ttable = NULL;
+	}
+
 	if (l_pidfile) {
 		unlink(l_pidfile);
 		l_pidfile = NULL;
@@ -872,39 +1050,64 @@ thread_exit(void) {
 	mutex_destroy(l_tmutex);
 }
 
-unsigned int
-thread_list(thread_list_f cb, void *cbdata) {
+/* Either cb or scb gets called for every thread */
+static unsigned int
+thread_list_do(thread_list_f cb, thread_stats_f scb, void *cbdata);
+static unsigned int
+thread_list_do(thread_list_f cb, thread_stats_f scb, void *cbdata) {
 	mythread_t	*t, *tn, *tc;
 	os_thread_id	thread_id = getthisthreadid();
+	thread_table_t	*ttable;
 	struct tm	teem;
 	uint64_t	now = gettime();
-	unsigned int	cnt = 0;
+	unsigned int	cnt = 0, i;
 	char		st[64];
 	hlist_t		tl;
 	time_t		tt;
 
 	list_init(&tl);
 
-	list_lock(l_threads);
-	list_for(l_threads, t, tn, mythread_t *) {
+	/* The threads keep running, only the message needs their lock */
+	rcu_read_lock();
+
+	ttable = rcu_dereference(l_ttable);
+	for (i = 0; ttable != NULL && i < ttable->num; i++) {
+		t = rcu_dereference(ttable->threads[i]);
+		if (t == NULL)
+			continue;
+
 		tc = mcalloc(sizeof *t, "tmpthread");
 		if (tc == NULL)
 			break;
 
-		/* Clone it */
+		/* Clone it, description goes away with the thread */
+		node_init(&tc->node);
+		tc->thread_num = t->thread_num;
+		tc->thread_id = t->thread_id;
+		tc->starttime = t->starttime;
+		tc->description = mstrdup(t->description,
+					  "tmpthread_description");
+		tc->state = atomic_ldr(t->state);
+		tc->served = atomic_ldr(t->served);
+		tc->local = atomic_ldr(t->local);
+		tc->steals = atomic_ldr(t->steals);
+
 		thread_lock(t);
-		memcpy(tc, t, sizeof *tc);
+		memcpy(tc->message, t->message, sizeof tc->message);
 		thread_unlock(t);
 
-		/* Empty the node, it is a clone */
-		node_init(&tc->node);
+		if (tc->description == NULL) {
+			mfree(tc, sizeof *tc, "tmpthread");
+			break;
+		}
 
 		list_addtail(&tl, &tc->node);
 
 		/* Another thread */
 		cnt++;
 	}
-	list_unlock(l_threads);
+
+	rcu_read_unlock();
 
 	/* Now, lockless, do the call backs */
 	list_for(&tl, t, tn, mythread_t *) {
@@ -914,17 +1117,27 @@ thread_list(thread_list_f cb, void *cbdata) {
 		snprintf(st, sizeof st, FMT_DATETIME, fmt_datetime(teem));
 
 		/* Callback which might actually show the details */
-		cb(cbdata,
-		   t->thread_num,
-		   t->thread_id,
-		   st,
-		   now - t->starttime,
-		   t->description,
-		   t->thread_id == thread_id,
-		   ts_names[t->state],
-		   t->message,
-		   t->served);
+		if (cb != NULL) {
+			cb(cbdata,
+			   t->thread_num,
+			   t->thread_id,
+			   st,
+			   now - t->starttime,
+			   t->description,
+			   t->thread_id == thread_id,
+			   ts_names[t->state],
+			   t->message,
+			   t->served);
+		} else {
+			scb(cbdata,
+			    t->thread_num,
+			    t->description,
+			    t->served,
+			    t->local,
+			    t->steals);
+		}
 
+		mfreestrdup(t->description, "tmpthread_description");
 		mfree(t, sizeof *t, "tmpthread");
 	}
 
@@ -933,6 +1146,16 @@ thread_list(thread_list_f cb, void *cbdata) {
 	return (cnt);
 }
 
+unsigned int
+thread_list(thread_list_f cb, void *cbdata) {
+	return (thread_list_do(cb, NULL, cbdata));
+}
+
+unsigned int
+thread_stats(thread_stats_f cb, void *cbdata) {
+	return (thread_list_do(NULL, cb, cbdata));
+}
+
 void
 thread_stop_running(void) {
 	log_dbg("Stop running...");
@@ -953,6 +1176,249 @@ thread_keep_running(void) {
 	return (r);
 }
 
+bool
+executor_init(executor_t *ex, unsigned int workers, unsigned int qsize) {
+	executor_worker_t	*w;
+	unsigned int		i;
+
+	fassert(workers > 0);
+	memzero(ex, sizeof *ex);
+
+	ex->workers = mcalloc(workers * sizeof *ex->workers, "executor_workers");
+	if (ex->workers == NULL) {
+		log_crt("No memory for %u executor workers", workers);
+		return (false);
+	}
+
+	for (i = 0; i < workers; i++) {
+		w = &ex->workers[i];
+		w->ex = ex;
+		w->num = i;
+
+		if (!mpmc_init(&w->q, qsize)) {
+			ex->num = i;
+			executor_destroy(ex);
+			return (false);
+		}
+
+#ifndef _LINUX
+		mutex_init(w->mutex);
+		cond_init(w->cond);
+#endif
+	}
+
+	ex->num = workers;
+
+	return (true);
+}
+
+void
+executor_destroy(executor_t *ex) {
+	unsigned int i;
+
+	fassert(ex->idle == 0);
+
+	for (i = 0; i < ex->num; i++) {
+		mpmc_destroy(&ex->workers[i].q);
+
+#ifndef _LINUX
+		cond_destroy(ex->workers[i].cond);
+		mutex_destroy(ex->workers[i].mutex);
+#endif
+	}
+
+	if (ex->workers != NULL) {
+		mfree(ex->workers, ex->num * sizeof *ex->workers,
+		      "executor_workers");
+	}
+
+	memzero(ex, sizeof *ex);
+}
+
+executor_worker_t *
+executor_join(executor_t *ex) {
+	executor_worker_t	*w;
+	unsigned int		n;
+
+	n = __atomic_fetch_add(&ex->joined, 1, __ATOMIC_RELAXED);
+	if (n >= ex->num) {
+		log_err("Executor has only %u workers", ex->num);
+		return (NULL);
+	}
+
+	w = &ex->workers[n];
+
+	/* Only for the statistics */
+	w->thread = l_tself;
+
+	return (w);
+}
+
+static void
+executor_unpark(executor_worker_t *w);
+static void
+executor_unpark(executor_worker_t *w) {
+#ifdef _LINUX
+	atomic_inc(w->wakeups);
+	futex_wake(&w->wakeups, 1);
+#else
+	mutex_lock(w->mutex);
+	cond_trigger(w->cond);
+	mutex_unlock(w->mutex);
+#endif
+}
+
+void
+executor_wake(executor_t *ex) {
+	unsigned int i;
+
+	/* Pairs with the increment of parked in executor_next() */
+	atomic_fence();
+
+	if (atomic_ldr(ex->idle) == 0) {
+		return;
+	}
+
+	for (i = 0; i < ex->num; i++) {
+		if (atomic_ldr(ex->workers[i].parked) > 0) {
+			executor_unpark(&ex->workers[i]);
+			return;
+		}
+	}
+}
+
+bool
+executor_submit(executor_t *ex, void *item, unsigned int hint) {
+	executor_worker_t	*w;
+	unsigned int		i, n;
+
+	if (hint >= ex->num) {
+		hint = __atomic_fetch_add(&ex->next, 1, __ATOMIC_RELAXED);
+		hint %= ex->num;
+	}
+
+	/* The hinted one, or the next one with room */
+	for (i = 0, n = hint; i < ex->num; i++, n = (n + 1) % ex->num) {
+		if (mpmc_push(&ex->workers[n].q, item)) {
+			break;
+		}
+	}
+
+	if (i == ex->num) {
+		return (false);
+	}
+
+	w = &ex->workers[n];
+
+	/* Pairs with the increment of parked in executor_next() */
+	atomic_fence();
+
+	/* Wake the owner, or when it is busy somebody who can steal it */
+	if (atomic_ldr(w->parked) > 0) {
+		executor_unpark(w);
+	} else {
+		executor_wake(ex);
+	}
+
+	return (true);
+}
+
+/* Own queue first, then steal from the others */
+static void *
+executor_take(executor_worker_t *w);
+static void *
+executor_take(executor_worker_t *w) {
+	executor_t	*ex = w->ex;
+	unsigned int	i;
+	void		*item;
+
+	item = mpmc_pop(&w->q);
+	if (item != NULL) {
+		if (w->thread != NULL) {
+			__atomic_add_fetch(&w->thread->local, 1,
+					   __ATOMIC_RELAXED);
+		}
+		return (item);
+	}
+
+	for (i = 1; i < ex->num; i++) {
+		item = mpmc_pop(&ex->workers[(w->num + i) % ex->num].q);
+		if (item == NULL) {
+			continue;
+		}
+
+		if (w->thread != NULL) {
+			__atomic_add_fetch(&w->thread->steals, 1,
+					   __ATOMIC_RELAXED);
+		}
+		return (item);
+	}
+
+	return (NULL);
+}
+
+void *
+executor_next(executor_worker_t *w, unsigned int msec) {
+	executor_t	*ex = w->ex;
+	void		*item;
+#ifdef _LINUX
+	uint32_t	wakeups;
+#endif
+
+	item = executor_take(w);
+	if (item != NULL || msec == 0) {
+		return (item);
+	}
+
+#ifdef _LINUX
+	/* A wakeup after this makes futex_wait() return immediately */
+	wakeups = atomic_ld(w->wakeups);
+	atomic_inc(w->parked);
+	atomic_inc(ex->idle);
+
+	/* Re-check now that submitters can see us */
+	item = executor_take(w);
+	if (item == NULL) {
+		futex_wait(&w->wakeups, wakeups, msec);
+		item = executor_take(w);
+	}
+
+	atomic_dec(ex->idle);
+	atomic_dec(w->parked);
+#else
+	mutex_lock(w->mutex);
+	atomic_inc(w->parked);
+	atomic_inc(ex->idle);
+
+	item = executor_take(w);
+	if (item == NULL) {
+		cond_wait(w->cond, w->mutex, msec);
+		item = executor_take(w);
+	}
+
+	atomic_dec(ex->idle);
+	atomic_dec(w->parked);
+	mutex_unlock(w->mutex);
+#endif
+
+	return (item);
+}
+
+void *
+executor_pop(executor_t *ex) {
+	unsigned int	i;
+	void		*item;
+
+	for (i = 0; i < ex->num; i++) {
+		item = mpmc_pop(&ex->workers[i].q);
+		if (item != NULL) {
+			return (item);
+		}
+	}
+
+	return (NULL);
+}
+
 /*
  * Returns:
  * <0 for error
@@ -1019,9 +1485,17 @@ thread_daemonize(const char *pidfile, const char *username) {
 		return (-1);
 	}
 
-	thread_destroy(t);
 	list_unlock(l_threads);
 
+	/* Unpublish, wait for readers that just found it */
+	l_tself = NULL;
+	mutex_lock(l_tmutex);
+	thread_table_set(NULL, t);
+	mutex_unlock(l_tmutex);
+
+	rcu_synchronize();
+	thread_destroy(t);
+
 	/* threads_list is now empty */
 
 	/* Daemonize */
@@ -0,0 +1,198 @@
+/* Hierarchical timer wheel */
+
+#include <libfutil/misc.h>
+
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+
+/* Ticks covered by the whole wheel */
+#define WHEEL_SPAN	((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+/* Slot index of tick t on level l */
+#define wheel_index(t, l) (((t) >> (WHEEL_BITS * (l))) & WHEEL_MASK)
+
+void
+wheel_init(wheel_t *w, uint64_t now) {
+	memzero(w, sizeof *w);
+	w->now = now;
+}
+
+void
+wheel_timer_init(wheel_timer_t *t) {
+	memzero(t, sizeof *t);
+}
+
+/* Link it into the slot that is due when it is, or that cascades first */
+static void
+wheel_place(wheel_t *w, wheel_timer_t *t);
+static void
+wheel_place(wheel_t *w, wheel_timer_t *t) {
+	uint64_t	e = t->expires, delta;
+	unsigned int	l;
+
+	/* Overdue ones go in the current slot, they are due right away */
+	if (e < w->now) {
+		e = w->now;
+	}
+
+	/* Too far out: park it at the end, it comes back here then */
+	delta = e - w->now;
+	if (delta >= WHEEL_SPAN) {
+		delta = WHEEL_SPAN - 1;
+		e = w->now + delta;
+	}
+
+	for (l = 0; l < WHEEL_LEVELS - 1 &&
+		    delta >= (uint64_t)1 << (WHEEL_BITS * (l + 1)); l++);
+
+	t->level = l;
+	t->slot = wheel_index(e, l);
+
+	t->next = w->slots[l][t->slot];
+	if (t->next != NULL) {
+		t->next->pprev = &t->next;
+	}
+
+	t->pprev = &w->slots[l][t->slot];
+	*t->pprev = t;
+
+	w->used[l] |= (uint64_t)1 << t->slot;
+}
+
+static void
+wheel_unlink(wheel_t *w, wheel_timer_t *t);
+static void
+wheel_unlink(wheel_t *w, wheel_timer_t *t) {
+	*t->pprev = t->next;
+	if (t->next != NULL) {
+		t->next->pprev = t->pprev;
+	}
+
+	if (w->slots[t->level][t->slot] == NULL) {
+		w->used[t->level] &= ~((uint64_t)1 << t->slot);
+	}
+
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+void
+wheel_arm(wheel_t *w, wheel_timer_t *t, uint64_t expires) {
+	if (wheel_armed(t)) {
+		wheel_unlink(w, t);
+	} else {
+		w->n++;
+	}
+
+	t->expires = expires;
+	wheel_place(w, t);
+}
+
+void
+wheel_cancel(wheel_t *w, wheel_timer_t *t) {
+	if (!wheel_armed(t)) {
+		return;
+	}
+
+	wheel_unlink(w, t);
+	w->n--;
+}
+
+/* The first used slot at or after slot s, as a distance */
+static unsigned int
+wheel_first(uint64_t used, unsigned int s);
+static unsigned int
+wheel_first(uint64_t used, unsigned int s) {
+	/* Rotate s down to bit 0 */
+	used = (used >> s) | (used << ((WHEEL_SLOTS - s) & WHEEL_MASK));
+
+	return (__builtin_ctzll(used));
+}
+
+uint64_t
+wheel_next(wheel_t *w) {
+	uint64_t	next = UINT64_MAX, t;
+	unsigned int	l, shift;
+
+	if (w->n == 0) {
+		return (next);
+	}
+
+	/* Level 0 slots hold exactly the ticks they are due at */
+	if (w->used[0] != 0) {
+		next = wheel_first(w->used[0], wheel_index(w->now, 0));
+	}
+
+	/*
+	 * Higher levels when their slot cascades: the current one went
+	 * already, thus the first is the one after it (or a full turn)
+	 */
+	for (l = 1; l < WHEEL_LEVELS; l++) {
+		if (w->used[l] == 0) {
+			continue;
+		}
+
+		shift = WHEEL_BITS * l;
+		t = (w->now >> shift) + 1 +
+		    wheel_first(w->used[l],
+				(wheel_index(w->now, l) + 1) & WHEEL_MASK);
+		t = (t << shift) - w->now;
+
+		if (t < next) {
+			next = t;
+		}
+	}
+
+	return (next);
+}
+
+/* Move the slots that are up now one level down */
+static void
+wheel_cascade(wheel_t *w);
+static void
+wheel_cascade(wheel_t *w) {
+	wheel_timer_t	*t;
+	unsigned int	l, s;
+
+	for (l = 1; l < WHEEL_LEVELS; l++) {
+		/* Only when all the levels below wrapped */
+		if ((w->now & (((uint64_t)1 << (WHEEL_BITS * l)) - 1)) != 0) {
+			break;
+		}
+
+		s = wheel_index(w->now, l);
+		while ((t = w->slots[l][s]) != NULL) {
+			wheel_unlink(w, t);
+			wheel_place(w, t);
+		}
+	}
+}
+
+wheel_timer_t *
+wheel_expire(wheel_t *w, uint64_t now) {
+	wheel_timer_t	*t;
+	uint64_t	d;
+
+	while (true) {
+		/* What is in the current slot is due */
+		t = w->slots[0][wheel_index(w->now, 0)];
+		if (t != NULL) {
+			wheel_unlink(w, t);
+			w->n--;
+			return (t);
+		}
+
+		if (w->now >= now) {
+			return (NULL);
+		}
+
+		/* Straight to the next thing to do, or to now */
+		d = wheel_next(w);
+		if (d > now - w->now) {
+			w->now = now;
+			continue;
+		}
+
+		w->now += d;
+		wheel_cascade(w);
+	}
+}
@@ -0,0 +1,61 @@
+#include <stdio.h>
+
+#include <libfutil/misc.h>
+#include "bench.h"
+#include "bench_buf.h"
+#include "bench_clk.h"
+#include "bench_conn.h"
+#include "bench_filecache.h"
+#include "bench_httpparse.h"
+#include "bench_lock.h"
+#include "bench_log.h"
+#include "bench_mem.h"
+#include "bench_pool.h"
+#include "bench_rcu.h"
+#include "bench_scan.h"
+#include "bench_wheel.h"
+
+uint64_t
+bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec);
+}
+
+void
+bench_report(const char *name, const char *v, uint64_t n, uint64_t ns) {
+	fprintf(stdout,
+		"- %-12s %-16s %10" PRIu64 " ops %10.1f ns/op %12.0f ops/s\n",
+		name, v, n,
+		n > 0 ? (double)ns / n : 0.0,
+		ns > 0 ? (double)n * 1000000000 / ns : 0.0);
+}
+
+int
+main(int UNUSED argc, const char UNUSED *argv[]) {
+	unsigned int fails = 0;
+
+	if (!thread_init()) {
+		fprintf(stderr, "thread_init() failed\n");
+		return (1);
+	}
+
+	fails += bench_scan();
+	fails += bench_buf();
+	fails += bench_clk();
+	fails += bench_httpparse();
+	fails += bench_lock();
+	fails += bench_log();
+	fails += bench_pool();
+	fails += bench_rcu();
+	fails += bench_conn();
+	fails += bench_filecache();
+	fails += bench_wheel();
+	fails += bench_mem();
+
+	fprintf(stdout, "- libfutil bench result: %u errors\n", fails);
+
+	return (fails);
+}
@@ -0,0 +1,10 @@
+#ifndef TESTS_BENCH_H
+#define TESTS_BENCH_H 1
+
+/* Monotonic clock in nanoseconds */
+uint64_t bench_now(void);
+
+/* name = benchmark, v = variant, n = operations, ns = time taken */
+void bench_report(const char *name, const char *v, uint64_t n, uint64_t ns);
+
+#endif /* TESTS_BENCH_H */
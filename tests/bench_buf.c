@@ -0,0 +1,146 @@
+#include <libfutil/misc.h>
+#include <libfutil/buf.h>
+#include "bench_buf.h"
+
+/*
+ * Line by line consumption of pipelined HTTP requests, the way
+ * conn_recvline() does it: find the '\n', copy the line out and shift
+ * it off the buffer. Compares buf_shift() with the previous one that
+ * moved the remainder to the front and zeroed the rest of the buffer.
+ */
+#define BENCH_BUF_HEADERS	40
+#define BENCH_BUF_PIPELINE	8
+#define BENCH_BUF_ROUNDS	2000
+
+/* What buf_shift() used to do */
+static void
+bench_buf_shift_memmove(buf_t *buf, unsigned int length);
+static void
+bench_buf_shift_memmove(buf_t *buf, unsigned int length) {
+	unsigned int left = buf_cur(buf) - length;
+
+	buf_compact(buf);
+
+	memmove(buf->buf, &buf->buf[length], left);
+	memzero(&buf->buf[left], buf->size - left);
+
+	buf->offset = left;
+}
+
+/* One request with BENCH_BUF_HEADERS headers */
+static bool
+bench_buf_request(buf_t *buf);
+static bool
+bench_buf_request(buf_t *buf) {
+	unsigned int i;
+
+	if (!buf_put(buf, "GET /some/path/to/a/resource.html?with=query HTTP/1.1\r\n"
+			  "Host: www.example.com\r\n"
+			  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) "
+			  "Gecko/20100101 Firefox/115.0\r\n"
+			  "Accept: text/html,application/xhtml+xml,application/xml;"
+			  "q=0.9,*/*;q=0.8\r\n")) {
+		return (false);
+	}
+
+	for (i = 4; i < BENCH_BUF_HEADERS; i++) {
+		if (!buf_printf(buf, "X-Header-%02u: some value that is typical "
+				"of a cookie or a token %u\r\n", i, i * 7919)) {
+			return (false);
+		}
+	}
+
+	return (buf_put(buf, "\r\n"));
+}
+
+static unsigned int
+bench_buf_run(const char *name, bool memmove);
+static unsigned int
+bench_buf_run(const char *name, bool memmove) {
+	const char	*testfunc = "buf";
+	unsigned int	fails = 0, r, lines = 0;
+	uint64_t	t, len;
+	buf_t		buf, req;
+	char		line[1024], *s;
+
+	if (!buf_init(&buf)) {
+		TEST_FAILA("buf_init", name);
+		return (1);
+	}
+
+	if (!buf_init(&req)) {
+		TEST_FAILA("buf_init", name);
+		buf_destroy(&buf);
+		return (1);
+	}
+
+	buf_lock(&buf);
+	buf_lock(&req);
+
+	/* A recv() worth of pipelined requests */
+	for (r = 0; r < BENCH_BUF_PIPELINE; r++) {
+		if (!bench_buf_request(&req)) {
+			TEST_FAILA("request", name);
+			fails++;
+			break;
+		}
+	}
+
+	t = bench_now();
+
+	for (r = 0; fails == 0 && r < BENCH_BUF_ROUNDS; r++) {
+		if (!buf_putl(&buf, buf_buffer(&req), buf_cur(&req))) {
+			TEST_FAILA("buf_putl", name);
+			fails++;
+			break;
+		}
+
+		while ((s = buf_find(&buf, 0, '\n', true)) != NULL) {
+			len = (s - buf_buffer(&buf)) + 1;
+			if (len >= sizeof line) {
+				TEST_FAILA("line too long", name);
+				fails++;
+				break;
+			}
+
+			memcpy(line, buf_buffer(&buf), len);
+			line[len] = '\0';
+			lines++;
+
+			if (memmove) {
+				bench_buf_shift_memmove(&buf, len);
+			} else {
+				buf_shift(&buf, len);
+			}
+		}
+
+		if (buf_cur(&buf) != 0) {
+			TEST_FAILA("leftover", name);
+			fails++;
+			break;
+		}
+	}
+
+	t = bench_now() - t;
+
+	bench_report(testfunc, name, r * BENCH_BUF_PIPELINE, t);
+	fprintf(stdout, "  %-29s %10.1f ns/line\n", "",
+		lines > 0 ? (double)t / lines : 0);
+
+	buf_unlock(&req);
+	buf_destroy(&req);
+	buf_unlock(&buf);
+	buf_destroy(&buf);
+
+	return (fails);
+}
+
+unsigned int
+bench_buf(void) {
+	unsigned int fails = 0;
+
+	fails += bench_buf_run("memmove", true);
+	fails += bench_buf_run("offset", false);
+
+	return (fails);
+}
@@ -0,0 +1,90 @@
+#include <libfutil/misc.h>
+#include "bench_clk.h"
+
+/*
+ * What it costs to know the time: the exact clocks against the coarse
+ * ones, and localtime_r() + formatting a log timestamp or an HTTP date
+ * against taking them from the cached second
+ */
+#define BENCH_CLK_ROUNDS	10000000
+
+/* Keeps the loops */
+static volatile uint64_t bench_clk_sink;
+
+unsigned int
+bench_clk(void) {
+	const char	*testfunc = "clk";
+	struct timespec	ts;
+	struct tm	tm;
+	char		buf[CLK_HTTP_LEN];
+	uint64_t	start, sum = 0, ms;
+	time_t		t;
+	unsigned int	i;
+
+	start = bench_now();
+	for (i = 0; i < BENCH_CLK_ROUNDS; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		sum += ts.tv_nsec;
+	}
+	bench_report(testfunc, "monotonic", BENCH_CLK_ROUNDS,
+		     bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_CLK_ROUNDS; i++) {
+		sum += clk_msec();
+	}
+	bench_report(testfunc, "msec", BENCH_CLK_ROUNDS, bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_CLK_ROUNDS; i++) {
+		sum += gettimes(&ms) + ms;
+	}
+	bench_report(testfunc, "gettimes", BENCH_CLK_ROUNDS,
+		     bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_CLK_ROUNDS; i++) {
+		sum += clk_now(&ms) + ms;
+	}
+	bench_report(testfunc, "now", BENCH_CLK_ROUNDS, bench_now() - start);
+
+	/* What a log line or a response did, and does now */
+	start = bench_now();
+	for (i = 0; i < BENCH_CLK_ROUNDS / 10; i++) {
+		t = gettime();
+		localtime_r(&t, &tm);
+		snprintf(buf, sizeof buf, "%4u-%02u-%02u %02u:%02u:%02u",
+			 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+			 tm.tm_hour, tm.tm_min, tm.tm_sec);
+		sum += buf[0];
+	}
+	bench_report(testfunc, "localtime", BENCH_CLK_ROUNDS / 10,
+		     bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_CLK_ROUNDS; i++) {
+		sum += clk_sec(gettime())->stamp[0];
+	}
+	bench_report(testfunc, "stamp", BENCH_CLK_ROUNDS, bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_CLK_ROUNDS / 10; i++) {
+		t = gettime();
+		gmtime_r(&t, &tm);
+		strftime(buf, sizeof buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+		sum += buf[0];
+	}
+	bench_report(testfunc, "gmtime", BENCH_CLK_ROUNDS / 10,
+		     bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_CLK_ROUNDS; i++) {
+		clk_http(gettime(), buf);
+		sum += buf[0];
+	}
+	bench_report(testfunc, "http", BENCH_CLK_ROUNDS, bench_now() - start);
+
+	bench_clk_sink = sum;
+
+	return (0);
+}
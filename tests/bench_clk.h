@@ -0,0 +1,9 @@
+#ifndef TESTS_BENCH_CLK_H
+#define TESTS_BENCH_CLK_H 1
+
+#include "test.h"
+#include "bench.h"
+
+unsigned int bench_clk(void);
+
+#endif /* TESTS_BENCH_CLK_H */
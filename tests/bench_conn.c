@@ -0,0 +1,463 @@
+#include <netinet/tcp.h>
+
+#include <libfutil/misc.h>
+#include <libfutil/conn.h>
+#include "bench_conn.h"
+
+/*
+ * Closed-loop echo over loopback TCP: every round each client
+ * connection sends a small message and waits for it to come back.
+ * Reports requests per second and the syscalls per request: all of
+ * them, and those of the poller (select()/epoll_*()/io_uring_enter()),
+ * the rest being recv()/writev() of the conns.
+ */
+#define BENCH_CONN_CLIENTS	64
+#define BENCH_CONN_ROUNDS	500
+#define BENCH_CONN_WORKERS	2
+#define BENCH_CONN_PORT		19380
+#define BENCH_CONN_MSG		"0123456789abcdef"
+
+typedef struct {
+	connset_t		cs;
+	executor_t		ex;		/* When using the executor */
+	bool			useex;
+	bool			stop;
+	unsigned int		pollers;	/* Still running */
+	unsigned int		workers;	/* Still running */
+} bench_conn_t;
+
+static void *
+bench_conn_poller(void *context);
+static void *
+bench_conn_poller(void *context) {
+	bench_conn_t *b = (bench_conn_t *)context;
+
+	while (!__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE)) {
+		if (connset_poll(&b->cs) < 0) {
+			break;
+		}
+	}
+
+	__atomic_sub_fetch(&b->pollers, 1, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+static void
+bench_conn_echo(conn_t *conn);
+static void
+bench_conn_echo(conn_t *conn) {
+	if (conn_recv(conn) < 0) {
+		/* Remote closed, forget about it */
+		conn_events(conn, CONN_POLLNONE);
+		connset_handling_done(conn, false);
+		conn_destroy(conn);
+		mfree(conn, sizeof *conn, "conn");
+		return;
+	}
+
+	if (!conn_buffer_isempty(conn)) {
+		if (!conn_putl(conn, conn_buffer(conn),
+			       conn_buffer_cur(conn))) {
+			fprintf(stderr, "conn_putl() failed\n");
+		}
+
+		conn_buffer_empty(conn);
+		conn_flush(conn);
+	}
+
+	connset_handling_done(conn, false);
+}
+
+static void *
+bench_conn_worker(void *context);
+static void *
+bench_conn_worker(void *context) {
+	bench_conn_t		*b = (bench_conn_t *)context;
+	executor_worker_t	*w = NULL;
+	conn_t			*conn, *nconn;
+
+	if (b->useex) {
+		w = executor_join(&b->ex);
+	}
+
+	while (!__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE)) {
+		conn = b->useex ? connset_get_ready_worker(&b->cs, w) :
+				  connset_get_ready(&b->cs);
+		if (conn == NULL) {
+			break;
+		}
+
+		if (conn_state(conn) != CONN_LISTENING) {
+			bench_conn_echo(conn);
+			continue;
+		}
+
+		nconn = mcalloc(sizeof *nconn, "conn");
+		if (nconn != NULL && conn_init(nconn, NULL) &&
+		    conn_accept(nconn, conn, NULL)) {
+			conn_events(nconn, CONN_POLLIN);
+		} else if (nconn != NULL) {
+			conn_destroy(nconn);
+			mfree(nconn, sizeof *nconn, "conn");
+		}
+
+		connset_handling_done(conn, false);
+	}
+
+	__atomic_sub_fetch(&b->workers, 1, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+static int
+bench_conn_connect(unsigned int port);
+static int
+bench_conn_connect(unsigned int port) {
+	struct sockaddr_in	sin;
+	int			sock, one = 1;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == -1) {
+		return (-1);
+	}
+
+	memzero(&sin, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (connect(sock, (struct sockaddr *)&sin, sizeof sin) == -1) {
+		close(sock);
+		return (-1);
+	}
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+	return (sock);
+}
+
+/* Sum the executor statistics of the workers */
+static void
+bench_conn_threads(void *cbdata, uint64_t tnum, const char *description,
+		   uint64_t served, uint64_t local, uint64_t steals);
+static void
+bench_conn_threads(void *cbdata, uint64_t UNUSED tnum,
+		   const char *description, uint64_t UNUSED served,
+		   uint64_t local, uint64_t steals) {
+	uint64_t *sums = (uint64_t *)cbdata;
+
+	if (strcmp(description, "BenchWorker") == 0) {
+		sums[0] += local;
+		sums[1] += steals;
+	}
+}
+
+static unsigned int
+bench_conn_backend(connset_backend_t backend, const char *name, bool useex);
+static unsigned int
+bench_conn_backend(connset_backend_t backend, const char *name, bool useex) {
+	const char	*testfunc = "conn";
+	bench_conn_t	b;
+	int		socks[BENCH_CONN_CLIENTS], sock;
+	char		buf[sizeof BENCH_CONN_MSG];
+	unsigned int	fails = 0, port, i, r;
+	uint64_t	t, syscalls, iocalls, sums[2] = { 0, 0 };
+	ssize_t		l;
+	size_t		got;
+
+	memzero(&b, sizeof b);
+	port = BENCH_CONN_PORT + backend + (useex ? 10 : 0);
+
+	if (!connset_init_backend(&b.cs, backend)) {
+		TEST_FAILA("connset_init_backend", name);
+		return (1);
+	}
+
+	/* It might have fallen back */
+	if (b.cs.backend != backend) {
+		fprintf(stdout, "- %-12s %-16s not available\n", testfunc, name);
+		connset_destroy(&b.cs);
+		return (0);
+	}
+
+	b.useex = useex;
+	if (useex) {
+		if (!executor_init(&b.ex, BENCH_CONN_WORKERS, 1024)) {
+			TEST_FAILA("executor_init", name);
+			connset_destroy(&b.cs);
+			return (1);
+		}
+
+		connset_set_executor(&b.cs, &b.ex);
+	}
+
+	if (!conn_create_listen(&b.cs, "127.0.0.1", IPPROTO_TCP, port)) {
+		TEST_FAILA("conn_create_listen", name);
+		connset_destroy(&b.cs);
+		return (1);
+	}
+
+	b.pollers = 1;
+	b.workers = BENCH_CONN_WORKERS;
+	if (!thread_add("BenchPoller", &bench_conn_poller, &b)) {
+		TEST_FAILA("thread_add", name);
+		return (1);
+	}
+
+	for (i = 0; i < BENCH_CONN_WORKERS; i++) {
+		if (!thread_add("BenchWorker", &bench_conn_worker, &b)) {
+			TEST_FAILA("thread_add", name);
+			return (1);
+		}
+	}
+
+	for (i = 0; i < lengthof(socks); i++) {
+		socks[i] = bench_conn_connect(port);
+		if (socks[i] == -1) {
+			TEST_FAILA("connect", name);
+			fails++;
+		}
+	}
+
+	/* Only count the steady state */
+	syscalls = __atomic_load_n(&b.cs.syscalls, __ATOMIC_RELAXED);
+	iocalls = __atomic_load_n(&b.cs.iocalls, __ATOMIC_RELAXED);
+	t = bench_now();
+
+	for (r = 0; fails == 0 && r < BENCH_CONN_ROUNDS; r++) {
+		for (i = 0; i < lengthof(socks); i++) {
+			l = write(socks[i], BENCH_CONN_MSG, sizeof buf - 1);
+			if (l != (ssize_t)sizeof buf - 1) {
+				TEST_FAILA("write", name);
+				fails++;
+				break;
+			}
+		}
+
+		for (i = 0; fails == 0 && i < lengthof(socks); i++) {
+			for (got = 0; got < sizeof buf - 1; got += l) {
+				l = read(socks[i], &buf[got],
+					 sizeof buf - 1 - got);
+				if (l <= 0) {
+					TEST_FAILA("read", name);
+					fails++;
+					break;
+				}
+			}
+		}
+	}
+
+	t = bench_now() - t;
+	syscalls = __atomic_load_n(&b.cs.syscalls, __ATOMIC_RELAXED) - syscalls;
+	iocalls = __atomic_load_n(&b.cs.iocalls, __ATOMIC_RELAXED) - iocalls;
+
+	bench_report(testfunc, name, (uint64_t)r * lengthof(socks), t);
+	if (r > 0) {
+		fprintf(stdout, "  %-29s %10.3f syscalls/request, "
+			"%.3f poller\n", "",
+			(double)(syscalls + iocalls) /
+			((uint64_t)r * lengthof(socks)),
+			(double)syscalls / ((uint64_t)r * lengthof(socks)));
+	}
+
+	if (useex && thread_stats(bench_conn_threads, sums) > 0) {
+		fprintf(stdout, "  %-29s %10" PRIu64 " local, %" PRIu64
+			" stolen\n", "", sums[0], sums[1]);
+	}
+
+	/* Stop the threads, workers need an event to notice */
+	__atomic_store_n(&b.stop, true, __ATOMIC_RELEASE);
+
+	for (i = 0; i < lengthof(socks); i++) {
+		if (socks[i] != -1) {
+			close(socks[i]);
+		}
+	}
+
+	while (__atomic_load_n(&b.workers, __ATOMIC_ACQUIRE) > 0) {
+		sock = bench_conn_connect(port);
+		if (sock != -1) {
+			close(sock);
+		}
+		usleep(10 * 1000);
+	}
+
+	/* The poller notices on its next timeout */
+	while (__atomic_load_n(&b.pollers, __ATOMIC_ACQUIRE) > 0) {
+		usleep(10 * 1000);
+	}
+
+	connset_destroy(&b.cs);
+
+	if (useex) {
+		executor_destroy(&b.ex);
+	}
+
+	return (fails);
+}
+
+/*
+ * Answers to pipelined requests: a write per answer (conn_flush() each)
+ * against sealing them (conn_seal()) and one writev() per batch.
+ */
+#define BENCH_CONN_BATCH	16
+#define BENCH_CONN_BATCHES	20000
+
+static unsigned int
+bench_conn_pipeline(bool seal);
+static unsigned int
+bench_conn_pipeline(bool seal) {
+	const char	*testfunc = "conn";
+	conn_t		conn;
+	char		rbuf[64 * 1024];
+	int		sv[2];
+	unsigned int	i, r;
+	uint64_t	t, got = 0, want = 0;
+	ssize_t		n;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1 ||
+	    !conn_init(&conn, NULL)) {
+		TEST_FAIL("pipeline setup");
+		return (1);
+	}
+
+	conn.sock = sv[0];
+	conn_set_connected(&conn);
+
+	t = bench_now();
+
+	for (r = 0; r < BENCH_CONN_BATCHES; r++) {
+		for (i = 0; i < BENCH_CONN_BATCH; i++) {
+			if (seal && !conn_seal(&conn)) {
+				TEST_FAIL("conn_seal");
+				return (1);
+			}
+
+			conn_addheader(&conn, "HTTP/1.1 200 OK");
+			conn_addheader(&conn, "Content-Type: text/plain");
+			conn_put(&conn, "hello world\n");
+
+			if (!seal) {
+				conn_flush(&conn);
+			}
+		}
+
+		if (seal) {
+			conn_flush(&conn);
+		}
+
+		/* The other side reads it all */
+		want += conn_flushleft(&conn) == 0;
+		while ((n = read(sv[1], rbuf, sizeof rbuf)) == sizeof rbuf);
+		got++;
+	}
+
+	t = bench_now() - t;
+
+	bench_report(testfunc, seal ? "pipeline/batch" : "pipeline/flush",
+		     (uint64_t)BENCH_CONN_BATCHES * BENCH_CONN_BATCH, t);
+
+	conn_destroy(&conn);
+	close(sv[1]);
+
+	/* Every batch has to have been written completely */
+	if (got != want) {
+		TEST_FAIL("pipeline flush");
+		return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * A large response (1 MiB): generated in 1 KiB pieces (conn_putl())
+ * against static data that is referenced (conn_putref()), written over
+ * a socketpair that is drained in between the flushes.
+ */
+#define BENCH_CONN_LARGE	(1024 * 1024)
+#define BENCH_CONN_PIECE	1024
+#define BENCH_CONN_LARGES	500
+
+static unsigned int
+bench_conn_large(bool ref);
+static unsigned int
+bench_conn_large(bool ref) {
+	const char	*testfunc = "conn";
+	static char	data[BENCH_CONN_LARGE];
+	conn_t		conn;
+	char		rbuf[64 * 1024];
+	int		sv[2];
+	unsigned int	i, r, o;
+	uint64_t	t, got = 0;
+	ssize_t		n;
+	bool		ok = true;
+
+	memset(data, 'x', sizeof data);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1 ||
+	    !conn_init(&conn, NULL)) {
+		TEST_FAIL("large setup");
+		return (1);
+	}
+
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+
+	conn.sock = sv[0];
+	conn_set_connected(&conn);
+
+	t = bench_now();
+
+	for (r = 0; r < BENCH_CONN_LARGES; r++) {
+		conn_addheader(&conn, "HTTP/1.1 200 OK");
+
+		if (ref) {
+			ok &= conn_putref(&conn, data, sizeof data, NULL, NULL);
+		}
+
+		for (o = 0; !ref && o < sizeof data; o += BENCH_CONN_PIECE) {
+			ok &= conn_putl(&conn, &data[o], BENCH_CONN_PIECE);
+		}
+
+		/* Until the other side has all of it */
+		for (i = 0; conn_flushleft(&conn) > 0 || i == 0; i++) {
+			ok &= conn_flush(&conn);
+
+			while ((n = read(sv[1], rbuf, sizeof rbuf)) > 0) {
+				got += n;
+			}
+		}
+	}
+
+	t = bench_now() - t;
+
+	bench_report(testfunc, ref ? "large/putref" : "large/putl",
+		     BENCH_CONN_LARGES, t);
+
+	conn_destroy(&conn);
+	close(sv[1]);
+
+	if (!ok || got < (uint64_t)BENCH_CONN_LARGES * sizeof data) {
+		TEST_FAIL("large flush");
+		return (1);
+	}
+
+	return (0);
+}
+
+unsigned int
+bench_conn(void) {
+	unsigned int fails = 0;
+
+	fails += bench_conn_pipeline(false);
+	fails += bench_conn_pipeline(true);
+	fails += bench_conn_large(false);
+	fails += bench_conn_large(true);
+
+	fails += bench_conn_backend(CONNSET_SELECT, "select", false);
+	fails += bench_conn_backend(CONNSET_EPOLL, "epoll", false);
+	fails += bench_conn_backend(CONNSET_EPOLL_EDGE, "epoll-edge", false);
+	fails += bench_conn_backend(CONNSET_URING, "io_uring", false);
+	fails += bench_conn_backend(CONNSET_DEFAULT, "executor", true);
+
+	return (fails);
+}
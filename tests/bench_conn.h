@@ -0,0 +1,9 @@
+#ifndef TESTS_BENCH_CONN_H
+#define TESTS_BENCH_CONN_H 1
+
+#include "test.h"
+#include "bench.h"
+
+unsigned int bench_conn(void);
+
+#endif /* TESTS_BENCH_CONN_H */
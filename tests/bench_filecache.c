@@ -0,0 +1,65 @@
+#include <libfutil/misc.h>
+#include <libfutil/conn.h>
+#include <libfutil/filecache.h>
+#include "bench_filecache.h"
+
+/*
+ * What a static file costs before it is sent: opening and looking at it
+ * every time, or getting it from the cache.
+ */
+#define BENCH_FILECACHE_ROUNDS	200000
+
+unsigned int
+bench_filecache(void) {
+	const char		*testfunc = "filecache";
+	char			name[] = "/tmp/bench_filecache.XXXXXX";
+	unsigned int		fails = 0, r;
+	filecache_t		fc;
+	filecache_entry_t	*fe;
+	uint64_t		t, size;
+	int			fd;
+
+	fd = mkstemp(name);
+	if (fd == -1 || write(fd, name, sizeof name) != sizeof name ||
+	    !filecache_init(&fc, 16, 1, NULL)) {
+		TEST_FAIL("setup");
+		return (1);
+	}
+
+	close(fd);
+
+	t = bench_now();
+
+	for (r = 0; r < BENCH_FILECACHE_ROUNDS; r++) {
+		fd = conn_openfile(name, &size);
+		if (fd == -1) {
+			TEST_FAIL("open");
+			fails++;
+			break;
+		}
+
+		close(fd);
+	}
+
+	bench_report(testfunc, "open", r, bench_now() - t);
+
+	t = bench_now();
+
+	for (r = 0; r < BENCH_FILECACHE_ROUNDS; r++) {
+		fe = filecache_get(&fc, name);
+		if (fe == NULL) {
+			TEST_FAIL("get");
+			fails++;
+			break;
+		}
+
+		filecache_put(fe);
+	}
+
+	bench_report(testfunc, "cache", r, bench_now() - t);
+
+	filecache_destroy(&fc);
+	unlink(name);
+
+	return (fails);
+}
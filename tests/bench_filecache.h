@@ -0,0 +1,9 @@
+#ifndef TESTS_BENCH_FILECACHE_H
+#define TESTS_BENCH_FILECACHE_H 1
+
+#include "test.h"
+#include "bench.h"
+
+unsigned int bench_filecache(void);
+
+#endif /* TESTS_BENCH_FILECACHE_H */
@@ -0,0 +1,9 @@
+#ifndef TESTS_BENCH_HTTPPARSE_H
+#define TESTS_BENCH_HTTPPARSE_H 1
+
+#include "test.h"
+#include "bench.h"
+
+unsigned int bench_httpparse(void);
+
+#endif /* TESTS_BENCH_HTTPPARSE_H */
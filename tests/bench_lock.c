@@ -0,0 +1,133 @@
+#include <libfutil/misc.h>
+#include "bench_lock.h"
+
+/*
+ * Lock cost of a request: handling a request takes the conn lock and
+ * the locks of its recv, send and send_headers buffers, a few times
+ * each. Compares the recursive mutex_t that used to protect those with
+ * lock_t, with one thread (uncontended) and with several threads
+ * hammering the same locks (contended).
+ *
+ * Also the uncontended run happens in a thread of its own: glibc skips
+ * the atomic operations in its mutexes as long as a process never
+ * started a thread, which a server always has.
+ */
+#define BENCH_LOCK_REQUESTS	200000
+#define BENCH_LOCK_THREADS	2
+#define BENCH_LOCK_PERREQ	2	/* Rounds over the locks per request */
+
+typedef struct {
+	bool		uselock;	/* lock_t instead of mutex_t */
+	mutex_t		mutexes[4];	/* conn, recv, send, send_headers */
+	lock_t		locks[4];
+	uint64_t	counter;	/* Protected by the conn lock */
+	unsigned int	running;	/* Threads still running */
+} bench_lock_t;
+
+static void
+bench_lock_request(bench_lock_t *b);
+static void
+bench_lock_request(bench_lock_t *b) {
+	unsigned int i, j;
+
+	for (j = 0; j < BENCH_LOCK_PERREQ; j++) {
+		for (i = 0; i < lengthof(b->locks); i++) {
+			if (b->uselock) {
+				lock_lock(&b->locks[i]);
+				if (i == 0) {
+					b->counter++;
+				}
+				lock_unlock(&b->locks[i]);
+			} else {
+				mutex_lock(b->mutexes[i]);
+				if (i == 0) {
+					b->counter++;
+				}
+				mutex_unlock(b->mutexes[i]);
+			}
+		}
+	}
+}
+
+static void *
+bench_lock_thread(void *context);
+static void *
+bench_lock_thread(void *context) {
+	bench_lock_t	*b = (bench_lock_t *)context;
+	unsigned int	r;
+
+	for (r = 0; r < BENCH_LOCK_REQUESTS; r++) {
+		bench_lock_request(b);
+	}
+
+	__atomic_sub_fetch(&b->running, 1, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+static unsigned int
+bench_lock_run(const char *name, bool uselock, unsigned int threads);
+static unsigned int
+bench_lock_run(const char *name, bool uselock, unsigned int threads) {
+	const char	*testfunc = "lock";
+	bench_lock_t	b;
+	unsigned int	fails = 0, i;
+	uint64_t	t;
+
+	memzero(&b, sizeof b);
+	b.uselock = uselock;
+
+	for (i = 0; i < lengthof(b.locks); i++) {
+		mutex_init(b.mutexes[i]);
+		lock_init(&b.locks[i]);
+	}
+
+	t = bench_now();
+
+	b.running = threads;
+	for (i = 0; i < threads; i++) {
+		if (!thread_add("BenchLock", &bench_lock_thread, &b)) {
+			TEST_FAILA("thread_add", name);
+			__atomic_sub_fetch(&b.running, threads - i, __ATOMIC_RELEASE);
+			fails++;
+			break;
+		}
+	}
+
+	while (__atomic_load_n(&b.running, __ATOMIC_ACQUIRE) > 0) {
+		usleep(1000);
+	}
+
+	t = bench_now() - t;
+
+	if (fails == 0 && b.counter !=
+	    (uint64_t)threads * BENCH_LOCK_REQUESTS * BENCH_LOCK_PERREQ) {
+		TEST_FAILA("counter", name);
+		fails++;
+	}
+
+	bench_report(testfunc, name, (uint64_t)threads * BENCH_LOCK_REQUESTS, t);
+
+	for (i = 0; i < lengthof(b.locks); i++) {
+		mutex_destroy(b.mutexes[i]);
+		lock_destroy(&b.locks[i]);
+	}
+
+	return (fails);
+}
+
+unsigned int
+bench_lock(void) {
+	unsigned int fails = 0;
+
+#ifdef LOCK_DEBUG
+	fprintf(stdout, "- lock         (LOCK_DEBUG: lock_t includes "
+		"recursion checks)\n");
+#endif
+
+	fails += bench_lock_run("mutex_t", false, 1);
+	fails += bench_lock_run("lock_t", true, 1);
+	fails += bench_lock_run("mutex_t-mt", false, BENCH_LOCK_THREADS);
+	fails += bench_lock_run("lock_t-mt", true, BENCH_LOCK_THREADS);
+
+	return (fails);
+}
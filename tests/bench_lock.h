@@ -0,0 +1,9 @@
+#ifndef TESTS_BENCH_LOCK_H
+#define TESTS_BENCH_LOCK_H 1
+
+#include "test.h"
+#include "bench.h"
+
+unsigned int bench_lock(void);
+
+#endif /* TESTS_BENCH_LOCK_H */
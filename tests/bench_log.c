@@ -0,0 +1,184 @@
+/* The debug sites are there also in a non-DEBUG build */
+#undef LOG_LEVEL_COMPILED
+#define LOG_LEVEL_COMPILED LOG_DEBUG
+
+#include <libfutil/misc.h>
+#include "bench_log.h"
+
+/*
+ * What logline() costs the threads that log, to a file: formatting and
+ * writing every line under the log lock, or only formatting it into the
+ * ring of the thread (async), or only copying the arguments there and
+ * leaving the formatting to the writer (deferred) or to log_decode()
+ * (binary). With one thread and with several at once; the ops/s are the
+ * calls per second of one thread, each thread times its own loop. Async
+ * also with the time it takes to get all of it written (flush), counting
+ * only the lines that were written. Dropped lines are reported, with the
+ * writer competing for the CPUs some can be; only many of them fail it.
+ */
+#define BENCH_LOG_LINES		100000	/* Per thread */
+#define BENCH_LOG_THREADS	4
+#define BENCH_LOG_RING		(1024 * 1024)
+#define BENCH_LOG_DROPMAX	1	/* Percent of the lines */
+
+/* arg: where the thread leaves the time its loop took */
+static void *
+bench_log_thread(void *arg);
+static void *
+bench_log_thread(void *arg) {
+	uint64_t	*ns = (uint64_t *)arg, t = bench_now();
+	unsigned int	i;
+
+	for (i = 0; i < BENCH_LOG_LINES; i++) {
+		log_ntc("bench_log line %u of %u from %s", i, BENCH_LOG_LINES,
+			"bench");
+	}
+
+	*ns = bench_now() - t;
+
+	return (NULL);
+}
+
+static unsigned int
+bench_log_run(const char *variant, unsigned int threads, bool async,
+	      log_format_t format);
+static unsigned int
+bench_log_run(const char *variant, unsigned int threads, bool async,
+	      log_format_t format) {
+	const char	*testfunc = "log";
+	pthread_t	th[BENCH_LOG_THREADS];
+	uint64_t	ns[BENCH_LOG_THREADS];
+	unsigned int	fails = 0, i;
+	uint64_t	t, n, lines, drops, lbefore, dbefore, sum = 0;
+	char		v[32];
+
+	log_async_stats(&lbefore, &dbefore);
+
+	if (async) {
+		if (!log_async_format(format) ||
+		    !log_async_start(BENCH_LOG_RING, 0)) {
+			TEST_FAIL("async");
+			return (1);
+		}
+	}
+
+	t = bench_now();
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&th[i], NULL, bench_log_thread,
+				   &ns[i]) != 0) {
+			TEST_FAIL("pthread_create");
+			fails++;
+			break;
+		}
+	}
+
+	threads = i;
+	for (i = 0; i < threads; i++) {
+		pthread_join(th[i], NULL);
+		sum += ns[i];
+	}
+
+	if (!async) {
+		bench_report(testfunc, variant, threads * BENCH_LOG_LINES, sum);
+		return (fails);
+	}
+
+	log_async_stop();
+	t = bench_now() - t;
+
+	/* The writer logs about the drops itself */
+	log_async_stats(&lines, &drops);
+	drops -= dbefore;
+	n = lines - lbefore > threads * BENCH_LOG_LINES ?
+	    threads * BENCH_LOG_LINES : lines - lbefore;
+
+	bench_report(testfunc, variant, n, sum);
+
+	snprintf(v, sizeof v, "%s+flush", variant);
+	bench_report(testfunc, v, n, t);
+
+	fprintf(stdout, "  %-29s %10" PRIu64 " dropped (%.2f%%)\n", "",
+		drops, (double)drops * 100 / (threads * BENCH_LOG_LINES));
+
+	if (drops * 100 > (uint64_t)threads * BENCH_LOG_LINES *
+			  BENCH_LOG_DROPMAX) {
+		TEST_FAILAR(variant, "dropped", (int)drops,
+			    (uint64_t)threads * BENCH_LOG_LINES *
+			    BENCH_LOG_DROPMAX / 100);
+		fails++;
+	}
+
+	return (fails);
+}
+
+/*
+ * What a disabled debug line costs: a site (log_dbg()) that is off, and
+ * a call into logline() that finds the level too low
+ */
+#define BENCH_LOG_OFF		10000000
+
+static void
+bench_log_off(void);
+static void
+bench_log_off(void) {
+	const char	*testfunc = "log";
+	unsigned int	i;
+	uint64_t	t;
+
+	log_setlevel(LOG_INFO);
+
+	t = bench_now();
+	for (i = 0; i < BENCH_LOG_OFF; i++) {
+		log_dbg("bench_log off %u", i);
+	}
+	bench_report(testfunc, "off/site", BENCH_LOG_OFF, bench_now() - t);
+
+	t = bench_now();
+	for (i = 0; i < BENCH_LOG_OFF; i++) {
+		logline(LOG_DEBUG, LOG_ARG, "bench_log off %u", i);
+	}
+	bench_report(testfunc, "off/logline", BENCH_LOG_OFF, bench_now() - t);
+}
+
+unsigned int
+bench_log(void) {
+	const char	*testfunc = "log";
+	char		name[] = "/tmp/bench_log.XXXXXX";
+	unsigned int	fails = 0;
+	int		fd;
+
+	fd = mkstemp(name);
+	if (fd == -1 || !log_set(name)) {
+		TEST_FAIL("setup");
+		return (1);
+	}
+
+	close(fd);
+
+	fails += bench_log_run("sync/1", 1, false, LOG_FORMAT_TEXT);
+	fails += bench_log_run("text/1", 1, true, LOG_FORMAT_TEXT);
+	fails += bench_log_run("deferred/1", 1, true, LOG_FORMAT_DEFERRED);
+	fails += bench_log_run("binary/1", 1, true, LOG_FORMAT_BINARY);
+	fails += bench_log_run("sync/4", BENCH_LOG_THREADS, false,
+			       LOG_FORMAT_TEXT);
+	fails += bench_log_run("text/4", BENCH_LOG_THREADS, true,
+			       LOG_FORMAT_TEXT);
+	fails += bench_log_run("deferred/4", BENCH_LOG_THREADS, true,
+			       LOG_FORMAT_DEFERRED);
+	fails += bench_log_run("binary/4", BENCH_LOG_THREADS, true,
+			       LOG_FORMAT_BINARY);
+
+	if (!log_async_format(LOG_FORMAT_TEXT)) {
+		TEST_FAIL("format");
+		fails++;
+	}
+
+	bench_log_off();
+
+	/* Back to where the logs went */
+	log_setup("bench", NULL);
+	unlink(name);
+
+	return (fails);
+}
@@ -0,0 +1,176 @@
+#include <libfutil/misc.h>
+#include <libfutil/httpsrv.h>
+#include "bench_mem.h"
+
+/*
+ * Memory per idle keep-alive connection: BENCH_MEM_CLIENTS connections
+ * to a httpsrv each do one request and then stay open. Reports the
+ * memory that the server holds for them (resident set).
+ *
+ * There is no way to stop a httpsrv short of thread_stopall(), thus it
+ * keeps running until the bench exits: keep this one last.
+ */
+#define BENCH_MEM_CLIENTS	256
+#define BENCH_MEM_PORT		19390
+#define BENCH_MEM_REQUEST	"GET /some/path?with=args HTTP/1.1\r\n"	\
+				"Host: www.example.com\r\n"		\
+				"Cookie: session=0123456789abcdef\r\n"	\
+				"\r\n"
+
+static bool
+bench_mem_handle(httpsrv_client_t *hcl, void *user);
+static bool
+bench_mem_handle(httpsrv_client_t *hcl, void UNUSED *user) {
+	httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_HTML);
+	conn_put(&hcl->conn, "ok\n");
+	httpsrv_done(hcl);
+
+	return (true);
+}
+
+/* Resident memory in bytes */
+static uint64_t
+bench_mem_rss(void);
+static uint64_t
+bench_mem_rss(void) {
+	unsigned long	size, rss = 0;
+	FILE		*f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (f == NULL) {
+		return (0);
+	}
+
+	if (fscanf(f, "%lu %lu", &size, &rss) != 2) {
+		rss = 0;
+	}
+
+	fclose(f);
+
+	return ((uint64_t)rss * sysconf(_SC_PAGESIZE));
+}
+
+static int
+bench_mem_connect(unsigned int port);
+static int
+bench_mem_connect(unsigned int port) {
+	struct sockaddr_in	sin;
+	int			sock;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == -1) {
+		return (-1);
+	}
+
+	memzero(&sin, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (connect(sock, (struct sockaddr *)&sin, sizeof sin) == -1) {
+		close(sock);
+		return (-1);
+	}
+
+	return (sock);
+}
+
+/* One request, wait for the full answer */
+static bool
+bench_mem_request(int sock);
+static bool
+bench_mem_request(int sock) {
+	char	buf[1024];
+	ssize_t	r;
+	size_t	len = 0;
+
+	if (send(sock, BENCH_MEM_REQUEST, strlen(BENCH_MEM_REQUEST),
+		 MSG_NOSIGNAL) <= 0) {
+		return (false);
+	}
+
+	while (len < sizeof buf - 1) {
+		r = recv(sock, &buf[len], sizeof buf - 1 - len, 0);
+		if (r <= 0) {
+			return (false);
+		}
+
+		len += r;
+		buf[len] = '\0';
+
+		if (strstr(buf, "\r\n\r\nok\n") != NULL) {
+			return (true);
+		}
+	}
+
+	return (false);
+}
+
+unsigned int
+bench_mem(void) {
+	const char	*testfunc = "mem";
+	httpsrv_t	*hs;
+	int		socks[BENCH_MEM_CLIENTS];
+	unsigned int	i, n = 0, fails = 0;
+	uint64_t	before, after;
+	double		per;
+
+	hs = mcalloc(sizeof *hs, "httpsrv_t");
+	if (hs == NULL) {
+		TEST_FAIL("no memory");
+		return (1);
+	}
+
+	if (!httpsrv_init(hs, NULL, NULL, NULL, NULL, NULL,
+			  bench_mem_handle, NULL, NULL, NULL) ||
+	    !httpsrv_start_sharded(hs, "127.0.0.1", BENCH_MEM_PORT,
+				   1, 1, false)) {
+		TEST_FAIL("could not start httpsrv");
+		return (1);
+	}
+
+	/* Warm up: the first connection sets up the pools etc */
+	socks[n] = bench_mem_connect(BENCH_MEM_PORT);
+	if (socks[n] == -1 || !bench_mem_request(socks[n])) {
+		TEST_FAIL("warm up request failed");
+		return (1);
+	}
+	n++;
+
+	/* The pool caches are not per connection */
+	usleep(100 * 1000);
+	buf_trim();
+	pool_trim(&hs->requests);
+	before = bench_mem_rss();
+
+	for (; n < BENCH_MEM_CLIENTS; n++) {
+		socks[n] = bench_mem_connect(BENCH_MEM_PORT);
+		if (socks[n] == -1 || !bench_mem_request(socks[n])) {
+			TEST_FAIL("request failed");
+			fails++;
+			break;
+		}
+	}
+
+	/* Let the server finish up with the last ones */
+	usleep(100 * 1000);
+	buf_trim();
+	pool_trim(&hs->requests);
+	after = bench_mem_rss();
+
+	per = n > 1 ? ((double)after - before) / (n - 1) : 0;
+
+	fprintf(stdout,
+		"- %-12s %-16s %10u conns %10.0f B/conn %8.1f MiB/100k\n",
+		testfunc, "idle", n - 1, per, per * 100000 / (1024 * 1024));
+	fprintf(stdout,
+		"  %-29s %10u B httpsrv_client_t %6u B conn_t\n",
+		"", (unsigned int)sizeof(httpsrv_client_t),
+		(unsigned int)sizeof(conn_t));
+
+	for (i = 0; i < n; i++) {
+		close(socks[i]);
+	}
+
+	return (fails);
+}
@@ -0,0 +1,9 @@
+#ifndef TESTS_BENCH_MEM_H
+#define TESTS_BENCH_MEM_H 1
+
+#include "test.h"
+#include "bench.h"
+
+unsigned int bench_mem(void);
+
+#endif /* TESTS_BENCH_MEM_H */
@@ -0,0 +1,76 @@
+#include <libfutil/misc.h>
+#include <libfutil/httpsrv.h>
+#include "bench_pool.h"
+
+/*
+ * Connection churn: a set of live clients where one is replaced all
+ * the time, each taking its request line buffers and touching the
+ * start of them. Compares calloc()/free() with the pool.
+ */
+#define BENCH_POOL_LIVE		256
+#define BENCH_POOL_ROUNDS	200000
+#define BENCH_POOL_SIZE		(2 * HTTPSRV_LINE_LEN)
+
+static unsigned int
+bench_pool_run(const char *name, pool_t *pool);
+static unsigned int
+bench_pool_run(const char *name, pool_t *pool) {
+	const char	*testfunc = "pool";
+	char		*live[BENCH_POOL_LIVE];
+	unsigned int	i, r, fails = 0;
+	uint64_t	t;
+
+	memzero(live, sizeof live);
+
+	t = bench_now();
+
+	for (r = 0; r < BENCH_POOL_ROUNDS; r++) {
+		i = (r * 7919) % BENCH_POOL_LIVE;
+
+		if (pool != NULL) {
+			pool_put(pool, live[i]);
+			live[i] = pool_get(pool);
+		} else {
+			free(live[i]);
+			live[i] = calloc(1, BENCH_POOL_SIZE);
+		}
+
+		if (live[i] == NULL) {
+			TEST_FAILA("alloc", name);
+			fails++;
+			break;
+		}
+
+		/* A request line and the copy of it */
+		memset(live[i], 'a', 128);
+		memset(&live[i][HTTPSRV_LINE_LEN], 'a', 128);
+	}
+
+	t = bench_now() - t;
+
+	bench_report(testfunc, name, r, t);
+
+	for (i = 0; i < BENCH_POOL_LIVE; i++) {
+		if (pool != NULL) {
+			pool_put(pool, live[i]);
+		} else {
+			free(live[i]);
+		}
+	}
+
+	return (fails);
+}
+
+unsigned int
+bench_pool(void) {
+	pool_t		pool;
+	unsigned int	fails = 0;
+
+	fails += bench_pool_run("calloc", NULL);
+
+	pool_init(&pool, BENCH_POOL_SIZE, "bench_pool");
+	fails += bench_pool_run("pool", &pool);
+	pool_destroy(&pool);
+
+	return (fails);
+}
@@ -0,0 +1,9 @@
+#ifndef TESTS_BENCH_POOL_H
+#define TESTS_BENCH_POOL_H 1
+
+#include "test.h"
+#include "bench.h"
+
+unsigned int bench_pool(void);
+
+#endif /* TESTS_BENCH_POOL_H */
@@ -0,0 +1,190 @@
+#include <libfutil/misc.h>
+#include "bench_rcu.h"
+
+/*
+ * Read side cost of read-mostly shared state: readers look at the
+ * current version of a small config object, protected by rcu, by a
+ * rwl_t or by a big reader rwl_t. Once with a single reader, once
+ * with several readers and a writer that publishes a new version
+ * every BENCH_RCU_WRITE_US.
+ */
+#define BENCH_RCU_READS		500000
+#define BENCH_RCU_THREADS	2
+#define BENCH_RCU_WRITE_US	100
+
+enum bench_rcu_mode {
+	BENCH_RCU = 0,
+	BENCH_RWL,
+	BENCH_RWL_BIGREADER
+};
+
+typedef struct {
+	rcu_head_t	rcu;
+	uint64_t	value;
+} bench_rcu_obj_t;
+
+typedef struct {
+	enum bench_rcu_mode mode;
+	rwl_t		rwl;
+	bench_rcu_obj_t	*cur;
+	uint64_t	sum;		/* Keeps the reads from being elided */
+	unsigned int	readers;	/* Still running */
+	uint64_t	writes;
+} bench_rcu_t;
+
+static void
+bench_rcu_free(rcu_head_t *head);
+static void
+bench_rcu_free(rcu_head_t *head) {
+	bench_rcu_obj_t *o = (bench_rcu_obj_t *)head;
+
+	mfree(o, sizeof *o, "bench_rcu_obj");
+}
+
+static void *
+bench_rcu_reader(void *context);
+static void *
+bench_rcu_reader(void *context) {
+	bench_rcu_t	*b = (bench_rcu_t *)context;
+	uint64_t	sum = 0;
+	unsigned int	i;
+
+	for (i = 0; i < BENCH_RCU_READS; i++) {
+		if (b->mode == BENCH_RCU) {
+			rcu_read_lock();
+			sum += rcu_dereference(b->cur)->value;
+			rcu_read_unlock();
+		} else {
+			rwl_lockR(&b->rwl);
+			sum += b->cur->value;
+			rwl_unlockR(&b->rwl);
+		}
+	}
+
+	__atomic_add_fetch(&b->sum, sum, __ATOMIC_RELAXED);
+
+	rcu_thread_offline();
+	__atomic_sub_fetch(&b->readers, 1, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+/* Publish a new version, false when out of memory */
+static bool
+bench_rcu_write(bench_rcu_t *b);
+static bool
+bench_rcu_write(bench_rcu_t *b) {
+	bench_rcu_obj_t *o, *old;
+
+	o = mcalloc(sizeof *o, "bench_rcu_obj");
+	if (o == NULL) {
+		return (false);
+	}
+
+	if (b->mode == BENCH_RCU) {
+		old = b->cur;
+		o->value = old->value + 1;
+		rcu_assign(b->cur, o);
+		rcu_defer(&old->rcu, bench_rcu_free);
+	} else {
+		rwl_lockW(&b->rwl);
+		old = b->cur;
+		o->value = old->value + 1;
+		b->cur = o;
+		rwl_unlockW(&b->rwl);
+		mfree(old, sizeof *old, "bench_rcu_obj");
+	}
+
+	b->writes++;
+
+	return (true);
+}
+
+static unsigned int
+bench_rcu_run(const char *name, enum bench_rcu_mode mode, unsigned int threads,
+	      bool writer);
+static unsigned int
+bench_rcu_run(const char *name, enum bench_rcu_mode mode, unsigned int threads,
+	      bool writer) {
+	const char	*testfunc = "rcu";
+	bench_rcu_t	b;
+	unsigned int	fails = 0, i;
+	uint64_t	t;
+
+	memzero(&b, sizeof b);
+	b.mode = mode;
+
+	if (mode == BENCH_RWL_BIGREADER) {
+		if (!rwl_init_bigreader(&b.rwl)) {
+			TEST_FAILA("rwl_init_bigreader", name);
+			return (1);
+		}
+	} else {
+		rwl_init(&b.rwl);
+	}
+
+	b.cur = mcalloc(sizeof *b.cur, "bench_rcu_obj");
+	if (b.cur == NULL) {
+		TEST_FAILA("mcalloc", name);
+		rwl_destroy(&b.rwl);
+		return (1);
+	}
+
+	t = bench_now();
+
+	/* Readers in threads of their own, see bench_lock */
+	b.readers = threads;
+	for (i = 0; i < threads; i++) {
+		if (!thread_add("BenchRCU", &bench_rcu_reader, &b)) {
+			TEST_FAILA("thread_add", name);
+			__atomic_sub_fetch(&b.readers, threads - i, __ATOMIC_RELEASE);
+			fails++;
+			break;
+		}
+	}
+
+	while (__atomic_load_n(&b.readers, __ATOMIC_ACQUIRE) > 0) {
+		if (!writer) {
+			usleep(1000);
+			continue;
+		}
+
+		if (!bench_rcu_write(&b)) {
+			TEST_FAILA("write", name);
+			fails++;
+			break;
+		}
+
+		usleep(BENCH_RCU_WRITE_US);
+	}
+
+	t = bench_now() - t;
+
+	bench_report(testfunc, name, (uint64_t)threads * BENCH_RCU_READS, t);
+	if (writer) {
+		fprintf(stdout, "  %-29s %10" PRIu64 " writes\n", "", b.writes);
+	}
+
+	if (mode == BENCH_RCU) {
+		rcu_barrier();
+	}
+
+	mfree(b.cur, sizeof *b.cur, "bench_rcu_obj");
+	rwl_destroy(&b.rwl);
+
+	return (fails);
+}
+
+unsigned int
+bench_rcu(void) {
+	unsigned int fails = 0;
+
+	fails += bench_rcu_run("rcu", BENCH_RCU, 1, false);
+	fails += bench_rcu_run("rwl", BENCH_RWL, 1, false);
+	fails += bench_rcu_run("bigreader", BENCH_RWL_BIGREADER, 1, false);
+	fails += bench_rcu_run("rcu-mt+w", BENCH_RCU, BENCH_RCU_THREADS, true);
+	fails += bench_rcu_run("rwl-mt+w", BENCH_RWL, BENCH_RCU_THREADS, true);
+	fails += bench_rcu_run("bigreader-mt+w", BENCH_RWL_BIGREADER,
+			       BENCH_RCU_THREADS, true);
+
+	return (fails);
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+
+#include <libfutil/misc.h>
+#include <libfutil/scan.h>
+#include "bench_scan.h"
+
+/*
+ * Delimiter search throughput in GB/s per implementation, 'bytes' is
+ * the byte at a time loop buf_find() had before. Three inputs:
+ *  lines: HTTP header lines, looking for '\n' or NUL (line ends)
+ *  long:  the same without any line end (a body, a long cookie)
+ *  set:   query strings, looking for a set of URI separators
+ */
+#define BENCH_SCAN_LEN		(256 * 1024)
+#define BENCH_SCAN_PASSES	400
+
+static const char *bench_scan_names[SCAN_MAX] = {
+	"auto", "scalar", "sse2", "avx2",
+};
+
+static const scan_set_t bench_scan_uriset = SCAN_SET("?&=%+# ");
+
+/* How buf_find() did it before */
+static const char *
+bench_scan_bytes(const char *s, const char *e, char a, char b);
+static const char *
+bench_scan_bytes(const char *s, const char *e, char a, char b) {
+	for (; s < e; s++) {
+		if (*s == a || *s == b) {
+			return (s);
+		}
+	}
+
+	return (NULL);
+}
+
+static const char *
+bench_scan_bytes_set(const scan_set_t *set, const char *s, const char *e);
+static const char *
+bench_scan_bytes_set(const scan_set_t *set, const char *s, const char *e) {
+	unsigned int i;
+
+	for (; s < e; s++) {
+		for (i = 0; i < set->n; i++) {
+			if (*s == set->c[i]) {
+				return (s);
+			}
+		}
+	}
+
+	return (NULL);
+}
+
+/* Go through the whole buffer hit after hit, returns the hits */
+static uint64_t
+bench_scan_pass(const char *buf, bool set, bool bytes);
+static uint64_t
+bench_scan_pass(const char *buf, bool set, bool bytes) {
+	const char	*s = buf, *e = &buf[BENCH_SCAN_LEN];
+	uint64_t	hits = 0;
+
+	while (s < e) {
+		if (set) {
+			s = bytes ? bench_scan_bytes_set(&bench_scan_uriset, s, e) :
+				    scan_set(&bench_scan_uriset, s, e);
+		} else {
+			s = bytes ? bench_scan_bytes(s, e, '\n', '\0') :
+				    scan_find2(s, e, '\n', '\0');
+		}
+
+		if (s == NULL) {
+			break;
+		}
+
+		hits++;
+		s++;
+	}
+
+	return (hits);
+}
+
+static unsigned int
+bench_scan_run(const char *input, const char *buf, bool set,
+	       const char *impl, bool bytes, uint64_t expect);
+static unsigned int
+bench_scan_run(const char *input, const char *buf, bool set,
+	       const char *impl, bool bytes, uint64_t expect) {
+	const char	*testfunc = "scan";
+	char		name[32];
+	unsigned int	p;
+	uint64_t	t, hits = 0;
+
+	snprintf(name, sizeof name, "%s/%s", input, impl);
+
+	t = bench_now();
+
+	for (p = 0; p < BENCH_SCAN_PASSES; p++) {
+		hits += bench_scan_pass(buf, set, bytes);
+	}
+
+	t = bench_now() - t;
+
+	fprintf(stdout, "- %-12s %-16s %10.2f GB/s\n",
+		testfunc, name,
+		t > 0 ? (double)BENCH_SCAN_LEN * BENCH_SCAN_PASSES / t : 0.0);
+
+	if (hits != expect * BENCH_SCAN_PASSES) {
+		TEST_FAILA("hits", name);
+		return (1);
+	}
+
+	return (0);
+}
+
+unsigned int
+bench_scan(void) {
+	static const struct {
+		const char	*name;
+		bool		set;
+	} inputs[] = {
+		{ "lines",	false },
+		{ "long",	false },
+		{ "set",	true },
+	};
+	char		*buf;
+	unsigned int	i, j, l = 0, fails = 0;
+	uint64_t	expect;
+
+	buf = mcalloc(BENCH_SCAN_LEN, "bench_scan");
+	if (buf == NULL) {
+		return (1);
+	}
+
+	for (i = 0; i < lengthof(inputs); i++) {
+		/* Fill it up with the input */
+		for (l = 0; l < BENCH_SCAN_LEN; l++) {
+			buf[l] = 'a' + (l % 23);
+
+			if (i == 0 && (l % 61) == 60) {
+				buf[l] = '\n';
+			} else if (i == 2 && (l % 37) == 36) {
+				buf[l] = bench_scan_uriset.c[l % 7];
+			}
+		}
+
+		expect = bench_scan_pass(buf, inputs[i].set, true);
+
+		fails += bench_scan_run(inputs[i].name, buf, inputs[i].set,
+					"bytes", true, expect);
+
+		for (j = SCAN_SCALAR; j < SCAN_MAX; j++) {
+			if (!scan_select(j)) {
+				continue;
+			}
+
+			fails += bench_scan_run(inputs[i].name, buf,
+						inputs[i].set,
+						bench_scan_names[j], false,
+						expect);
+		}
+	}
+
+	if (!scan_select(SCAN_AUTO)) {
+		fails++;
+	}
+
+	mfree(buf, BENCH_SCAN_LEN, "bench_scan");
+
+	return (fails);
+}
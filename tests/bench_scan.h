@@ -0,0 +1,9 @@
+#ifndef TESTS_BENCH_SCAN_H
+#define TESTS_BENCH_SCAN_H 1
+
+#include "test.h"
+#include "bench.h"
+
+unsigned int bench_scan(void);
+
+#endif /* TESTS_BENCH_SCAN_H */
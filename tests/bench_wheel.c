@@ -0,0 +1,86 @@
+#include <libfutil/misc.h>
+#include "bench_wheel.h"
+
+/*
+ * What a deadline costs with many connections around: arming one, pushing
+ * it out again (every request on a keep-alive connection), cancelling it
+ * and having them expire as the time goes on.
+ */
+#define BENCH_WHEEL_TIMERS	100000
+#define BENCH_WHEEL_ROUNDS	10
+
+unsigned int
+bench_wheel(void) {
+	const char	*testfunc = "wheel";
+	wheel_timer_t	*timers;
+	wheel_t		w;
+	uint64_t	start, now = 0;
+	unsigned int	fails = 0, i, r, n = 0;
+
+	timers = mcalloc(BENCH_WHEEL_TIMERS * sizeof *timers, "timers");
+	if (timers == NULL) {
+		TEST_FAIL("setup");
+		return (1);
+	}
+
+	wheel_init(&w, now);
+
+	for (i = 0; i < BENCH_WHEEL_TIMERS; i++) {
+		wheel_timer_init(&timers[i]);
+	}
+
+	/* Spread over a minute, like idle keep-alives */
+	start = bench_now();
+
+	for (i = 0; i < BENCH_WHEEL_TIMERS; i++) {
+		wheel_arm(&w, &timers[i], now + 1000 + (i * 7919) % 60000);
+	}
+
+	bench_report(testfunc, "arm", BENCH_WHEEL_TIMERS, bench_now() - start);
+
+	start = bench_now();
+
+	for (r = 0; r < BENCH_WHEEL_ROUNDS; r++) {
+		for (i = 0; i < BENCH_WHEEL_TIMERS; i++) {
+			wheel_arm(&w, &timers[i],
+				  now + 1000 + (i * 7919 + r) % 60000);
+		}
+	}
+
+	bench_report(testfunc, "rearm", BENCH_WHEEL_TIMERS * BENCH_WHEEL_ROUNDS,
+		     bench_now() - start);
+
+	start = bench_now();
+
+	for (i = 0; i < BENCH_WHEEL_TIMERS; i++) {
+		wheel_cancel(&w, &timers[i]);
+	}
+
+	bench_report(testfunc, "cancel", BENCH_WHEEL_TIMERS,
+		     bench_now() - start);
+
+	/* All of them come due, a millisecond at a time */
+	for (i = 0; i < BENCH_WHEEL_TIMERS; i++) {
+		wheel_arm(&w, &timers[i], now + 1000 + (i * 7919) % 60000);
+	}
+
+	start = bench_now();
+
+	while (now < 62000) {
+		now++;
+		while (wheel_expire(&w, now) != NULL) {
+			n++;
+		}
+	}
+
+	bench_report(testfunc, "expire", n, bench_now() - start);
+
+	if (n != BENCH_WHEEL_TIMERS || w.n != 0) {
+		TEST_FAILAR("expire", "count", n, BENCH_WHEEL_TIMERS);
+		fails++;
+	}
+
+	mfree(timers, BENCH_WHEEL_TIMERS * sizeof *timers, "timers");
+
+	return (fails);
+}
@@ -3,14 +3,41 @@
 #include <libfutil/misc.h>
 #include "test.h"
 #include "test_buf.h"
+#include "test_clk.h"
+#include "test_conn.h"
+#include "test_filecache.h"
+#include "test_httpparse.h"
+#include "test_httpsrv.h"
 #include "test_misc.h"
+#include "test_mpmc.h"
+#include "test_pool.h"
+#include "test_rcu.h"
+#include "test_rwl.h"
+#include "test_scan.h"
+#include "test_wheel.h"
 
 int
 main(int UNUSED argc, const char UNUSED *argv[]) {
 	unsigned int fails = 0;
 
+	if (!thread_init()) {
+		fprintf(stderr, "thread_init() failed\n");
+		return (1);
+	}
+
 	fails += test_buf();
+	fails += test_clk();
+	fails += test_conn();
+	fails += test_filecache();
+	fails += test_httpparse();
 	fails += test_misc();
+	fails += test_mpmc();
+	fails += test_pool();
+	fails += test_rcu();
+	fails += test_rwl();
+	fails += test_scan();
+	fails += test_wheel();
+	fails += test_httpsrv();
 
 	fprintf(stdout, "- libfutil tests result: %u errors\n", fails);
 
@@ -103,13 +103,13 @@ test_buf(void) {
 	}
 
 	/* Should always work to get a buffer */
-	if (buf_buffer(&buf) == NULL) {
+	if (buf.buf == NULL) {
 		TEST_FAIL("Buffer did not exist!?");
 		fails++;
 	}
 
-	/* The end should always exist */
-	if (buf_bufend(&buf) == NULL) {
+	/* The end should always be where the data ends */
+	if (buf_bufend(&buf) != buf_buffer(&buf) + buf_cur(&buf)) {
 		TEST_FAIL("Buffer End did not exist!?");
 		fails++;
 	}
@@ -121,6 +121,61 @@ test_buf(void) {
 		fails++;
 	}
 
+	/* Shifting only moves the read cursor */
+	if (!buf_put(&buf, "abc\ndef\n")) {
+		TEST_FAIL("buf_put() of lines failed");
+		fails++;
+	}
+
+	buf_shift(&buf, 4);
+	if (buf_cur(&buf) != 4 || strcmp(buf_buffer(&buf), "def\n") != 0) {
+		TEST_FAIL("Shift did not leave the second line");
+		fails++;
+	}
+
+	/* Relative to what is left */
+	if (buf_find(&buf, 0, '\n', false) != &buf_buffer(&buf)[3]) {
+		TEST_FAIL("buf_find() after shift");
+		fails++;
+	}
+
+	/* Room consumed at the front is reclaimed before growing */
+	i = buf.size;
+	while (buf_left(&buf) > 0) {
+		if (!buf_put(&buf, "x")) {
+			TEST_FAIL("Could not fill it");
+			fails++;
+			break;
+		}
+	}
+
+	if (!buf_put(&buf, "yz") || buf.size != i || buf.start != 0 ||
+	    strncmp(buf_buffer(&buf), "def\n", 4) != 0) {
+		TEST_FAIL("Did not compact");
+		fails++;
+	}
+
+	/* Only empty buffers give their storage back */
+	buf_release(&buf);
+	if (buf.buf == NULL) {
+		TEST_FAIL("buf_release() of a non-empty buffer");
+		fails++;
+	}
+
+	buf_empty(&buf);
+	buf_release(&buf);
+	if (buf.buf != NULL || buf_cur(&buf) != 0) {
+		TEST_FAIL("buf_release() kept the storage");
+		fails++;
+	}
+
+	/* And take it again when needed */
+	if (!buf_put(&buf, "again") || buf.size != BUF_INITSIZE ||
+	    strcmp(buf_buffer(&buf), "again") != 0) {
+		TEST_FAIL("buf_put() after buf_release()");
+		fails++;
+	}
+
 	buf_unlock(&buf);
 	buf_destroy(&buf);
 
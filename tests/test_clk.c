@@ -0,0 +1,100 @@
+#include <libfutil/misc.h>
+#include "test_clk.h"
+
+/*
+ * The coarse clocks are at most a tick (a few msec) behind the exact
+ * ones, never ahead, and the cached second says what libc says
+ */
+#define TEST_CLK_SLACK		20	/* msec */
+
+static const struct {
+	time_t		t;
+	const char	*http;
+} test_clk_dates[] = {
+	{ 0,		"Thu, 01 Jan 1970 00:00:00 GMT" },
+	{ 784111777,	"Sun, 06 Nov 1994 08:49:37 GMT" },	/* RFC 7231 */
+	{ 951782400,	"Tue, 29 Feb 2000 00:00:00 GMT" },
+	{ 1700000000,	"Tue, 14 Nov 2023 22:13:20 GMT" },
+};
+
+unsigned int
+test_clk(void) {
+	const char		*testfunc = "clk";
+	const clk_sec_t		*c;
+	struct timespec		ts;
+	struct tm		tm;
+	char			buf[CLK_HTTP_LEN], stamp[CLK_STAMP_LEN];
+	uint64_t		coarse, exact, ms, prev = 0;
+	unsigned int		fails = 0, i;
+
+	for (i = 0; i < 1000; i++) {
+		coarse = clk_msec();
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		exact = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / (1000 * 1000);
+
+		if (coarse < prev || coarse > exact ||
+		    exact - coarse > TEST_CLK_SLACK) {
+			TEST_FAILAR("msec", "behind", (int)(exact - coarse),
+				    TEST_CLK_SLACK);
+			fails++;
+			break;
+		}
+
+		prev = coarse;
+	}
+
+	coarse = clk_now(&ms) * 1000 + ms;
+	exact = gettimes(&ms) * 1000 + ms;
+	if (coarse > exact || exact - coarse > TEST_CLK_SLACK) {
+		TEST_FAILAR("now", "behind", (int)(exact - coarse),
+			    TEST_CLK_SLACK);
+		fails++;
+	}
+
+	for (i = 0; i < lengthof(test_clk_dates); i++) {
+		c = clk_sec(test_clk_dates[i].t);
+		if (strcmp(c->http, test_clk_dates[i].http) != 0) {
+			TEST_FAILNS((uint64_t)test_clk_dates[i].t, c->http,
+				    test_clk_dates[i].http);
+			fails++;
+		}
+
+		/* Not cached: the same */
+		clk_http(test_clk_dates[i].t + 1, buf);
+		clk_http(test_clk_dates[i].t, buf);
+		if (strcmp(buf, test_clk_dates[i].http) != 0) {
+			TEST_FAILNS((uint64_t)test_clk_dates[i].t, buf,
+				    test_clk_dates[i].http);
+			fails++;
+		}
+
+		localtime_r(&test_clk_dates[i].t, &tm);
+		strftime(stamp, sizeof stamp, "%Y-%m-%d %H:%M:%S", &tm);
+		if (strcmp(c->stamp, stamp) != 0 ||
+		    c->local.tm_hour != tm.tm_hour ||
+		    c->local.tm_yday != tm.tm_yday) {
+			TEST_FAILNS((uint64_t)test_clk_dates[i].t, c->stamp,
+				    stamp);
+			fails++;
+		}
+
+		/* The same second again is the cache */
+		if (clk_sec(test_clk_dates[i].t) != c ||
+		    c->sec != test_clk_dates[i].t) {
+			TEST_FAIL("cached");
+			fails++;
+		}
+	}
+
+	/* Now, from the cache and made */
+	c = clk_sec(gettime());
+	gmtime_r(&c->sec, &tm);
+	strftime(stamp, sizeof stamp, "%H:%M:%S", &tm);
+	clk_http(c->sec, buf);
+	if (strcmp(buf, c->http) != 0 || strstr(buf, stamp) == NULL) {
+		TEST_FAILNS((uint64_t)c->sec, buf, c->http);
+		fails++;
+	}
+
+	return (fails);
+}
@@ -0,0 +1,8 @@
+#ifndef TESTS_TEST_CLK_H
+#define TESTS_TEST_CLK_H 1
+
+#include "test.h"
+
+unsigned int test_clk(void);
+
+#endif /* TESTS_TEST_CLK_H */
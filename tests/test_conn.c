@@ -0,0 +1,383 @@
+#include <libfutil/misc.h>
+#include <libfutil/conn.h>
+#include "test_conn.h"
+
+/*
+ * The send chain: buffers, borrowed memory and a file range have to come
+ * out in the order they were put in, also when the socket only takes a
+ * bit at a time.
+ */
+#define TEST_CONN_REF	(100 * 1024)
+#define TEST_CONN_FILE	(64 * 1024)
+#define TEST_CONN_PUT	(20 * 1024)
+#define TEST_CONN_MAX	(512 * 1024)
+
+typedef struct {
+	unsigned int	calls;
+	uint64_t	len;
+} test_conn_ref_t;
+
+static void
+test_conn_release(void *user, const char *data, uint64_t len);
+static void
+test_conn_release(void *user, const char UNUSED *data, uint64_t len) {
+	test_conn_ref_t *ref = (test_conn_ref_t *)user;
+
+	ref->calls++;
+	ref->len = len;
+}
+
+/* Some bytes that are different depending on where they are */
+static void
+test_conn_fill(char *buf, unsigned int len, char base);
+static void
+test_conn_fill(char *buf, unsigned int len, char base) {
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = base + (i % 23);
+	}
+}
+
+/* A file with len bytes of 'f' data, unlinked already */
+static int
+test_conn_file(char *buf, unsigned int len);
+static int
+test_conn_file(char *buf, unsigned int len) {
+	char	name[] = "/tmp/test_conn.XXXXXX";
+	int	fd;
+
+	fd = mkstemp(name);
+	if (fd == -1) {
+		return (-1);
+	}
+
+	unlink(name);
+	test_conn_fill(buf, len, 'f');
+
+	if (write(fd, buf, len) != (ssize_t)len) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+#ifdef _LINUX
+/* Not a file: a pipe goes out with splice() */
+static unsigned int
+test_conn_splice(void);
+static unsigned int
+test_conn_splice(void) {
+	const char	*testfunc = "conn_splice";
+	static char	data[TEST_CONN_PUT], got[TEST_CONN_PUT + 16];
+	unsigned int	fails = 0, want = 0, i;
+	conn_t		conn;
+	int		sv[2], pfd[2];
+	ssize_t		n;
+
+	test_conn_fill(data, sizeof data, 's');
+
+	if (pipe(pfd) == -1 ||
+	    write(pfd[1], data, sizeof data) != sizeof data ||
+	    socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1 ||
+	    !conn_init(&conn, NULL)) {
+		TEST_FAIL("setup");
+		return (1);
+	}
+
+	close(pfd[1]);
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+
+	conn.sock = sv[0];
+	conn_set_connected(&conn);
+
+	/* Only what was asked for, the rest stays in the pipe */
+	if (!conn_put(&conn, "<a>") ||
+	    !conn_putfile(&conn, pfd[0], 0, sizeof data - 10, false) ||
+	    !conn_put(&conn, "<b>")) {
+		TEST_FAIL("put");
+		fails++;
+	}
+
+	for (i = 0; i < 1000 && conn_flushleft(&conn) > 0; i++) {
+		if (!conn_flush(&conn)) {
+			TEST_FAIL("conn_flush");
+			fails++;
+			break;
+		}
+
+		while ((n = read(sv[1], &got[want], sizeof got - want)) > 0) {
+			want += n;
+		}
+	}
+
+	while ((n = read(sv[1], &got[want], sizeof got - want)) > 0) {
+		want += n;
+	}
+
+	if (want != sizeof data - 10 + 6 ||
+	    memcmp(got, "<a>", 3) != 0 ||
+	    memcmp(&got[3], data, sizeof data - 10) != 0 ||
+	    memcmp(&got[want - 3], "<b>", 3) != 0) {
+		TEST_FAILAR("splice", "data", want, sizeof data - 10 + 6);
+		fails++;
+	}
+
+	/* Not closed, the rest is still there */
+	if (read(pfd[0], got, sizeof got) != 10) {
+		TEST_FAIL("rest of the pipe");
+		fails++;
+	}
+
+	/* Non-blocking: nothing would tell when there is more, refused */
+	fcntl(pfd[0], F_SETFL, fcntl(pfd[0], F_GETFL) | O_NONBLOCK);
+	if (conn_putfile(&conn, pfd[0], 0, 10, false)) {
+		TEST_FAIL("non-blocking source accepted");
+		fails++;
+	}
+
+	conn_destroy(&conn);
+	close(pfd[0]);
+	close(sv[1]);
+
+	return (fails);
+}
+#endif /* _LINUX */
+
+/* Buffers, references and a file range, written in pieces */
+static unsigned int
+test_conn_chain(void);
+static unsigned int
+test_conn_chain(void) {
+	const char	*testfunc = "conn";
+	unsigned int	fails = 0, len = 0, want, i;
+	static char	ref[TEST_CONN_REF], file[TEST_CONN_FILE],
+			put[TEST_CONN_PUT], exp[TEST_CONN_MAX],
+			got[TEST_CONN_MAX];
+	test_conn_ref_t	rel;
+	conn_t		conn;
+	int		sv[2], fd, sz = 4096;
+	ssize_t		n;
+
+	memzero(&rel, sizeof rel);
+	test_conn_fill(ref, sizeof ref, 'r');
+	test_conn_fill(put, sizeof put, 'p');
+
+	fd = test_conn_file(file, sizeof file);
+
+	if (fd == -1 ||
+	    socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1 ||
+	    !conn_init(&conn, NULL)) {
+		TEST_FAIL("setup");
+		return (1);
+	}
+
+	/* A small socket buffer: every flush only gets a bit out */
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sz, sizeof sz);
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+
+	conn.sock = sv[0];
+	conn_set_connected(&conn);
+
+	/* The first response, what it is made of in order */
+	conn_addheader(&conn, "HTTP/1.1 200 OK");
+	if (!conn_put(&conn, "<start>") ||
+	    !conn_putref(&conn, ref, sizeof ref, test_conn_release, &rel) ||
+	    !conn_putfile(&conn, fd, 1000, sizeof file - 2000, true) ||
+	    !conn_putl(&conn, put, sizeof put) ||
+	    !conn_putl(&conn, put, sizeof put) ||
+	    !conn_printf(&conn, "<end %u>", 1)) {
+		TEST_FAIL("put");
+		fails++;
+	}
+
+	want = 7 + sizeof ref + sizeof file - 2000 + 2 * sizeof put + 7;
+	len += snprintf(exp, sizeof exp,
+			"HTTP/1.1 200 OK\r\nContent-Length: %u\r\n\r\n"
+			"<start>", want);
+	memcpy(&exp[len], ref, sizeof ref);
+	len += sizeof ref;
+	memcpy(&exp[len], &file[1000], sizeof file - 2000);
+	len += sizeof file - 2000;
+	memcpy(&exp[len], put, sizeof put);
+	len += sizeof put;
+	memcpy(&exp[len], put, sizeof put);
+	len += sizeof put;
+	memcpy(&exp[len], "<end 1>", 7);
+	len += 7;
+
+	if (!conn_seal(&conn)) {
+		TEST_FAIL("conn_seal");
+		fails++;
+	}
+
+	/* The second one goes behind it */
+	conn_addheader(&conn, "HTTP/1.1 404 Not Found");
+	conn_put(&conn, "second");
+	len += snprintf(&exp[len], sizeof exp - len,
+			"HTTP/1.1 404 Not Found\r\nContent-Length: 6\r\n\r\n"
+			"second");
+
+	/* Only counted from when it is finished */
+	if (!conn_seal(&conn) || conn_flushleft(&conn) != len) {
+		TEST_FAILAR("flushleft", "before",
+			    (int)conn_flushleft(&conn), len);
+		fails++;
+	}
+
+	/* Flush and read until it is all there */
+	want = 0;
+	for (i = 0; i < 100000 && want < len; i++) {
+		if (!conn_flush(&conn)) {
+			TEST_FAIL("conn_flush");
+			fails++;
+			break;
+		}
+
+		while ((n = read(sv[1], &got[want], sizeof got - want)) > 0) {
+			want += n;
+		}
+	}
+
+	/* Not in one go, or resuming was not tested */
+	if (i < 2) {
+		TEST_FAIL("written at once");
+		fails++;
+	}
+
+	if (want != len || memcmp(got, exp, len) != 0) {
+		TEST_FAILAR("chain", "data", want, len);
+		fails++;
+	}
+
+	if (conn_flushleft(&conn) != 0) {
+		TEST_FAIL("flushleft after");
+		fails++;
+	}
+
+	/* Written: released once, the file is closed */
+	if (rel.calls != 1 || rel.len != sizeof ref) {
+		TEST_FAILAR("release", "written", rel.calls, 1);
+		fails++;
+	}
+
+	if (fcntl(fd, F_GETFD) != -1) {
+		TEST_FAIL("file not closed");
+		fails++;
+	}
+
+	/* Not written: released when it is dropped */
+	memzero(&rel, sizeof rel);
+	if (!conn_putref(&conn, ref, 10, test_conn_release, &rel) ||
+	    !conn_seal(&conn)) {
+		TEST_FAIL("put (drop)");
+		fails++;
+	}
+
+	conn_destroy(&conn);
+	close(sv[1]);
+
+	if (rel.calls != 1 || rel.len != 10) {
+		TEST_FAILAR("release", "dropped", rel.calls, 1);
+		fails++;
+	}
+
+	return (fails);
+}
+
+/*
+ * A conn that is destroyed while it waits in the ready queue: the entry
+ * stays behind, the worker that pops it gets nothing (and the listener
+ * that went through the queue before still comes out)
+ */
+#define TEST_CONN_PORT	19480
+
+static unsigned int
+test_conn_queued(void);
+static unsigned int
+test_conn_queued(void) {
+	const char		*testfunc = "conn_queued";
+	struct sockaddr_in	sin;
+	connset_t		cs;
+	conn_t			*lconn, *conn;
+	unsigned int		fails = 0;
+	int			sock;
+
+	if (!connset_init_backend(&cs, CONNSET_SELECT) ||
+	    !conn_create_listen(&cs, "127.0.0.1", IPPROTO_TCP,
+				TEST_CONN_PORT)) {
+		TEST_FAIL("setup");
+		return (1);
+	}
+
+	memzero(&sin, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(TEST_CONN_PORT);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == -1 ||
+	    connect(sock, (struct sockaddr *)&sin, sizeof sin) == -1) {
+		TEST_FAIL("connect");
+		connset_destroy(&cs);
+		return (1);
+	}
+
+	/* The listener is ready, make a conn of what came in */
+	if (connset_poll(&cs) < 0 ||
+	    (lconn = connset_get_one_ready(&cs)) == NULL) {
+		TEST_FAIL("listener ready");
+		close(sock);
+		connset_destroy(&cs);
+		return (1);
+	}
+
+	conn = mcalloc(sizeof *conn, "conn");
+	if (conn == NULL || !conn_init(conn, NULL) ||
+	    !conn_accept(conn, lconn, NULL)) {
+		TEST_FAIL("accept");
+		fails++;
+	} else {
+		conn_events(conn, CONN_POLLIN);
+	}
+
+	connset_handling_done(lconn, false);
+
+	/* Ready, thus in the queue, and gone before a worker saw it */
+	if (fails == 0 &&
+	    (write(sock, "x", 1) != 1 || connset_poll(&cs) < 0)) {
+		TEST_FAIL("conn ready");
+		fails++;
+	}
+
+	if (conn != NULL) {
+		conn_destroy(conn);
+		mfree(conn, sizeof *conn, "conn");
+	}
+
+	if (connset_get_one_ready(&cs) != NULL) {
+		TEST_FAIL("destroyed conn came out of the queue");
+		fails++;
+	}
+
+	close(sock);
+	connset_destroy(&cs);
+
+	return (fails);
+}
+
+unsigned int
+test_conn(void) {
+	unsigned int fails = 0;
+
+	fails += test_conn_chain();
+	fails += test_conn_queued();
+#ifdef _LINUX
+	fails += test_conn_splice();
+#endif
+
+	return (fails);
+}
@@ -0,0 +1,8 @@
+#ifndef TESTS_TEST_CONN_H
+#define TESTS_TEST_CONN_H 1
+
+#include "test.h"
+
+unsigned int test_conn(void);
+
+#endif /* TESTS_TEST_CONN_H */
@@ -0,0 +1,147 @@
+#include <libfutil/misc.h>
+#include <libfutil/filecache.h>
+#include "test_filecache.h"
+
+/*
+ * Looking a file up again gives the same entry (and fd), a changed file
+ * a new one while the old one stays usable for who still has it, and
+ * the least recently used entry goes first.
+ */
+
+static const char *
+test_filecache_type(const char *path);
+static const char *
+test_filecache_type(const char UNUSED *path) {
+	return ("test/type");
+}
+
+/* Write len bytes to dir/name */
+static bool
+test_filecache_write(const char *dir, const char *name, unsigned int len);
+static bool
+test_filecache_write(const char *dir, const char *name, unsigned int len) {
+	char	path[256], buf[64];
+	int	fd;
+
+	fassert(len <= sizeof buf);
+	memset(buf, 'c', len);
+
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		return (false);
+	}
+
+	if (write(fd, buf, len) != (ssize_t)len) {
+		close(fd);
+		return (false);
+	}
+
+	close(fd);
+	return (true);
+}
+
+unsigned int
+test_filecache(void) {
+	const char		*testfunc = "filecache";
+	unsigned int		fails = 0;
+	char			dir[] = "/tmp/test_filecache.XXXXXX",
+				a[256], b[256], c[256];
+	filecache_t		fc;
+	filecache_entry_t	*fe, *fe2, *fe3;
+	int			fd;
+
+	if (mkdtemp(dir) == NULL ||
+	    !test_filecache_write(dir, "a", 10) ||
+	    !test_filecache_write(dir, "b", 20) ||
+	    !test_filecache_write(dir, "c", 30) ||
+	    !filecache_init(&fc, 2, 0, test_filecache_type)) {
+		TEST_FAIL("setup");
+		return (1);
+	}
+
+	snprintf(a, sizeof a, "%s/a", dir);
+	snprintf(b, sizeof b, "%s/b", dir);
+	snprintf(c, sizeof c, "%s/c", dir);
+
+	/* Opened once, shared after that */
+	fe = filecache_get(&fc, a);
+	fe2 = filecache_get(&fc, a);
+	if (fe == NULL || fe2 != fe || fc.hits != 1 || fc.misses != 1) {
+		TEST_FAIL("same entry");
+		fails++;
+	}
+
+	if (fe != NULL && (fe->size != 10 || fe->etag[0] != '"' ||
+			   strcmp(fe->type, "test/type") != 0)) {
+		TEST_FAIL("entry");
+		fails++;
+	}
+
+	if (fe2 != NULL) {
+		filecache_put(fe2);
+	}
+
+	/* Changed: a new entry, the old one is still there for us */
+	if (!test_filecache_write(dir, "a", 11)) {
+		TEST_FAIL("rewrite");
+		fails++;
+	}
+
+	fe2 = filecache_get(&fc, a);
+	if (fe2 == NULL || fe2 == fe || fe2->size != 11 ||
+	    (fe != NULL && (fe->cached || fe->size != 10 ||
+			    fcntl(fe->fd, F_GETFD) == -1))) {
+		TEST_FAIL("changed");
+		fails++;
+	}
+
+	/* The last one closes it */
+	if (fe != NULL) {
+		fd = fe->fd;
+		filecache_put(fe);
+
+		if (fcntl(fd, F_GETFD) != -1) {
+			TEST_FAIL("closed");
+			fails++;
+		}
+	}
+
+	/* Room for two: a is the oldest, it goes */
+	fe = filecache_get(&fc, b);
+	fe3 = filecache_get(&fc, c);
+	if (fe == NULL || fe3 == NULL || fc.n != 2 ||
+	    (fe2 != NULL && fe2->cached) || !fe->cached || !fe3->cached) {
+		TEST_FAIL("evict");
+		fails++;
+	}
+
+	if (fe != NULL) {
+		filecache_put(fe);
+	}
+
+	if (fe2 != NULL) {
+		filecache_put(fe2);
+	}
+
+	if (fe3 != NULL) {
+		filecache_put(fe3);
+	}
+
+	/* Gone, not a file or not allowed */
+	if (filecache_get(&fc, "/tmp/test_filecache.none") != NULL ||
+	    filecache_get(&fc, dir) != NULL ||
+	    filecache_get(&fc, "/tmp/../tmp") != NULL) {
+		TEST_FAIL("not there");
+		fails++;
+	}
+
+	filecache_destroy(&fc);
+
+	unlink(a);
+	unlink(b);
+	unlink(c);
+	rmdir(dir);
+
+	return (fails);
+}
@@ -0,0 +1,8 @@
+#ifndef TESTS_TEST_FILECACHE_H
+#define TESTS_TEST_FILECACHE_H 1
+
+#include "test.h"
+
+unsigned int test_filecache(void);
+
+#endif /* TESTS_TEST_FILECACHE_H */
@@ -0,0 +1,235 @@
+#include <libfutil/misc.h>
+#include <libfutil/httpparse.h>
+#include "test_httpparse.h"
+
+#define TEST_HTTPPARSE_MAX 1024
+
+/* Parse it in one go and byte by byte, both should agree */
+static int
+test_httpparse_run(const char *testfunc, httpparse_t *p, const char *req);
+static int
+test_httpparse_run(const char *testfunc, httpparse_t *p, const char *req) {
+	httpparse_t	q;
+	uint32_t	l, len = strlen(req);
+	int		i, j = HTTPPARSE_MORE;
+
+	httpparse_init(p, TEST_HTTPPARSE_MAX);
+	i = httpparse_run(p, req, len);
+
+	httpparse_init(&q, TEST_HTTPPARSE_MAX);
+	for (l = 1; l <= len && j == HTTPPARSE_MORE; l++) {
+		j = httpparse_run(&q, req, l);
+	}
+
+	if (i != j || p->nhdrs != q.nhdrs ||
+	    p->uri.off != q.uri.off || p->uri.len != q.uri.len) {
+		TEST_FAILAR("incremental", req, j, i);
+	}
+
+	return (i);
+}
+
+/* Compare a span with a string */
+static bool
+test_httpparse_is(const char *req, httpparse_span_t sp, const char *s);
+static bool
+test_httpparse_is(const char *req, httpparse_span_t sp, const char *s) {
+	return (sp.len == strlen(s) && strncmp(&req[sp.off], s, sp.len) == 0);
+}
+
+static unsigned int
+test_httpparse_request(void);
+static unsigned int
+test_httpparse_request(void) {
+	const char	*testfunc = "httpparse";
+	const char	*req;
+	httpparse_t	p;
+	unsigned int	fails = 0;
+	int		i;
+
+	/*******************************************************/
+	req =	"\r\n"
+		"GET /index.html?a=b HTTP/1.1\r\n"
+		"Host: example.com\r\n"
+		"Cookie:  a=b; c=d \t\r\n"
+		"X-Empty:\r\n"
+		"\r\n"
+		"body";
+
+	i = test_httpparse_run(testfunc, &p, req);
+	if (i != (int)(strlen(req) - 4)) {
+		TEST_FAILAR("length", req, i, strlen(req) - 4);
+		fails++;
+	}
+
+	if (!test_httpparse_is(req, p.method, "GET") ||
+	    !test_httpparse_is(req, p.uri, "/index.html?a=b") ||
+	    !test_httpparse_is(req, p.version, "HTTP/1.1") ||
+	    !test_httpparse_is(req, p.request,
+			       "GET /index.html?a=b HTTP/1.1")) {
+		TEST_FAILA("request line", req);
+		fails++;
+	}
+
+	if (p.nhdrs != 3 ||
+	    !test_httpparse_is(req, p.hdrs[0].name, "Host") ||
+	    !test_httpparse_is(req, p.hdrs[0].value, "example.com") ||
+	    !test_httpparse_is(req, p.hdrs[1].value, "a=b; c=d") ||
+	    !test_httpparse_is(req, p.hdrs[2].value, "")) {
+		TEST_FAILA("headers", req);
+		fails++;
+	}
+
+	if (httpparse_find(&p, req, "cookie", 6) != 1 ||
+	    httpparse_find(&p, req, "Cookies", 7) != -1) {
+		TEST_FAILA("find", req);
+		fails++;
+	}
+
+	/*******************************************************/
+	req =	"GET /\n"
+		"\n";
+
+	i = test_httpparse_run(testfunc, &p, req);
+	if (i != (int)strlen(req) || p.version.len != 0 ||
+	    !test_httpparse_is(req, p.uri, "/")) {
+		TEST_FAILAR("LF only", req, i, strlen(req));
+		fails++;
+	}
+
+	/*******************************************************/
+	req =	"GET / HTTP/1.1\r\n"
+		"Host: x\r\n";
+
+	i = test_httpparse_run(testfunc, &p, req);
+	if (i != HTTPPARSE_MORE) {
+		TEST_FAILAR("incomplete", req, i, HTTPPARSE_MORE);
+		fails++;
+	}
+
+	return (fails);
+}
+
+static unsigned int
+test_httpparse_errors(void);
+static unsigned int
+test_httpparse_errors(void) {
+	const char	*testfunc = "httpparse_errors";
+	char		big[TEST_HTTPPARSE_MAX + 64];
+	httpparse_t	p;
+	unsigned int	i, fails = 0;
+	int		r;
+	struct {
+		const char	*req;
+		int		result;
+	} tests[] = {
+		{ "GET\r\n\r\n",				HTTPPARSE_BAD },
+		{ " / HTTP/1.1\r\n\r\n",			HTTPPARSE_BAD },
+		{ "GET  HTTP/1.1\r\n\r\n",			HTTPPARSE_BAD },
+		{ "GET / HTTP/1.1\r\nHost x\r\n\r\n",		HTTPPARSE_BAD },
+		{ "GET / HTTP/1.1\r\n: x\r\n\r\n",		HTTPPARSE_BAD },
+		{ "GET / HTTP/1.1\r\nHost : x\r\n\r\n",		HTTPPARSE_BAD },
+		{ "GET / HTTP/1.1\r\nA: b\r\n c\r\n\r\n",	HTTPPARSE_BAD },
+	};
+
+	for (i = 0; i < lengthof(tests); i++) {
+		r = test_httpparse_run(testfunc, &p, tests[i].req);
+		if (r != tests[i].result) {
+			TEST_FAILAR("result", tests[i].req, r, tests[i].result);
+			fails++;
+		}
+	}
+
+	/* A NUL anywhere */
+	httpparse_init(&p, TEST_HTTPPARSE_MAX);
+	r = httpparse_run(&p, "GET / HTTP/1.1\r\nA: \0\r\n\r\n", 24);
+	if (r != HTTPPARSE_BAD) {
+		TEST_FAILAR("result", "NUL", r, HTTPPARSE_BAD);
+		fails++;
+	}
+
+	/* Request line without an end */
+	memset(big, 'a', sizeof big);
+	httpparse_init(&p, TEST_HTTPPARSE_MAX);
+	r = httpparse_run(&p, big, sizeof big);
+	if (r != HTTPPARSE_URITOOLONG) {
+		TEST_FAILAR("result", "long request", r, HTTPPARSE_URITOOLONG);
+		fails++;
+	}
+
+	/* Too many headers */
+	i = snprintf(big, sizeof big, "GET / HTTP/1.1\r\n");
+	while (i < TEST_HTTPPARSE_MAX - 8) {
+		i += snprintf(&big[i], sizeof big - i, "A: b\r\n");
+	}
+
+	httpparse_init(&p, TEST_HTTPPARSE_MAX);
+	r = httpparse_run(&p, big, i);
+	if (r != HTTPPARSE_TOOLARGE) {
+		TEST_FAILAR("result", "many headers", r, HTTPPARSE_TOOLARGE);
+		fails++;
+	}
+
+	return (fails);
+}
+
+static unsigned int
+test_httpparse_range(void);
+static unsigned int
+test_httpparse_range(void) {
+	const char	*testfunc = "httpparse_range";
+	unsigned int	i, fails = 0;
+	uint64_t	off, len;
+	int		r;
+	struct {
+		const char	*range;
+		uint64_t	size;
+		int		result;
+		uint64_t	off, len;
+	} tests[] = {
+		{ NULL,			1000,	200,			0, 1000 },
+		{ "bytes=0-99",		1000,	206,			0, 100 },
+		{ "bytes=100-",		1000,	206,			100, 900 },
+		{ "bytes=-100",		1000,	206,			900, 100 },
+		{ "bytes=-2000",	1000,	206,			0, 1000 },
+		{ "BYTES= 500-5000 ",	1000,	206,			500, 500 },
+		{ "bytes=999-999",	1000,	206,			999, 1 },
+		{ "bytes=1000-",	1000,	HTTPPARSE_BADRANGE,	0, 1000 },
+		{ "bytes=-0",		1000,	HTTPPARSE_BADRANGE,	0, 1000 },
+		{ "bytes=0-",		0,	HTTPPARSE_BADRANGE,	0, 0 },
+		{ "bytes=5-4",		1000,	200,			0, 1000 },
+		{ "bytes=0-1,5-6",	1000,	200,			0, 1000 },
+		{ "bytes=a-b",		1000,	200,			0, 1000 },
+		{ "bytes=-",		1000,	200,			0, 1000 },
+		{ "bytes=1-2x",		1000,	200,			0, 1000 },
+		{ "items=0-1",		1000,	200,			0, 1000 },
+		{ "bytes=99999999999999999999-", 1000, 200,		0, 1000 },
+	};
+
+	for (i = 0; i < lengthof(tests); i++) {
+		r = httpparse_range(tests[i].range, tests[i].size, &off, &len);
+		if (r != tests[i].result) {
+			TEST_FAILAR("result", tests[i].range, r,
+				    tests[i].result);
+			fails++;
+		} else if (r != HTTPPARSE_BADRANGE &&
+			   (off != tests[i].off || len != tests[i].len)) {
+			TEST_FAILAR("off/len", tests[i].range, (int)off,
+				    tests[i].off);
+			fails++;
+		}
+	}
+
+	return (fails);
+}
+
+unsigned int
+test_httpparse(void) {
+	unsigned int fails = 0;
+
+	fails += test_httpparse_request();
+	fails += test_httpparse_errors();
+	fails += test_httpparse_range();
+
+	return (fails);
+}
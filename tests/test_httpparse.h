@@ -0,0 +1,8 @@
+#ifndef TESTS_TEST_HTTPPARSE_H
+#define TESTS_TEST_HTTPPARSE_H 1
+
+#include "test.h"
+
+unsigned int test_httpparse(void);
+
+#endif /* TESTS_TEST_HTTPPARSE_H */
@@ -0,0 +1,273 @@
+#include <libfutil/misc.h>
+#include <libfutil/httpsrv.h>
+#include "test_httpsrv.h"
+
+/*
+ * Pipelined requests against a running httpsrv: the answers have to come
+ * back in order and each exactly as long as its Content-Length says,
+ * whether the requests came in together, split in the middle of a
+ * header, or so many that the answers go over HTTPSRV_BATCH_MAX and
+ * the socket fills up (the rest goes out after POLLOUT).
+ *
+ * There is no way to stop a httpsrv short of thread_stopall(), thus it
+ * keeps running until the tests exit: keep this one last.
+ */
+#define TEST_HTTPSRV_PORT	19395
+#define TEST_HTTPSRV_BIG	(32*1024)	/* Body of a /bN answer */
+#define TEST_HTTPSRV_BIGS	64		/* 2 MiB of answers */
+#define TEST_HTTPSRV_REQ(n)	"GET /s" n " HTTP/1.1\r\n"		\
+				"Host: www.example.com\r\n"		\
+				"\r\n"
+
+static char l_test_httpsrv_fill[TEST_HTTPSRV_BIG];
+
+/* /sN answers "N:", /bN answers "N:" and TEST_HTTPSRV_BIG x's */
+static bool
+test_httpsrv_handle(httpsrv_client_t *hcl, void *user);
+static bool
+test_httpsrv_handle(httpsrv_client_t *hcl, void UNUSED *user) {
+	unsigned int	n;
+	char		kind;
+
+	if (hcl->the_request == NULL ||
+	    sscanf(hcl->the_request, "%*s /%c%u", &kind, &n) != 2) {
+		httpsrv_error(hcl, HTTPSRV_HTTP_NOTFOUND);
+		httpsrv_done(hcl);
+		return (true);
+	}
+
+	httpsrv_answer(hcl, HTTPSRV_HTTP_OK, HTTPSRV_CTYPE_BINARY);
+	conn_printf(&hcl->conn, "%u:", n);
+
+	if (kind == 'b') {
+		conn_putl(&hcl->conn, l_test_httpsrv_fill,
+			  sizeof l_test_httpsrv_fill);
+	}
+
+	httpsrv_done(hcl);
+
+	return (true);
+}
+
+static int
+test_httpsrv_connect(void);
+static int
+test_httpsrv_connect(void) {
+	struct sockaddr_in	sin;
+	struct timeval		tv = { 5, 0 };
+	int			sock, sz = 16 * 1024;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == -1) {
+		return (-1);
+	}
+
+	/* Small, the big answers have to wait for room */
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &sz, sizeof sz);
+
+	/* Never hang the tests */
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+	memzero(&sin, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(TEST_HTTPSRV_PORT);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (connect(sock, (struct sockaddr *)&sin, sizeof sin) == -1) {
+		close(sock);
+		return (-1);
+	}
+
+	return (sock);
+}
+
+static bool
+test_httpsrv_send(int sock, const char *data);
+static bool
+test_httpsrv_send(int sock, const char *data) {
+	size_t	len = strlen(data);
+	ssize_t	r;
+
+	while (len > 0) {
+		r = send(sock, data, len, MSG_NOSIGNAL);
+		if (r <= 0) {
+			return (false);
+		}
+
+		data += r;
+		len -= r;
+	}
+
+	return (true);
+}
+
+/*
+ * Read the answers to requests first..first+num-1, bodies with big have
+ * the fill after the number. Nothing may follow them.
+ */
+static unsigned int
+test_httpsrv_answers(const char *testfunc, const char *what, int sock,
+		     unsigned int first, unsigned int num, bool big);
+static unsigned int
+test_httpsrv_answers(const char *testfunc, const char *what, int sock,
+		     unsigned int first, unsigned int num, bool big) {
+	static char	buf[TEST_HTTPSRV_BIG + 1024];
+	char		num_s[16], *end, *cl;
+	unsigned int	i = first, len, have = 0, head, want;
+	ssize_t		r;
+
+	while (i < first + num) {
+		end = strstr(buf, "\r\n\r\n");
+		if (have > 0 && end != NULL) {
+			head = end + 4 - buf;
+			snprintf(num_s, sizeof num_s, "%u:", i);
+			want = strlen(num_s) + (big ? TEST_HTTPSRV_BIG : 0);
+
+			cl = strstr(buf, "Content-Length: ");
+			if (strncmp(buf, "HTTP/1.1 200 OK\r\n", 17) != 0 ||
+			    cl == NULL || cl > end ||
+			    sscanf(cl, "Content-Length: %u", &len) != 1 ||
+			    len != want) {
+				TEST_FAILA(what, "answer head");
+				return (1);
+			}
+
+			if (have >= head + len) {
+				if (memcmp(&buf[head], num_s,
+					   strlen(num_s)) != 0 ||
+				    (big &&
+				     memcmp(&buf[head + strlen(num_s)],
+					    l_test_httpsrv_fill,
+					    TEST_HTTPSRV_BIG) != 0)) {
+					TEST_FAILAR(what, "answer order",
+						    i, first);
+					return (1);
+				}
+
+				/* The next one */
+				have -= head + len;
+				memmove(buf, &buf[head + len], have);
+				buf[have] = '\0';
+				i++;
+				continue;
+			}
+		}
+
+		if (have >= sizeof buf - 1) {
+			TEST_FAILA(what, "answer too long");
+			return (1);
+		}
+
+		r = recv(sock, &buf[have], sizeof buf - 1 - have, 0);
+		if (r <= 0) {
+			TEST_FAILAR(what, "answers", i - first, num);
+			return (1);
+		}
+
+		have += r;
+		buf[have] = '\0';
+	}
+
+	if (have != 0) {
+		TEST_FAILAR(what, "bytes after the answers", have, 0);
+		buf[0] = '\0';
+		return (1);
+	}
+
+	buf[0] = '\0';
+
+	return (0);
+}
+
+unsigned int
+test_httpsrv(void) {
+	const char	*testfunc = "httpsrv";
+	static char	reqs[TEST_HTTPSRV_BIGS * 64];
+	httpsrv_t	*hs;
+	unsigned int	fails = 0, i, len = 0;
+	int		sock;
+
+	memset(l_test_httpsrv_fill, 'x', sizeof l_test_httpsrv_fill);
+
+	hs = mcalloc(sizeof *hs, "httpsrv_t");
+	if (hs == NULL) {
+		TEST_FAIL("no memory");
+		return (1);
+	}
+
+	if (!httpsrv_init(hs, NULL, NULL, NULL, NULL, NULL,
+			  test_httpsrv_handle, NULL, NULL, NULL) ||
+	    !httpsrv_start(hs, "127.0.0.1", TEST_HTTPSRV_PORT, 2)) {
+		TEST_FAIL("could not start httpsrv");
+		return (1);
+	}
+
+	sock = test_httpsrv_connect();
+	if (sock == -1) {
+		TEST_FAIL("connect");
+		return (1);
+	}
+
+	/* Three in one go */
+	if (!test_httpsrv_send(sock, TEST_HTTPSRV_REQ("0")
+				     TEST_HTTPSRV_REQ("1")
+				     TEST_HTTPSRV_REQ("2"))) {
+		TEST_FAIL("send");
+		close(sock);
+		return (1);
+	}
+
+	fails += test_httpsrv_answers(testfunc, "together", sock, 0, 3, false);
+
+	/* The second one split in its Host: header, the rest behind it */
+	if (!test_httpsrv_send(sock, TEST_HTTPSRV_REQ("3")
+				     "GET /s4 HTTP/1.1\r\nHo")) {
+		TEST_FAIL("send");
+		close(sock);
+		return (fails + 1);
+	}
+
+	fails += test_httpsrv_answers(testfunc, "split", sock, 3, 1, false);
+
+	if (!test_httpsrv_send(sock, "st: www.example.com\r\n\r\n"
+				     TEST_HTTPSRV_REQ("5"))) {
+		TEST_FAIL("send");
+		close(sock);
+		return (fails + 1);
+	}
+
+	fails += test_httpsrv_answers(testfunc, "split", sock, 4, 2, false);
+
+	/*
+	 * Answers way over HTTPSRV_BATCH_MAX and what the sockets hold:
+	 * not read until all went in, they go out over several POLLOUTs
+	 */
+	for (i = 0; i < TEST_HTTPSRV_BIGS; i++) {
+		len += snprintf(&reqs[len], sizeof reqs - len,
+				"GET /b%u HTTP/1.1\r\n\r\n", i);
+	}
+
+	if (!test_httpsrv_send(sock, reqs)) {
+		TEST_FAIL("send");
+		close(sock);
+		return (fails + 1);
+	}
+
+	usleep(100 * 1000);
+
+	fails += test_httpsrv_answers(testfunc, "batch", sock, 0,
+				      TEST_HTTPSRV_BIGS, true);
+
+	/* And it is still fine for the next one */
+	if (!test_httpsrv_send(sock, TEST_HTTPSRV_REQ("6"))) {
+		TEST_FAIL("send");
+		close(sock);
+		return (fails + 1);
+	}
+
+	fails += test_httpsrv_answers(testfunc, "after", sock, 6, 1, false);
+
+	close(sock);
+
+	return (fails);
+}
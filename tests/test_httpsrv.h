@@ -0,0 +1,8 @@
+#ifndef TESTS_TEST_HTTPSRV_H
+#define TESTS_TEST_HTTPSRV_H 1
+
+#include "test.h"
+
+unsigned int test_httpsrv(void);
+
+#endif /* TESTS_TEST_HTTPSRV_H */
@@ -1,3 +1,7 @@
+/* The log site tests use debug sites, also when the build has them out */
+#undef LOG_LEVEL_COMPILED
+#define LOG_LEVEL_COMPILED LOG_DEBUG
+
 #include <libfutil/misc.h>
 #include "test_misc.h"
 
@@ -315,6 +319,431 @@ test_human_size(void) {
 	return (fails);
 }
 
+/*
+ * Threads log through their rings at the same time: every line that was
+ * not dropped has to be in the file, whole and in the order of its
+ * thread. Then with a small maximum size the file has to be rotated.
+ */
+#define TEST_LOG_THREADS	4
+#define TEST_LOG_LINES		5000
+#define TEST_LOG_MAXSIZE	(64 * 1024)
+
+static void *
+test_log_thread(void *arg);
+static void *
+test_log_thread(void *arg) {
+	unsigned int i, t = (unsigned int)(uintptr_t)arg;
+
+	for (i = 0; i < TEST_LOG_LINES; i++) {
+		log_ntc("test_log %u %u", t, i);
+	}
+
+	return (NULL);
+}
+
+static unsigned int
+test_log_check(const char *name, uint64_t *lines);
+static unsigned int
+test_log_check(const char *name, uint64_t *lines) {
+	const char	*testfunc = "log_async";
+	unsigned int	fails = 0, t, i, next[TEST_LOG_THREADS];
+	const char	*p;
+	char		line[1100];
+	FILE		*f;
+
+	memzero(next, sizeof next);
+	*lines = 0;
+
+	f = fopen(name, "r");
+	if (f == NULL) {
+		TEST_FAILA("open", name);
+		return (1);
+	}
+
+	while (fgets(line, sizeof line, f) != NULL) {
+		p = strstr(line, "test_log ");
+		if (p == NULL) {
+			continue;
+		}
+
+		if (sscanf(p, "test_log %u %u", &t, &i) != 2 ||
+		    t >= TEST_LOG_THREADS || i < next[t] ||
+		    line[strlen(line) - 1] != '\n') {
+			TEST_FAILA("line", line);
+			fails++;
+			break;
+		}
+
+		next[t] = i + 1;
+		(*lines)++;
+	}
+
+	fclose(f);
+
+	return (fails);
+}
+
+static unsigned int
+test_log_async(void);
+static unsigned int
+test_log_async(void) {
+	const char	*testfunc = "log_async";
+	static char	name[] = "/tmp/test_log.XXXXXX";
+	char		old[sizeof name + 2];
+	pthread_t	th[TEST_LOG_THREADS];
+	unsigned int	fails = 0, i;
+	uint64_t	lines, drops, found;
+	struct stat	st;
+	int		fd;
+
+	fd = mkstemp(name);
+	if (fd == -1 || !log_set(name)) {
+		TEST_FAIL("setup");
+		return (1);
+	}
+
+	close(fd);
+	snprintf(old, sizeof old, "%s.1", name);
+
+	if (!log_async_start(4096, 0)) {
+		TEST_FAIL("start");
+		return (1);
+	}
+
+	for (i = 0; i < TEST_LOG_THREADS; i++) {
+		if (pthread_create(&th[i], NULL, test_log_thread,
+				   (void *)(uintptr_t)i) != 0) {
+			TEST_FAIL("pthread_create");
+			fails++;
+			th[i] = pthread_self();
+		}
+	}
+
+	for (i = 0; i < TEST_LOG_THREADS; i++) {
+		if (!pthread_equal(th[i], pthread_self())) {
+			pthread_join(th[i], NULL);
+		}
+	}
+
+	log_async_stop();
+	log_async_stats(&lines, &drops);
+
+	fails += test_log_check(name, &found);
+	if (found + drops != TEST_LOG_THREADS * TEST_LOG_LINES) {
+		TEST_FAILAR("lines", "written + dropped", (int)found,
+			    (TEST_LOG_THREADS * TEST_LOG_LINES - drops));
+		fails++;
+	}
+
+	/* Now it has to rotate */
+	if (!log_async_start(4096, TEST_LOG_MAXSIZE)) {
+		TEST_FAIL("restart");
+		fails++;
+	} else {
+		test_log_thread((void *)0);
+		log_async_stop();
+
+		if (stat(old, &st) != 0 || stat(name, &st) != 0 ||
+		    st.st_size > TEST_LOG_MAXSIZE) {
+			TEST_FAIL("rotate");
+			fails++;
+		}
+	}
+
+	/* Back to where the logs went */
+	log_setup("test", NULL);
+	unlink(old);
+	unlink(name);
+
+	return (fails);
+}
+
+/*
+ * The same lines formatted by the threads, by the writer (deferred) and
+ * from a binary log (log_decode()) have to come out the same
+ */
+static void
+test_log_formats_log(void);
+static void
+test_log_formats_log(void) {
+	char		big[1500];
+	long double	ld = 2.5;
+
+	memset(big, 'b', sizeof big - 1);
+	big[sizeof big - 1] = '\0';
+
+	log_ntc("fmt int %d %5d %-5d| %+d %05d %i %" PRId64, -1, 42, 42, 7, 42,
+		0, INT64_MIN);
+	log_ntc("fmt uint %u %x %#X %o %" PRIu64 " %" PRIx64,
+		1U, 255U, 255U, 8U, UINT64_MAX, (uint64_t)0xdeadbeef);
+	log_ntc("fmt len %hd %hhu %ld %lld %zu %" PRIsizet " %jd",
+		(short)-5, (unsigned char)200, -7L, 1LL << 40, (size_t)12,
+		(ssize_t)-3, (intmax_t)-9);
+	log_ntc("fmt str %c%c %s %10s|%-4s| %.3s %.*s %s",
+		'o', 'k', "abc", "right", "l", "truncate", 2, "xyz", "");
+	log_ntc("fmt star %*d|%-*d|%.*f|%*.*s|%.*s|",
+		6, 1, 4, 2, 2, 3.14159, 5, 2, "abc", -1, "all");
+	log_ntc("fmt double %f %.2e %g %p", 1.5, 12345.678, 0.0001,
+		(void *)&ld);
+	log_ntc("fmt pct 100%% %s", "done");
+	log_ntc("fmt now %Lf", ld);
+	log_ntc("fmt big %s", big);
+
+	errno = ENOENT;
+	log_err("fmt errno %d", 5);
+}
+
+/* The messages of the fmt lines in name, after each other */
+static unsigned int
+test_log_formats_read(const char *name, char *buf, size_t size);
+static unsigned int
+test_log_formats_read(const char *name, char *buf, size_t size) {
+	char		line[2048];
+	const char	*p;
+	unsigned int	n = 0, len = 0;
+	FILE		*f;
+
+	buf[0] = '\0';
+
+	f = fopen(name, "r");
+	if (f == NULL) {
+		return (0);
+	}
+
+	while (fgets(line, sizeof line, f) != NULL) {
+		p = strstr(line, "() fmt ");
+		if (p != NULL && len + strlen(p) < size) {
+			strcpy(&buf[len], p);
+			len += strlen(p);
+			n++;
+		}
+	}
+
+	fclose(f);
+
+	return (n);
+}
+
+static unsigned int
+test_log_formats(void);
+static unsigned int
+test_log_formats(void) {
+	const char	*testfunc = "log_formats";
+	const char	*modes[] = { "text", "deferred", "binary" };
+	static char	name[] = "/tmp/test_log.XXXXXX";
+	char		text[] = "/tmp/test_log.XXXXXX";
+	static char	got[3][8192];
+	unsigned int	fails = 0, m, n;
+	FILE		*in, *out;
+	int		fd;
+
+	for (m = 0; m < lengthof(modes); m++) {
+		strcpy(name, "/tmp/test_log.XXXXXX");
+		fd = mkstemp(name);
+		if (fd == -1 || !log_set(name)) {
+			TEST_FAILA("setup", modes[m]);
+			return (fails + 1);
+		}
+
+		close(fd);
+
+		if (!log_async_format((log_format_t)m) ||
+		    !log_async_start(0, 0)) {
+			TEST_FAILA("start", modes[m]);
+			fails++;
+			unlink(name);
+			continue;
+		}
+
+		/* Not under the running threads and writer */
+		if (log_async_format(LOG_FORMAT_TEXT)) {
+			TEST_FAILA("format while running", modes[m]);
+			fails++;
+		}
+
+		test_log_formats_log();
+		log_async_stop();
+
+		if (m == LOG_FORMAT_BINARY) {
+			fd = mkstemp(text);
+			in = fopen(name, "r");
+			out = fd == -1 ? NULL : fdopen(fd, "w");
+			if (in == NULL || out == NULL || !log_decode(in, out)) {
+				TEST_FAILA("decode", modes[m]);
+				fails++;
+			}
+
+			if (in != NULL) {
+				fclose(in);
+			}
+
+			if (out != NULL) {
+				fclose(out);
+			}
+
+			unlink(name);
+			strcpy(name, text);
+		}
+
+		n = test_log_formats_read(name, got[m], sizeof got[m]);
+		if (n != 10) {
+			TEST_FAILAR("lines", modes[m], n, 10);
+			fails++;
+		}
+
+		if (strcmp(got[m], got[0]) != 0) {
+			TEST_FAILA("differs", modes[m]);
+			fprintf(stderr, "%s\n---\n%s\n", got[0], got[m]);
+			fails++;
+		}
+
+		unlink(name);
+	}
+
+	/* Back to where the logs went */
+	if (!log_async_format(LOG_FORMAT_TEXT)) {
+		TEST_FAIL("format");
+		fails++;
+	}
+
+	log_setup("test", NULL);
+
+	return (fails);
+}
+
+/* Sites follow the level, and the rules for their file and function */
+static void
+test_log_sites_log(void);
+static void
+test_log_sites_log(void) {
+	log_dbg("site dbg");
+	log_ntc("site ntc");
+}
+
+static void
+test_log_sites_other(void);
+static void
+test_log_sites_other(void) {
+	log_dbg("site other");
+}
+
+/* Lines with what in the log file */
+static unsigned int
+test_log_sites_count(const char *name, const char *what);
+static unsigned int
+test_log_sites_count(const char *name, const char *what) {
+	char		line[2048];
+	unsigned int	n = 0;
+	FILE		*f;
+
+	f = fopen(name, "r");
+	if (f == NULL) {
+		return (0);
+	}
+
+	while (fgets(line, sizeof line, f) != NULL) {
+		if (strstr(line, what) != NULL) {
+			n++;
+		}
+	}
+
+	fclose(f);
+
+	return (n);
+}
+
+static unsigned int
+test_log_sites(void);
+static unsigned int
+test_log_sites(void) {
+	const char		*testfunc = "log_sites";
+	const char		*what[] = { "site dbg", "site ntc",
+					    "site other" };
+	/* Lines of each so far, after each step */
+	const unsigned int	want[][3] = {
+		{ 0, 1, 0 },	/* Level info */
+		{ 1, 2, 0 },	/* On: test_log_sites_log() in this file */
+		{ 1, 2, 0 },	/* Off: test_log_sites_log() anywhere */
+		{ 1, 2, 1 },	/* Level debug, the rules stay */
+		{ 2, 3, 2 },	/* No rules */
+		{ 2, 4, 2 },	/* Level info again */
+	};
+	static char		name[] = "/tmp/test_log.XXXXXX";
+	char			big[100];
+	unsigned int		fails = 0, step, i, n;
+	int			fd;
+
+	fd = mkstemp(name);
+	if (fd == -1 || !log_set(name)) {
+		TEST_FAIL("setup");
+		return (1);
+	}
+
+	close(fd);
+
+	for (step = 0; step < lengthof(want); step++) {
+		switch (step) {
+		case 0:
+			log_setlevel(LOG_INFO);
+			break;
+
+		case 1:
+			if (!log_site_rule("test_misc.c", "test_log_sites_log",
+					   true)) {
+				TEST_FAIL("rule on");
+				fails++;
+			}
+			break;
+
+		case 2:
+			if (!log_site_rule(NULL, "test_log_sites_log",
+					   false)) {
+				TEST_FAIL("rule off");
+				fails++;
+			}
+			break;
+
+		case 3:
+			log_setlevel(LOG_DEBUG);
+			break;
+
+		case 4:
+			log_site_rules_clear();
+			break;
+
+		default:
+			log_setlevel(LOG_INFO);
+			break;
+		}
+
+		test_log_sites_log();
+		test_log_sites_other();
+
+		for (i = 0; i < lengthof(what); i++) {
+			n = test_log_sites_count(name, what[i]);
+			if (n != want[step][i]) {
+				TEST_FAILAR("lines", what[i], n,
+					    want[step][i]);
+				fails++;
+			}
+		}
+	}
+
+	/* Names that do not fit are no rule */
+	memset(big, 'x', sizeof big - 1);
+	big[sizeof big - 1] = '\0';
+	if (log_site_rule(big, NULL, true)) {
+		TEST_FAIL("long");
+		fails++;
+	}
+
+	/* Back to where the logs went */
+	log_site_rules_clear();
+	log_setup("test", NULL);
+	unlink(name);
+
+	return (fails);
+}
 
 unsigned int
 test_misc(void) {
@@ -330,6 +759,10 @@ test_misc(void) {
 
 	fails += test_human_size();
 
+	fails += test_log_async();
+	fails += test_log_formats();
+	fails += test_log_sites();
+
 	return (fails);
 }
 
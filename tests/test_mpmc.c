@@ -0,0 +1,171 @@
+#include <libfutil/misc.h>
+#include "test_mpmc.h"
+
+#define TEST_MPMC_THREADS	2
+#define TEST_MPMC_ITEMS		100000
+
+typedef struct {
+	mpmc_t		q;
+	uint64_t	sum;		/* Of all popped items */
+	uint64_t	popped;		/* Number of popped items */
+} test_mpmc_t;
+
+unsigned int
+test_mpmc_basic(void);
+unsigned int
+test_mpmc_basic(void) {
+	unsigned int	fails = 0;
+	const char	*testfunc = "mpmc_basic";
+	mpmc_t		q;
+	uintptr_t	i;
+	void		*p;
+
+	if (!mpmc_init(&q, 5)) {
+		TEST_FAIL("init");
+		return (1);
+	}
+
+	/* Rounded up to 8 */
+	for (i = 1; i <= 8; i++) {
+		if (!mpmc_push(&q, (void *)i)) {
+			TEST_FAIL("push");
+			fails++;
+		}
+	}
+
+	if (mpmc_push(&q, (void *)i)) {
+		TEST_FAIL("push when full");
+		fails++;
+	}
+
+	if (mpmc_count(&q) != 8) {
+		TEST_FAIL("count");
+		fails++;
+	}
+
+	/* FIFO, also across the wrap */
+	for (i = 1; i <= 12; i++) {
+		p = mpmc_pop(&q);
+		if (p != (void *)i) {
+			TEST_FAIL("pop order");
+			fails++;
+		}
+
+		if (!mpmc_push(&q, (void *)(i + 8))) {
+			TEST_FAIL("push after pop");
+			fails++;
+		}
+	}
+
+	while (mpmc_pop(&q) != NULL);
+
+	if (!mpmc_isempty(&q)) {
+		TEST_FAIL("isempty");
+		fails++;
+	}
+
+	/* Nothing there: times out */
+	if (mpmc_pop_wait(&q, 10) != NULL) {
+		TEST_FAIL("pop_wait on empty");
+		fails++;
+	}
+
+	mpmc_destroy(&q);
+
+	return (fails);
+}
+
+static void *
+test_mpmc_producer(void *arg);
+static void *
+test_mpmc_producer(void *arg) {
+	test_mpmc_t	*t = (test_mpmc_t *)arg;
+	uintptr_t	i;
+
+	for (i = 1; i <= TEST_MPMC_ITEMS; i++) {
+		while (!mpmc_push(&t->q, (void *)i)) {
+			sched_yield();
+		}
+	}
+
+	return (NULL);
+}
+
+static void *
+test_mpmc_consumer(void *arg);
+static void *
+test_mpmc_consumer(void *arg) {
+	test_mpmc_t	*t = (test_mpmc_t *)arg;
+	void		*p;
+
+	while (atomic_ld(t->popped) < TEST_MPMC_ITEMS * TEST_MPMC_THREADS) {
+		p = mpmc_pop_wait(&t->q, 100);
+		if (p == NULL) {
+			continue;
+		}
+
+		__atomic_add_fetch(&t->sum, (uintptr_t)p, __ATOMIC_RELAXED);
+		atomic_inc(t->popped);
+	}
+
+	return (NULL);
+}
+
+unsigned int
+test_mpmc_threads(void);
+unsigned int
+test_mpmc_threads(void) {
+	unsigned int	fails = 0, i;
+	const char	*testfunc = "mpmc_threads";
+	test_mpmc_t	t;
+	pthread_t	prod[TEST_MPMC_THREADS], cons[TEST_MPMC_THREADS];
+	uint64_t	exp;
+
+	memzero(&t, sizeof t);
+
+	/* Small, so that producers hit full and consumers park */
+	if (!mpmc_init(&t.q, 64)) {
+		TEST_FAIL("init");
+		return (1);
+	}
+
+	for (i = 0; i < TEST_MPMC_THREADS; i++) {
+		if (pthread_create(&cons[i], NULL, test_mpmc_consumer, &t) != 0 ||
+		    pthread_create(&prod[i], NULL, test_mpmc_producer, &t) != 0) {
+			TEST_FAIL("pthread_create");
+			return (1);
+		}
+	}
+
+	for (i = 0; i < TEST_MPMC_THREADS; i++) {
+		pthread_join(prod[i], NULL);
+		pthread_join(cons[i], NULL);
+	}
+
+	/* Every item exactly once */
+	exp = (uint64_t)TEST_MPMC_ITEMS * (TEST_MPMC_ITEMS + 1) / 2;
+	exp *= TEST_MPMC_THREADS;
+	if (t.sum != exp || t.popped != TEST_MPMC_ITEMS * TEST_MPMC_THREADS) {
+		TEST_FAIL("sum");
+		fails++;
+	}
+
+	if (!mpmc_isempty(&t.q)) {
+		TEST_FAIL("isempty");
+		fails++;
+	}
+
+	mpmc_destroy(&t.q);
+
+	return (fails);
+}
+
+unsigned int
+test_mpmc(void) {
+	unsigned int fails = 0;
+
+	fails += test_mpmc_basic();
+	fails += test_mpmc_threads();
+
+	return (fails);
+}
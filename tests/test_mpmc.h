@@ -0,0 +1,8 @@
+#ifndef TESTS_TEST_MPMC_H
+#define TESTS_TEST_MPMC_H 1
+
+#include "test.h"
+
+unsigned int test_mpmc(void);
+
+#endif /* TESTS_TEST_MPMC_H */
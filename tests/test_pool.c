@@ -0,0 +1,102 @@
+#include <libfutil/misc.h>
+#include "test_pool.h"
+
+#define TEST_POOL_OBJS 16
+
+static unsigned int
+test_pool_reuse(const char *testfunc);
+static unsigned int
+test_pool_reuse(const char *testfunc) {
+	pool_t		pool;
+	void		*a, *b;
+	unsigned int	fails = 0;
+
+	pool_init(&pool, 64, "test_pool");
+
+	a = pool_get(&pool);
+	pool_put(&pool, a);
+
+	/* The same object comes back */
+	b = pool_get(&pool);
+	if (a != b) {
+		TEST_FAIL("object not reused");
+		fails++;
+	}
+
+	if (pool.allocs != 1 || pool.reuses != 1 || pool.inuse != 1) {
+		TEST_FAIL("counters off");
+		fails++;
+	}
+
+	pool_put(&pool, b);
+	pool_destroy(&pool);
+
+	return (fails);
+}
+
+static unsigned int
+test_pool_trim(const char *testfunc);
+static unsigned int
+test_pool_trim(const char *testfunc) {
+	pool_t		pool;
+	void		*objs[TEST_POOL_OBJS], *o;
+	unsigned int	i, fails = 0;
+
+	pool_init(&pool, 64, "test_pool");
+
+	/* A burst, all of it gets cached */
+	for (i = 0; i < TEST_POOL_OBJS; i++) {
+		objs[i] = pool_get(&pool);
+	}
+
+	for (i = 0; i < TEST_POOL_OBJS; i++) {
+		pool_put(&pool, objs[i]);
+	}
+
+	if (pool.nfree != TEST_POOL_OBJS) {
+		TEST_FAIL("burst not cached");
+		fails++;
+	}
+
+	/* Fill up the window with a single object: the burst is kept */
+	for (i = TEST_POOL_OBJS; i < POOL_WINDOW; i++) {
+		o = pool_get(&pool);
+		pool_put(&pool, o);
+	}
+
+	if (pool.nfree != TEST_POOL_OBJS) {
+		TEST_FAIL("trimmed below the high-water mark");
+		fails++;
+	}
+
+	/* The next window peaks at 1, the rest goes */
+	for (i = 0; i < POOL_WINDOW; i++) {
+		o = pool_get(&pool);
+		pool_put(&pool, o);
+	}
+
+	if (pool.nfree != 1 || pool.trimmed != TEST_POOL_OBJS - 1) {
+		TEST_FAIL("not trimmed to the high-water mark");
+		fails++;
+	}
+
+	pool_trim(&pool);
+	if (pool.nfree != 0 || pool.free != NULL) {
+		TEST_FAIL("pool_trim() left objects");
+		fails++;
+	}
+
+	pool_destroy(&pool);
+
+	return (fails);
+}
+
+unsigned int
+test_pool(void) {
+	unsigned int fails = 0;
+
+	fails += test_pool_reuse("pool_reuse");
+	fails += test_pool_trim("pool_trim");
+
+	return (fails);
+}
@@ -0,0 +1,8 @@
+#ifndef TESTS_TEST_POOL_H
+#define TESTS_TEST_POOL_H 1
+
+#include "test.h"
+
+unsigned int test_pool(void);
+
+#endif /* TESTS_TEST_POOL_H */
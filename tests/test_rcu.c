@@ -0,0 +1,232 @@
+#include <libfutil/misc.h>
+#include "test_rcu.h"
+
+#define TEST_RCU_READERS	3
+#define TEST_RCU_VERSIONS	20000
+#define TEST_RCU_MAGIC		0x52435521
+#define TEST_RCU_DEAD		0xdeadbeef
+
+typedef struct {
+	rcu_head_t	rcu;
+	uint32_t	magic;		/* TEST_RCU_DEAD once reclaimed */
+	uint64_t	version;
+} test_rcu_obj_t;
+
+typedef struct {
+	test_rcu_obj_t	*cur;		/* Published version */
+	bool		stop;		/* Writer is done */
+	uint64_t	bad;		/* Readers that saw a reclaimed one */
+	uint64_t	backwards;	/* Readers that saw an older version */
+	uint64_t	reads;
+	bool		inside;		/* Slow reader in its section */
+	bool		done;		/* Slow reader about to leave */
+} test_rcu_t;
+
+/*
+ * Reclaimed objects are poisoned and kept until the end, so that a
+ * reader that still has one notices instead of reading freed memory.
+ */
+static mutex_t test_rcu_mutex = PTHREAD_MUTEX_INITIALIZER;
+static rcu_head_t *test_rcu_dead = NULL;
+static uint64_t test_rcu_reclaimed = 0;
+
+static void
+test_rcu_reclaim(rcu_head_t *head);
+static void
+test_rcu_reclaim(rcu_head_t *head) {
+	test_rcu_obj_t *o = (test_rcu_obj_t *)head;
+
+	atomic_st(o->magic, TEST_RCU_DEAD);
+
+	mutex_lock(test_rcu_mutex);
+	head->next = test_rcu_dead;
+	test_rcu_dead = head;
+	test_rcu_reclaimed++;
+	mutex_unlock(test_rcu_mutex);
+}
+
+static void *
+test_rcu_reader(void *arg);
+static void *
+test_rcu_reader(void *arg) {
+	test_rcu_t	*t = (test_rcu_t *)arg;
+	test_rcu_obj_t	*o;
+	uint64_t	last = 0;
+
+	while (!atomic_ld(t->stop)) {
+		rcu_read_lock();
+
+		o = rcu_dereference(t->cur);
+		if (atomic_ld(o->magic) != TEST_RCU_MAGIC) {
+			atomic_inc(t->bad);
+		}
+
+		if (o->version < last) {
+			atomic_inc(t->backwards);
+		}
+		last = o->version;
+
+		/* Still good at the end of the section */
+		sched_yield();
+		if (atomic_ld(o->magic) != TEST_RCU_MAGIC) {
+			atomic_inc(t->bad);
+		}
+
+		rcu_read_unlock();
+
+		atomic_inc(t->reads);
+	}
+
+	rcu_thread_offline();
+
+	return (NULL);
+}
+
+static void *
+test_rcu_slow(void *arg);
+static void *
+test_rcu_slow(void *arg) {
+	test_rcu_t *t = (test_rcu_t *)arg;
+
+	rcu_read_lock();
+	atomic_st(t->inside, true);
+	usleep(50 * 1000);
+	atomic_st(t->done, true);
+	rcu_read_unlock();
+
+	rcu_thread_offline();
+
+	return (NULL);
+}
+
+static unsigned int
+test_rcu_synchronize(void);
+static unsigned int
+test_rcu_synchronize(void) {
+	unsigned int	fails = 0;
+	const char	*testfunc = "rcu_synchronize";
+	test_rcu_t	t;
+	pthread_t	th;
+
+	memzero(&t, sizeof t);
+
+	/* Nested sections are fine */
+	rcu_read_lock();
+	rcu_read_lock();
+	rcu_read_unlock();
+	rcu_read_unlock();
+
+	/* Nobody reading, returns right away */
+	rcu_synchronize();
+
+	if (pthread_create(&th, NULL, test_rcu_slow, &t) != 0) {
+		TEST_FAIL("pthread_create");
+		return (1);
+	}
+
+	while (!atomic_ld(t.inside)) {
+		usleep(1000);
+	}
+
+	/* Has to wait for the slow reader */
+	rcu_synchronize();
+
+	if (!atomic_ld(t.done)) {
+		TEST_FAIL("returned while a reader was inside");
+		fails++;
+	}
+
+	pthread_join(th, NULL);
+
+	return (fails);
+}
+
+static unsigned int
+test_rcu_stress(void);
+static unsigned int
+test_rcu_stress(void) {
+	unsigned int	fails = 0, i;
+	const char	*testfunc = "rcu_stress";
+	test_rcu_t	t;
+	test_rcu_obj_t	*o, *old;
+	pthread_t	readers[TEST_RCU_READERS];
+	rcu_head_t	*h, *hn;
+
+	memzero(&t, sizeof t);
+
+	t.cur = mcalloc(sizeof *t.cur, "test_rcu_obj");
+	if (t.cur == NULL) {
+		TEST_FAIL("mcalloc");
+		return (1);
+	}
+	t.cur->magic = TEST_RCU_MAGIC;
+
+	for (i = 0; i < TEST_RCU_READERS; i++) {
+		if (pthread_create(&readers[i], NULL, test_rcu_reader, &t) != 0) {
+			TEST_FAIL("pthread_create");
+			return (1);
+		}
+	}
+
+	/* Publish new versions, reclaiming the old ones */
+	for (i = 1; i <= TEST_RCU_VERSIONS; i++) {
+		o = mcalloc(sizeof *o, "test_rcu_obj");
+		if (o == NULL) {
+			TEST_FAIL("mcalloc");
+			fails++;
+			break;
+		}
+
+		o->magic = TEST_RCU_MAGIC;
+		o->version = i;
+
+		old = t.cur;
+		rcu_assign(t.cur, o);
+		rcu_defer(&old->rcu, test_rcu_reclaim);
+	}
+
+	atomic_st(t.stop, true);
+
+	for (i = 0; i < TEST_RCU_READERS; i++) {
+		pthread_join(readers[i], NULL);
+	}
+
+	rcu_barrier();
+
+	if (t.bad != 0) {
+		TEST_FAIL("reader saw a reclaimed version");
+		fails++;
+	}
+
+	if (t.backwards != 0) {
+		TEST_FAIL("reader saw versions go backwards");
+		fails++;
+	}
+
+	if (test_rcu_reclaimed != TEST_RCU_VERSIONS) {
+		TEST_FAIL("not everything was reclaimed");
+		fails++;
+	}
+
+	for (h = test_rcu_dead; h != NULL; h = hn) {
+		hn = h->next;
+		mfree(h, sizeof(test_rcu_obj_t), "test_rcu_obj");
+	}
+	test_rcu_dead = NULL;
+
+	mfree(t.cur, sizeof *t.cur, "test_rcu_obj");
+
+	return (fails);
+}
+
+unsigned int
+test_rcu(void) {
+	unsigned int fails = 0;
+
+	fails += test_rcu_synchronize();
+	fails += test_rcu_stress();
+
+	rcu_exit();
+
+	return (fails);
+}
@@ -0,0 +1,8 @@
+#ifndef TESTS_TEST_RCU_H
+#define TESTS_TEST_RCU_H 1
+
+#include "test.h"
+
+unsigned int test_rcu(void);
+
+#endif /* TESTS_TEST_RCU_H */
@@ -0,0 +1,172 @@
+#include <libfutil/misc.h>
+#include "test_rwl.h"
+
+#define TEST_RWL_READERS	3
+#define TEST_RWL_WRITERS	2
+#define TEST_RWL_ROUNDS		20000
+
+typedef struct {
+	rwl_t		rwl;
+	uint64_t	a, b;		/* Only differ inside the write lock */
+	uint64_t	torn;		/* Readers that saw a != b */
+	unsigned int	writers;	/* Writers still running */
+} test_rwl_t;
+
+static void *
+test_rwl_readonce(void *arg);
+static void *
+test_rwl_readonce(void *arg) {
+	rwl_t *rwl = (rwl_t *)arg;
+
+	rwl_lockR(rwl);
+	rwl_unlockR(rwl);
+
+	return (NULL);
+}
+
+static unsigned int
+test_rwl_basic(const char *testfunc, rwl_t *rwl);
+static unsigned int
+test_rwl_basic(const char *testfunc, rwl_t *rwl) {
+	unsigned int	fails = 0;
+	pthread_t	th;
+
+	/* Readers share (another thread, read locks do not nest) */
+	rwl_lockR(rwl);
+	if (pthread_create(&th, NULL, test_rwl_readonce, rwl) != 0 ||
+	    pthread_join(th, NULL) != 0) {
+		TEST_FAIL("second reader");
+		fails++;
+	}
+	rwl_unlockR(rwl);
+
+	rwl_lockW(rwl);
+	if ((rwl->state & RWL_WRITER) == 0) {
+		TEST_FAIL("writer not marked");
+		fails++;
+	}
+	rwl_unlockW(rwl);
+
+	/* And can come back after a writer */
+	rwl_lockR(rwl);
+	rwl_unlockR(rwl);
+
+	if (rwl->state != 0) {
+		TEST_FAIL("state not clear");
+		fails++;
+	}
+
+	return (fails);
+}
+
+static void *
+test_rwl_reader(void *arg);
+static void *
+test_rwl_reader(void *arg) {
+	test_rwl_t *t = (test_rwl_t *)arg;
+
+	while (atomic_ld(t->writers) > 0) {
+		rwl_lockR(&t->rwl);
+		if (t->a != t->b) {
+			atomic_inc(t->torn);
+		}
+		rwl_unlockR(&t->rwl);
+	}
+
+	return (NULL);
+}
+
+static void *
+test_rwl_writer(void *arg);
+static void *
+test_rwl_writer(void *arg) {
+	test_rwl_t	*t = (test_rwl_t *)arg;
+	unsigned int	i;
+
+	for (i = 0; i < TEST_RWL_ROUNDS; i++) {
+		rwl_lockW(&t->rwl);
+		t->a++;
+
+		/* Give readers a chance to see it half done */
+		if ((i % 1000) == 0) {
+			sched_yield();
+		}
+
+		t->b++;
+		rwl_unlockW(&t->rwl);
+	}
+
+	atomic_dec(t->writers);
+
+	return (NULL);
+}
+
+static unsigned int
+test_rwl_threads(const char *testfunc, bool bigreader);
+static unsigned int
+test_rwl_threads(const char *testfunc, bool bigreader) {
+	unsigned int	fails = 0, i;
+	test_rwl_t	t;
+	pthread_t	readers[TEST_RWL_READERS], writers[TEST_RWL_WRITERS];
+
+	memzero(&t, sizeof t);
+
+	if (bigreader) {
+		if (!rwl_init_bigreader(&t.rwl)) {
+			TEST_FAIL("init_bigreader");
+			return (1);
+		}
+	} else {
+		rwl_init(&t.rwl);
+	}
+
+	fails += test_rwl_basic(testfunc, &t.rwl);
+
+	t.writers = TEST_RWL_WRITERS;
+
+	for (i = 0; i < TEST_RWL_WRITERS; i++) {
+		if (pthread_create(&writers[i], NULL, test_rwl_writer, &t) != 0) {
+			TEST_FAIL("pthread_create");
+			return (1);
+		}
+	}
+
+	for (i = 0; i < TEST_RWL_READERS; i++) {
+		if (pthread_create(&readers[i], NULL, test_rwl_reader, &t) != 0) {
+			TEST_FAIL("pthread_create");
+			return (1);
+		}
+	}
+
+	for (i = 0; i < TEST_RWL_WRITERS; i++) {
+		pthread_join(writers[i], NULL);
+	}
+
+	for (i = 0; i < TEST_RWL_READERS; i++) {
+		pthread_join(readers[i], NULL);
+	}
+
+	if (t.torn != 0) {
+		TEST_FAIL("reader saw a half write");
+		fails++;
+	}
+
+	if (t.a != (uint64_t)TEST_RWL_WRITERS * TEST_RWL_ROUNDS || t.a != t.b) {
+		TEST_FAIL("lost writes");
+		fails++;
+	}
+
+	rwl_destroy(&t.rwl);
+
+	return (fails);
+}
+
+unsigned int
+test_rwl(void) {
+	unsigned int fails = 0;
+
+	fails += test_rwl_threads("rwl", false);
+	fails += test_rwl_threads("rwl_bigreader", true);
+
+	return (fails);
+}
@@ -0,0 +1,8 @@
+#ifndef TESTS_TEST_RWL_H
+#define TESTS_TEST_RWL_H 1
+
+#include "test.h"
+
+unsigned int test_rwl(void);
+
+#endif /* TESTS_TEST_RWL_H */
@@ -0,0 +1,89 @@
+#include <libfutil/misc.h>
+#include <libfutil/scan.h>
+#include "test_scan.h"
+
+#define TEST_SCAN_LEN 320
+
+static const char *test_scan_names[SCAN_MAX] = {
+	"auto", "scalar", "sse2", "avx2",
+};
+
+/* What they all should find */
+static const char *
+test_scan_ref(const char *set, unsigned int n, const char *s, const char *e);
+static const char *
+test_scan_ref(const char *set, unsigned int n, const char *s, const char *e) {
+	for (; s < e; s++) {
+		if (memchr(set, *s, n) != NULL) {
+			return (s);
+		}
+	}
+
+	return (NULL);
+}
+
+/* Every start and length against the reference */
+static unsigned int
+test_scan_impl(const char *testfunc, const char *name, const char *buf);
+static unsigned int
+test_scan_impl(const char *testfunc, const char *name, const char *buf) {
+	static const scan_set_t	set = SCAN_SET(":= ?&\r\n\0");
+	unsigned int		o, l;
+
+	for (o = 0; o < 40; o++) {
+		for (l = 0; o + l <= TEST_SCAN_LEN; l++) {
+			if (scan_find2(&buf[o], &buf[o + l], '\n', '\0') !=
+			    test_scan_ref("\n\0", 2, &buf[o], &buf[o + l])) {
+				TEST_FAILA("find2", name);
+				return (1);
+			}
+
+			if (scan_find2(&buf[o], &buf[o + l], 'x', 'x') !=
+			    test_scan_ref("x", 1, &buf[o], &buf[o + l])) {
+				TEST_FAILA("find2 single", name);
+				return (1);
+			}
+
+			if (scan_set(&set, &buf[o], &buf[o + l]) !=
+			    test_scan_ref(set.c, set.n, &buf[o], &buf[o + l])) {
+				TEST_FAILA("set", name);
+				return (1);
+			}
+		}
+	}
+
+	return (0);
+}
+
+unsigned int
+test_scan(void) {
+	const char	*testfunc = "scan";
+	const char	chars[] = "abcdefghijklmnopqrstuvwxyz:= ?&\r\n\0x";
+	char		buf[TEST_SCAN_LEN];
+	unsigned int	i, fails = 0;
+
+	/* Mostly plain bytes, some of what is searched for */
+	srandom(1);
+	for (i = 0; i < sizeof buf; i++) {
+		buf[i] = chars[random() % sizeof chars];
+		if (random() % 4 != 0) {
+			buf[i] = 'a' + (i % 20);
+		}
+	}
+
+	for (i = SCAN_SCALAR; i < SCAN_MAX; i++) {
+		/* Not every CPU has all of them */
+		if (!scan_select(i)) {
+			continue;
+		}
+
+		fails += test_scan_impl(testfunc, test_scan_names[i], buf);
+	}
+
+	if (!scan_select(SCAN_AUTO)) {
+		TEST_FAIL("auto");
+		fails++;
+	}
+
+	return (fails);
+}
@@ -0,0 +1,8 @@
+#ifndef TESTS_TEST_SCAN_H
+#define TESTS_TEST_SCAN_H 1
+
+#include "test.h"
+
+unsigned int test_scan(void);
+
+#endif /* TESTS_TEST_SCAN_H */
@@ -0,0 +1,161 @@
+#include <libfutil/misc.h>
+#include "test_wheel.h"
+
+/*
+ * Random arms, re-arms and cancels against the time going on in small
+ * and large steps: every timer has to come out at the first expire at
+ * or after the tick it is due at, not before and not later, also those
+ * that are further out than the wheel spans.
+ */
+#define TEST_WHEEL_TIMERS	2000
+#define TEST_WHEEL_ROUNDS	20000
+
+typedef struct {
+	wheel_timer_t	timer;		/* First, thus also the pointer */
+	uint64_t	due;		/* Tick it is due at */
+	bool		armed;
+} test_wheel_t;
+
+static uint64_t
+test_wheel_rand(uint64_t *s);
+static uint64_t
+test_wheel_rand(uint64_t *s) {
+	/* xorshift64 */
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+
+	return (*s);
+}
+
+/* Mostly close by, some far out, some beyond the span, some overdue */
+static uint64_t
+test_wheel_when(uint64_t *s, uint64_t now);
+static uint64_t
+test_wheel_when(uint64_t *s, uint64_t now) {
+	uint64_t r = test_wheel_rand(s);
+
+	switch (r % 8) {
+	case 0:
+		return (now - (r >> 8) % 100);
+	case 1:
+		return (now + (r >> 8) % (1ULL << 26));
+	case 2:
+		return (now + (r >> 8) % (1ULL << 18));
+	default:
+		return (now + (r >> 8) % 5000);
+	}
+}
+
+unsigned int
+test_wheel(void) {
+	const char		*testfunc = "wheel";
+	static test_wheel_t	tw[TEST_WHEEL_TIMERS];
+	wheel_t			w;
+	wheel_timer_t		*t;
+	test_wheel_t		*x;
+	uint64_t		s = 0x9e3779b97f4a7c15ULL, now = 1000, prev,
+				next, r, first;
+	unsigned int		fails = 0, round, i, n = 0;
+
+	wheel_init(&w, now);
+
+	if (wheel_next(&w) != UINT64_MAX || wheel_expire(&w, now + 10)) {
+		TEST_FAIL("empty");
+		fails++;
+	}
+
+	now += 10;
+
+	for (i = 0; i < TEST_WHEEL_TIMERS; i++) {
+		wheel_timer_init(&tw[i].timer);
+		tw[i].armed = false;
+	}
+
+	for (round = 0; round < TEST_WHEEL_ROUNDS && fails < 10; round++) {
+		/* Some timers change */
+		for (i = 0; i < 20; i++) {
+			x = &tw[test_wheel_rand(&s) % TEST_WHEEL_TIMERS];
+
+			if (x->armed && test_wheel_rand(&s) % 4 == 0) {
+				wheel_cancel(&w, &x->timer);
+				x->armed = false;
+				n--;
+				continue;
+			}
+
+			if (!x->armed) {
+				n++;
+			}
+
+			x->due = test_wheel_when(&s, now);
+			wheel_arm(&w, &x->timer, x->due);
+			x->armed = true;
+
+			/* Overdue is due at the next expire */
+			if (x->due < now) {
+				x->due = now;
+			}
+		}
+
+		if (w.n != n) {
+			TEST_FAILAR("count", "armed", w.n, n);
+			fails++;
+		}
+
+		/* Never later than the first one that is due */
+		first = UINT64_MAX;
+		for (i = 0; i < TEST_WHEEL_TIMERS; i++) {
+			if (tw[i].armed && tw[i].due < first) {
+				first = tw[i].due;
+			}
+		}
+
+		next = wheel_next(&w);
+		if (first != UINT64_MAX && next > first - now) {
+			TEST_FAILAR("next", "too late", (int)next,
+				    (first - now));
+			fails++;
+		}
+
+		/* Time goes on, sometimes by a lot */
+		prev = now;
+		r = test_wheel_rand(&s);
+		now += r % 16 == 0 ? r % (1ULL << 20) : r % 64;
+
+		while ((t = wheel_expire(&w, now)) != NULL) {
+			x = (test_wheel_t *)t;
+
+			if (!x->armed || x->due > now || x->due < prev ||
+			    wheel_armed(t)) {
+				TEST_FAILAR("expire", "when", (int)x->due,
+					    now);
+				fails++;
+			}
+
+			x->armed = false;
+			n--;
+		}
+
+		/* Nothing due left behind */
+		for (i = 0; i < TEST_WHEEL_TIMERS; i++) {
+			if (tw[i].armed && tw[i].due <= now) {
+				TEST_FAILAR("expire", "missed",
+					    (int)tw[i].due, now);
+				fails++;
+			}
+		}
+	}
+
+	/* Cancel the rest, it has to be empty after that */
+	for (i = 0; i < TEST_WHEEL_TIMERS; i++) {
+		wheel_cancel(&w, &tw[i].timer);
+	}
+
+	if (w.n != 0 || wheel_next(&w) != UINT64_MAX) {
+		TEST_FAIL("cancel");
+		fails++;
+	}
+
+	return (fails);
+}
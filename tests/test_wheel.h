@@ -0,0 +1,8 @@
+#ifndef TESTS_TEST_WHEEL_H
+#define TESTS_TEST_WHEEL_H 1
+
+#include "test.h"
+
+unsigned int test_wheel(void);
+
+#endif /* TESTS_TEST_WHEEL_H */
@@ -0,0 +1,41 @@
+#include <libfutil/misc.h>
+
+/*
+ * Turns binary logs (log_async_format(LOG_FORMAT_BINARY)) into text,
+ * from the files given or stdin. Has to run on the same kind of machine
+ * (byte order) as wrote them.
+ */
+int
+main(int argc, const char *argv[]) {
+	FILE	*f;
+	int	i, ret = 0;
+
+	if (argc < 2) {
+		if (!log_decode(stdin, stdout)) {
+			fprintf(stderr, "stdin: not a (complete) binary log\n");
+			return (1);
+		}
+
+		return (0);
+	}
+
+	for (i = 1; i < argc; i++) {
+		f = fopen(argv[i], "r");
+		if (f == NULL) {
+			fprintf(stderr, "Could not open %s: %s\n",
+				argv[i], strerror(errno));
+			ret = 1;
+			continue;
+		}
+
+		if (!log_decode(f, stdout)) {
+			fprintf(stderr, "%s: not a (complete) binary log\n",
+				argv[i]);
+			ret = 1;
+		}
+
+		fclose(f);
+	}
+
+	return (ret);
+}